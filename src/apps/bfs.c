@@ -11,6 +11,7 @@
 #include <egos/queue.h>
 #include <egos/file.h>
 #include <egos/block.h>
+#include <egos/block_store.h>
 #include <egos/gate.h>
 
 struct file_server_state {
@@ -43,6 +44,7 @@ static void blkfile_do_chmod(struct file_server_state *fss, struct file_request
 static void blkfile_do_read(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_write(struct file_server_state *, struct file_request *req, void *data, unsigned int size, gpid_t src, unsigned int uid);
 static void blkfile_do_sync(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
+static void blkfile_do_hint(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_stat(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_setsize(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_respond(struct file_request *req, enum file_status status,
@@ -112,6 +114,11 @@ static void blkfile_proc(void *arg){
         flush_stat_cache_all(fss);
     }
 
+    // the FCBs in i-node 0 are file system metadata
+    if (!block_hint(fss->block_svr, 0, BLOCK_HINT_METADATA)) {
+        printf("blkfile_proc: hint error\n");
+    }
+
     struct file_request *req =
 		calloc(1, sizeof(struct file_request) + FILE_MAX_MSG_SIZE);
     for (;;) {
@@ -154,6 +161,9 @@ static void blkfile_proc(void *arg){
             //fprintf(stderr, "!!DEBUG: calling blkfile sync\n");
             blkfile_do_sync(fss, req, src, uid);
             break;
+        case FILE_HINT:
+            blkfile_do_hint(fss, req, src, uid);
+            break;
         case FILE_STAT:
             //fprintf(stderr, "!!DEBUG: calling blkfile stat\n");
             blkfile_do_stat(fss, req, src, uid);
@@ -502,6 +512,29 @@ static void blkfile_do_sync(struct file_server_state *fss, struct file_request *
 	blkfile_respond(req, FILE_OK, 0, 0, src);
 }
 
+/* Respond to a hint request by passing it on to the block server.
+ */
+static void blkfile_do_hint(struct file_server_state *fss, struct file_request *req, gpid_t src, unsigned int uid){
+    if (req->file_no >= fss->num_fcbs || !fss->fcb_cache[req->file_no].st_alloc) {
+        printf("blkfile_do_hint: bad inode %u\n", req->file_no);
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+    if (!blkfile_read_allowed(&fss->fcb_cache[req->file_no], uid)) {
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    bool r = block_hint(fss->block_svr, req->file_no, req->offset);
+    if (!r) {
+        printf("blkfile_do_hint: hint error\n");
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+	blkfile_respond(req, FILE_OK, 0, 0, src);
+}
+
 /* Respond to a stat request.
  */
 static void blkfile_do_stat(struct file_server_state *fss, struct file_request *req, gpid_t src, unsigned int uid){
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <egos/block.h>
+
+/* Print the statistics report of the block server.  The block server has
+ * to run with -t.
+ */
+int main(int argc, char **argv){
+	gpid_t svr = GRASS_ENV->servers[GPID_BLOCK];
+
+	if (argc != 1) {
+		fprintf(stderr, "Usage: blkstat\n");
+		return 1;
+	}
+	char *buf = malloc(PAGESIZE);
+	int n = block_stats(svr, buf, PAGESIZE);
+	if (n < 0) {
+		fprintf(stderr, "blkstat: failed\n");
+		return 1;
+	}
+	printf("%s", buf);
+	if (n >= PAGESIZE) {
+		printf("blkstat: report truncated\n");
+	}
+	free(buf);
+	return 0;
+}
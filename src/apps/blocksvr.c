@@ -20,6 +20,10 @@
 struct block_server_state {
 	block_store_t *stack[MAX_STACK_SIZE];
 	block_store_t **sp;
+	block_store_t *fs_below;		// store below the treedisk, if any
+	block_store_t *snap;			// snapdisk, if any
+	bool readonly;					// serving a snapshot
+	block_store_t *stats;			// statdisk, if any
 };
 
 // these helper functions are declared here and defined later
@@ -29,6 +33,10 @@ static void block_do_sync(struct block_server_state *bss, struct block_request *
 static void block_do_getsize(struct block_server_state *bss, struct block_request *req, gpid_t src);
 static void block_do_setsize(struct block_server_state *bss, struct block_request *req, gpid_t src);
 static void block_do_getninodes(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_defrag(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_snapshot(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_stats(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_hint(struct block_server_state *bss, struct block_request *req, gpid_t src);
 
 #ifdef notdef
 static void block_cleanup(void *arg){
@@ -89,6 +97,18 @@ static void block_proc(void *arg){
 				//fprintf(stderr, "!!DEBUG: calling block getninodes\n");
 				block_do_getninodes(bss, req, src);
 				break;
+			case BLOCK_DEFRAG:
+				block_do_defrag(bss, req, src);
+				break;
+			case BLOCK_SNAPSHOT:
+				block_do_snapshot(bss, req, src);
+				break;
+			case BLOCK_STATS:
+				block_do_stats(bss, req, src);
+				break;
+			case BLOCK_HINT:
+				block_do_hint(bss, req, src);
+				break;
 			default:
 				assert(0);
 		}
@@ -103,14 +123,123 @@ static void block_proc(void *arg){
 #define BOTTOM_INODE 		0
 
 /* Create a new block device.  fsconf is the file system configuration,
- * which is currently either "tree", "fat", or "unix".
+ * which is currently either "tree", "fat", or "unix".  If compress is
+ * set, the blocks are stored compressed on the bottom block store.  If
+ * dedup is set, identical blocks are stored only once (see dedupdisk).
+ * If snap is set, the bottom block store keeps snapshots (see snapdisk),
+ * and if mount is not 0 the server serves snapshot 'mount' instead of the
+ * live volume, read-only.
+ * If log is set, all writes are appended to a log on the bottom block
+ * store (see logdisk), using the given cleaning policy.  If stats is set,
+ * statistics are kept on the requests (see statdisk).  If tier is set,
+ * the cache disk is used as a second-level cache in front of the bottom
+ * block store, in the given mode (see tierdisk).
  */
-void block_init(block_store_t *bot, char *fsconf){
+void block_init(block_store_t *bot, char *fsconf, bool log, enum logdisk_policy policy,
+						bool snap, unsigned int mount, bool compress, bool dedup,
+						enum dedupdisk_hash hash, bool verify,
+						bool stats, bool tier, enum tierdisk_mode tier_mode){
 	struct block_server_state *bss = new_alloc(struct block_server_state);
 	bss->sp = bss->stack;
 
+	/* The inode of the store below that the next layer is put on.  Only
+	 * the layer right above the snapdisk may use another inode than
+	 * BOTTOM_INODE: the snapshot to serve.
+	 */
+	unsigned int below_ino = BOTTOM_INODE;
+
 	*bss->sp = bot;
 
+	/* Second-level cache layer.
+	 */
+	if (tier) {
+		if (GRASS_ENV->servers[GPID_DISK_CACHE] == 0) {
+			fprintf(stderr, "block_init: no cache disk\n");
+			exit(1);
+		}
+		block_store_t *fast = protdisk_init(GRASS_ENV->servers[GPID_DISK_CACHE], 0);
+		if (tierdisk_create(fast, BOTTOM_INODE) < 0) {
+			fprintf(stderr, "block_init: can't create tierdisk\n");
+			exit(1);
+		}
+		bss->sp++;
+		*bss->sp = tierdisk_init(fast, BOTTOM_INODE, bss->sp[-1], tier_mode);
+		if (*bss->sp == 0) {
+			fprintf(stderr, "block_init: can't open tierdisk\n");
+			exit(1);
+		}
+	}
+
+	/* Log layer.
+	 */
+	if (log) {
+		if (logdisk_create(*bss->sp, BOTTOM_INODE, 0) < 0) {
+			fprintf(stderr, "block_init: can't create logdisk\n");
+			exit(1);
+		}
+		bss->sp++;
+		*bss->sp = logdisk_init(bss->sp[-1], BOTTOM_INODE, policy);
+		if (*bss->sp == 0) {
+			fprintf(stderr, "block_init: can't open logdisk\n");
+			exit(1);
+		}
+	}
+
+	/* Snapshot layer.
+	 */
+	if (snap) {
+		if (snapdisk_create(*bss->sp, BOTTOM_INODE, 0) < 0) {
+			fprintf(stderr, "block_init: can't create snapdisk\n");
+			exit(1);
+		}
+		bss->sp++;
+		*bss->sp = bss->snap = snapdisk_init(bss->sp[-1], BOTTOM_INODE);
+		if (*bss->sp == 0) {
+			fprintf(stderr, "block_init: can't open snapdisk\n");
+			exit(1);
+		}
+		if (mount != 0) {
+			if ((*bss->snap->getsize)(bss->snap, mount) < 0) {
+				fprintf(stderr, "block_init: no snapshot %u\n", mount);
+				exit(1);
+			}
+			below_ino = mount;
+			bss->readonly = true;
+		}
+	}
+
+	/* Compression layer.
+	 */
+	if (compress) {
+		if (compressdisk_create(*bss->sp, below_ino) < 0) {
+			fprintf(stderr, "block_init: can't create compressdisk\n");
+			exit(1);
+		}
+		bss->sp++;
+		*bss->sp = compressdisk_init(bss->sp[-1], below_ino);
+		if (*bss->sp == 0) {
+			fprintf(stderr, "block_init: can't open compressdisk\n");
+			exit(1);
+		}
+		below_ino = BOTTOM_INODE;
+	}
+
+	/* Deduplication layer.
+	 */
+	if (dedup) {
+		if (dedupdisk_create(*bss->sp, below_ino, 0) < 0) {
+			fprintf(stderr, "block_init: can't create dedupdisk\n");
+			exit(1);
+		}
+		bss->sp++;
+		*bss->sp = dedupdisk_init(bss->sp[-1], below_ino, hash, verify);
+		if (*bss->sp == 0) {
+			fprintf(stderr, "block_init: can't open dedupdisk\n");
+			exit(1);
+		}
+		below_ino = BOTTOM_INODE;
+	}
+
 	/* Create cache layer.
 	 */
 	block_t *cache = malloc(NCACHE_BLOCKS * BLOCK_SIZE);
@@ -128,29 +257,30 @@ void block_init(block_store_t *bot, char *fsconf){
 	 * has one inode, inode 0).
 	 */
 	if (strcmp(fsconf, "tree") == 0) {
-		if (treedisk_create(*bss->sp, BOTTOM_INODE, NINODES) < 0) {
+		if (treedisk_create(*bss->sp, below_ino, NINODES) < 0) {
 			fprintf(stderr, "block_init: can't create treedisk file system\n");
 			exit(1);
 		}
+		bss->fs_below = *bss->sp;
 		bss->sp++;
-		*bss->sp = treedisk_init(bss->sp[-1], BOTTOM_INODE);
+		*bss->sp = treedisk_init(bss->sp[-1], below_ino);
 	}
 #ifdef HW_FS
 	else if (strcmp(fsconf, "unix") == 0) {
-		if (unixdisk_create(*bss->sp, BOTTOM_INODE, NINODES) < 0) {
+		if (unixdisk_create(*bss->sp, below_ino, NINODES) < 0) {
 			fprintf(stderr, "block_init: can't create unixdisk file system\n");
 			exit(1);
 		}
 		bss->sp++;
-		*bss->sp = unixdisk_init(bss->sp[-1], BOTTOM_INODE);
+		*bss->sp = unixdisk_init(bss->sp[-1], below_ino);
 	}
 	else if (strcmp(fsconf, "fat") == 0) {
-		if (fatdisk_create(*bss->sp, BOTTOM_INODE, NINODES) < 0) {
+		if (fatdisk_create(*bss->sp, below_ino, NINODES) < 0) {
 			fprintf(stderr, "block_init: can't create fatdisk file system\n");
 			exit(1);
 		}
 		bss->sp++;
-		*bss->sp = fatdisk_init(bss->sp[-1], BOTTOM_INODE);
+		*bss->sp = fatdisk_init(bss->sp[-1], below_ino);
 	}
 #endif //HW_FS
 	else {
@@ -158,11 +288,24 @@ void block_init(block_store_t *bot, char *fsconf){
 		exit(1);
 	}
 
+	/* Readahead layer, which reads ahead into the cache below the file
+	 * system.
+	 */
+	bss->sp++;
+	*bss->sp = readaheaddisk_init(bss->sp[-1], NCACHE_BLOCKS / 4);
+
 	/* Check layer.
 	 */
 	// bss->sp++;
 	// *bss->sp = checkdisk_init(bss->sp[-1], "above file system");
 
+	/* Statistics layer.
+	 */
+	if (stats) {
+		bss->sp++;
+		*bss->sp = bss->stats = statdisk_init(bss->sp[-1]);
+	}
+
 	// bss->sp++;
 	// *bss->sp = debugdisk_init(bss->sp[-1], "above file system");
 
@@ -170,24 +313,82 @@ void block_init(block_store_t *bot, char *fsconf){
 }
 
 static void usage(char *name){
-	fprintf(stderr, "Usage: %s [-r #blocks | -s server] [-c file-sys-conf]\n", name);
+	fprintf(stderr, "Usage: %s [-r #blocks | -s server] [-c file-sys-conf] [-L greedy|cb] [-S [-m snapshot]] [-z] [-D sha256|fast] [-V] [-t] [-T wb|wt]\n", name);
 	exit(1);
 }
 
 int main(int argc, char **argv){
 	block_store_t *bottom = 0;
 	char *fsconf = "tree", c;
-
-    while ((c = getopt(argc, argv, "c:r:s:")) != -1) {
+	bool log = false, snap = false, compress = false, dedup = false, verify = false, stats = false;
+	bool tier = false, ram = false;
+	unsigned int mount = 0;
+	enum tierdisk_mode tier_mode = TIER_WRITE_BACK;
+	enum logdisk_policy policy = LOG_GREEDY;
+	enum dedupdisk_hash hash = DEDUP_SHA256;
+
+    while ((c = getopt(argc, argv, "c:r:s:L:Sm:zD:VtT:")) != -1) {
 		switch (c) {
 		case 'c':
 			fsconf = optarg;
 			break;
+		case 'L':
+			log = true;
+			if (strcmp(optarg, "greedy") == 0) {
+				policy = LOG_GREEDY;
+			}
+			else if (strcmp(optarg, "cb") == 0) {
+				policy = LOG_COST_BENEFIT;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		case 'S':
+			snap = true;
+			break;
+		case 'm':
+			mount = atoi(optarg);
+			break;
+		case 'z':
+			compress = true;
+			break;
+		case 'D':
+			dedup = true;
+			if (strcmp(optarg, "sha256") == 0) {
+				hash = DEDUP_SHA256;
+			}
+			else if (strcmp(optarg, "fast") == 0) {
+				hash = DEDUP_FAST;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		case 'V':
+			verify = true;
+			break;
+		case 't':
+			stats = true;
+			break;
+		case 'T':
+			tier = true;
+			if (strcmp(optarg, "wb") == 0) {
+				tier_mode = TIER_WRITE_BACK;
+			}
+			else if (strcmp(optarg, "wt") == 0) {
+				tier_mode = TIER_WRITE_THROUGH;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
 		case 'r':
 			if (bottom == 0) {
 				int n = atoi(optarg);
 				block_t *blocks = malloc(n * BLOCK_SIZE);
 				bottom = ramdisk_init(blocks, n);
+				ram = true;
 			}
 			else {
 				usage(argv[0]);
@@ -210,13 +411,28 @@ int main(int argc, char **argv){
 		usage(argv[0]);
 	}
 
+	/* The cache disk outlives a ramdisk, and would hold blocks of the
+	 * ramdisk of the previous boot.
+	 */
+	if (tier && ram) {
+		fprintf(stderr, "%s: -T cannot be used with -r\n", argv[0]);
+		usage(argv[0]);
+	}
+
+	/* Snapshots are only kept with -S.
+	 */
+	if (mount != 0 && !snap) {
+		fprintf(stderr, "%s: -m needs -S\n", argv[0]);
+		usage(argv[0]);
+	}
+
 	/* Default bottom layer is file system disk.
 	 */
 	if (bottom == 0) {
 		bottom = protdisk_init(GRASS_ENV->servers[GPID_DISK_FS], 0);
 	}
 
-	block_init(bottom, fsconf);
+	block_init(bottom, fsconf, log, policy, snap, mount, compress, dedup, hash, verify, stats, tier, tier_mode);
 	return 0;
 }
 
@@ -269,6 +485,12 @@ static void block_do_write(struct block_server_state *bss, struct block_request
 		return;
 	}
 
+	if (bss->readonly) {
+		printf("block_do_write: serving a snapshot, which is read-only\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
 	int result;
 	block_t *buffer = (block_t *) data;
 	block_store_t *bs = *bss->sp;
@@ -327,6 +549,11 @@ static void block_do_getsize(struct block_server_state *bss, struct block_reques
 /* Respond to a setsize block request.
  */
 static void block_do_setsize(struct block_server_state *bss, struct block_request *req, gpid_t src){
+	if (bss->readonly) {
+		printf("block_do_setsize: serving a snapshot, which is read-only\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
 
 	block_store_t *bs = *bss->sp;
 	int result = (*bs->setsize)(bs, req->ino, req->offset_nblock);
@@ -354,3 +581,105 @@ static void block_do_getninodes(struct block_server_state *bss, struct block_req
 	rep.br_ninodes = ninodes;
 	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
+
+/* Respond to a defrag request.  This is only supported for treedisk.
+ * The whole stack is synced first so no layer above the treedisk holds
+ * dirty blocks.
+ */
+static void block_do_defrag(struct block_server_state *bss, struct block_request *req, gpid_t src){
+	if (bss->fs_below == 0) {
+		printf("block_do_defrag: not a treedisk file system\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+	if (bss->readonly) {
+		printf("block_do_defrag: serving a snapshot, which is read-only\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
+	block_store_t *bs = *bss->sp;
+	if ((*bs->sync)(bs, (unsigned int) -1) < 0) {
+		printf("block_do_defrag: sync error\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
+	int nmoved = treedisk_defrag(bss->fs_below, BOTTOM_INODE);
+
+	struct block_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = nmoved < 0 ? BLOCK_ERROR : BLOCK_OK;
+	rep.br_nmoved = nmoved < 0 ? 0 : nmoved;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
+/* Respond to a snapshot request: take a snapshot if req->ino is 0, and
+ * delete snapshot req->ino otherwise.  This needs a snapdisk.  The whole
+ * stack is synced first so the snapshot has all the blocks written so far.
+ */
+static void block_do_snapshot(struct block_server_state *bss, struct block_request *req, gpid_t src){
+	if (bss->snap == 0) {
+		printf("block_do_snapshot: no snapdisk\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+	if (bss->readonly) {
+		printf("block_do_snapshot: serving a snapshot, which is read-only\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
+	int result;
+	if (req->ino == 0) {
+		block_store_t *bs = *bss->sp;
+		if ((*bs->sync)(bs, (unsigned int) -1) < 0) {
+			printf("block_do_snapshot: sync error\n");
+			block_respond(req, BLOCK_ERROR, 0, 0, src);
+			return;
+		}
+		result = snapdisk_snapshot(bss->snap);
+	}
+	else {
+		result = snapdisk_delete(bss->snap, req->ino);
+	}
+
+	struct block_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = result < 0 ? BLOCK_ERROR : BLOCK_OK;
+	rep.br_snapshot = result < 0 ? 0 : result;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
+/* Respond to a stats request with the report of the statdisk at the top
+ * of the stack, truncated to fit in a page.  br_length is the length of
+ * the whole report.
+ */
+static void block_do_stats(struct block_server_state *bss, struct block_request *req, gpid_t src){
+	if (bss->stats == 0) {
+		printf("block_do_stats: no statdisk\n");
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
+	struct block_reply *rep = new_alloc_ext(struct block_reply, PAGESIZE);
+	int len = statdisk_report(bss->stats, (char *) &rep[1], PAGESIZE);
+	rep->status = BLOCK_OK;
+	rep->br_length = len;
+	sys_send(src, MSG_REPLY, rep, sizeof(*rep) + (len < PAGESIZE ? len + 1 : PAGESIZE));
+	free(rep);
+}
+
+/* Respond to a hint request by passing the hint for the whole inode down
+ * the stack (see clockdisk for what the cache does with it).
+ */
+static void block_do_hint(struct block_server_state *bss, struct block_request *req, gpid_t src){
+	block_store_t *bs = *bss->sp;
+	if (block_store_hint(bs, req->ino, 0, (block_no) -1, (enum block_hint) req->offset_nblock) < 0) {
+		printf("block_do_hint: bad hint %u for inode %u\n", req->offset_nblock, req->ino);
+		block_respond(req, BLOCK_ERROR, 0, 0, src);
+		return;
+	}
+
+	block_respond(req, BLOCK_OK, 0, 0, src);
+}
@@ -0,0 +1,18 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <egos/block.h>
+
+/* Ask the block server (or the one given as argument) to defragment
+ * its file system.
+ */
+int main(int argc, char **argv){
+	gpid_t svr = argc > 1 ? (gpid_t) atoi(argv[1]) : GRASS_ENV->servers[GPID_BLOCK];
+	unsigned int nmoved;
+
+	if (!block_defrag(svr, &nmoved)) {
+		fprintf(stderr, "defrag: failed\n");
+		return 1;
+	}
+	printf("defrag: moved %u blocks\n", nmoved);
+	return 0;
+}
@@ -7,9 +7,49 @@
 #include <egos/syscall.h>
 #include <egos/file.h>
 #include <egos/dir.h>
+#include <egos/block_store.h>
 
 #define MAX_PATH_NAME	1024
 #define NENTRIES		(PAGESIZE / DIR_ENTRY_SIZE)
+#define NHINTED			64
+
+/* Directories that were hinted to their file server as metadata, so it
+ * keeps them cached.  When the table is full the oldest entry is reused,
+ * and that directory is hinted again the next time it is used.  A file
+ * that is removed from a directory is forgotten, as its file number may
+ * be reused for a new file or directory once it is deleted.
+ */
+static struct {
+	fid_t fid;
+	bool valid;
+} hinted[NHINTED];
+static unsigned int nhinted;
+
+static void dir_hint(fid_t *dir){
+	unsigned int i;
+
+	for (i = 0; i < NHINTED; i++) {
+		if (hinted[i].valid && hinted[i].fid.server == dir->server &&
+								hinted[i].fid.file_no == dir->file_no) {
+			return;
+		}
+	}
+	i = nhinted++ % NHINTED;
+	hinted[i].fid = *dir;
+	hinted[i].valid = true;
+	(void) file_hint(dir->server, dir->file_no, BLOCK_HINT_METADATA);
+}
+
+static void dir_unhint(fid_t *fid){
+	unsigned int i;
+
+	for (i = 0; i < NHINTED; i++) {
+		if (hinted[i].valid && hinted[i].fid.server == fid->server &&
+								hinted[i].fid.file_no == fid->file_no) {
+			hinted[i].valid = false;
+		}
+	}
+}
 
 /* See if the name in de->name is the same as in s for the given size.
  */
@@ -252,10 +292,14 @@ static void dir_do_remove(struct dir_request *req, gpid_t src, unsigned int uid,
 				//only compare file_no since de->fid.server may be different from req->fid.server
 				&& de->fid.file_no == req->fid.file_no
 				&& name_cmp(de, name, size)) {
+				fid_t removed = de->fid;
 				memset(de, 0, sizeof(*de));
 				bool wstatus = file_write(req->dir.server, req->dir.file_no,
 											offset, de, sizeof(*de));
 				free(buf);
+				if (wstatus) {
+					dir_unhint(&removed);
+				}
 				dir_respond(src, wstatus ? DIR_OK : DIR_ERROR, &req->fid);
 				return;
 			}
@@ -282,6 +326,7 @@ static void dir_proc(){
 		}
 
 		assert(req_size >= (int) sizeof(*req));
+		dir_hint(&req->dir);
 		switch (req->type) {
 		case DIR_LOOKUP:
 			dir_do_lookup(req, src, uid,
@@ -0,0 +1,63 @@
+/* fsck checks the consistency of a treedisk file system image, such
+ * as the storage/fs.dev file created by mkfs.
+ *
+ * You can specify the image with the -f option, and the number of
+ * threads to use with the -j option (the default is 1).  The image is
+ * opened read-only, once for each thread.  With -v, fsck also prints how
+ * long the check took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <egos/block_store.h>
+
+static void usage(char *name){
+	fprintf(stderr, "Usage: %s [-f file] [-j nthreads] [-v]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	char *file_name = "storage/fs.dev";
+	unsigned int nthreads = 1, i;
+	int verbose = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "f:j:v")) != -1) {
+		switch (c) {
+		case 'f':
+			file_name = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads == 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+	}
+
+	block_store_t **files = calloc(nthreads, sizeof(*files));
+	for (i = 0; i < nthreads; i++) {
+		if ((files[i] = filedisk_open_readonly(file_name)) == 0) {
+			exit(1);
+		}
+	}
+
+	int ok = treedisk_check_parallel(files, nthreads, verbose);
+	for (i = 0; i < nthreads; i++) {
+		(*files[i]->release)(files[i]);
+	}
+	free(files);
+
+	printf("%s: %s\n", file_name, ok ? "clean" : "corrupt");
+	return ok ? 0 : 1;
+}
@@ -8,6 +8,14 @@
  * file system.
  *
  * You can specify the disk size in blocks with the -d option.
+ * With the -z option the blocks are stored compressed (see compressdisk),
+ * in which case the block server has to be run with -z as well.
+ * Likewise, with -D sha256 or -D fast identical blocks are stored only
+ * once (see dedupdisk), and the block server needs the same -D option.
+ * With -S the disk can keep snapshots (see snapdisk), for a block server
+ * run with -S.  With -L the disk is a log (see logdisk), for a block
+ * server run with -L.  With -T the block operations of the file system
+ * are recorded in the given trace file (see tracedisk and replay).
  * You can specify the default uid (file owner) with the -u option.
  *
  * A directory that contains a file .mkfs-skip is not included.
@@ -26,6 +34,7 @@
 #include <dirent.h>
 #include <time.h>
 #include <getopt.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <egos/block_store.h>
 #include <egos/file.h>
@@ -199,7 +208,7 @@ void trav(block_store_t *bs, fid_t parent, char *path, char *name,
 block_t blocks[CACHE_SIZE];
 
 static void usage(char *name){
-	fprintf(stderr, "Usage: %s [-d disk-size] [-u uid] [-c file-sys-conf] path1 ...\n", name);
+	fprintf(stderr, "Usage: %s [-d disk-size] [-u uid] [-c file-sys-conf] [-T trace] [-L] [-S] [-z] [-D sha256|fast] path1 ...\n", name);
 	exit(1);
 }
 
@@ -207,10 +216,12 @@ static void usage(char *name){
 
 int main(int argc, char **argv){
 	unsigned int uid = 0, disksize = DISK_SIZE;
-	char *fsconf = "tree", *file_name = "storage/fs.dev";
+	char *fsconf = "tree", *file_name = "storage/fs.dev", *trace = 0;
+	bool log = false, snap = false, compress = false, dedup = false;
+	enum dedupdisk_hash hash = DEDUP_SHA256;
 
 	char c;
-    while ((c = getopt(argc, argv, "c:d:f:u:")) != -1) {
+    while ((c = getopt(argc, argv, "c:d:f:u:LSzD:T:")) != -1) {
 		switch (c) {
 		case 'c':
 			fsconf = optarg;
@@ -224,6 +235,30 @@ int main(int argc, char **argv){
 		case 'u':
 			uid = atoi(optarg);
 			break;
+		case 'L':
+			log = true;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'S':
+			snap = true;
+			break;
+		case 'z':
+			compress = true;
+			break;
+		case 'D':
+			dedup = true;
+			if (strcmp(optarg, "sha256") == 0) {
+				hash = DEDUP_SHA256;
+			}
+			else if (strcmp(optarg, "fast") == 0) {
+				hash = DEDUP_FAST;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
 		default:
 			usage(argv[0]);
 		}
@@ -236,6 +271,38 @@ int main(int argc, char **argv){
 	 */
 	block_store_t *file = filedisk_init(file_name, disksize);
 	assert(file != 0);
+	if (log) {
+		if (logdisk_create(file, BOTTOM_INODE, 0) < 0) {
+			fprintf(stderr, "main: can't create logdisk\n");
+			exit(1);
+		}
+		file = logdisk_init(file, BOTTOM_INODE, LOG_GREEDY);
+		assert(file != 0);
+	}
+	if (snap) {
+		if (snapdisk_create(file, BOTTOM_INODE, 0) < 0) {
+			fprintf(stderr, "main: can't create snapdisk\n");
+			exit(1);
+		}
+		file = snapdisk_init(file, BOTTOM_INODE);
+		assert(file != 0);
+	}
+	if (compress) {
+		if (compressdisk_create(file, BOTTOM_INODE) < 0) {
+			fprintf(stderr, "main: can't create compressdisk\n");
+			exit(1);
+		}
+		file = compressdisk_init(file, BOTTOM_INODE);
+		assert(file != 0);
+	}
+	if (dedup) {
+		if (dedupdisk_create(file, BOTTOM_INODE, 0) < 0) {
+			fprintf(stderr, "main: can't create dedupdisk\n");
+			exit(1);
+		}
+		file = dedupdisk_init(file, BOTTOM_INODE, hash, false);
+		assert(file != 0);
+	}
 	block_store_t *cache = clockdisk_init(file, blocks, CACHE_SIZE);
 	assert(cache != 0);
 
@@ -268,6 +335,10 @@ int main(int argc, char **argv){
 		exit(1);
 	}
 	assert(bs != 0);
+	if (trace != 0) {
+		bs = tracedisk_init(bs, trace);
+		assert(bs != 0);
+	}
 
 	fid_t fid;
 	fid.server = 0;
@@ -0,0 +1,346 @@
+/* replay replays a trace recorded by tracedisk on a stack of block
+ * stores, and reports how long the operations took.
+ *
+ * The stack is given with the -s option as a comma-separated list of
+ * layers, from the bottom up (the default is "clock:64,tree"):
+ *
+ *		raid0:k, raid1:k, raid4:k, raid5:k
+ *			RAID over k disks (only as the first layer).
+ *		log, snap, compress
+ *			logdisk, snapdisk or compressdisk.
+ *		clock:n, wtclock:n
+ *			A write-back or write-through cache of n blocks.
+ *		ra:n
+ *			Readahead of up to n blocks.
+ *		tree
+ *			A treedisk file system with enough inodes for the trace.
+ *
+ * The disks at the bottom are ramdisks of 65536 blocks, or the size
+ * given with the -n option.  With -f the bottom is the given file
+ * instead.  With -S hdd or -S ssd each disk at the bottom is put under a
+ * simdisk that delays requests as the given device would.  The operations
+ * are replayed as fast as possible, or with -p at the pace at which they
+ * were recorded.  Writes write a pattern; the data is not in the trace.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define MAX_DISKS		16
+#define MAX_SIMS		(MAX_DISKS + 1)
+#define NOPS			(TRACE_GETNINODES + 1)
+
+static const char *op_names[NOPS] = {
+	0, "read", "write", "readv", "writev", "getsize", "setsize", "sync", "getninodes"
+};
+
+/* Per operation type statistics.
+ */
+struct replay_stats {
+	unsigned long count;		// #operations
+	unsigned long nblocks;		// #blocks read or written
+	unsigned long nfailed;		// #operations that failed
+	unsigned long recorded;		// total recorded latency
+	unsigned long *latencies;	// replayed latencies
+};
+
+static struct replay_stats stats[NOPS];
+
+static block_if sims[MAX_SIMS];		// simdisks at the bottom
+static unsigned int nsims;
+static block_if readahead;			// readaheaddisk, if any
+
+static void usage(char *name){
+	fprintf(stderr, "Usage: %s [-s stack] [-n #blocks | -f file] [-S hdd|ssd] [-p] trace\n", name);
+	exit(1);
+}
+
+static int cmp_ulong(const void *a, const void *b){
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Find the largest inode number in the trace, so that a treedisk can be
+ * created with enough inodes.
+ */
+static unsigned int max_inode(const char *trace){
+	struct tracedisk_reader *tr = tracedisk_open(trace);
+	struct tracedisk_op op;
+	unsigned int max = 0;
+
+	if (tr == 0) {
+		exit(1);
+	}
+	while (tracedisk_next(tr, &op) > 0) {
+		if (op.op != TRACE_SYNC && op.ino > max) {		// sync may be for all inodes
+			max = op.ino;
+		}
+	}
+	tracedisk_close(tr);
+	return max;
+}
+
+/* Create a disk for the bottom of the stack, under a simdisk if a
+ * profile was given.
+ */
+static block_if bottom(block_no nblocks, char *file, char *profile){
+	block_if bs = file != 0 ? filedisk_init(file, nblocks) :
+						ramdisk_init(calloc(nblocks, BLOCK_SIZE), nblocks);
+
+	if (bs == 0 || profile == 0) {
+		return bs;
+	}
+	bs = simdisk_init(bs, strcmp(profile, "hdd") == 0 ? SIM_HDD : SIM_SSD, 1);
+	if (bs != 0) {
+		sims[nsims++] = bs;
+	}
+	return bs;
+}
+
+/* Build the stack described by spec and return the top.
+ */
+static block_if build_stack(char *spec, block_no nblocks, char *file, char *profile,
+						unsigned int ninodes){
+	block_if *disks, bs = 0;
+	char *layer, *arg;
+	unsigned int i;
+
+	for (layer = strtok(spec, ","); layer != 0; layer = strtok(0, ",")) {
+		if ((arg = strchr(layer, ':')) != 0) {
+			*arg++ = 0;
+		}
+		unsigned int n = arg == 0 ? 0 : atoi(arg);
+
+		if (strncmp(layer, "raid", 4) == 0) {
+			if (bs != 0 || n < 2 || n > MAX_DISKS) {
+				fprintf(stderr, "replay: bad RAID layer\n");
+				exit(1);
+			}
+			disks = malloc(n * sizeof(*disks));		// kept by the RAID layer
+			for (i = 0; i < n; i++) {
+				disks[i] = bottom(nblocks, 0, profile);
+			}
+			if (strcmp(layer, "raid0") == 0) {
+				bs = raid0disk_init(disks, n);
+			}
+			else if (strcmp(layer, "raid1") == 0) {
+				bs = raid1disk_init(disks, n);
+			}
+			else if (strcmp(layer, "raid4") == 0) {
+				bs = raid4disk_init(disks, n);
+			}
+			else if (strcmp(layer, "raid5") == 0) {
+				bs = raid5disk_init(disks, n);
+			}
+			else {
+				fprintf(stderr, "replay: unknown layer %s\n", layer);
+				exit(1);
+			}
+		}
+		else {
+			if (bs == 0) {
+				bs = bottom(nblocks, file, profile);
+			}
+			if (strcmp(layer, "log") == 0) {
+				if (logdisk_create(bs, 0, 0) == 0) {
+					bs = logdisk_init(bs, 0, LOG_GREEDY);
+				}
+			}
+			else if (strcmp(layer, "snap") == 0) {
+				if (snapdisk_create(bs, 0, 0) == 0) {
+					bs = snapdisk_init(bs, 0);
+				}
+			}
+			else if (strcmp(layer, "compress") == 0) {
+				if (compressdisk_create(bs, 0) == 0) {
+					bs = compressdisk_init(bs, 0);
+				}
+			}
+			else if (strcmp(layer, "clock") == 0 && n > 0) {
+				bs = clockdisk_init(bs, calloc(n, BLOCK_SIZE), n);
+			}
+			else if (strcmp(layer, "wtclock") == 0 && n > 0) {
+				bs = wtclockdisk_init(bs, calloc(n, BLOCK_SIZE), n);
+			}
+			else if (strcmp(layer, "ra") == 0 && n > 0) {
+				bs = readahead = readaheaddisk_init(bs, n);
+			}
+			else if (strcmp(layer, "tree") == 0) {
+				if (treedisk_create(bs, 0, ninodes) == 0) {
+					bs = treedisk_init(bs, 0);
+				}
+			}
+			else {
+				fprintf(stderr, "replay: unknown layer %s\n", layer);
+				exit(1);
+			}
+		}
+		if (bs == 0) {
+			fprintf(stderr, "replay: can't create layer %s\n", layer);
+			exit(1);
+		}
+	}
+	if (bs == 0) {
+		bs = bottom(nblocks, file, profile);
+	}
+	return bs;
+}
+
+int main(int argc, char **argv){
+	char *spec = 0, *file = 0, *profile = 0;
+	block_no nblocks = 65536;
+	bool paced = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "f:n:pS:s:")) != -1) {
+		switch (c) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			nblocks = atoi(optarg);
+			break;
+		case 'p':
+			paced = true;
+			break;
+		case 's':
+			spec = optarg;
+			break;
+		case 'S':
+			profile = optarg;
+			if (strcmp(profile, "hdd") != 0 && strcmp(profile, "ssd") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nblocks == 0) {
+		usage(argv[0]);
+	}
+	char *trace = argv[optind];
+	if (spec == 0) {
+		spec = strdup("clock:64,tree");
+	}
+
+	block_if bs = build_stack(spec, nblocks, file, profile, max_inode(trace) + 1);
+	struct tracedisk_reader *tr = tracedisk_open(trace);
+	if (tr == 0) {
+		return 1;
+	}
+
+	block_no bufsize = 1;
+	block_t *buf = malloc(BLOCK_SIZE);
+	unsigned long nops = 0, maxops = 1024, recorded_end = 0;
+	for (c = 0; c < NOPS; c++) {
+		stats[c].latencies = malloc(maxops * sizeof(unsigned long));
+	}
+
+	struct tracedisk_op op;
+	unsigned long start = block_store_usec();
+	int r;
+	while ((r = tracedisk_next(tr, &op)) > 0) {
+		if (paced) {
+			unsigned long now = block_store_usec() - start;
+			if (op.time > now) {
+				usleep(op.time - now);
+			}
+		}
+		if (op.nblocks > bufsize) {
+			bufsize = op.nblocks;
+			buf = realloc(buf, bufsize * BLOCK_SIZE);
+		}
+		if (op.op == TRACE_WRITE || op.op == TRACE_WRITEV) {
+			block_no i;
+			for (i = 0; i < op.nblocks; i++) {
+				memset(&buf[i], (op.ino + op.offset + i) & 0xFF, BLOCK_SIZE);
+			}
+		}
+
+		unsigned long t = block_store_usec();
+		switch (op.op) {
+		case TRACE_READ:
+			r = (*bs->read)(bs, op.ino, op.offset, buf);
+			break;
+		case TRACE_WRITE:
+			r = (*bs->write)(bs, op.ino, op.offset, buf);
+			break;
+		case TRACE_READV:
+			r = block_store_readv(bs, op.ino, op.offset, op.nblocks, buf);
+			break;
+		case TRACE_WRITEV:
+			r = block_store_writev(bs, op.ino, op.offset, op.nblocks, buf);
+			break;
+		case TRACE_GETSIZE:
+			r = (*bs->getsize)(bs, op.ino);
+			break;
+		case TRACE_SETSIZE:
+			r = (*bs->setsize)(bs, op.ino, op.offset);
+			break;
+		case TRACE_SYNC:
+			r = (*bs->sync)(bs, op.ino);
+			break;
+		default:
+			r = (*bs->getninodes)(bs);
+		}
+		t = block_store_usec() - t;
+
+		struct replay_stats *st = &stats[op.op];
+		if (st->count == maxops) {
+			maxops *= 2;
+			for (c = 0; c < NOPS; c++) {
+				stats[c].latencies = realloc(stats[c].latencies, maxops * sizeof(unsigned long));
+			}
+		}
+		st->latencies[st->count++] = t;
+		st->nblocks += op.nblocks;
+		st->recorded += op.latency;
+		if (r < 0) {
+			st->nfailed++;
+		}
+		recorded_end = op.time + op.latency;
+		nops++;
+	}
+	if (r < 0) {
+		fprintf(stderr, "replay: trace is corrupt after %lu operations\n", nops);
+	}
+	(*bs->sync)(bs, (unsigned int) -1);
+	unsigned long elapsed = block_store_usec() - start;
+	tracedisk_close(tr);
+
+	printf("replayed %lu operations in %.3f s (recorded %.3f s), %.0f ops/s\n",
+				nops, elapsed / 1e6, recorded_end / 1e6,
+				elapsed == 0 ? 0 : nops * 1e6 / elapsed);
+	printf("%-10s %9s %9s %7s %10s %10s %9s %9s\n", "op", "count", "blocks", "failed",
+				"recorded", "mean", "p50", "p99");
+	for (c = 1; c < NOPS; c++) {
+		struct replay_stats *st = &stats[c];
+		unsigned long total = 0, i;
+		if (st->count == 0) {
+			continue;
+		}
+		qsort(st->latencies, st->count, sizeof(unsigned long), cmp_ulong);
+		for (i = 0; i < st->count; i++) {
+			total += st->latencies[i];
+		}
+		printf("%-10s %9lu %9lu %7lu %8.1fus %8.1fus %7luus %7luus\n", op_names[c],
+				st->count, st->nblocks, st->nfailed,
+				(double) st->recorded / st->count, (double) total / st->count,
+				st->latencies[st->count / 2], st->latencies[st->count * 99 / 100]);
+	}
+	if (readahead != 0) {
+		readaheaddisk_dump_stats(readahead);
+	}
+	for (c = 0; c < (int) nsims; c++) {
+		simdisk_dump_stats(sims[c]);
+	}
+	return r < 0;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block.h>
+
+/* Ask the block server to take a snapshot of its block store, or with
+ * -d to delete one.  The block server has to run with -S.  A snapshot
+ * can be read by running the block server with -S -m snapshot, which
+ * serves the snapshot, read-only, instead of the live volume.
+ */
+int main(int argc, char **argv){
+	gpid_t svr = GRASS_ENV->servers[GPID_BLOCK];
+	unsigned int snapshot;
+
+	if (argc == 3 && strcmp(argv[1], "-d") == 0) {
+		if (!block_snapshot_delete(svr, atoi(argv[2]))) {
+			fprintf(stderr, "snap: can't delete snapshot %s\n", argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+	if (argc != 1) {
+		fprintf(stderr, "Usage: snap [-d snapshot]\n");
+		return 1;
+	}
+	if (!block_snapshot(svr, &snapshot)) {
+		fprintf(stderr, "snap: failed\n");
+		return 1;
+	}
+	printf("snap: snapshot %u\n", snapshot);
+	return 0;
+}
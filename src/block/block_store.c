@@ -0,0 +1,253 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Helper functions shared by the block store modules.
+ *
+ *		unsigned long block_store_usec(void)
+ *			Returns a monotonic time in microseconds, for block store
+ *			modules that keep timing statistics.  Inside EGOS this uses
+ *			the (millisecond resolution) gettime system call; in host
+ *			tools it uses the host's monotonic clock.
+ *
+ *		unsigned long block_store_nsec(void)
+ *			Like block_store_usec(), but in nanoseconds.
+ *
+ *		int block_store_readv(block_if bs, unsigned int ino, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *		int block_store_writev(block_if bs, unsigned int ino, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *			Transfer nblocks consecutive blocks using the readv or writev
+ *			method of 'bs', or one block at a time if it has none.
+ *
+ *		int block_store_hint(block_if bs, unsigned int ino, block_no offset,
+ *							block_no nblocks, enum block_hint hint)
+ *			Pass a hint to the hint method of 'bs', if it has one.
+ *
+ *		struct block_store_pool *block_store_pool_init(unsigned int nworkers)
+ *			Create a pool of 'nworkers' workers for block_store_pool_run().
+ *			In host programs each worker is a thread, started on first use.
+ *			Inside EGOS there are no threads and the transfers are simply
+ *			done one after the other.
+ *
+ *		int block_store_pool_run(struct block_store_pool *pool,
+ *							struct block_store_xfer *xfers, unsigned int nxfers)
+ *			Run transfer i on worker i, for i < nxfers <= nworkers, and wait
+ *			for all of them to complete.  Returns -1 if any of them failed.
+ *
+ *		void block_store_pool_release(struct block_store_pool *pool)
+ *			Stop the workers and free the pool.
+ */
+
+#ifndef GRASS
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <pthread.h>
+#endif
+#include <stdlib.h>
+#include <egos/block_store.h>
+
+unsigned long block_store_usec(void){
+#ifdef GRASS
+	return sys_gettime() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+unsigned long block_store_nsec(void){
+#ifdef GRASS
+	return sys_gettime() * 1000000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int block_store_readv(block_if bs, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	block_no i;
+
+	if (bs->readv != 0) {
+		return (*bs->readv)(bs, ino, offset, nblocks, blocks);
+	}
+	for (i = 0; i < nblocks; i++) {
+		if ((*bs->read)(bs, ino, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_store_writev(block_if bs, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	block_no i;
+
+	if (bs->writev != 0) {
+		return (*bs->writev)(bs, ino, offset, nblocks, blocks);
+	}
+	for (i = 0; i < nblocks; i++) {
+		if ((*bs->write)(bs, ino, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_store_hint(block_if bs, unsigned int ino, block_no offset,
+							block_no nblocks, enum block_hint hint){
+	if (bs->hint == 0) {
+		return 0;
+	}
+	return (*bs->hint)(bs, ino, offset, nblocks, hint);
+}
+
+static int block_store_xfer_do(struct block_store_xfer *x){
+	x->result = x->write ?
+		block_store_writev(x->bs, x->ino, x->offset, x->nblocks, x->buf) :
+		block_store_readv(x->bs, x->ino, x->offset, x->nblocks, x->buf);
+	return x->result;
+}
+
+#ifndef GRASS
+
+enum block_store_worker_state { BSW_IDLE, BSW_BUSY, BSW_EXIT };
+
+struct block_store_worker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	enum block_store_worker_state state;
+	struct block_store_xfer *xfer;
+};
+
+struct block_store_pool {
+	unsigned int nworkers;
+	struct block_store_worker *workers;		// null until first use
+};
+
+static void *block_store_worker_main(void *arg){
+	struct block_store_worker *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->state == BSW_IDLE) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->state == BSW_EXIT) {
+			break;
+		}
+		pthread_mutex_unlock(&w->lock);
+		block_store_xfer_do(w->xfer);
+		pthread_mutex_lock(&w->lock);
+		w->state = BSW_IDLE;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static void block_store_pool_start(struct block_store_pool *pool){
+	unsigned int i;
+
+	pool->workers = calloc(pool->nworkers, sizeof(*pool->workers));
+	for (i = 0; i < pool->nworkers; i++) {
+		struct block_store_worker *w = &pool->workers[i];
+		pthread_mutex_init(&w->lock, 0);
+		pthread_cond_init(&w->cond, 0);
+		w->state = BSW_IDLE;
+		pthread_create(&w->tid, 0, block_store_worker_main, w);
+	}
+}
+
+#else /* GRASS */
+
+struct block_store_pool {
+	unsigned int nworkers;
+};
+
+#endif /* GRASS */
+
+struct block_store_pool *block_store_pool_init(unsigned int nworkers){
+	struct block_store_pool *pool = new_alloc(struct block_store_pool);
+	pool->nworkers = nworkers;
+	return pool;
+}
+
+int block_store_pool_run(struct block_store_pool *pool,
+						struct block_store_xfer *xfers, unsigned int nxfers){
+	unsigned int i, nbusy = 0;
+	int result = 0;
+
+	for (i = 0; i < nxfers; i++) {
+		if (xfers[i].nblocks > 0) {
+			nbusy++;
+		}
+	}
+
+#ifndef GRASS
+	/* Hand the transfers to the workers, unless there is only one.
+	 */
+	if (nbusy > 1 && nxfers <= pool->nworkers) {
+		if (pool->workers == 0) {
+			block_store_pool_start(pool);
+		}
+		for (i = 0; i < nxfers; i++) {
+			struct block_store_worker *w = &pool->workers[i];
+			if (xfers[i].nblocks > 0) {
+				pthread_mutex_lock(&w->lock);
+				w->xfer = &xfers[i];
+				w->state = BSW_BUSY;
+				pthread_cond_broadcast(&w->cond);
+				pthread_mutex_unlock(&w->lock);
+			}
+		}
+		for (i = 0; i < nxfers; i++) {
+			struct block_store_worker *w = &pool->workers[i];
+			if (xfers[i].nblocks > 0) {
+				pthread_mutex_lock(&w->lock);
+				while (w->state != BSW_IDLE) {
+					pthread_cond_wait(&w->cond, &w->lock);
+				}
+				pthread_mutex_unlock(&w->lock);
+				if (xfers[i].result < 0) {
+					result = -1;
+				}
+			}
+		}
+		return result;
+	}
+#endif
+
+	for (i = 0; i < nxfers; i++) {
+		if (xfers[i].nblocks > 0 && block_store_xfer_do(&xfers[i]) < 0) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
+void block_store_pool_release(struct block_store_pool *pool){
+#ifndef GRASS
+	if (pool->workers != 0) {
+		for (unsigned int i = 0; i < pool->nworkers; i++) {
+			struct block_store_worker *w = &pool->workers[i];
+			pthread_mutex_lock(&w->lock);
+			w->state = BSW_EXIT;
+			pthread_cond_broadcast(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+			pthread_join(w->tid, 0);
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->cond);
+		}
+		free(pool->workers);
+	}
+#endif
+	free(pool);
+}
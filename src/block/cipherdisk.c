@@ -1,9 +1,23 @@
-/* Primitive block-level encryption using AES128 in CTR mode. It encrypts and
- * decrypts blocks live on each read/write by using a hash of the salt and
- * offset.
+/* Block-level encryption using AES128 in CTR mode. It encrypts and decrypts
+ * blocks live on each read/write.
  *
- * Uses SHA256 with multiple iterations for the master password.
+ *		block_if cipherdisk_init(block_if below, unsigned int below_ino)
+ *			Prompts for the passphrase of the cipherdisk on inode
+ *			'below_ino' of 'below', or for a new passphrase if there is no
+ *			cipherdisk there yet.  The cipherdisk has a single inode.
  *
+ *		block_if cipherdisk_init_passphrase(block_if below,
+ *							unsigned int below_ino, const char *passphrase)
+ *			Like cipherdisk_init(), but uses 'passphrase' instead of
+ *			prompting for one.  Returns 0 if it is wrong.
+ *
+ * Block 0 below holds the salt and a hash of the passphrase, and block b of
+ * the cipherdisk is stored encrypted in block b + 1 below.  The key is a
+ * SHA256 hash of the passphrase, and is expanded into the AES round keys
+ * once when the cipherdisk is opened.  The initial counter for block b is
+ * b in the upper 64 bits (big-endian) and 0 in the lower 64, so that each
+ * block uses its own range of 64 counter values.  The AES engine in
+ * lib/aes.c uses AES-NI when the processor supports it.
  *
  * Copyright 2018 Jason Liu
  *
@@ -20,21 +34,17 @@
  * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#ifdef CIPHERDISK
-
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <egos/block_store.h>
-#include "../../shared/aes.h"
+#include <egos/aes.h>
 #include <egos/sha256.h>
-#include <egos/file.h>
 
-#define CIPHER_ITERATIONS (1 << 20)
 #define CIPHER_MAGIC 0x4411AE5D
+#define CIPHER_BATCH 64		// #blocks encrypted at a time when set up
 
 /* The sole unencrypted block, which contains metadata. */
 struct cipherdisk_superblock {
@@ -45,8 +55,9 @@ struct cipherdisk_superblock {
 
 /* State of a cipherdisk. */
 struct cipherdisk_state {
-	block_store_t *below;
-	uint8_t key[16];
+	block_if below;
+	unsigned int below_ino;
+	struct aes128 aes;		/* expanded key */
 };
 
 union cipherdisk_block {
@@ -54,17 +65,6 @@ union cipherdisk_block {
 	block_t datablock;
 };
 
-static int readline(char *, size_t);
-static int cipherdisk_unlock(const uint8_t *, const uint8_t *, uint8_t *, size_t);
-static int cipherdisk_open(block_store_t *, struct cipherdisk_state *);
-static int cipherdisk_open(block_store_t *, struct cipherdisk_state *);
-
-static int cipherdisk_write(block_store_t *, block_no, block_t *);
-static int cipherdisk_read(block_store_t *, block_no, block_t *);
-static int cipherdisk_nblocks(block_store_t *);
-static int cipherdisk_setsize(block_store_t *, block_no);
-static void cipherdisk_destroy(block_store_t *);
-
 /* Read up to (len - 1) characters into s from stdin and return the number of
  * read chars. s will be null-terminated, and the trailing newline will not be
  * included. s should be at least as large as len. This will allow input
@@ -78,10 +78,10 @@ static int readline(char *s, size_t len) {
 	while (i < len) {
 		/* Using stdio and bypassing egos's stdio is not ideal, but not sure how
 		 * to use egos's stdio this early in init */
-		char c = fgetc(stdin);
+		int c = fgetc(stdin);
 		if (c == EOF)
 			return -1;
-		if (c == '\r') {
+		if (c == '\r' || c == '\n') {
 			s[i] = '\0';
 			return i;
 		} else if (c == 127) { /* delete keycode (backspace) */
@@ -93,16 +93,117 @@ static int readline(char *s, size_t len) {
 	s[len] = '\0';
 	/* grab characters, but they won't actually be kept */
 	for (;;) {
-		char c = fgetc(stdin);
-		if (c == EOF || c == '\r')
+		int c = fgetc(stdin);
+		if (c == EOF || c == '\r' || c == '\n')
 			return -2;
 	}
 }
 
-/* Prompt the user for the passphrase to unlock this cipherdisk. keylen must
- * be less than or equal to 32. */
-static int cipherdisk_unlock(const uint8_t *salt, const uint8_t *hashed,
-		uint8_t *key, size_t keylen) {
+/* Calculate the hashed passphrase that is stored in the superblock. */
+static void cipherdisk_hash(const uint8_t *salt, const char *pwd, size_t n,
+		uint8_t *hashed) {
+	sha256_context sc;
+
+	sha256_starts(&sc);
+	sha256_update(&sc, salt, 32);
+	sha256_update(&sc, (const uint8_t *) pwd, n);
+	sha256_finish(&sc, hashed);
+}
+
+/* Calculate the key and expand it into the round keys. Only 16 of the 32
+ * bytes of the hash are used. */
+static void cipherdisk_set_key(struct cipherdisk_state *cs,
+		const uint8_t *hashed, const char *pwd, size_t n) {
+	sha256_context sc;
+	uint8_t digest[32];
+
+	sha256_starts(&sc);
+	sha256_update(&sc, hashed, 32);
+	sha256_update(&sc, (const uint8_t *) pwd, n);
+	sha256_finish(&sc, digest);
+
+	aes128_init(&cs->aes, digest);
+	memset(digest, 0, sizeof(digest));
+}
+
+/* Check the passphrase against the superblock and set the key. */
+static int cipherdisk_unlock(struct cipherdisk_state *cs,
+		const struct cipherdisk_superblock *sb, const char *pwd) {
+	uint8_t digest[32];
+	size_t n = strlen(pwd);
+
+	cipherdisk_hash(sb->salt, pwd, n, digest);
+	if (memcmp(digest, sb->hashed, sizeof(digest)) != 0) {
+		return -1;
+	}
+	cipherdisk_set_key(cs, sb->hashed, pwd, n);
+	return 0;
+}
+
+/* Encrypt/decrypt the given block. */
+static void block_xcrypt(struct cipherdisk_state *cs, block_no offset, block_t *block) {
+	uint8_t iv[16];
+
+	memset(iv, 0, sizeof(iv));
+	for (unsigned int i = 0; i < 8; ++i) {
+		iv[i] = (uint64_t) offset >> (56 - 8 * i);
+	}
+	aes128_ctr(&cs->aes, iv, block, sizeof(block_t));
+}
+
+/* Create a new cipherdisk with the given passphrase, encrypting what is
+ * already there. */
+static int cipherdisk_create(struct cipherdisk_state *cs, const char *pwd) {
+	union cipherdisk_block sb;
+	size_t n = strlen(pwd);
+
+	memset(&sb, 0, sizeof(sb));
+	sb.superblock.magic = CIPHER_MAGIC;
+
+	/* generate a random salt */
+	srand(block_store_usec());
+	for (unsigned int i = 0; i < 32; ++i) {
+		sb.superblock.salt[i] = (uint8_t) rand();
+	}
+	cipherdisk_hash(sb.superblock.salt, pwd, n, sb.superblock.hashed);
+	cipherdisk_set_key(cs, sb.superblock.hashed, pwd, n);
+
+	/* encrypt everything underneath, in place */
+	int nblocks = (*cs->below->getsize)(cs->below, cs->below_ino);
+	if (nblocks < 1) {
+		fprintf(stderr, "!!cipherdisk_create: block store below is empty\n");
+		return -1;
+	}
+	block_t *buf = malloc(CIPHER_BATCH * sizeof(block_t));
+	for (block_no b = 0; b < (block_no) nblocks - 1; b += CIPHER_BATCH) {
+		block_no cnt = nblocks - 1 - b < CIPHER_BATCH ? nblocks - 1 - b : CIPHER_BATCH;
+		if (block_store_readv(cs->below, cs->below_ino, b + 1, cnt, buf) < 0) {
+			fprintf(stderr, "!!cipherdisk_create: failed to read block %u\n", b + 1);
+			free(buf);
+			return -1;
+		}
+		for (block_no i = 0; i < cnt; ++i) {
+			block_xcrypt(cs, b + i, &buf[i]);
+		}
+		if (block_store_writev(cs->below, cs->below_ino, b + 1, cnt, buf) < 0) {
+			fprintf(stderr, "!!cipherdisk_create: failed to write block %u\n", b + 1);
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+
+	/* write the superblock */
+	if ((*cs->below->write)(cs->below, cs->below_ino, 0, &sb.datablock) != 0) {
+		fprintf(stderr, "!!cipherdisk_create: failed to write superblock\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Prompt the user for the passphrase to unlock this cipherdisk. */
+static int cipherdisk_prompt_unlock(struct cipherdisk_state *cs,
+		const struct cipherdisk_superblock *sb) {
 	char pwd[256];
 	for (unsigned int i = 0; i < 5; ++i) {
 		printf("\n\rEnter cipherdisk passphrase: ");
@@ -121,32 +222,12 @@ static int cipherdisk_unlock(const uint8_t *salt, const uint8_t *hashed,
 				goto retry;
 		}
 
-		/* calculate and check the hashed passphrase */
-		sha256_context sc;
-		uint8_t digest[32];
-
-		sha256_starts(&sc);
-		sha256_update(&sc, salt, 32);
-		sha256_update(&sc, (uint8_t *) pwd, n);
-		sha256_finish(&sc, digest);
-
-		for (unsigned int j = 0; j < 32; ++j) {
-			if (digest[j] != hashed[j]) {
-				goto retry;
-			}
+		if (cipherdisk_unlock(cs, sb, pwd) == 0) {
+			memset(pwd, 0, sizeof(pwd));
+			printf("\n\r");
+			return 0;
 		}
 
-		/* calculate the key */
-		sha256_starts(&sc);
-		sha256_update(&sc, hashed, 32);
-		sha256_update(&sc, (uint8_t *) pwd, n);
-		sha256_finish(&sc, digest);
-
-		memcpy(key, &digest, keylen);
-
-		printf("\n\r");
-		return 0;
-
 retry:
 		sleep(2);
 		fprintf(stderr, "Wrong passphrase.\n\r");
@@ -157,10 +238,9 @@ fail:
 	return -1;
 }
 
-static int cipherdisk_setup(struct cipherdisk_state *cs) {
-	struct cipherdisk_superblock sb;
+/* Prompt the user for a new passphrase and create the cipherdisk. */
+static int cipherdisk_prompt_setup(struct cipherdisk_state *cs) {
 	char pwd[2][256];
-	sb.magic = CIPHER_MAGIC;
 	for (unsigned int i = 0; i < 5; ++i) {
 		printf("\n\rEnter a passphrase: ");
 		int n1 = readline(pwd[0], sizeof(pwd[0])/sizeof(pwd[0][0]));
@@ -194,62 +274,12 @@ static int cipherdisk_setup(struct cipherdisk_state *cs) {
 				goto retry;
 		}
 
-		if (n1 != n2) {
-			goto retry;
-		}
-
-		if (strncmp(pwd[0], pwd[1], sizeof(pwd[0])/sizeof(pwd[0][0])) == 0) {
-			/* generate a random salt */
-			srandom(clock_now());
-			for (unsigned int i = 0; i < 32; ++i) {
-				sb.salt[i] = (uint8_t) random();
-			}
-
-			/* calculate and set the hashed passphrase */
-			sha256_context sc;
-			uint8_t digest[32];
-
-			sha256_starts(&sc);
-			sha256_update(&sc, sb.salt, 32);
-			sha256_update(&sc, (uint8_t *) pwd[0], n1);
-			sha256_finish(&sc, digest);
-
-			memcpy(sb.hashed, digest, sizeof(sb.hashed));
-
-			/* calculate the key */
-			sha256_starts(&sc);
-			sha256_update(&sc, sb.hashed, 32);
-			sha256_update(&sc, (uint8_t *) pwd[0], n1);
-			sha256_finish(&sc, digest);
-
-			memcpy(cs->key, digest, sizeof(cs->key)/sizeof(cs->key[0]));
-
-			/* encrypt everything underneath */
-			block_store_t tmp =
-				{ .state = cs
-				, .nblocks = cipherdisk_nblocks
-				, .setsize = cipherdisk_setsize
-				, .read = cipherdisk_read
-				, .write = cipherdisk_write
-				, .destroy = cipherdisk_destroy
-				};
+		if (n1 == n2 && strcmp(pwd[0], pwd[1]) == 0) {
 			printf("Encrypting blocks...");
-			int nblocks = (*cs->below->nblocks)(cs->below);
-			for (int i = 0; i < nblocks - 1; ++i) {
-				block_t block;
-				(*cs->below->read)(cs->below, i, &block);
-				cipherdisk_write(&tmp, i, &block);
-			}
-			printf(" Done.\n\r");
-
-			/* write the superblock */
-			if ((*cs->below->write)(cs->below, 0, (block_t *) &sb) != 0) {
-				fprintf(stderr, "cipherdisk_setup: failed to write superblock\n\r");
-				return -1;
-			}
-
-			printf("\n\r");
-			return 0;
+			int r = cipherdisk_create(cs, pwd[0]);
+			memset(pwd, 0, sizeof(pwd));
+			printf(r == 0 ? " Done.\n\r\n\r" : " Failed.\n\r\n\r");
+			return r;
 		}
 
 retry:
@@ -261,58 +291,34 @@ fail:
 	return -1;
 }
 
-/* Try to open this cipherdisk, or prompt for a new password to create a
- * cipherdisk otherwise, and initialize cs. */
-static int cipherdisk_open(block_store_t *below, struct cipherdisk_state *cs) {
-	cs->below = below;
-	union cipherdisk_block sb;
-	if ((*below->read)(below, 0, &sb.datablock) != 0) {
-		fprintf(stderr, "cipherdisk_open: failed to read superblock\n\r");
-		return -1;
-	}
-
-	if (sb.superblock.magic == CIPHER_MAGIC) {
-		return cipherdisk_unlock(sb.superblock.salt, sb.superblock.hashed,
-				cs->key, sizeof(cs->key)/sizeof(cs->key[0]));
-	} else {
-		return cipherdisk_setup(cs);
-	}
+static int cipherdisk_getninodes(block_if this_bs) {
+	return 1;
 }
 
-static int cipherdisk_nblocks(block_store_t *this_bs) {
+static int cipherdisk_getsize(block_if this_bs, unsigned int ino) {
 	struct cipherdisk_state *cs = this_bs->state;
-	return (*cs->below->nblocks)(cs->below) - 1;
+	if (ino != 0) {
+		fprintf(stderr, "!!cipherdisk_getsize: ino != 0 not supported\n");
+		return -1;
+	}
+	int r = (*cs->below->getsize)(cs->below, cs->below_ino);
+	return r < 0 ? r : r - 1;
 }
 
-static int cipherdisk_setsize(block_store_t *this_bs, block_no newsize) {
-	/* not implemented */
+static int cipherdisk_setsize(block_if this_bs, unsigned int ino, block_no newsize) {
+	fprintf(stderr, "!!cipherdisk_setsize: not supported\n");
 	return -1;
 }
 
-/* Encrypt/decrypt the given block. */
-static void block_xcrypt(struct cipherdisk_state *cs, block_no offset, block_t *block) {
-	/* calculate the initialization vector */
-	sha256_context sc;
-	uint8_t iv[32];
-
-	sha256_starts(&sc);
-	sha256_update(&sc, cs->key, 32);
-	sha256_update(&sc, (uint8_t *) &offset, sizeof(offset));
-	sha256_finish(&sc, iv);
-
-	/* this only uses 16 of the 32 bytes for both the iv and key */
-	struct AES_ctx aes;
-	AES_init_ctx_iv(&aes, cs->key, iv);
-	AES_CTR_xcrypt_buffer(&aes, (uint8_t *) block, sizeof(block_t));
-}
-
-static int cipherdisk_read(block_store_t *this_bs, block_no offset, block_t *block) {
+static int cipherdisk_read(block_if this_bs, unsigned int ino, block_no offset, block_t *block) {
 	struct cipherdisk_state *cs = this_bs->state;
-	/* don't need to pad the blocks, because BLOCK_SIZE is already a multiple of 16 */
-	assert(sizeof(block_t) % AES_BLOCKLEN == 0);
+	if (ino != 0) {
+		fprintf(stderr, "!!cipherdisk_read: ino != 0 not supported\n");
+		return -1;
+	}
 
-	if ((*cs->below->read)(cs->below, offset + 1, block) != 0) {
-		fprintf(stderr, "cipherdisk_read: failed to read block\n\r");
+	if ((*cs->below->read)(cs->below, cs->below_ino, offset + 1, block) != 0) {
+		fprintf(stderr, "!!cipherdisk_read: failed to read block\n");
 		return -1;
 	}
 
@@ -321,46 +327,122 @@ static int cipherdisk_read(block_store_t *this_bs, block_no offset, block_t *blo
 	return 0;
 }
 
-static int cipherdisk_write(block_store_t *this_bs, block_no offset, block_t *block) {
+static int cipherdisk_write(block_if this_bs, unsigned int ino, block_no offset, block_t *block) {
 	struct cipherdisk_state *cs = this_bs->state;
-	/* don't need to pad the blocks, because BLOCK_SIZE is already a multiple of 16 */
-	assert(BLOCK_SIZE % AES_BLOCKLEN == 0);
+	if (ino != 0) {
+		fprintf(stderr, "!!cipherdisk_write: ino != 0 not supported\n");
+		return -1;
+	}
 
-	/* copy the block into a buffer */
+	/* copy the block into a buffer and encrypt it */
 	block_t buffer;
 	memcpy(&buffer, block, sizeof(buffer));
-
-	/* encrypt the buffer */
 	block_xcrypt(cs, offset, &buffer);
 
-	if ((*cs->below->write)(cs->below, offset + 1, &buffer) != 0) {
-		fprintf(stderr, "cipherdisk_write: failed to write block\n\r");
+	if ((*cs->below->write)(cs->below, cs->below_ino, offset + 1, &buffer) != 0) {
+		fprintf(stderr, "!!cipherdisk_write: failed to write block\n");
 		return -1;
 	}
+	return 0;
+}
 
+static int cipherdisk_readv(block_if this_bs, unsigned int ino, block_no offset,
+		block_no nblocks, block_t *blocks) {
+	struct cipherdisk_state *cs = this_bs->state;
+	if (ino != 0) {
+		fprintf(stderr, "!!cipherdisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (block_store_readv(cs->below, cs->below_ino, offset + 1, nblocks, blocks) != 0) {
+		fprintf(stderr, "!!cipherdisk_readv: failed to read blocks\n");
+		return -1;
+	}
+	for (block_no i = 0; i < nblocks; ++i) {
+		block_xcrypt(cs, offset + i, &blocks[i]);
+	}
+	return 0;
+}
+
+static int cipherdisk_writev(block_if this_bs, unsigned int ino, block_no offset,
+		block_no nblocks, block_t *blocks) {
+	struct cipherdisk_state *cs = this_bs->state;
+	if (ino != 0) {
+		fprintf(stderr, "!!cipherdisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	block_t *buf = malloc(nblocks * sizeof(block_t));
+	memcpy(buf, blocks, nblocks * sizeof(block_t));
+	for (block_no i = 0; i < nblocks; ++i) {
+		block_xcrypt(cs, offset + i, &buf[i]);
+	}
+	int r = block_store_writev(cs->below, cs->below_ino, offset + 1, nblocks, buf);
+	free(buf);
+	if (r != 0) {
+		fprintf(stderr, "!!cipherdisk_writev: failed to write blocks\n");
+		return -1;
+	}
 	return 0;
 }
 
-static void cipherdisk_destroy(block_store_t *this_bs) {
-	free(this_bs->state);
+static int cipherdisk_sync(block_if this_bs, unsigned int ino) {
+	struct cipherdisk_state *cs = this_bs->state;
+	return (*cs->below->sync)(cs->below, cs->below_ino);
+}
+
+static void cipherdisk_release(block_if this_bs) {
+	struct cipherdisk_state *cs = this_bs->state;
+	memset(&cs->aes, 0, sizeof(cs->aes));
+	free(cs);
 	free(this_bs);
 }
 
-block_store_t *cipherdisk_init(block_store_t *below) {
+/* Open the cipherdisk on the given inode below. If passphrase is null,
+ * prompt for it (or for a new one to create a cipherdisk). */
+static block_if cipherdisk_open(block_if below, unsigned int below_ino,
+		const char *passphrase) {
 	struct cipherdisk_state *cs = new_alloc(struct cipherdisk_state);
-	if (cipherdisk_open(below, cs) != 0) {
-		fprintf(stderr, "cipherdisk_init: failed to open cipherdisk\n\r");
-		sys_exit(1);
+	cs->below = below;
+	cs->below_ino = below_ino;
+
+	union cipherdisk_block sb;
+	int r;
+	if ((*below->read)(below, below_ino, 0, &sb.datablock) != 0) {
+		fprintf(stderr, "!!cipherdisk_open: failed to read superblock\n");
+		r = -1;
+	} else if (sb.superblock.magic == CIPHER_MAGIC) {
+		r = passphrase == 0 ? cipherdisk_prompt_unlock(cs, &sb.superblock) :
+							cipherdisk_unlock(cs, &sb.superblock, passphrase);
+	} else {
+		r = passphrase == 0 ? cipherdisk_prompt_setup(cs) :
+							cipherdisk_create(cs, passphrase);
+	}
+	if (r != 0) {
+		fprintf(stderr, "!!cipherdisk_open: failed to open cipherdisk\n");
+		free(cs);
+		return 0;
 	}
 
-	block_store_t *bi = new_alloc(block_store_t);
+	block_if bi = new_alloc(block_store_t);
 	bi->state = cs;
-	bi->nblocks = cipherdisk_nblocks;
+	bi->getninodes = cipherdisk_getninodes;
+	bi->getsize = cipherdisk_getsize;
 	bi->setsize = cipherdisk_setsize;
 	bi->read = cipherdisk_read;
 	bi->write = cipherdisk_write;
-	bi->destroy = cipherdisk_destroy;
+	bi->release = cipherdisk_release;
+	bi->sync = cipherdisk_sync;
+	bi->readv = cipherdisk_readv;
+	bi->writev = cipherdisk_writev;
 	return bi;
 }
 
-#endif // CIPHERDISK
+block_if cipherdisk_init(block_if below, unsigned int below_ino) {
+	return cipherdisk_open(below, below_ino, 0);
+}
+
+block_if cipherdisk_init_passphrase(block_if below, unsigned int below_ino,
+		const char *passphrase) {
+	return cipherdisk_open(below, below_ino, passphrase);
+}
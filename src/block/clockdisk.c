@@ -1,7 +1,7 @@
 /* Author: Robbert van Renesse, August 2015
  *
  * This block store module mirrors the underlying block store but contains
- * a write-through cache.  The caching strategy is CLOCK, approximating LRU.
+ * a write-back cache.  The caching strategy is CLOCK, approximating LRU.
  * The interface is as follows:
  *
  *		block_if clockdisk_init(block_if below,
@@ -9,8 +9,39 @@
  *			'below' is the underlying block store.  'blocks' points to
  *			a chunk of memory wth 'nblocks' blocks for caching.
  *
+ *		void clockdisk_set_partition(block_if bi,
+ *									block_no meta_min, block_no stream_max)
+ *			Reserve 'meta_min' slots for metadata blocks, and let
+ *			streaming blocks use at most 'stream_max' slots (0 for no
+ *			maximum).  The defaults are half and a quarter of the cache.
+ *
  *		void clockdisk_dump_stats(block_if bi)
  *			Prints the cache statistics.
+ *
+ * Writes are delayed.  Dirty blocks are written back sorted by inode and
+ * offset, with one writev per run of consecutive blocks: all of them when
+ * CLOCK_HIGH_WATER percent of the cache is dirty, when the oldest has been
+ * dirty for CLOCK_MAX_AGE microseconds, and on sync; and the run around a
+ * dirty block that the clock hand replaces.  The dirty blocks are kept in
+ * an array sorted by inode and offset and in a list ordered by age, so
+ * finding a run or the oldest block needs no scan.  There is no timer:
+ * the age is checked on every read, write and sync, so dirty blocks stay
+ * in the cache as long as nothing uses it.  If the write-back of a dirty block that the
+ * clock hand would replace fails, the block stays dirty and the hand moves
+ * on.  If no block can be replaced a read is not cached, and a write goes
+ * straight to the block store below.
+ *
+ * Each cached block has a class (normal, metadata or streaming) set by the
+ * hint method.  The last CLOCK_NHINTS hints are remembered and give the
+ * class of a block when it is brought in, and a hint also changes the class
+ * of the blocks it covers that are in the cache already.  Repeating a
+ * remembered hint does not scan the cache again.  The clock hand
+ * passes over metadata blocks while there are no more than meta_min of
+ * them, unless the new block is metadata too, and once there are
+ * stream_max streaming blocks a streaming block can only replace another
+ * one.  A large scan thus cannot push the file system metadata out of the
+ * cache.  If the hand goes around twice without finding a block, it takes
+ * the first one that is not recently used.
  */
 
 #include <stdio.h>
@@ -18,6 +49,11 @@
 #include <string.h>
 #include <egos/block_store.h>
 
+#define CLOCK_HIGH_WATER	75				// % of the cache dirty
+#define CLOCK_MAX_AGE		(5 * 1000000)	// usec
+#define CLOCK_NHINTS		16				// hints remembered
+#define CLOCK_NCLASSES		3				// one for each enum block_hint
+
 enum block_status {
 	EMPTY,	// block not in use
 	OLD,	// block not used for a while (ready to be replaced)
@@ -32,8 +68,33 @@ typedef struct block_info {
 	unsigned int dirty;
 	unsigned int ino;
 	block_no offset;
+	unsigned long dirtied;		// when it became dirty
+	block_no older, newer;		// neighbors in the list of dirty blocks by age
+	enum block_hint class;
 } block_info_t;
 
+/* A hint for blocks offset .. offset + nblocks - 1 of an inode.
+ */
+struct clock_hint {
+	unsigned int ino;
+	block_no offset, nblocks;
+	enum block_hint class;
+	unsigned long used;			// when last given or used; 0 if free
+};
+
+static const char *clock_class_names[CLOCK_NCLASSES] = {
+	"normal", "metadata", "streaming"
+};
+
+/* An entry of the array of dirty blocks, which is kept sorted by inode
+ * and offset.
+ */
+struct dirty_block {
+	unsigned int ino;
+	block_no offset;
+	block_no slot;
+};
+
 /* State contains the pointer to the block module below as well as caching
  * information and caching statistics.
  */
@@ -43,10 +104,22 @@ struct clockdisk_state {
 	block_info_t *block_infos;  // memory for caching blocks' metadata
 	block_no nblocks;			// size of cache (not size of block store!)
 	block_no clock_hand;
+	block_no ndirty;			// #dirty blocks
+	struct dirty_block *dirty;	// dirty blocks, sorted by inode and offset
+	block_no oldest, newest;	// ends of the age list, or nblocks if empty
+	block_t *wbuf;				// run of blocks to write back
+	block_no ncached[CLOCK_NCLASSES];	// #blocks in the cache per class
+	block_no meta_min;			// #slots reserved for metadata
+	block_no stream_max;		// maximum #streaming blocks, or 0
+	struct clock_hint hints[CLOCK_NHINTS];
+	unsigned long hint_clock;	// counts hints given and used
 
 	/* Stats.
 	 */
 	unsigned int read_hit, read_miss, write_hit, write_miss, nops;
+	unsigned int nwritev, nwritten;		// #writevs and #blocks written below
+	unsigned int flush_evict, flush_high, flush_age, flush_sync;
+	unsigned int class_hit[CLOCK_NCLASSES], class_miss[CLOCK_NCLASSES];
 };
 
 void clockdisk_dump_stats_if_needed(block_if bi);
@@ -65,14 +138,173 @@ static int clockdisk_getsize(block_if bi, unsigned int ino){
 	return (*cs->below->getsize)(cs->below, ino);
 }
 
+/* Return the position in cs->dirty of the first dirty block at or after
+ * the given inode and offset.
+ */
+static block_no dirty_find(struct clockdisk_state *cs, unsigned int ino, block_no offset){
+	block_no lo = 0, hi = cs->ndirty;
+
+	while (lo < hi) {
+		block_no mid = lo + (hi - lo) / 2;
+		struct dirty_block *d = &cs->dirty[mid];
+		if (d->ino < ino || (d->ino == ino && d->offset < offset)) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Mark slot i dirty: add it to the sorted array and to the new end of the
+ * age list.
+ */
+static void cache_dirty(struct clockdisk_state *cs, block_no i){
+	block_info_t *info = &cs->block_infos[i];
+
+	if (info->dirty) {
+		return;
+	}
+	block_no p = dirty_find(cs, info->ino, info->offset);
+	memmove(&cs->dirty[p + 1], &cs->dirty[p], (cs->ndirty - p) * sizeof(*cs->dirty));
+	cs->dirty[p].ino = info->ino;
+	cs->dirty[p].offset = info->offset;
+	cs->dirty[p].slot = i;
+	cs->ndirty++;
+
+	info->dirty = 1;
+	info->dirtied = block_store_usec();
+	info->older = cs->newest;
+	info->newer = cs->nblocks;
+	if (cs->newest == cs->nblocks) {
+		cs->oldest = i;
+	}
+	else {
+		cs->block_infos[cs->newest].newer = i;
+	}
+	cs->newest = i;
+}
+
+/* Mark slot i clean and take it off the age list.  The caller removes it
+ * from the sorted array.
+ */
+static void cache_clean(struct clockdisk_state *cs, block_no i){
+	block_info_t *info = &cs->block_infos[i];
+
+	info->dirty = 0;
+	if (info->older == cs->nblocks) {
+		cs->oldest = info->newer;
+	}
+	else {
+		cs->block_infos[info->older].newer = info->newer;
+	}
+	if (info->newer == cs->nblocks) {
+		cs->newest = info->older;
+	}
+	else {
+		cs->block_infos[info->newer].older = info->older;
+	}
+}
+
+/* Remove the entries of cs->dirty[first .. last - 1] whose blocks are no
+ * longer dirty.
+ */
+static void dirty_compact(struct clockdisk_state *cs, block_no first, block_no last){
+	block_no i, n = first;
+
+	for (i = first; i < last; i++) {
+		if (cs->block_infos[cs->dirty[i].slot].dirty) {
+			cs->dirty[n++] = cs->dirty[i];
+		}
+	}
+	memmove(&cs->dirty[n], &cs->dirty[last], (cs->ndirty - last) * sizeof(*cs->dirty));
+	cs->ndirty -= last - n;
+}
+
+/* Write back the dirty blocks cs->dirty[first .. last - 1], with a writev
+ * for each run of consecutive blocks.
+ */
+static int cache_write_runs(struct clockdisk_state *cs, block_no first, block_no last){
+	struct dirty_block *d = cs->dirty;
+	block_no i, j, k;
+	int result = 0;
+
+	for (i = first; i < last; i = j) {
+		for (j = i + 1; j < last && d[j].ino == d[i].ino && d[j].offset == d[j - 1].offset + 1; j++)
+			;
+		for (k = i; k < j; k++) {
+			memcpy(&cs->wbuf[k - i], &cs->blocks[d[k].slot], sizeof(block_t));
+		}
+		cs->nwritev++;
+		cs->nwritten += j - i;
+		if (block_store_writev(cs->below, d[i].ino, d[i].offset, j - i, cs->wbuf) < 0) {
+			result = -1;
+			continue;
+		}
+		for (k = i; k < j; k++) {
+			cache_clean(cs, d[k].slot);
+		}
+	}
+	dirty_compact(cs, first, last);
+	return result;
+}
+
+/* Write back all dirty blocks of inode ino (or all if ino is -1).
+ */
+static int cache_flush(struct clockdisk_state *cs, unsigned int ino){
+	if (ino == (unsigned int) -1) {
+		return cache_write_runs(cs, 0, cs->ndirty);
+	}
+	return cache_write_runs(cs, dirty_find(cs, ino, 0), dirty_find(cs, ino + 1, 0));
+}
+
+/* Write back the dirty block in slot victim, along with the dirty blocks
+ * that it is a run of consecutive blocks with.
+ */
+static void cache_flush_run(struct clockdisk_state *cs, block_no victim){
+	struct dirty_block *d = cs->dirty;
+	block_no p, lo, hi;
+
+	p = dirty_find(cs, cs->block_infos[victim].ino, cs->block_infos[victim].offset);
+	for (lo = p; lo > 0 && d[lo - 1].ino == d[p].ino && d[lo - 1].offset + 1 == d[lo].offset; lo--)
+		;
+	for (hi = p + 1; hi < cs->ndirty && d[hi].ino == d[p].ino && d[hi].offset == d[hi - 1].offset + 1; hi++)
+		;
+	(void) cache_write_runs(cs, lo, hi);
+}
+
+/* Start writing back when too much of the cache is dirty, or when a block
+ * has been dirty for too long.
+ */
+static void cache_check_flush(struct clockdisk_state *cs){
+	if (cs->ndirty * 100 >= cs->nblocks * CLOCK_HIGH_WATER) {
+		cs->flush_high++;
+		(void) cache_flush(cs, (unsigned int) -1);
+	}
+	else if (cs->ndirty > 0 &&
+			block_store_usec() - cs->block_infos[cs->oldest].dirtied >= CLOCK_MAX_AGE) {
+		cs->flush_age++;
+		(void) cache_flush(cs, (unsigned int) -1);
+	}
+}
+
 static int clockdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
 	struct clockdisk_state *cs = bi->state;
 	++cs->nops;
 
+	// The dirty ones among them are a range of the sorted array
+	block_no first = dirty_find(cs, ino, nblocks), last = dirty_find(cs, ino + 1, 0);
+	for (block_no p = first; p < last; p++) {
+		cache_clean(cs, cs->dirty[p].slot);
+	}
+	dirty_compact(cs, first, last);
+
 	// Clear cache's entries of about-to-be-deleted blocks
 	for (block_no i = 0; i < cs->nblocks; ++i) {
 		if (cs->block_infos[i].status != EMPTY && 
 			cs->block_infos[i].ino == ino && cs->block_infos[i].offset >= nblocks) {
+				cs->ncached[cs->block_infos[i].class]--;
 				cs->block_infos[i].status = EMPTY;
 			}
 	}
@@ -81,29 +313,98 @@ static int clockdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
 	return (*cs->below->setsize)(cs->below, ino, nblocks);
 }
 
-static void cache_update(struct clockdisk_state *cs, unsigned int ino, block_no offset, block_t *block, unsigned int dirty) {
-	while (1) {
+/* Find the class of a block from the most recent hint that covers it.
+ */
+static enum block_hint cache_class(struct clockdisk_state *cs, unsigned int ino, block_no offset){
+	struct clock_hint *h, *best = 0;
+
+	for (h = cs->hints; h < &cs->hints[CLOCK_NHINTS]; h++) {
+		if (h->used != 0 && h->ino == ino && offset >= h->offset &&
+							offset - h->offset < h->nblocks &&
+							(best == 0 || h->used > best->used)) {
+			best = h;
+		}
+	}
+	if (best == 0) {
+		return BLOCK_HINT_NORMAL;
+	}
+	best->used = ++cs->hint_clock;
+	return best->class;
+}
+
+/* Set the class of the block in slot i.
+ */
+static void cache_set_class(struct clockdisk_state *cs, block_no i, enum block_hint class){
+	cs->ncached[cs->block_infos[i].class]--;
+	cs->block_infos[i].class = class;
+	cs->ncached[class]++;
+}
+
+/* See if the block in slot i (if any) may be replaced by a block of the
+ * given class without breaking the partitioning.
+ */
+static int cache_replaceable(struct clockdisk_state *cs, block_no i, enum block_hint class){
+	block_info_t *info = &cs->block_infos[i];
+
+	if (class == BLOCK_HINT_STREAM && cs->stream_max != 0 &&
+						cs->ncached[BLOCK_HINT_STREAM] >= cs->stream_max &&
+						(info->status == EMPTY || info->class != BLOCK_HINT_STREAM)) {
+		return 0;
+	}
+	if (info->status != EMPTY && info->class == BLOCK_HINT_METADATA &&
+						class != BLOCK_HINT_METADATA &&
+						cs->ncached[BLOCK_HINT_METADATA] <= cs->meta_min) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Put the block in the cache, replacing the block under the clock hand.
+ * Returns -1 if no block could be replaced because write-backs failed.
+ */
+static int cache_update(struct clockdisk_state *cs, unsigned int ino, block_no offset, block_t *block, unsigned int dirty, enum block_status status) {
+	enum block_hint class = cache_class(cs, ino, offset);
+	block_no steps;
+
+	for (steps = 0; steps < 3 * cs->nblocks; steps++) {
 		block_no i = cs->clock_hand;
-		if (cs->block_infos[i].status != NEW) {
+		if (cs->block_infos[i].status != NEW &&
+				(steps >= 2 * cs->nblocks || cache_replaceable(cs, i, class))) {
 			// Write-back if the evicted slot is dirty
 			if (cs->block_infos[i].status != EMPTY && cs->block_infos[i].dirty) {
-				(*cs->below->write)(cs->below, cs->block_infos[i].ino, cs->block_infos[i].offset, &cs->blocks[i]);
+				cs->flush_evict++;
+				cache_flush_run(cs, i);
+				if (cs->block_infos[i].dirty) {		// write failed; keep it
+					cs->clock_hand = (i + 1) % cs->nblocks;
+					continue;
+				}
 			}
 
 			// Write new block in
-			cs->block_infos[i].status = NEW;
-			cs->block_infos[i].dirty = dirty;
+			if (cs->block_infos[i].status != EMPTY) {
+				cs->ncached[cs->block_infos[i].class]--;
+			}
+			cs->block_infos[i].class = class;
+			cs->ncached[class]++;
+			cs->block_infos[i].status = status;
+			cs->block_infos[i].dirty = 0;
 			cs->block_infos[i].ino = ino;
 			cs->block_infos[i].offset = offset;
 			memcpy(&cs->blocks[i], block, sizeof(block_t));
+			if (dirty) {
+				cache_dirty(cs, i);
+			}
 
 			cs->clock_hand = (i + 1) % cs->nblocks;
-			return;
+			return 0;
 		}  
 		
-		cs->block_infos[i].status = OLD;
+		if (cs->block_infos[i].status == NEW) {
+			cs->block_infos[i].status = OLD;
+		}
 		cs->clock_hand = (i + 1) % cs->nblocks;
 	}
+	return -1;
 }
 
 static int clockdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
@@ -117,20 +418,79 @@ static int clockdisk_read(block_if bi, unsigned int ino, block_no offset, block_
 				memcpy(block, &cs->blocks[i], sizeof(block_t));
 				cs->block_infos[i].status = NEW;
 				cs->read_hit += 1;
+				cs->class_hit[cs->block_infos[i].class]++;
 
 				clockdisk_dump_stats_if_needed(bi);
+				cache_check_flush(cs);
 				return 0;
 			}
 	}
 
 	// Cache miss
 	cs->read_miss += 1;
+	cs->class_miss[cache_class(cs, ino, offset)]++;
 
 	int r = (*cs->below->read)(cs->below, ino, offset, block);
 	clockdisk_dump_stats_if_needed(bi);
 	if (r == -1) return r;
 
-	cache_update(cs, ino, offset, block, 0);
+	(void) cache_update(cs, ino, offset, block, 0, NEW);
+	cache_check_flush(cs);
+	return 0;
+}
+
+/* Return the slot that caches the given block, or cs->nblocks if none.
+ */
+static block_no cache_find(struct clockdisk_state *cs, unsigned int ino, block_no offset){
+	block_no i;
+
+	for (i = 0; i < cs->nblocks; ++i) {
+		if (cs->block_infos[i].status != EMPTY &&
+			cs->block_infos[i].ino == ino && cs->block_infos[i].offset == offset) {
+				break;
+			}
+	}
+	return i;
+}
+
+/* Read a range of blocks.  Each run of consecutive blocks that are not in
+ * the cache is read from below with a single readv.
+ */
+static int clockdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct clockdisk_state *cs = bi->state;
+	block_no i, j, k;
+	++cs->nops;
+
+	for (i = 0; i < nblocks; i = j) {
+		k = cache_find(cs, ino, offset + i);
+		if (k < cs->nblocks) {
+			// Cache hit
+			memcpy(&blocks[i], &cs->blocks[k], sizeof(block_t));
+			cs->block_infos[k].status = NEW;
+			cs->read_hit += 1;
+			cs->class_hit[cs->block_infos[k].class]++;
+			j = i + 1;
+			continue;
+		}
+
+		// Run of cache misses
+		for (j = i + 1; j < nblocks && cache_find(cs, ino, offset + j) == cs->nblocks; j++)
+			;
+		cs->read_miss += j - i;
+		for (k = i; k < j; k++) {
+			cs->class_miss[cache_class(cs, ino, offset + k)]++;
+		}
+		if (block_store_readv(cs->below, ino, offset + i, j - i, &blocks[i]) < 0) {
+			clockdisk_dump_stats_if_needed(bi);
+			return -1;
+		}
+		for (k = i; k < j; k++) {
+			(void) cache_update(cs, ino, offset + k, &blocks[k], 0, NEW);
+		}
+	}
+
+	clockdisk_dump_stats_if_needed(bi);
+	cache_check_flush(cs);
 	return 0;
 }
 
@@ -144,10 +504,11 @@ static int clockdisk_write(block_if bi, unsigned int ino, block_no offset, block
 				// Cache hit
 				memcpy(&cs->blocks[i], block, sizeof(block_t));
 				cs->block_infos[i].status = NEW;
-				cs->block_infos[i].dirty = 1;
+				cache_dirty(cs, i);
 				cs->write_hit += 1;
 
 				clockdisk_dump_stats_if_needed(bi);
+				cache_check_flush(cs);
 				return 0;
 			}
 	}
@@ -156,7 +517,10 @@ static int clockdisk_write(block_if bi, unsigned int ino, block_no offset, block
 	cs->write_miss += 1;
 	clockdisk_dump_stats_if_needed(bi);
 
-	cache_update(cs, ino, offset, block, 1);
+	if (cache_update(cs, ino, offset, block, 1, NEW) < 0) {
+		return (*cs->below->write)(cs->below, ino, offset, block);
+	}
+	cache_check_flush(cs);
 	return 0;
 }
 
@@ -164,21 +528,80 @@ static int clockdisk_sync(block_if bi, unsigned int ino){
 	struct clockdisk_state *cs = bi->state;
 	++cs->nops;
 
-	for (block_no i = 0; i < cs->nblocks; ++i) {
-		if (cs->block_infos[i].status != EMPTY && cs->block_infos[i].dirty && 
-			(cs->block_infos[i].ino == ino || ino == (unsigned int) -1)) {
-				(*cs->below->write)(cs->below, cs->block_infos[i].ino, cs->block_infos[i].offset, &cs->blocks[i]);
-				cs->block_infos[i].dirty = 0;
-			}
+	if (cs->ndirty > 0) {
+		cs->flush_sync++;
+		if (cache_flush(cs, ino) < 0) {
+			return -1;
+		}
 	}
+	cache_check_flush(cs);
 
 	clockdisk_dump_stats_if_needed(bi);
 	return (*cs->below->sync)(cs->below, ino);
 }
 
+/* See if another remembered hint with a different class covers some of
+ * the blocks of hint h.
+ */
+static int hint_overlap(struct clockdisk_state *cs, struct clock_hint *h){
+	struct clock_hint *g;
+
+	for (g = cs->hints; g < &cs->hints[CLOCK_NHINTS]; g++) {
+		if (g != h && g->used != 0 && g->ino == h->ino && g->class != h->class &&
+							(g->offset - h->offset < h->nblocks ||
+							 h->offset - g->offset < g->nblocks)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Remember the hint, replacing the least recently used one if there is
+ * no room, and apply it to the blocks in the cache.  A hint that is
+ * remembered already only counts as used, without a scan of the cache.
+ */
+static int clockdisk_hint(block_if bi, unsigned int ino, block_no offset, block_no nblocks, enum block_hint hint){
+	struct clockdisk_state *cs = bi->state;
+	struct clock_hint *h, *victim = &cs->hints[0];
+
+	if ((unsigned int) hint >= CLOCK_NCLASSES) {
+		fprintf(stderr, "!!clockdisk_hint: bad hint %d\n", hint);
+		return -1;
+	}
+	for (h = cs->hints; h < &cs->hints[CLOCK_NHINTS]; h++) {
+		if (h->used != 0 && h->ino == ino && h->offset == offset && h->nblocks == nblocks) {
+			if (h->class == hint && !hint_overlap(cs, h)) {
+				h->used = ++cs->hint_clock;
+				return 0;
+			}
+			victim = h;
+			break;
+		}
+		if (h->used < victim->used) {
+			victim = h;
+		}
+	}
+	victim->ino = ino;
+	victim->offset = offset;
+	victim->nblocks = nblocks;
+	victim->class = hint;
+	victim->used = ++cs->hint_clock;
+
+	for (block_no i = 0; i < cs->nblocks; ++i) {
+		if (cs->block_infos[i].status != EMPTY && cs->block_infos[i].ino == ino &&
+							cs->block_infos[i].offset >= offset &&
+							cs->block_infos[i].offset - offset < nblocks) {
+			cache_set_class(cs, i, hint);
+		}
+	}
+	return 0;
+}
+
 static void clockdisk_release(block_if bi){
 	struct clockdisk_state *cs = bi->state;
 	free(cs->block_infos);
+	free(cs->dirty);
+	free(cs->wbuf);
 	free(cs);
 	free(bi);
 }
@@ -195,6 +618,21 @@ void clockdisk_dump_stats(block_if bi){
 	printf("!$CLOCK: #read misses:  %u\n", cs->read_miss);
 	printf("!$CLOCK: #write hits:   %u\n", cs->write_hit);
 	printf("!$CLOCK: #write misses: %u\n", cs->write_miss);
+	printf("!$CLOCK: #writevs:      %u (%u blocks)\n", cs->nwritev, cs->nwritten);
+	printf("!$CLOCK: #flushes:      %u eviction, %u high-water, %u age, %u sync\n",
+					cs->flush_evict, cs->flush_high, cs->flush_age, cs->flush_sync);
+	for (unsigned int c = 0; c < CLOCK_NCLASSES; c++) {
+		unsigned int n = cs->class_hit[c] + cs->class_miss[c];
+		printf("!$CLOCK: %-9s %u read hits (%.1f%%), %u cached\n", clock_class_names[c],
+					cs->class_hit[c], n == 0 ? 0 : 100.0 * cs->class_hit[c] / n, cs->ncached[c]);
+	}
+}
+
+void clockdisk_set_partition(block_if bi, block_no meta_min, block_no stream_max){
+	struct clockdisk_state *cs = bi->state;
+
+	cs->meta_min = meta_min;
+	cs->stream_max = stream_max;
 }
 
 /* Create a new block store module on top of the specified module below.
@@ -210,6 +648,11 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks){
 	cs->nblocks = nblocks;
 	cs->clock_hand = 0;
 	cs->block_infos = calloc(nblocks, sizeof(block_info_t));
+	cs->dirty = calloc(nblocks, sizeof(struct dirty_block));
+	cs->wbuf = malloc(nblocks * BLOCK_SIZE);
+	cs->oldest = cs->newest = nblocks;
+	cs->meta_min = nblocks / 2;
+	cs->stream_max = nblocks / 4;
 
 	cs->read_hit = 0;
 	cs->read_miss = 0;
@@ -228,5 +671,7 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks){
 	bi->write = clockdisk_write;
 	bi->release = clockdisk_release;
 	bi->sync = clockdisk_sync;
+	bi->readv = clockdisk_readv;
+	bi->hint = clockdisk_hint;
 	return bi;
 }
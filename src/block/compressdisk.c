@@ -0,0 +1,837 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module compresses the blocks of the block store
+ * above it.  The interface is as follows:
+ *
+ *		int compressdisk_create(block_if below, unsigned int below_ino)
+ *			Initialize inode 'below_ino' of 'below' as an empty compressed
+ *			block store (all blocks zero), unless it already is one.
+ *
+ *		block_if compressdisk_init(block_if below, unsigned int below_ino)
+ *			Open the compressed block store on inode 'below_ino' of
+ *			'below'.  It has a single inode.
+ *
+ *		void compressdisk_dump_stats(block_if bi)
+ *			Print how many blocks were read and written above and below,
+ *			and how well the data compressed.
+ *
+ * The virtual blocks are grouped into groups of COMPRESS_GROUP
+ * consecutive blocks.  The blocks of a group that are not all zeroes
+ * are compressed together into an extent of as many physical blocks as
+ * it needs.  If that does not save at least one block, they are stored
+ * uncompressed instead.  Either way blocks of zeroes take no space, and
+ * neither do groups of zeroes.  Block 0 below is a
+ * superblock, followed by the map, which holds for each group which of
+ * its blocks are not zero, the physical blocks of its extent, and its
+ * compressed length.  The rest of
+ * the blocks below hold the extents.  The virtual block store has as
+ * many blocks as fit uncompressed, plus one spare group, so a write never
+ * runs out of space; what compression saves is I/O.
+ *
+ * The codec is in the style of LZ4: a sequence of literal runs, each
+ * followed by a match (a 16-bit offset back into the output and a
+ * length), with both lengths packed into a token byte.  The compressor
+ * finds matches greedily using a hash table of 4-byte prefixes.
+ *
+ * A small cache holds COMPRESS_NCACHE decompressed groups.  Writes only
+ * update the cache; a group is compressed and written when it is evicted
+ * or on sync, so consecutive writes to a group cost a single extent
+ * write.  The map is kept in memory as well and written on sync.  Free
+ * physical blocks are tracked in memory, computed from the map when the
+ * block store is opened.  An extent is allocated contiguously if
+ * possible, so that it can be transferred with a single readv or writev.
+ *
+ * Extents are never overwritten in place: a group is always written to a
+ * newly allocated extent, and the blocks of its old extent are not
+ * reused until the map that no longer refers to them has been written
+ * (a "commit").  A commit first syncs the extents below, then writes the
+ * dirty map blocks and syncs again.  Thus after a crash every group
+ * reads back as it was at some sync, or later if it was flushed and its
+ * map block written since.  If a flush runs out of free blocks while
+ * there are old extents waiting to be freed, it commits early; the spare
+ * group guarantees that this makes enough room.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define COMPRESS_MAGIC		0x4411C0DE
+#define COMPRESS_GROUP		8		// virtual blocks per group
+#define COMPRESS_NCACHE		4		// #groups in the cache
+
+#define GROUP_SIZE			(COMPRESS_GROUP * BLOCK_SIZE)
+
+struct compressdisk_superblock {
+	uint32_t magic;
+	uint32_t group;			// COMPRESS_GROUP when created
+	uint32_t ngroups;		// #groups
+	uint32_t nmapblocks;	// #map blocks, following the superblock
+};
+
+/* Where a group is stored.
+ */
+struct compressdisk_extent {
+	uint8_t nphys;			// #physical blocks (0 if the group is all zeroes)
+	uint8_t mask;			// bit i is set if block i is not zero
+	uint16_t clen;			// compressed length in bytes (0 if uncompressed)
+	uint32_t phys[COMPRESS_GROUP];	// the physical blocks, in order
+};
+
+#define EXTENTS_PER_BLOCK	(BLOCK_SIZE / sizeof(struct compressdisk_extent))
+
+union compressdisk_block {
+	struct compressdisk_superblock superblock;
+	struct compressdisk_extent extents[EXTENTS_PER_BLOCK];
+	block_t block;
+};
+
+/* A decompressed group in the cache.
+ */
+struct compressdisk_cached {
+	bool valid;
+	bool dirty;
+	block_no group;
+	unsigned long lru;		// time of last use
+	block_t blocks[COMPRESS_GROUP];
+};
+
+struct compressdisk_state {
+	block_if below;			// block store below
+	unsigned int below_ino;	// inode below
+	block_no nbelow;		// #blocks below
+	block_no ngroups;		// #groups
+	block_no nmapblocks;	// #map blocks
+	struct compressdisk_extent *extents;	// the map, one entry per group
+	bool *map_dirty;		// map blocks that need to be written
+	bool *used;				// physical blocks in use
+	block_no nfree;			// #physical blocks free
+	uint32_t *freed;		// blocks of old extents, free after the next commit
+	block_no nfreed;		// #entries in freed
+	block_no rotor;			// where to start looking for free blocks
+	struct compressdisk_cached *cache;
+	unsigned long clock;	// for LRU
+
+	block_t *cbuf;			// compressed extent (COMPRESS_GROUP blocks)
+	block_t *gbuf;			// non-zero blocks of a group (COMPRESS_GROUP blocks)
+
+	/* Statistics.
+	 */
+	unsigned int nread, nwrite;			// blocks read and written above
+	unsigned int nphys_read, nphys_write;	// blocks read and written below
+	unsigned int nhit, nmiss;			// cache hits and misses
+	unsigned int ncommit;				// #commits
+	unsigned long nbytes_in, nbytes_out;	// bytes of data and of extents flushed
+};
+
+/* The codec.  A compressed group is a sequence of
+ *
+ *		token (literal length << 4 | (match length - 4))
+ *		[more literal length]  literals  [offset (2 bytes)  [more match length]]
+ *
+ * where a length nibble of 15 is followed by bytes that are added to it,
+ * up to and including the first one that is not 255.  The last sequence
+ * has no match.
+ */
+#define LZ_MINMATCH		4
+#define LZ_HASH_BITS	12
+
+static uint32_t lz_read32(const uint8_t *p){
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int lz_hash(uint32_t v){
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_length(uint8_t *op, unsigned int len){
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* Emit literals in[anchor .. ip - 1] followed by a match of length mlen
+ * at offset 'off' (or no match if mlen == 0).  Returns 0 if it does not
+ * fit in the output.
+ */
+static uint8_t *lz_sequence(uint8_t *op, uint8_t *end, const uint8_t *lit, unsigned int nlit,
+										unsigned int off, unsigned int mlen){
+	if (op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > end) {
+		return 0;
+	}
+	uint8_t *token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15) {
+		op = lz_put_length(op, nlit - 15);
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen > 0) {
+		*op++ = off;
+		*op++ = off >> 8;
+		mlen -= LZ_MINMATCH;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15) {
+			op = lz_put_length(op, mlen - 15);
+		}
+	}
+	return op;
+}
+
+/* Compress n bytes (n < 64 KB) into at most 'cap' bytes.  Returns the
+ * compressed length, or 0 if it does not fit.
+ */
+static unsigned int lz_compress(const uint8_t *in, unsigned int n, uint8_t *out, unsigned int cap){
+	uint16_t table[1 << LZ_HASH_BITS];
+	uint8_t *op = out, *end = out + cap;
+	unsigned int ip = 0, anchor = 0;
+
+	memset(table, 0, sizeof(table));
+	while (ip + LZ_MINMATCH <= n) {
+		uint32_t v = lz_read32(&in[ip]);
+		unsigned int h = lz_hash(v), ref = table[h];
+		table[h] = ip;
+		if (ref >= ip || lz_read32(&in[ref]) != v) {
+			ip++;
+			continue;
+		}
+		unsigned int len = LZ_MINMATCH;
+		while (ip + len < n && in[ref + len] == in[ip + len]) {
+			len++;
+		}
+		if ((op = lz_sequence(op, end, &in[anchor], ip - anchor, ip - ref, len)) == 0) {
+			return 0;
+		}
+		ip += len;
+		anchor = ip;
+	}
+	if ((op = lz_sequence(op, end, &in[anchor], n - anchor, 0, 0)) == 0) {
+		return 0;
+	}
+	return op - out;
+}
+
+static int lz_get_length(const uint8_t *in, unsigned int n, unsigned int *ip, unsigned int *len){
+	uint8_t b;
+
+	do {
+		if (*ip >= n) {
+			return -1;
+		}
+		b = in[(*ip)++];
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* Decompress n bytes into at most 'cap' bytes.  Returns the decompressed
+ * length, or -1 if the input is corrupt.
+ */
+static int lz_decompress(const uint8_t *in, unsigned int n, uint8_t *out, unsigned int cap){
+	unsigned int ip = 0, op = 0, i;
+
+	while (ip < n) {
+		uint8_t token = in[ip++];
+		unsigned int nlit = token >> 4;
+		if (nlit == 15 && lz_get_length(in, n, &ip, &nlit) < 0) {
+			return -1;
+		}
+		if (nlit > n - ip || nlit > cap - op) {
+			return -1;
+		}
+		memcpy(&out[op], &in[ip], nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == n) {
+			break;
+		}
+
+		if (n - ip < 2) {
+			return -1;
+		}
+		unsigned int off = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		unsigned int mlen = token & 15;
+		if (mlen == 15 && lz_get_length(in, n, &ip, &mlen) < 0) {
+			return -1;
+		}
+		mlen += LZ_MINMATCH;
+		if (off == 0 || off > op || mlen > cap - op) {
+			return -1;
+		}
+		if (off >= mlen) {
+			memcpy(&out[op], &out[op - off], mlen);
+		}
+		else {
+			for (i = 0; i < mlen; i++) {
+				out[op + i] = out[op + i - off];
+			}
+		}
+		op += mlen;
+	}
+	return op;
+}
+
+/* Allocate n physical blocks for an extent, contiguously if possible.
+ */
+static int compressdisk_alloc(struct compressdisk_state *cs, unsigned int n, uint32_t *phys){
+	block_no first = 1 + cs->nmapblocks, ndata = cs->nbelow - first;
+	block_no i, run = 0;
+	unsigned int k;
+
+	if (cs->nfree < n) {
+		fprintf(stderr, "!!compressdisk: out of space\n");
+		return -1;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	/* Look for a run of n free blocks, starting at the rotor.  A run
+	 * does not wrap around the end.
+	 */
+	for (i = 0; i < ndata; i++) {
+		block_no b = first + (cs->rotor - first + i) % ndata;
+		if (b == first) {
+			run = 0;
+		}
+		run = cs->used[b] ? 0 : run + 1;
+		if (run == n) {
+			for (k = 0; k < n; k++) {
+				phys[k] = b + 1 - n + k;
+			}
+			break;
+		}
+	}
+
+	/* Otherwise just take the first n free blocks.
+	 */
+	if (i == ndata) {
+		k = 0;
+		for (i = 0; i < ndata && k < n; i++) {
+			block_no b = first + (cs->rotor - first + i) % ndata;
+			if (!cs->used[b]) {
+				phys[k++] = b;
+			}
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		cs->used[phys[k]] = true;
+	}
+	cs->nfree -= n;
+	cs->rotor = phys[n - 1] + 1 < cs->nbelow ? phys[n - 1] + 1 : first;
+	return 0;
+}
+
+/* Free the blocks of an extent.  If the map below may still refer to
+ * them they are only put on the freed list.
+ */
+static void compressdisk_free(struct compressdisk_state *cs, struct compressdisk_extent *ext,
+												bool committed){
+	unsigned int k;
+
+	for (k = 0; k < ext->nphys; k++) {
+		if (committed) {
+			cs->freed[cs->nfreed++] = ext->phys[k];
+		}
+		else {
+			cs->used[ext->phys[k]] = false;
+			cs->nfree++;
+		}
+	}
+}
+
+/* Transfer the blocks of an extent to or from buf, with one readv or
+ * writev per run of consecutive physical blocks.
+ */
+static int compressdisk_xfer(struct compressdisk_state *cs, struct compressdisk_extent *ext,
+												int write, block_t *buf){
+	unsigned int k, n;
+
+	for (k = 0; k < ext->nphys; k += n) {
+		for (n = 1; k + n < ext->nphys && ext->phys[k + n] == ext->phys[k] + n; n++)
+			;
+		int r = write ?
+			block_store_writev(cs->below, cs->below_ino, ext->phys[k], n, &buf[k]) :
+			block_store_readv(cs->below, cs->below_ino, ext->phys[k], n, &buf[k]);
+		if (r < 0) {
+			return -1;
+		}
+	}
+	if (write) {
+		cs->nphys_write += ext->nphys;
+	}
+	else {
+		cs->nphys_read += ext->nphys;
+	}
+	return 0;
+}
+
+static bool compressdisk_is_zero(block_t *block){
+	uint64_t *w = (uint64_t *) block;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(*w); i++) {
+		if (w[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Write the dirty map blocks below, between two syncs, after which the
+ * blocks of old extents can be reused.
+ */
+static int compressdisk_commit(struct compressdisk_state *cs){
+	block_no b;
+
+	if ((*cs->below->sync)(cs->below, cs->below_ino) < 0) {
+		return -1;
+	}
+	for (b = 0; b < cs->nmapblocks; b++) {
+		if (!cs->map_dirty[b]) {
+			continue;
+		}
+		union compressdisk_block mb;
+		block_no g = b * EXTENTS_PER_BLOCK, n = cs->ngroups - g;
+		memset(&mb, 0, sizeof(mb));
+		memcpy(mb.extents, &cs->extents[g],
+				(n < EXTENTS_PER_BLOCK ? n : EXTENTS_PER_BLOCK) * sizeof(*cs->extents));
+		if ((*cs->below->write)(cs->below, cs->below_ino, 1 + b, &mb.block) < 0) {
+			fprintf(stderr, "!!compressdisk: can't write map block %u\n", b);
+			return -1;
+		}
+		cs->nphys_write++;
+		cs->map_dirty[b] = false;
+	}
+	if ((*cs->below->sync)(cs->below, cs->below_ino) < 0) {
+		return -1;
+	}
+	for (b = 0; b < cs->nfreed; b++) {
+		cs->used[cs->freed[b]] = false;
+	}
+	cs->nfree += cs->nfreed;
+	cs->nfreed = 0;
+	cs->ncommit++;
+	return 0;
+}
+
+/* Compress a cached group and write it to a new extent below.
+ */
+static int compressdisk_flush(struct compressdisk_state *cs, struct compressdisk_cached *c){
+	struct compressdisk_extent *ext = &cs->extents[c->group], next;
+	unsigned int i, nz = 0, clen = 0, n;
+	uint8_t mask = 0;
+
+	/* Gather the blocks that are not zero.
+	 */
+	for (i = 0; i < COMPRESS_GROUP; i++) {
+		if (!compressdisk_is_zero(&c->blocks[i])) {
+			memcpy(&cs->gbuf[nz++], &c->blocks[i], BLOCK_SIZE);
+			mask |= 1 << i;
+		}
+	}
+
+	block_t *buf = cs->gbuf;
+	n = nz;
+	if (nz > 1) {
+		clen = lz_compress((uint8_t *) cs->gbuf, nz * BLOCK_SIZE, (uint8_t *) cs->cbuf,
+												(nz - 1) * BLOCK_SIZE);
+	}
+	if (clen > 0) {
+		n = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		memset((char *) cs->cbuf + clen, 0, n * BLOCK_SIZE - clen);
+		buf = cs->cbuf;
+	}
+
+	/* Write the new extent.  The old one stays intact until the next
+	 * commit, and so does the map entry if the write fails.
+	 */
+	if (cs->nfree < n && cs->nfreed > 0 && compressdisk_commit(cs) < 0) {
+		return -1;
+	}
+	memset(&next, 0, sizeof(next));
+	if (compressdisk_alloc(cs, n, next.phys) < 0) {
+		return -1;
+	}
+	next.nphys = n;
+	next.mask = mask;
+	next.clen = clen;
+	if (compressdisk_xfer(cs, &next, 1, buf) < 0) {
+		fprintf(stderr, "!!compressdisk: can't write group %u\n", c->group);
+		compressdisk_free(cs, &next, false);
+		return -1;
+	}
+	compressdisk_free(cs, ext, true);
+	*ext = next;
+	cs->map_dirty[c->group / EXTENTS_PER_BLOCK] = true;
+	cs->nbytes_in += GROUP_SIZE;
+	cs->nbytes_out += n * BLOCK_SIZE;
+	c->dirty = false;
+	return 0;
+}
+
+/* Read and decompress a group into the cache.
+ */
+static int compressdisk_load(struct compressdisk_state *cs, struct compressdisk_cached *c, block_no group){
+	struct compressdisk_extent *ext = &cs->extents[group];
+	unsigned int i, nz = 0;
+
+	c->valid = false;
+	for (i = 0; i < COMPRESS_GROUP; i++) {
+		if (ext->mask & (1 << i)) {
+			nz++;
+		}
+	}
+	if (ext->clen == 0) {
+		if (compressdisk_xfer(cs, ext, 0, cs->gbuf) < 0) {
+			return -1;
+		}
+	}
+	else {
+		if (compressdisk_xfer(cs, ext, 0, cs->cbuf) < 0) {
+			return -1;
+		}
+		if (lz_decompress((uint8_t *) cs->cbuf, ext->clen, (uint8_t *) cs->gbuf,
+										nz * BLOCK_SIZE) != (int) (nz * BLOCK_SIZE)) {
+			fprintf(stderr, "!!compressdisk: group %u is corrupt\n", group);
+			return -1;
+		}
+	}
+
+	/* Scatter the blocks that are not zero.
+	 */
+	nz = 0;
+	for (i = 0; i < COMPRESS_GROUP; i++) {
+		if (ext->mask & (1 << i)) {
+			memcpy(&c->blocks[i], &cs->gbuf[nz++], BLOCK_SIZE);
+		}
+		else {
+			memset(&c->blocks[i], 0, BLOCK_SIZE);
+		}
+	}
+	c->valid = true;
+	c->dirty = false;
+	c->group = group;
+	return 0;
+}
+
+/* Find the group in the cache, loading it if necessary.
+ */
+static struct compressdisk_cached *compressdisk_get(struct compressdisk_state *cs, block_no group){
+	struct compressdisk_cached *c, *victim = &cs->cache[0];
+	unsigned int i;
+
+	for (i = 0; i < COMPRESS_NCACHE; i++) {
+		c = &cs->cache[i];
+		if (c->valid && c->group == group) {
+			cs->nhit++;
+			c->lru = ++cs->clock;
+			return c;
+		}
+		if (!c->valid || (victim->valid && c->lru < victim->lru)) {
+			victim = c;
+		}
+	}
+
+	cs->nmiss++;
+	if (victim->valid && victim->dirty && compressdisk_flush(cs, victim) < 0) {
+		return 0;
+	}
+	if (compressdisk_load(cs, victim, group) < 0) {
+		return 0;
+	}
+	victim->lru = ++cs->clock;
+	return victim;
+}
+
+static int compressdisk_getninodes(block_if bi){
+	return 1;
+}
+
+static int compressdisk_getsize(block_if bi, unsigned int ino){
+	struct compressdisk_state *cs = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!compressdisk_getsize: ino != 0 not supported\n");
+		return -1;
+	}
+	return cs->ngroups * COMPRESS_GROUP;
+}
+
+static int compressdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "!!compressdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int compressdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct compressdisk_state *cs = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!compressdisk_read: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset >= cs->ngroups * COMPRESS_GROUP) {
+		fprintf(stderr, "!!compressdisk_read: bad offset %u\n", offset);
+		return -1;
+	}
+
+	struct compressdisk_cached *c = compressdisk_get(cs, offset / COMPRESS_GROUP);
+	if (c == 0) {
+		return -1;
+	}
+	memcpy(block, &c->blocks[offset % COMPRESS_GROUP], BLOCK_SIZE);
+	cs->nread++;
+	return 0;
+}
+
+static int compressdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct compressdisk_state *cs = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!compressdisk_write: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset >= cs->ngroups * COMPRESS_GROUP) {
+		fprintf(stderr, "!!compressdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+
+	struct compressdisk_cached *c = compressdisk_get(cs, offset / COMPRESS_GROUP);
+	if (c == 0) {
+		return -1;
+	}
+	memcpy(&c->blocks[offset % COMPRESS_GROUP], block, BLOCK_SIZE);
+	c->dirty = true;
+	cs->nwrite++;
+	return 0;
+}
+
+/* Read or write nblocks consecutive blocks, one cache lookup per group.
+ */
+static int compressdisk_xferv(struct compressdisk_state *cs, const char *fn, unsigned int ino,
+						block_no offset, block_no nblocks, block_t *blocks, int write){
+	block_no i, n;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!%s: ino != 0 not supported\n", fn);
+		return -1;
+	}
+	if (offset > cs->ngroups * COMPRESS_GROUP || nblocks > cs->ngroups * COMPRESS_GROUP - offset) {
+		fprintf(stderr, "!!%s: bad offset %u\n", fn, offset);
+		return -1;
+	}
+	for (i = 0; i < nblocks; i += n) {
+		block_no b = offset + i, k = b % COMPRESS_GROUP;
+		n = COMPRESS_GROUP - k;
+		if (n > nblocks - i) {
+			n = nblocks - i;
+		}
+		struct compressdisk_cached *c = compressdisk_get(cs, b / COMPRESS_GROUP);
+		if (c == 0) {
+			return -1;
+		}
+		if (write) {
+			memcpy(&c->blocks[k], &blocks[i], n * BLOCK_SIZE);
+			c->dirty = true;
+			cs->nwrite += n;
+		}
+		else {
+			memcpy(&blocks[i], &c->blocks[k], n * BLOCK_SIZE);
+			cs->nread += n;
+		}
+	}
+	return 0;
+}
+
+static int compressdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	return compressdisk_xferv(bi->state, "compressdisk_readv", ino, offset, nblocks, blocks, 0);
+}
+
+static int compressdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	return compressdisk_xferv(bi->state, "compressdisk_writev", ino, offset, nblocks, blocks, 1);
+}
+
+/* Flush the dirty groups and commit.
+ */
+static int compressdisk_sync(block_if bi, unsigned int ino){
+	struct compressdisk_state *cs = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < COMPRESS_NCACHE; i++) {
+		struct compressdisk_cached *c = &cs->cache[i];
+		if (c->valid && c->dirty && compressdisk_flush(cs, c) < 0) {
+			return -1;
+		}
+	}
+	return compressdisk_commit(cs);
+}
+
+static void compressdisk_free_state(struct compressdisk_state *cs){
+	free(cs->gbuf);
+	free(cs->cbuf);
+	free(cs->cache);
+	free(cs->freed);
+	free(cs->used);
+	free(cs->map_dirty);
+	free(cs->extents);
+	free(cs);
+}
+
+static void compressdisk_release(block_if bi){
+	(void) compressdisk_sync(bi, 0);
+	compressdisk_free_state(bi->state);
+	free(bi);
+}
+
+void compressdisk_dump_stats(block_if bi){
+	struct compressdisk_state *cs = bi->state;
+
+	printf("!$COMPRESS: #blocks read/written above: %u/%u\n", cs->nread, cs->nwrite);
+	printf("!$COMPRESS: #blocks read/written below: %u/%u\n", cs->nphys_read, cs->nphys_write);
+	printf("!$COMPRESS: #cache hits/misses:         %u/%u\n", cs->nhit, cs->nmiss);
+	printf("!$COMPRESS: #commits:                   %u\n", cs->ncommit);
+	printf("!$COMPRESS: groups flushed: %lu KB in %lu KB\n", cs->nbytes_in / 1024, cs->nbytes_out / 1024);
+	printf("!$COMPRESS: %u of %u physical blocks free\n", cs->nfree, cs->nbelow - 1 - cs->nmapblocks);
+}
+
+int compressdisk_create(block_if below, unsigned int below_ino){
+	union compressdisk_block blk;
+
+	if (sizeof(blk) != BLOCK_SIZE) {
+		fprintf(stderr, "compressdisk_create: block has wrong size\n");
+		return -1;
+	}
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	if (blk.superblock.magic == COMPRESS_MAGIC) {
+		return 0;
+	}
+
+	/* Find the largest number of groups that fit uncompressed, together
+	 * with the superblock, the map, and a spare group.
+	 */
+	int nblocks = (*below->getsize)(below, below_ino);
+	if (nblocks < 0) {
+		return -1;
+	}
+	block_no ngroups = nblocks / COMPRESS_GROUP, nmapblocks;
+	while (ngroups > 0) {
+		nmapblocks = (ngroups + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+		if (1 + nmapblocks + (ngroups + 1) * COMPRESS_GROUP <= (block_no) nblocks) {
+			break;
+		}
+		ngroups--;
+	}
+	if (ngroups == 0) {
+		fprintf(stderr, "compressdisk_create: too few blocks\n");
+		return -1;
+	}
+
+	/* All groups start out empty (all zeroes).
+	 */
+	block_no b;
+	memset(&blk, 0, sizeof(blk));
+	for (b = 1; b <= nmapblocks; b++) {
+		if ((*below->write)(below, below_ino, b, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	blk.superblock.magic = COMPRESS_MAGIC;
+	blk.superblock.group = COMPRESS_GROUP;
+	blk.superblock.ngroups = ngroups;
+	blk.superblock.nmapblocks = nmapblocks;
+	if ((*below->write)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+block_if compressdisk_init(block_if below, unsigned int below_ino){
+	union compressdisk_block blk;
+	block_no b, g;
+	unsigned int k;
+
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return 0;
+	}
+	if (blk.superblock.magic != COMPRESS_MAGIC || blk.superblock.group != COMPRESS_GROUP) {
+		fprintf(stderr, "!!compressdisk_init: not a compressed block store\n");
+		return 0;
+	}
+	int nblocks = (*below->getsize)(below, below_ino);
+	if (nblocks < 0) {
+		return 0;
+	}
+
+	struct compressdisk_state *cs = new_alloc(struct compressdisk_state);
+	cs->below = below;
+	cs->below_ino = below_ino;
+	cs->nbelow = nblocks;
+	cs->ngroups = blk.superblock.ngroups;
+	cs->nmapblocks = blk.superblock.nmapblocks;
+	cs->extents = calloc(cs->ngroups, sizeof(*cs->extents));
+	cs->map_dirty = calloc(cs->nmapblocks, sizeof(*cs->map_dirty));
+	cs->used = calloc(cs->nbelow, sizeof(*cs->used));
+	cs->freed = calloc(cs->nbelow, sizeof(*cs->freed));
+	cs->cache = calloc(COMPRESS_NCACHE, sizeof(*cs->cache));
+	cs->cbuf = malloc(GROUP_SIZE);
+	cs->gbuf = malloc(GROUP_SIZE);
+	cs->rotor = 1 + cs->nmapblocks;
+
+	/* Read the map and compute which physical blocks are free.
+	 */
+	for (b = 0; b < cs->nmapblocks; b++) {
+		if ((*below->read)(below, below_ino, 1 + b, &blk.block) < 0) {
+			fprintf(stderr, "!!compressdisk_init: can't read map block %u\n", b);
+			compressdisk_free_state(cs);
+			return 0;
+		}
+		g = b * EXTENTS_PER_BLOCK;
+		memcpy(&cs->extents[g], blk.extents,
+			(cs->ngroups - g < EXTENTS_PER_BLOCK ? cs->ngroups - g : EXTENTS_PER_BLOCK) * sizeof(*cs->extents));
+	}
+	for (g = 0; g < cs->ngroups; g++) {
+		struct compressdisk_extent *ext = &cs->extents[g];
+		for (k = 0; k < ext->nphys; k++) {
+			if (ext->nphys > COMPRESS_GROUP || ext->phys[k] <= cs->nmapblocks ||
+						ext->phys[k] >= cs->nbelow || cs->used[ext->phys[k]]) {
+				fprintf(stderr, "!!compressdisk_init: bad extent for group %u\n", g);
+				compressdisk_free_state(cs);
+				return 0;
+			}
+			cs->used[ext->phys[k]] = true;
+		}
+	}
+	for (b = 1 + cs->nmapblocks; b < cs->nbelow; b++) {
+		if (!cs->used[b]) {
+			cs->nfree++;
+		}
+	}
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = cs;
+	bi->getninodes = compressdisk_getninodes;
+	bi->getsize = compressdisk_getsize;
+	bi->setsize = compressdisk_setsize;
+	bi->read = compressdisk_read;
+	bi->write = compressdisk_write;
+	bi->readv = compressdisk_readv;
+	bi->writev = compressdisk_writev;
+	bi->release = compressdisk_release;
+	bi->sync = compressdisk_sync;
+	return bi;
+}
@@ -0,0 +1,616 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module stores each distinct block only once.  The
+ * interface is as follows:
+ *
+ *		int dedupdisk_create(block_if below, unsigned int below_ino,
+ *															block_no nblocks)
+ *			Initialize inode 'below_ino' of 'below' as an empty
+ *			deduplicating block store of 'nblocks' blocks (all zero),
+ *			unless it already is one.  If nblocks is 0, it gets as many
+ *			blocks as fit without any sharing, so that a write never runs
+ *			out of space.  A larger size is allowed, but then writes fail
+ *			when the distinct blocks no longer fit.
+ *
+ *		block_if dedupdisk_init(block_if below, unsigned int below_ino,
+ *									enum dedupdisk_hash hash, int verify)
+ *			Open the deduplicating block store on inode 'below_ino' of
+ *			'below'.  It has a single inode.  'hash' is the fingerprint
+ *			used to find identical blocks:
+ *				DEDUP_SHA256: SHA256 (32 bytes).
+ *				DEDUP_FAST: a 64-bit multiply-rotate hash, several times
+ *					faster than SHA256 but not collision-resistant.
+ *			If 'verify' is set, a block whose fingerprint matches is
+ *			read back and compared before it is shared.  This is always
+ *			done for DEDUP_FAST.
+ *
+ *		void dedupdisk_dump_stats(block_if bi)
+ *			Print the deduplication ratio, the memory used by the index,
+ *			and how writes were handled.
+ *
+ * Block 0 below is a superblock, followed by the map from virtual block
+ * numbers to physical block numbers below (0 for a block of zeroes,
+ * which takes no space).  The rest of the blocks below hold the data.
+ * The map is kept in memory and written on sync.
+ *
+ * Each physical block in use has a reference count (the number of
+ * virtual blocks that map to it) and a fingerprint of its contents.  The
+ * index is an open-addressing hash table from fingerprints to physical
+ * blocks.  Only the map is stored; the reference counts are computed
+ * from it, and the fingerprints by reading the blocks in use, when the
+ * block store is opened.  A write of a block that is already stored
+ * just adds a reference.  Otherwise the block is written to a free
+ * physical block.  Either way the reference to the old contents of the
+ * virtual block is dropped, and its physical block is freed if that was
+ * the last one.  If verification finds two different blocks with the
+ * same fingerprint, the new one is stored but not indexed.
+ *
+ * A physical block that the map below still refers to is not given
+ * other contents until the next sync, so after a crash every block
+ * reads back as it was at the last sync or as written since.  A copy of
+ * the map below is kept for this.  If a write finds no free block, it
+ * syncs first, which frees the blocks that only the map below kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+#include <egos/sha256.h>
+
+#define DEDUP_MAGIC			0x4411DED0
+#define DEDUP_MAX_FP		32			// max fingerprint size
+#define DEDUP_BATCH			64			// #blocks read at a time on open
+
+#define MAP_PER_BLOCK		(BLOCK_SIZE / sizeof(uint32_t))
+
+struct dedupdisk_superblock {
+	uint32_t magic;
+	uint32_t nblocks;		// #virtual blocks
+	uint32_t nmapblocks;	// #map blocks, following the superblock
+};
+
+union dedupdisk_block {
+	struct dedupdisk_superblock superblock;
+	uint32_t map[MAP_PER_BLOCK];
+	block_t block;
+};
+
+struct dedupdisk_state {
+	block_if below;			// block store below
+	unsigned int below_ino;	// inode below
+	block_no nbelow;		// #blocks below
+	block_no nblocks;		// #virtual blocks
+	block_no nmapblocks;	// #map blocks
+	block_no first;			// first data block below
+	enum dedupdisk_hash hash;
+	bool verify;			// compare blocks with matching fingerprints
+	unsigned int fp_size;	// fingerprint size in bytes
+
+	uint32_t *map;			// virtual to physical block number
+	bool *map_dirty;		// map blocks that need to be written
+	uint32_t *disk_map;		// the map as last written below
+	uint32_t *disk_refs;	// per physical block: #entries of disk_map
+
+	/* Per physical block: reference count, and fingerprint if indexed.
+	 */
+	uint32_t *refs;
+	uint8_t *fps;
+	bool *indexed;
+	block_no nused;			// #physical blocks in use
+	block_no rotor;			// where to look for a free block
+
+	/* The index: linear probing, 0 is an empty slot.
+	 */
+	uint32_t *index;
+	unsigned int index_size;	// power of 2
+
+	/* Statistics.
+	 */
+	unsigned int nwrites;		// blocks written
+	unsigned int nzero;			// ... that were all zeroes
+	unsigned int ndup;			// ... that were already stored
+	unsigned int nunique;		// ... that had to be stored
+	unsigned int ncollisions;	// matching fingerprints, different blocks
+	unsigned int nverify;		// blocks read back to verify a match
+	unsigned int nhashed;		// blocks fingerprinted, including on open
+	unsigned long hash_usec;	// time spent computing fingerprints
+};
+
+#define FP(ds, p)	(&(ds)->fps[(size_t) (p) * (ds)->fp_size])
+
+static uint64_t dedup_rotl(uint64_t x, unsigned int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+/* A 64-bit hash of a block that processes four independent lanes of
+ * 64-bit words, so that the multiplications overlap.
+ */
+static uint64_t dedup_fast_hash(block_t *block){
+	const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t a = p1, b = p2, c = 0, d = -p1, w[4];
+	const uint8_t *s = (const uint8_t *) block;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE; i += sizeof(w)) {
+		memcpy(w, &s[i], sizeof(w));
+		a = dedup_rotl(a + w[0] * p2, 31) * p1;
+		b = dedup_rotl(b + w[1] * p2, 31) * p1;
+		c = dedup_rotl(c + w[2] * p2, 31) * p1;
+		d = dedup_rotl(d + w[3] * p2, 31) * p1;
+	}
+	uint64_t h = dedup_rotl(a, 1) + dedup_rotl(b, 7) + dedup_rotl(c, 12) + dedup_rotl(d, 18);
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	return h;
+}
+
+static void dedupdisk_fingerprint(struct dedupdisk_state *ds, block_t *block, uint8_t *fp){
+	unsigned long start = block_store_usec();
+
+	if (ds->hash == DEDUP_SHA256) {
+		sha256_context sc;
+		sha256_starts(&sc);
+		sha256_update(&sc, (const uint8 *) block, BLOCK_SIZE);
+		sha256_finish(&sc, fp);
+	}
+	else {
+		uint64_t h = dedup_fast_hash(block);
+		memcpy(fp, &h, sizeof(h));
+	}
+	ds->nhashed++;
+	ds->hash_usec += block_store_usec() - start;
+}
+
+static unsigned int dedupdisk_slot(struct dedupdisk_state *ds, const uint8_t *fp){
+	uint64_t h;
+
+	memcpy(&h, fp, sizeof(h));
+	return (unsigned int) (h ^ (h >> 32)) & (ds->index_size - 1);
+}
+
+/* Returns the slot of the physical block with fingerprint fp, or of the
+ * empty slot where it would go.
+ */
+static unsigned int dedupdisk_lookup(struct dedupdisk_state *ds, const uint8_t *fp){
+	unsigned int i = dedupdisk_slot(ds, fp);
+
+	while (ds->index[i] != 0 && memcmp(FP(ds, ds->index[i]), fp, ds->fp_size) != 0) {
+		i = (i + 1) & (ds->index_size - 1);
+	}
+	return i;
+}
+
+static void dedupdisk_index_insert(struct dedupdisk_state *ds, block_no p){
+	unsigned int i = dedupdisk_lookup(ds, FP(ds, p));
+
+	if (ds->index[i] == 0) {
+		ds->index[i] = p;
+		ds->indexed[p] = true;
+	}
+}
+
+/* Remove physical block p from the index, moving back the entries that
+ * follow it so that lookups do not stop early.
+ */
+static void dedupdisk_index_remove(struct dedupdisk_state *ds, block_no p){
+	unsigned int mask = ds->index_size - 1;
+	unsigned int i = dedupdisk_lookup(ds, FP(ds, p)), j = i;
+
+	ds->indexed[p] = false;
+	ds->index[i] = 0;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (ds->index[j] == 0) {
+			return;
+		}
+		unsigned int home = dedupdisk_slot(ds, FP(ds, ds->index[j]));
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			ds->index[i] = ds->index[j];
+			ds->index[j] = 0;
+			i = j;
+		}
+	}
+}
+
+static bool dedupdisk_is_zero(block_t *block){
+	uint64_t *w = (uint64_t *) block;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(*w); i++) {
+		if (w[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void dedupdisk_set_map(struct dedupdisk_state *ds, block_no offset, block_no p){
+	ds->map[offset] = p;
+	ds->map_dirty[offset / MAP_PER_BLOCK] = true;
+}
+
+static void dedupdisk_unref(struct dedupdisk_state *ds, block_no p){
+	if (p != 0 && --ds->refs[p] == 0) {
+		if (ds->indexed[p]) {
+			dedupdisk_index_remove(ds, p);
+		}
+		ds->nused--;
+	}
+}
+
+static block_no dedupdisk_alloc(struct dedupdisk_state *ds){
+	block_no ndata = ds->nbelow - ds->first, i;
+
+	for (i = 0; i < ndata; i++) {
+		block_no p = ds->first + (ds->rotor - ds->first + i) % ndata;
+		if (ds->refs[p] == 0 && ds->disk_refs[p] == 0) {
+			ds->rotor = p + 1 < ds->nbelow ? p + 1 : ds->first;
+			return p;
+		}
+	}
+	return 0;
+}
+
+/* Find a physical block for new contents of virtual block 'offset',
+ * which is now in 'old'.  That is 'old' itself if nothing else refers to
+ * it, here or in the map below.
+ */
+static block_no dedupdisk_place(struct dedupdisk_state *ds, block_no offset, block_no old){
+	if (old != 0 && ds->refs[old] == 1 && (ds->disk_refs[old] == 0 ||
+				(ds->disk_refs[old] == 1 && ds->disk_map[offset] == old))) {
+		return old;
+	}
+	return dedupdisk_alloc(ds);
+}
+
+/* Write the dirty map blocks.  Once they are synced below, the blocks
+ * that only the old map referred to can be reused.
+ */
+static int dedupdisk_sync(block_if bi, unsigned int ino){
+	struct dedupdisk_state *ds = bi->state;
+	block_no b, i;
+
+	for (b = 0; b < ds->nmapblocks; b++) {
+		if (ds->map_dirty[b] && (*ds->below->write)(ds->below, ds->below_ino, 1 + b,
+								(block_t *) &ds->map[b * MAP_PER_BLOCK]) < 0) {
+			fprintf(stderr, "!!dedupdisk_sync: can't write map block %u\n", b);
+			return -1;
+		}
+	}
+	if ((*ds->below->sync)(ds->below, ds->below_ino) < 0) {
+		return -1;
+	}
+	for (b = 0; b < ds->nmapblocks; b++) {
+		if (!ds->map_dirty[b]) {
+			continue;
+		}
+		for (i = b * MAP_PER_BLOCK; i < (b + 1) * MAP_PER_BLOCK; i++) {
+			if (ds->disk_map[i] != 0) {
+				ds->disk_refs[ds->disk_map[i]]--;
+			}
+			if (ds->map[i] != 0) {
+				ds->disk_refs[ds->map[i]]++;
+			}
+			ds->disk_map[i] = ds->map[i];
+		}
+		ds->map_dirty[b] = false;
+	}
+	return 0;
+}
+
+static int dedupdisk_getninodes(block_if bi){
+	return 1;
+}
+
+static int dedupdisk_getsize(block_if bi, unsigned int ino){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!dedupdisk_getsize: ino != 0 not supported\n");
+		return -1;
+	}
+	return ds->nblocks;
+}
+
+static int dedupdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "!!dedupdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int dedupdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!dedupdisk_read: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset >= ds->nblocks) {
+		fprintf(stderr, "!!dedupdisk_read: bad offset %u\n", offset);
+		return -1;
+	}
+
+	block_no p = ds->map[offset];
+	if (p == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return (*ds->below->read)(ds->below, ds->below_ino, p, block);
+}
+
+static int dedupdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+	uint8_t fp[DEDUP_MAX_FP];
+
+	if (ino != 0) {
+		fprintf(stderr, "!!dedupdisk_write: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset >= ds->nblocks) {
+		fprintf(stderr, "!!dedupdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+
+	ds->nwrites++;
+	block_no old = ds->map[offset];
+	if (dedupdisk_is_zero(block)) {
+		ds->nzero++;
+		dedupdisk_unref(ds, old);
+		dedupdisk_set_map(ds, offset, 0);
+		return 0;
+	}
+
+	/* See if the block is already stored.
+	 */
+	dedupdisk_fingerprint(ds, block, fp);
+	unsigned int slot = dedupdisk_lookup(ds, fp);
+	block_no p = ds->index[slot];
+	if (p != 0 && ds->verify) {
+		block_t copy;
+		ds->nverify++;
+		if ((*ds->below->read)(ds->below, ds->below_ino, p, &copy) < 0) {
+			return -1;
+		}
+		if (memcmp(&copy, block, BLOCK_SIZE) != 0) {
+			ds->ncollisions++;
+			p = 0;
+			slot = ds->index_size;		// do not index the new block
+		}
+	}
+	if (p != 0) {
+		ds->ndup++;
+		ds->refs[p]++;
+		dedupdisk_unref(ds, old);
+		dedupdisk_set_map(ds, offset, p);
+		return 0;
+	}
+
+	/* Store it, in place if the old contents are not shared.  Dropping
+	 * the reference may change the index.
+	 */
+	if ((p = dedupdisk_place(ds, offset, old)) == 0) {
+		if (dedupdisk_sync(bi, 0) < 0) {
+			return -1;
+		}
+		p = dedupdisk_place(ds, offset, old);
+	}
+	if (p == 0) {
+		fprintf(stderr, "!!dedupdisk_write: out of space\n");
+		return -1;
+	}
+	dedupdisk_unref(ds, old);
+	if (slot < ds->index_size) {
+		slot = dedupdisk_lookup(ds, fp);
+	}
+	if ((*ds->below->write)(ds->below, ds->below_ino, p, block) < 0) {
+		dedupdisk_set_map(ds, offset, 0);
+		return -1;
+	}
+	ds->nunique++;
+	ds->nused++;
+	ds->refs[p] = 1;
+	memcpy(FP(ds, p), fp, ds->fp_size);
+	if (slot < ds->index_size) {
+		ds->index[slot] = p;
+		ds->indexed[p] = true;
+	}
+	dedupdisk_set_map(ds, offset, p);
+	return 0;
+}
+
+static void dedupdisk_free_state(struct dedupdisk_state *ds){
+	free(ds->index);
+	free(ds->indexed);
+	free(ds->fps);
+	free(ds->refs);
+	free(ds->disk_refs);
+	free(ds->disk_map);
+	free(ds->map_dirty);
+	free(ds->map);
+	free(ds);
+}
+
+static void dedupdisk_release(block_if bi){
+	(void) dedupdisk_sync(bi, 0);
+	dedupdisk_free_state(bi->state);
+	free(bi);
+}
+
+void dedupdisk_dump_stats(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+	block_no b, nref = 0;
+
+	for (b = 0; b < ds->nblocks; b++) {
+		if (ds->map[b] != 0) {
+			nref++;
+		}
+	}
+	size_t mem = (size_t) ds->nbelow * (sizeof(*ds->refs) + ds->fp_size + sizeof(*ds->indexed)) +
+					(size_t) ds->index_size * sizeof(*ds->index);
+
+	printf("!$DEDUP: hash %s%s\n", ds->hash == DEDUP_SHA256 ? "sha256" : "fast",
+										ds->verify ? ", verify" : "");
+	printf("!$DEDUP: %u non-zero blocks stored in %u physical blocks (ratio %.2f)\n",
+				nref, ds->nused, ds->nused == 0 ? 1.0 : (double) nref / ds->nused);
+	printf("!$DEDUP: writes: %u zero, %u duplicate, %u unique; %u verified, %u collisions\n",
+				ds->nzero, ds->ndup, ds->nunique, ds->nverify, ds->ncollisions);
+	printf("!$DEDUP: index memory: %lu KB (%u slots, %u-byte fingerprints)\n",
+				(unsigned long) mem / 1024, ds->index_size, ds->fp_size);
+	printf("!$DEDUP: hashing: %lu us for %u blocks\n", ds->hash_usec, ds->nhashed);
+}
+
+int dedupdisk_create(block_if below, unsigned int below_ino, block_no nblocks){
+	union dedupdisk_block blk;
+
+	if (sizeof(blk) != BLOCK_SIZE) {
+		fprintf(stderr, "dedupdisk_create: block has wrong size\n");
+		return -1;
+	}
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	if (blk.superblock.magic == DEDUP_MAGIC) {
+		return 0;
+	}
+
+	int nbelow = (*below->getsize)(below, below_ino);
+	if (nbelow < 0) {
+		return -1;
+	}
+	block_no nmapblocks;
+	if (nblocks == 0) {
+		/* As many blocks as fit with the map.
+		 */
+		nblocks = nbelow - 1;
+		while (nblocks > 0 && 1 + (nblocks + MAP_PER_BLOCK - 1) / MAP_PER_BLOCK + nblocks > (block_no) nbelow) {
+			nblocks--;
+		}
+	}
+	nmapblocks = (nblocks + MAP_PER_BLOCK - 1) / MAP_PER_BLOCK;
+	if (nblocks == 0 || 1 + nmapblocks >= (block_no) nbelow) {
+		fprintf(stderr, "dedupdisk_create: too few blocks\n");
+		return -1;
+	}
+
+	/* All blocks start out as zeroes.
+	 */
+	block_no b;
+	memset(&blk, 0, sizeof(blk));
+	for (b = 1; b <= nmapblocks; b++) {
+		if ((*below->write)(below, below_ino, b, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	blk.superblock.magic = DEDUP_MAGIC;
+	blk.superblock.nblocks = nblocks;
+	blk.superblock.nmapblocks = nmapblocks;
+	if ((*below->write)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+block_if dedupdisk_init(block_if below, unsigned int below_ino, enum dedupdisk_hash hash, int verify){
+	union dedupdisk_block blk;
+	block_no b, p, n;
+
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return 0;
+	}
+	if (blk.superblock.magic != DEDUP_MAGIC) {
+		fprintf(stderr, "!!dedupdisk_init: not a deduplicating block store\n");
+		return 0;
+	}
+	int nbelow = (*below->getsize)(below, below_ino);
+	if (nbelow < 0) {
+		return 0;
+	}
+
+	struct dedupdisk_state *ds = new_alloc(struct dedupdisk_state);
+	ds->below = below;
+	ds->below_ino = below_ino;
+	ds->nbelow = nbelow;
+	ds->nblocks = blk.superblock.nblocks;
+	ds->nmapblocks = blk.superblock.nmapblocks;
+	ds->first = 1 + ds->nmapblocks;
+	ds->rotor = ds->first;
+	ds->hash = hash;
+	ds->verify = verify || hash == DEDUP_FAST;
+	ds->fp_size = hash == DEDUP_SHA256 ? SHA256_SIZE : sizeof(uint64_t);
+	ds->map = calloc(ds->nmapblocks * MAP_PER_BLOCK, sizeof(*ds->map));
+	ds->map_dirty = calloc(ds->nmapblocks, sizeof(*ds->map_dirty));
+	ds->disk_map = calloc(ds->nmapblocks * MAP_PER_BLOCK, sizeof(*ds->disk_map));
+	ds->refs = calloc(ds->nbelow, sizeof(*ds->refs));
+	ds->disk_refs = calloc(ds->nbelow, sizeof(*ds->disk_refs));
+	ds->fps = calloc(ds->nbelow, ds->fp_size);
+	ds->indexed = calloc(ds->nbelow, sizeof(*ds->indexed));
+	for (ds->index_size = 1; ds->index_size < 2 * ds->nbelow; ds->index_size *= 2)
+		;
+	ds->index = calloc(ds->index_size, sizeof(*ds->index));
+
+	/* Read the map and count the references.
+	 */
+	for (b = 0; b < ds->nmapblocks; b++) {
+		if ((*below->read)(below, below_ino, 1 + b, (block_t *) &ds->map[b * MAP_PER_BLOCK]) < 0) {
+			fprintf(stderr, "!!dedupdisk_init: can't read map block %u\n", b);
+			dedupdisk_free_state(ds);
+			return 0;
+		}
+	}
+	for (b = 0; b < ds->nblocks; b++) {
+		p = ds->map[b];
+		if (p == 0) {
+			continue;
+		}
+		if (p < ds->first || p >= ds->nbelow) {
+			fprintf(stderr, "!!dedupdisk_init: bad map entry for block %u\n", b);
+			dedupdisk_free_state(ds);
+			return 0;
+		}
+		if (ds->refs[p]++ == 0) {
+			ds->nused++;
+		}
+	}
+	memcpy(ds->disk_map, ds->map, ds->nmapblocks * MAP_PER_BLOCK * sizeof(*ds->map));
+	memcpy(ds->disk_refs, ds->refs, ds->nbelow * sizeof(*ds->refs));
+
+	/* Fingerprint the blocks in use, reading runs of them at a time.
+	 */
+	block_t *buf = malloc(DEDUP_BATCH * BLOCK_SIZE);
+	for (p = ds->first; p < ds->nbelow; p += n) {
+		if (ds->refs[p] == 0) {
+			n = 1;
+			continue;
+		}
+		for (n = 1; n < DEDUP_BATCH && p + n < ds->nbelow && ds->refs[p + n] != 0; n++)
+			;
+		if (block_store_readv(below, below_ino, p, n, buf) < 0) {
+			fprintf(stderr, "!!dedupdisk_init: can't read block %u\n", p);
+			free(buf);
+			dedupdisk_free_state(ds);
+			return 0;
+		}
+		for (b = 0; b < n; b++) {
+			dedupdisk_fingerprint(ds, &buf[b], FP(ds, p + b));
+			dedupdisk_index_insert(ds, p + b);
+		}
+	}
+	free(buf);
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ds;
+	bi->getninodes = dedupdisk_getninodes;
+	bi->getsize = dedupdisk_getsize;
+	bi->setsize = dedupdisk_setsize;
+	bi->read = dedupdisk_read;
+	bi->write = dedupdisk_write;
+	bi->release = dedupdisk_release;
+	bi->sync = dedupdisk_sync;
+	return bi;
+}
@@ -0,0 +1,651 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module implements Reed-Solomon erasure coding over
+ * k data and m parity members, which survives the failure of any m
+ * members (with m = 2, like RAID6).
+ *
+ *		block_if ecdisk_init(block_if *below, unsigned int k, unsigned int m)
+ *			'below' is an array of k + m underlying block stores, all of
+ *			which are assumed to be of the same size.  below[0 .. k-1]
+ *			hold data and below[k .. k+m-1] hold parity.
+ *
+ *		int ecdisk_rebuild(block_if bi, unsigned int i, block_if replacement)
+ *			Replace member i (below[i]) by 'replacement', and write on it
+ *			the contents of the old member, computed from the others.
+ *
+ *		void ecdisk_dump_stats(block_if bi)
+ *			Print how many writes took each write path and how many
+ *			stripes had to be decoded.
+ *
+ * Block b of the virtual disk is stored as block b / k of data member
+ * b % k.  Blocks with the same number on all members form a stripe.
+ * Parity block j of a stripe is sum_i C[j][i] * D[i] over GF(2^8), where
+ * D[i] is the data block on member i and C is the Cauchy matrix
+ * C[j][i] = 1 / ((k + j) - i), where subtraction in GF(2^8) is XOR.
+ * Every k x k submatrix of the identity matrix stacked on C is
+ * invertible, so any k surviving members of a stripe determine the rest.
+ *
+ * Reads go directly to the data member, and the stripe is only decoded
+ * if that member has failed.  Like raid4disk, a single-block write
+ * updates the parity incrementally (read-modify-write) and a writev
+ * that covers whole stripes computes the parity without reading.  With
+ * failed members, a write decodes the whole stripe and re-encodes it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define ECDISK_BATCH	256		// max #stripes per batch in writev
+#define ECDISK_REBUILD_BATCH	64	// stripes per rebuild step
+
+struct ecdisk_state {
+	block_if *below;		// block stores below
+	unsigned int k;			// #data members
+	unsigned int m;			// #parity members
+	unsigned int n;			// k + m
+	bool *failed;			// members that returned an error
+	uint8_t *coef;			// m x k Cauchy matrix
+
+	/* The inverse matrix used by the last decode, and the members
+	 * it was computed for.
+	 */
+	uint8_t *inv;			// k x k
+	unsigned int *used;		// k member numbers
+	bool inv_valid;
+
+	/* Scratch space for ecdisk_decode().
+	 */
+	unsigned int *cur;		// k member numbers
+	uint8_t *mat;			// k x k
+
+	block_t *stripe;		// one block per member
+	block_t *old;			// for read-modify-write
+	struct block_store_xfer *xfers;	// one per member
+	struct block_store_pool *pool;	// one worker per member
+
+	/* Statistics.
+	 */
+	unsigned int nrmw;			// read-modify-write writes
+	unsigned int nfull;			// full-stripe writes
+	unsigned int ndegwrites;	// writes to a stripe with failed members
+	unsigned int ndecodes;		// stripes decoded
+};
+
+static uint8_t ecdisk_coef(struct ecdisk_state *ecs, unsigned int j, unsigned int i){
+	return ecs->coef[j * ecs->k + i];
+}
+
+static unsigned int ecdisk_nfailed(struct ecdisk_state *ecs){
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ecs->n; i++) {
+		if (ecs->failed[i]) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static int ecdisk_read_member(struct ecdisk_state *ecs, unsigned int i, block_no stripe, block_t *block){
+	if (ecs->failed[i]) {
+		return -1;
+	}
+	if ((*ecs->below[i]->read)(ecs->below[i], 0, stripe, block) < 0) {
+		fprintf(stderr, "!!ecdisk: member %u failed\n", i);
+		ecs->failed[i] = true;
+		return -1;
+	}
+	return 0;
+}
+
+static int ecdisk_write_member(struct ecdisk_state *ecs, unsigned int i, block_no stripe, block_t *block){
+	if (ecs->failed[i]) {
+		return -1;
+	}
+	if ((*ecs->below[i]->write)(ecs->below[i], 0, stripe, block) < 0) {
+		fprintf(stderr, "!!ecdisk: member %u failed\n", i);
+		ecs->failed[i] = true;
+		return -1;
+	}
+	return 0;
+}
+
+/* Compute the parity blocks of 'stripe' (an array of n blocks) from the
+ * data blocks.
+ */
+static void ecdisk_encode(struct ecdisk_state *ecs, block_t *stripe){
+	unsigned int i, j;
+
+	for (j = 0; j < ecs->m; j++) {
+		block_t *p = &stripe[ecs->k + j];
+		memset(p, 0, BLOCK_SIZE);
+		for (i = 0; i < ecs->k; i++) {
+			gf256_madd(p, &stripe[i], ecdisk_coef(ecs, j, i));
+		}
+	}
+}
+
+/* Invert the k x k matrix a in place using Gauss-Jordan elimination.
+ * Returns -1 if it is singular.
+ */
+static int ecdisk_invert(uint8_t *a, uint8_t *inv, unsigned int k){
+	unsigned int r, c, i;
+
+	memset(inv, 0, k * k);
+	for (i = 0; i < k; i++) {
+		inv[i * k + i] = 1;
+	}
+	for (c = 0; c < k; c++) {
+		for (r = c; r < k && a[r * k + c] == 0; r++)
+			;
+		if (r == k) {
+			return -1;
+		}
+		if (r != c) {
+			for (i = 0; i < k; i++) {
+				uint8_t t = a[r * k + i]; a[r * k + i] = a[c * k + i]; a[c * k + i] = t;
+				t = inv[r * k + i]; inv[r * k + i] = inv[c * k + i]; inv[c * k + i] = t;
+			}
+		}
+		uint8_t scale = gf256_inv(a[c * k + c]);
+		for (i = 0; i < k; i++) {
+			a[c * k + i] = gf256_mul(a[c * k + i], scale);
+			inv[c * k + i] = gf256_mul(inv[c * k + i], scale);
+		}
+		for (r = 0; r < k; r++) {
+			uint8_t f = a[r * k + c];
+			if (r == c || f == 0) {
+				continue;
+			}
+			for (i = 0; i < k; i++) {
+				a[r * k + i] ^= gf256_mul(f, a[c * k + i]);
+				inv[r * k + i] ^= gf256_mul(f, inv[c * k + i]);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Read the stripe from the working members into ecs->stripe and compute
+ * the blocks of the failed ones.
+ */
+static int ecdisk_decode(struct ecdisk_state *ecs, block_no stripe){
+	unsigned int i, t, nused;
+	block_t *s = ecs->stripe;
+
+	ecs->ndecodes++;
+
+	/* Read from the first k members that work, preferring data members,
+	 * which need no decoding.  A member may fail while we read it.
+	 */
+	unsigned int *used = ecs->cur;
+	nused = 0;
+	for (i = 0; i < ecs->n && nused < ecs->k; i++) {
+		if (ecdisk_read_member(ecs, i, stripe, &s[i]) == 0) {
+			used[nused++] = i;
+		}
+	}
+	if (nused < ecs->k) {
+		fprintf(stderr, "!!ecdisk: too many failed members to decode stripe %u\n", stripe);
+		return -1;
+	}
+	if (used[ecs->k - 1] == ecs->k - 1) {
+		/* All data members are there; only parity may be missing.
+		 */
+		ecdisk_encode(ecs, s);
+		return 0;
+	}
+
+	/* Row t of the matrix expresses block used[t] in terms of the data
+	 * blocks.  Invert it, unless it is the same as last time.
+	 */
+	if (!ecs->inv_valid || memcmp(used, ecs->used, ecs->k * sizeof(*used)) != 0) {
+		uint8_t *a = ecs->mat;
+		for (t = 0; t < ecs->k; t++) {
+			for (i = 0; i < ecs->k; i++) {
+				a[t * ecs->k + i] = used[t] < ecs->k ? (used[t] == i) :
+										ecdisk_coef(ecs, used[t] - ecs->k, i);
+			}
+		}
+		if (ecdisk_invert(a, ecs->inv, ecs->k) < 0) {
+			fprintf(stderr, "!!ecdisk: singular decoding matrix\n");
+			return -1;
+		}
+		memcpy(ecs->used, used, ecs->k * sizeof(*used));
+		ecs->inv_valid = true;
+	}
+
+	/* Data block i is sum_t inv[i][t] * block used[t].  used[] is sorted,
+	 * so if used[i] == i then data member i was read.  The other data
+	 * blocks are computed into ecs->old first, since the blocks in the
+	 * stripe are the sources.
+	 */
+	for (i = 0; i < ecs->k; i++) {
+		if (used[i] == i) {
+			continue;
+		}
+		memset(&ecs->old[i], 0, BLOCK_SIZE);
+		for (t = 0; t < ecs->k; t++) {
+			gf256_madd(&ecs->old[i], &s[used[t]], ecs->inv[i * ecs->k + t]);
+		}
+	}
+	for (i = 0; i < ecs->k; i++) {
+		if (used[i] != i) {
+			memcpy(&s[i], &ecs->old[i], BLOCK_SIZE);
+		}
+	}
+
+	/* Recompute the parity blocks, in case any of them are missing.
+	 */
+	ecdisk_encode(ecs, s);
+	return 0;
+}
+
+static int ecdisk_getninodes(block_if bi){
+	return 1;
+}
+
+static int ecdisk_getsize(block_if bi, unsigned int ino){
+	if (ino != 0) {
+		fprintf(stderr, "!!ecdisk_getsize: ino != 0 not supported\n");
+		return -1;
+	}
+
+	struct ecdisk_state *ecs = bi->state;
+	int min = -1;
+	for (unsigned int i = 0; i < ecs->n; i++) {
+		if (ecs->failed[i]) {
+			continue;
+		}
+		int r = (*ecs->below[i]->getsize)(ecs->below[i], 0);
+		if (r >= 0 && (min < 0 || r < min)) {
+			min = r;
+		}
+	}
+	return min < 0 ? -1 : min * (int) ecs->k;
+}
+
+static int ecdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "ecdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int ecdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct ecdisk_state *ecs = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ecdisk_read: ino != 0 not supported\n");
+		return -1;
+	}
+
+	unsigned int d = offset % ecs->k;
+	block_no stripe = offset / ecs->k;
+	if (ecdisk_read_member(ecs, d, stripe, block) == 0) {
+		return 0;
+	}
+	if (ecdisk_decode(ecs, stripe) < 0) {
+		return -1;
+	}
+	memcpy(block, &ecs->stripe[d], BLOCK_SIZE);
+	return 0;
+}
+
+/* Write the blocks of the stripe to all working members.
+ */
+static int ecdisk_write_stripe(struct ecdisk_state *ecs, block_no stripe){
+	unsigned int i;
+
+	for (i = 0; i < ecs->n; i++) {
+		struct block_store_xfer *x = &ecs->xfers[i];
+		x->bs = ecs->below[i];
+		x->ino = 0;
+		x->write = 1;
+		x->offset = stripe;
+		x->nblocks = ecs->failed[i] ? 0 : 1;
+		x->buf = &ecs->stripe[i];
+	}
+	if (block_store_pool_run(ecs->pool, ecs->xfers, ecs->n) < 0) {
+		for (i = 0; i < ecs->n; i++) {
+			if (ecs->xfers[i].nblocks > 0 && ecs->xfers[i].result < 0) {
+				fprintf(stderr, "!!ecdisk: member %u failed\n", i);
+				ecs->failed[i] = true;
+			}
+		}
+	}
+	return ecdisk_nfailed(ecs) > ecs->m ? -1 : 0;
+}
+
+/* Encode 'nstripes' full stripes of data starting at 'first' and write
+ * them, with one transfer per working member.
+ */
+static int ecdisk_write_stripes(struct ecdisk_state *ecs, block_no first,
+									block_no nstripes, block_t *data){
+	block_no s;
+	unsigned int i;
+
+	block_t *buf = malloc(nstripes * ecs->n * BLOCK_SIZE);
+	for (s = 0; s < nstripes; s++) {
+		memcpy(ecs->stripe, &data[s * ecs->k], ecs->k * BLOCK_SIZE);
+		ecdisk_encode(ecs, ecs->stripe);
+		for (i = 0; i < ecs->n; i++) {
+			memcpy(&buf[i * nstripes + s], &ecs->stripe[i], BLOCK_SIZE);
+		}
+	}
+	ecs->nfull += nstripes;
+
+	for (i = 0; i < ecs->n; i++) {
+		struct block_store_xfer *x = &ecs->xfers[i];
+		x->bs = ecs->below[i];
+		x->ino = 0;
+		x->write = 1;
+		x->offset = first;
+		x->nblocks = ecs->failed[i] ? 0 : nstripes;
+		x->buf = &buf[i * nstripes];
+	}
+	if (block_store_pool_run(ecs->pool, ecs->xfers, ecs->n) < 0) {
+		for (i = 0; i < ecs->n; i++) {
+			if (ecs->xfers[i].nblocks > 0 && ecs->xfers[i].result < 0) {
+				fprintf(stderr, "!!ecdisk: member %u failed\n", i);
+				ecs->failed[i] = true;
+			}
+		}
+	}
+	free(buf);
+	return ecdisk_nfailed(ecs) > ecs->m ? -1 : 0;
+}
+
+static int ecdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct ecdisk_state *ecs = bi->state;
+	unsigned int j;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ecdisk_write: ino != 0 not supported\n");
+		return -1;
+	}
+
+	unsigned int d = offset % ecs->k;
+	block_no stripe = offset / ecs->k;
+	block_t *delta = &ecs->old[0];
+
+	/* Read-modify-write: parity j ^= C[j][d] * (old ^ new).
+	 */
+	if (ecdisk_nfailed(ecs) == 0 && ecdisk_read_member(ecs, d, stripe, delta) == 0) {
+		block_t *srcs[2] = { delta, block };
+		parity_xor(delta, srcs, 2);
+		for (j = 0; j < ecs->m; j++) {
+			if (ecdisk_read_member(ecs, ecs->k + j, stripe, &ecs->stripe[j]) < 0) {
+				break;
+			}
+		}
+		if (j == ecs->m) {
+			ecs->nrmw++;
+			for (j = 0; j < ecs->m; j++) {
+				gf256_madd(&ecs->stripe[j], delta, ecdisk_coef(ecs, j, d));
+			}
+			(void) ecdisk_write_member(ecs, d, stripe, block);
+			for (j = 0; j < ecs->m; j++) {
+				(void) ecdisk_write_member(ecs, ecs->k + j, stripe, &ecs->stripe[j]);
+			}
+			return ecdisk_nfailed(ecs) > ecs->m ? -1 : 0;
+		}
+	}
+
+	/* Some member has failed: decode the stripe, replace the block, and
+	 * write the stripe with its new parity.
+	 */
+	ecs->ndegwrites++;
+	if (ecdisk_decode(ecs, stripe) < 0) {
+		return -1;
+	}
+	memcpy(&ecs->stripe[d], block, BLOCK_SIZE);
+	ecdisk_encode(ecs, ecs->stripe);
+	return ecdisk_write_stripe(ecs, stripe);
+}
+
+/* Read blocks one at a time, decoding each stripe with a failed data
+ * member only once.
+ */
+static int ecdisk_read_degraded(struct ecdisk_state *ecs, block_no offset,
+									block_no nblocks, block_t *blocks){
+	block_no o, decoded = (block_no) -1;
+
+	for (o = 0; o < nblocks; o++) {
+		unsigned int d = (offset + o) % ecs->k;
+		block_no stripe = (offset + o) / ecs->k;
+		if (stripe != decoded) {
+			if (ecdisk_read_member(ecs, d, stripe, &blocks[o]) == 0) {
+				continue;
+			}
+			if (ecdisk_decode(ecs, stripe) < 0) {
+				return -1;
+			}
+			decoded = stripe;
+		}
+		memcpy(&blocks[o], &ecs->stripe[d], BLOCK_SIZE);
+	}
+	return 0;
+}
+
+static int ecdisk_readv(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct ecdisk_state *ecs = bi->state;
+	block_no o;
+	unsigned int i;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ecdisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (ecdisk_nfailed(ecs) > 0 || nblocks < ecs->k) {
+		return ecdisk_read_degraded(ecs, offset, nblocks, blocks);
+	}
+
+	/* Read a contiguous range from each data member concurrently, then
+	 * gather the blocks.
+	 */
+	block_no first = offset / ecs->k;
+	block_no nstripes = (offset + nblocks - 1) / ecs->k - first + 1;
+	block_t *buf = malloc(nstripes * ecs->k * BLOCK_SIZE);
+	for (i = 0; i < ecs->n; i++) {
+		struct block_store_xfer *x = &ecs->xfers[i];
+		x->bs = ecs->below[i];
+		x->ino = 0;
+		x->write = 0;
+		x->offset = first;
+		x->nblocks = i < ecs->k ? nstripes : 0;
+		x->buf = &buf[i * nstripes];
+	}
+	int result = block_store_pool_run(ecs->pool, ecs->xfers, ecs->n);
+	if (result == 0) {
+		for (o = 0; o < nblocks; o++) {
+			block_no b = offset + o;
+			memcpy(&blocks[o], &buf[(b % ecs->k) * nstripes + b / ecs->k - first], BLOCK_SIZE);
+		}
+	}
+	else {
+		for (i = 0; i < ecs->k; i++) {
+			if (ecs->xfers[i].result < 0) {
+				fprintf(stderr, "!!ecdisk: member %u failed\n", i);
+				ecs->failed[i] = true;
+			}
+		}
+		result = ecdisk_read_degraded(ecs, offset, nblocks, blocks);
+	}
+	free(buf);
+	return result;
+}
+
+static int ecdisk_writev(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct ecdisk_state *ecs = bi->state;
+	block_no o = 0;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ecdisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	while (o < nblocks) {
+		/* Partial stripes go through the single-block path.
+		 */
+		if ((offset + o) % ecs->k != 0 || nblocks - o < ecs->k) {
+			if (ecdisk_write(bi, ino, offset + o, &blocks[o]) < 0) {
+				return -1;
+			}
+			o++;
+			continue;
+		}
+
+		/* Full stripes: encode the new data without reading anything,
+		 * and write a batch of stripes with a single writev per member.
+		 */
+		block_no nstripes = (nblocks - o) / ecs->k;
+		if (nstripes > ECDISK_BATCH) {
+			nstripes = ECDISK_BATCH;
+		}
+		if (ecdisk_write_stripes(ecs, (offset + o) / ecs->k, nstripes, &blocks[o]) < 0) {
+			return -1;
+		}
+		o += nstripes * ecs->k;
+	}
+	return 0;
+}
+
+static void ecdisk_release(block_if bi){
+	struct ecdisk_state *ecs = bi->state;
+
+	block_store_pool_release(ecs->pool);
+	free(ecs->xfers);
+	free(ecs->old);
+	free(ecs->stripe);
+	free(ecs->mat);
+	free(ecs->cur);
+	free(ecs->used);
+	free(ecs->inv);
+	free(ecs->coef);
+	free(ecs->failed);
+	free(ecs);
+	free(bi);
+}
+
+static int ecdisk_sync(block_if bi, unsigned int ino){
+	struct ecdisk_state *ecs = bi->state;
+
+	for (unsigned int i = 0; i < ecs->n; i++) {
+		if (ecs->failed[i]) {
+			continue;
+		}
+		if ((*ecs->below[i]->sync)(ecs->below[i], ino) < 0) {
+			fprintf(stderr, "!!ecdisk_sync: sync error for block store %d below\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int ecdisk_rebuild(block_if bi, unsigned int i, block_if replacement){
+	struct ecdisk_state *ecs = bi->state;
+	block_no s, n, t;
+
+	if (i >= ecs->n) {
+		fprintf(stderr, "!!ecdisk_rebuild: no member %u\n", i);
+		return -1;
+	}
+	int size = (*bi->getsize)(bi, 0);
+	if (size < 0) {
+		return -1;
+	}
+	ecs->below[i] = replacement;
+	ecs->failed[i] = true;
+
+	/* Decode a batch of stripes, collecting the blocks of member i,
+	 * and write them to the replacement in one go.
+	 */
+	block_no nstripes = (block_no) size / ecs->k;
+	block_t *acc = malloc(ECDISK_REBUILD_BATCH * BLOCK_SIZE);
+	int result = 0;
+	for (s = 0; s < nstripes && result == 0; s += n) {
+		n = nstripes - s < ECDISK_REBUILD_BATCH ? nstripes - s : ECDISK_REBUILD_BATCH;
+		for (t = 0; t < n && result == 0; t++) {
+			if (ecdisk_decode(ecs, s + t) < 0) {
+				result = -1;
+			}
+			else {
+				memcpy(&acc[t], &ecs->stripe[i], BLOCK_SIZE);
+			}
+		}
+		if (result == 0 && block_store_writev(replacement, 0, s, n, acc) < 0) {
+			fprintf(stderr, "!!ecdisk_rebuild: cannot write the replacement\n");
+			result = -1;
+		}
+	}
+	free(acc);
+	if (result == 0) {
+		ecs->failed[i] = false;
+		printf("!$EC: member %u rebuilt (%u blocks)\n", i, size / ecs->k);
+	}
+	return result;
+}
+
+void ecdisk_dump_stats(block_if bi){
+	struct ecdisk_state *ecs = bi->state;
+
+	printf("!$EC: %u+%u, gf256 kernel %s, %u failed members\n",
+				ecs->k, ecs->m, gf256_kernel(), ecdisk_nfailed(ecs));
+	printf("!$EC: writes: %u read-modify-write, %u full-stripe, %u degraded; %u stripes decoded\n",
+				ecs->nrmw, ecs->nfull, ecs->ndegwrites, ecs->ndecodes);
+}
+
+block_if ecdisk_init(block_if *below, unsigned int k, unsigned int m){
+	unsigned int i, j;
+
+	if (k == 0 || k + m > 255) {
+		fprintf(stderr, "!!ecdisk_init: bad configuration %u+%u\n", k, m);
+		return 0;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct ecdisk_state *ecs = new_alloc(struct ecdisk_state);
+	ecs->below = below;
+	ecs->k = k;
+	ecs->m = m;
+	ecs->n = k + m;
+	ecs->failed = calloc(ecs->n, sizeof(*ecs->failed));
+	ecs->coef = malloc(m * k + 1);
+	for (j = 0; j < m; j++) {
+		for (i = 0; i < k; i++) {
+			ecs->coef[j * k + i] = gf256_inv((k + j) ^ i);
+		}
+	}
+	ecs->inv = malloc(k * k);
+	ecs->used = calloc(k, sizeof(*ecs->used));
+	ecs->cur = calloc(k, sizeof(*ecs->cur));
+	ecs->mat = malloc(k * k);
+	ecs->stripe = malloc(ecs->n * BLOCK_SIZE);
+	ecs->old = malloc(k * BLOCK_SIZE);
+	ecs->xfers = calloc(ecs->n, sizeof(*ecs->xfers));
+	ecs->pool = block_store_pool_init(ecs->n);
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ecs;
+	bi->getninodes = ecdisk_getninodes;
+	bi->getsize = ecdisk_getsize;
+	bi->setsize = ecdisk_setsize;
+	bi->read = ecdisk_read;
+	bi->write = ecdisk_write;
+	bi->release = ecdisk_release;
+	bi->sync = ecdisk_sync;
+	bi->readv = ecdisk_readv;
+	bi->writev = ecdisk_writev;
+	return bi;
+}
@@ -1,3 +1,34 @@
+/*
+ * This code implements a set of virtualized block stores on top of a single
+ * inode of another block store, using a File Allocation Table (FAT).  The
+ * layout is described in "fatdisk.h".  Data block i of the disk corresponds
+ * to FAT entry i + 1; FAT entry 0 is never allocated so that 0 can be used
+ * to terminate both the chains of files and the free list.
+ *
+ * The whole FAT is loaded into memory by fatdisk_init, so following the
+ * chain of a file does not cost any reads.  FAT blocks that are modified
+ * are marked dirty and written back (together with the superblock, which
+ * holds the head of the free list) by sync and release.  In addition, each
+ * inode has a cursor that remembers the FAT entry of every
+ * FATDISK_CKPT_INTERVAL'th block of the file, as well as the last entry
+ * looked up.  Finding the FAT entry of any offset then takes at most
+ * FATDISK_CKPT_INTERVAL in-memory hops, and sequential access takes one.
+ *
+ * Free entries are also kept in an in-memory bitmap, so that blocks can be
+ * allocated anywhere rather than only from the head of the free list.  A
+ * file grows into the entry right after its current tail if that is free.
+ * Otherwise the allocator consults an index of runs of free entries (built
+ * lazily from the bitmap) and picks the largest run.  If the entry before
+ * that run is in use, the allocator starts halfway the run, leaving room
+ * for the file in front of it to grow.  Sequential writes therefore result
+ * in physically sequential files.  Because entries are taken out of the
+ * middle of the free list, the on-disk free list is regenerated, sorted by
+ * entry number, when the FAT is written back.
+ *
+ *		void fatdisk_dump_stats(block_store_t *this_bs)
+ *			Print layout and allocation statistics.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,23 +38,67 @@
 #ifdef HW_FS
 #include "fatdisk.h"
 
+#define FATDISK_CKPT_INTERVAL	64		// #blocks between checkpoints
+#define FATDISK_MIN_SPLIT		16		// don't split smaller free runs
+
 /* Temporary information about the file system and a particular inode.
  * Convenient for all operations. See "fatdisk.h" for field details.
  */
 struct fatdisk_snapshot {
-    union fatdisk_block superblock;
     union fatdisk_block inodeblock;
     block_no inode_blockno;
     unsigned int inode_no;
     struct fatdisk_inode *inode;
 };
 
+/* Cached positions in the FAT chain of an inode.  ckpt[i] is the FAT entry
+ * of block i * FATDISK_CKPT_INTERVAL of the file.  (last_offset, last_entry)
+ * is the most recently looked up block.  Both only ever refer to a prefix of
+ * the chain, which does not change until the file is freed.
+ */
+struct fatdisk_cursor {
+    fatentry_no *ckpt;
+    unsigned int nckpt, max_ckpt;
+    block_no last_offset;
+    fatentry_no last_entry;     // 0 if none
+};
+
 struct fatdisk_state {
     block_store_t *below;   // block store below
     unsigned int below_ino; // inode number to use for the block store below
     unsigned int ninodes;   // number of inodes
+    union fatdisk_block superblock;     // cached superblock
+    int super_dirty;                    // superblock needs to be written
+    block_no data_start;    // block number of the first data block
+    fatentry_no nentries;   // number of FAT entries (including entry 0)
+    fatentry_no *fat;       // in-memory copy of the FAT
+    unsigned char *dirty;   // one bit per dirty FAT block
+    struct fatdisk_cursor *cursors;     // one per inode
+
+    /* Free space management.
+     */
+    unsigned char *freemap; // one bit per free FAT entry
+    fatentry_no nfree;      // number of free entries
+    int freelist_dirty;     // on-disk free list needs to be regenerated
+    struct fatdisk_run *runs;           // index of free runs, sorted by start
+    unsigned int nruns, max_runs;
+    int runs_stale;         // index needs to be rebuilt
+
+    /* Statistics.
+     */
+    unsigned long nalloc_tail;          // allocated right after the tail
+    unsigned long nalloc_run;           // allocated from the run index
+    unsigned long nrebuild;             // #times the run index was rebuilt
 };
 
+/* A run of consecutive free FAT entries.
+ */
+struct fatdisk_run {
+    fatentry_no start;
+    fatentry_no len;
+};
+
+static block_t null_block;  // a block filled with null bytes
 
 static void panic(char *s){
 	fprintf(stderr, "Panic: %s\n", s);
@@ -34,16 +109,10 @@ static int fatdisk_get_snapshot(struct fatdisk_snapshot *snapshot,
                                 struct fatdisk_state* fs, unsigned int inode_no) {
     snapshot->inode_no = inode_no;
 
-    /* Get the super block.
-     */
-    if ((*fs->below->read)(fs->below, fs->below_ino, 0, (block_t *) &snapshot->superblock) < 0) {
-        return -1;
-    }
-
     /* Check the inode number.
      */
-    if (inode_no >= snapshot->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
-        fprintf(stderr, "!!FATDISK: inode number too large %u %u\n", inode_no, snapshot->superblock.superblock.n_inodeblocks);
+    if (inode_no >= fs->ninodes) {
+        fprintf(stderr, "!!FATDISK: inode number too large %u %u\n", inode_no, fs->superblock.superblock.n_inodeblocks);
         return -1;
     }
 
@@ -58,45 +127,461 @@ static int fatdisk_get_snapshot(struct fatdisk_snapshot *snapshot,
     return 0;
 }
 
+static int fatdisk_put_inode(struct fatdisk_snapshot *snapshot, struct fatdisk_state *fs){
+    return (*fs->below->write)(fs->below, fs->below_ino, snapshot->inode_blockno,
+                                        (block_t *) &snapshot->inodeblock);
+}
+
+/* Update FAT entry e and mark its FAT block dirty.
+ */
+static void fatdisk_set_entry(struct fatdisk_state *fs, fatentry_no e, fatentry_no next){
+    fs->fat[e] = next;
+    fs->dirty[(e / FAT_PER_BLOCK) / 8] |= 1 << ((e / FAT_PER_BLOCK) % 8);
+}
+
+static int fatdisk_is_free(struct fatdisk_state *fs, fatentry_no e){
+    return (fs->freemap[e / 8] >> (e % 8)) & 1;
+}
+
+static void fatdisk_mark_free(struct fatdisk_state *fs, fatentry_no e){
+    fs->freemap[e / 8] |= 1 << (e % 8);
+    fs->nfree++;
+    fs->freelist_dirty = 1;
+    fs->runs_stale = 1;
+}
+
+static void fatdisk_mark_used(struct fatdisk_state *fs, fatentry_no e){
+    fs->freemap[e / 8] &= ~(1 << (e % 8));
+    fs->nfree--;
+    fs->freelist_dirty = 1;
+}
+
+/* Rebuild the index of free runs from the free bitmap.
+ */
+static void fatdisk_build_runs(struct fatdisk_state *fs){
+    fatentry_no e = 1;
+
+    fs->nruns = 0;
+    while (e < fs->nentries) {
+        /* Skip bytes without free entries quickly.
+         */
+        if (e % 8 == 0 && fs->freemap[e / 8] == 0) {
+            e += 8;
+            continue;
+        }
+        if (!fatdisk_is_free(fs, e)) {
+            e++;
+            continue;
+        }
+        fatentry_no start = e;
+        while (e < fs->nentries && fatdisk_is_free(fs, e)) {
+            e++;
+        }
+        if (fs->nruns == fs->max_runs) {
+            fs->max_runs = fs->max_runs == 0 ? 64 : fs->max_runs * 2;
+            fs->runs = realloc(fs->runs, fs->max_runs * sizeof(*fs->runs));
+        }
+        fs->runs[fs->nruns].start = start;
+        fs->runs[fs->nruns].len = e - start;
+        fs->nruns++;
+    }
+    fs->runs_stale = 0;
+    fs->nrebuild++;
+}
+
+/* Take entry e out of run r of the index, splitting the run if needed.
+ */
+static void fatdisk_take_from_run(struct fatdisk_state *fs, unsigned int r, fatentry_no e){
+    struct fatdisk_run *run = &fs->runs[r];
+    fatentry_no end = run->start + run->len;
+
+    if (e == run->start) {
+        run->start++;
+        run->len--;
+    }
+    else if (e == end - 1) {
+        run->len--;
+    }
+    else {
+        if (fs->nruns == fs->max_runs) {
+            fs->max_runs *= 2;
+            fs->runs = realloc(fs->runs, fs->max_runs * sizeof(*fs->runs));
+            run = &fs->runs[r];
+        }
+        memmove(&fs->runs[r + 2], &fs->runs[r + 1], (fs->nruns - r - 1) * sizeof(*fs->runs));
+        fs->nruns++;
+        run->len = e - run->start;
+        fs->runs[r + 1].start = e + 1;
+        fs->runs[r + 1].len = end - (e + 1);
+    }
+    if (fs->runs[r].len == 0) {
+        memmove(&fs->runs[r], &fs->runs[r + 1], (fs->nruns - r - 1) * sizeof(*fs->runs));
+        fs->nruns--;
+    }
+}
+
+/* Return the run of the index that starts at free entry e.
+ */
+static unsigned int fatdisk_find_run(struct fatdisk_state *fs, fatentry_no e){
+    unsigned int lo = 0, hi = fs->nruns;
+
+    while (lo + 1 < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (fs->runs[mid].start <= e) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    assert(lo < fs->nruns && fs->runs[lo].start == e);
+    return lo;
+}
+
+/* Allocate a free FAT entry for a file whose last entry is 'tail' (0 if
+ * the file is empty).  Returns 0 if the disk is full.
+ */
+static fatentry_no fatdisk_alloc_entry(struct fatdisk_state *fs, fatentry_no tail){
+    fatentry_no e;
+
+    if (fs->nfree == 0) {
+        return 0;
+    }
+
+    /* Best case: the entry right after the tail is free.  As the tail is
+     * not, the entry starts a free run, which shrinks by one.
+     */
+    if (tail != 0 && tail + 1 < fs->nentries && fatdisk_is_free(fs, tail + 1)) {
+        e = tail + 1;
+        if (!fs->runs_stale) {
+            fatdisk_take_from_run(fs, fatdisk_find_run(fs, e), e);
+        }
+        fatdisk_mark_used(fs, e);
+        fs->nalloc_tail++;
+        fatdisk_set_entry(fs, e, 0);
+        return e;
+    }
+
+    /* Otherwise start a new extent in the largest free run.
+     */
+    if (fs->runs_stale) {
+        fatdisk_build_runs(fs);
+    }
+    unsigned int r, best = 0;
+    for (r = 1; r < fs->nruns; r++) {
+        if (fs->runs[r].len > fs->runs[best].len) {
+            best = r;
+        }
+    }
+    assert(fs->nruns > 0);
+    struct fatdisk_run *run = &fs->runs[best];
+    e = run->start;
+    if (run->len >= FATDISK_MIN_SPLIT && run->start > 1) {
+        e += run->len / 2;
+    }
+    fatdisk_take_from_run(fs, best, e);
+    fatdisk_mark_used(fs, e);
+    fs->nalloc_run++;
+    fatdisk_set_entry(fs, e, 0);
+    return e;
+}
+
+/* Regenerate the on-disk free list from the free bitmap, sorted by entry
+ * number.  Only entries that change are marked dirty.
+ */
+static void fatdisk_rebuild_freelist(struct fatdisk_state *fs){
+    fatentry_no e, prev = 0;
+
+    for (e = 1; e < fs->nentries; e++) {
+        if (e % 8 == 0 && fs->freemap[e / 8] == 0) {
+            e += 7;
+            continue;
+        }
+        if (!fatdisk_is_free(fs, e)) {
+            continue;
+        }
+        if (prev == 0) {
+            if (fs->superblock.superblock.fat_free_list != e) {
+                fs->superblock.superblock.fat_free_list = e;
+                fs->super_dirty = 1;
+            }
+        }
+        else if (fs->fat[prev] != e) {
+            fatdisk_set_entry(fs, prev, e);
+        }
+        prev = e;
+    }
+    if (prev == 0) {
+        if (fs->superblock.superblock.fat_free_list != 0) {
+            fs->superblock.superblock.fat_free_list = 0;
+            fs->super_dirty = 1;
+        }
+    }
+    else if (fs->fat[prev] != 0) {
+        fatdisk_set_entry(fs, prev, 0);
+    }
+    fs->freelist_dirty = 0;
+}
+
+/* Write back the dirty FAT blocks and the superblock.
+ */
+static int fatdisk_flush(struct fatdisk_state *fs){
+    block_no b, n_fatblocks = fs->superblock.superblock.n_fatblocks;
+    union fatdisk_block fb;
+
+    if (fs->freelist_dirty) {
+        fatdisk_rebuild_freelist(fs);
+    }
+
+    for (b = 0; b < n_fatblocks; b++) {
+        if (!(fs->dirty[b / 8] & (1 << (b % 8)))) {
+            continue;
+        }
+        unsigned int i;
+        for (i = 0; i < FAT_PER_BLOCK; i++) {
+            fatentry_no e = b * FAT_PER_BLOCK + i;
+            fb.fatblock.entries[i].next = e < fs->nentries ? fs->fat[e] : 0;
+        }
+        if ((*fs->below->write)(fs->below, fs->below_ino,
+                    1 + fs->superblock.superblock.n_inodeblocks + b, &fb.datablock) < 0) {
+            return -1;
+        }
+        fs->dirty[b / 8] &= ~(1 << (b % 8));
+    }
+    if (fs->super_dirty) {
+        if ((*fs->below->write)(fs->below, fs->below_ino, 0, &fs->superblock.datablock) < 0) {
+            return -1;
+        }
+        fs->super_dirty = 0;
+    }
+    return 0;
+}
+
+/* Forget the cached positions of an inode.
+ */
+static void fatdisk_cursor_reset(struct fatdisk_cursor *fc){
+    fc->nckpt = 0;
+    fc->last_entry = 0;
+}
+
+/* Return the FAT entry of block 'offset' of the file described by 'inode',
+ * which must be less than the size of the file.
+ */
+static fatentry_no fatdisk_lookup(struct fatdisk_state *fs, struct fatdisk_cursor *fc,
+                                struct fatdisk_inode *inode, block_no offset){
+    block_no pos;
+    fatentry_no e;
+
+    if (fc->nckpt == 0) {
+        if (fc->max_ckpt == 0) {
+            fc->max_ckpt = 4;
+            fc->ckpt = malloc(fc->max_ckpt * sizeof(*fc->ckpt));
+        }
+        fc->ckpt[fc->nckpt++] = inode->head;
+    }
+
+    /* Start from the closest checkpoint, or the last position if closer.
+     */
+    unsigned int ci = offset / FATDISK_CKPT_INTERVAL;
+    if (ci >= fc->nckpt) {
+        ci = fc->nckpt - 1;
+    }
+    pos = ci * FATDISK_CKPT_INTERVAL;
+    e = fc->ckpt[ci];
+    if (fc->last_entry != 0 && fc->last_offset <= offset && fc->last_offset > pos) {
+        pos = fc->last_offset;
+        e = fc->last_entry;
+    }
+
+    /* Walk the in-memory chain, adding checkpoints along the way.
+     */
+    while (pos < offset) {
+        e = fs->fat[e];
+        pos++;
+        if (pos % FATDISK_CKPT_INTERVAL == 0 && pos / FATDISK_CKPT_INTERVAL == fc->nckpt) {
+            if (fc->nckpt == fc->max_ckpt) {
+                fc->max_ckpt *= 2;
+                fc->ckpt = realloc(fc->ckpt, fc->max_ckpt * sizeof(*fc->ckpt));
+            }
+            fc->ckpt[fc->nckpt++] = e;
+        }
+    }
+    assert(e != 0);
+
+    fc->last_offset = offset;
+    fc->last_entry = e;
+    return e;
+}
+
 /* Create a new FAT file system on the specified inode of the block store below
  */
 int fatdisk_create(block_store_t *below, unsigned int below_ino, unsigned int ninodes) {
-    /* Your code goes here:
+    if (sizeof(union fatdisk_block) != BLOCK_SIZE) {
+        panic("fatdisk_create: block has wrong size");
+    }
+
+    /* Compute the number of inode blocks needed to store the inodes.
      */
-    panic("Fatdisk create not implemented!");
-}
+    block_no n_inodeblocks = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+
+    /* Read the superblock to see if it's already initialized.
+     */
+    union fatdisk_block superblock;
+    if ((*below->read)(below, below_ino, 0, (block_t *) &superblock) < 0) {
+        return -1;
+    }
+    if (superblock.superblock.n_inodeblocks != 0) {
+        assert(superblock.superblock.n_inodeblocks >= n_inodeblocks);
+        return 0;
+    }
+
+    /* Figure out how many FAT blocks are needed for the remaining blocks.
+     * There is one entry per data block, plus the unused entry 0.
+     */
+    block_no nblocks = (*below->getsize)(below, below_ino);
+    block_no n_fatblocks = 1;
+    if (nblocks < n_inodeblocks + 3) {
+        fprintf(stderr, "fatdisk_create: too few blocks\n");
+        return -1;
+    }
+    while (n_fatblocks * FAT_PER_BLOCK < nblocks - n_inodeblocks - n_fatblocks) {
+        n_fatblocks++;
+    }
+    fatentry_no ndata = nblocks - 1 - n_inodeblocks - n_fatblocks;
+
+    /* The inodes all start out empty.
+     */
+    block_no b;
+    for (b = 1; b <= n_inodeblocks; b++) {
+        if ((*below->write)(below, below_ino, b, &null_block) < 0) {
+            return -1;
+        }
+    }
+
+    /* Initially all entries are on the free list, in order.
+     */
+    union fatdisk_block fb;
+    for (b = 0; b < n_fatblocks; b++) {
+        unsigned int i;
+        for (i = 0; i < FAT_PER_BLOCK; i++) {
+            fatentry_no e = b * FAT_PER_BLOCK + i;
+            fb.fatblock.entries[i].next = e != 0 && e < ndata ? e + 1 : 0;
+        }
+        if ((*below->write)(below, below_ino, 1 + n_inodeblocks + b, &fb.datablock) < 0) {
+            return -1;
+        }
+    }
 
+    memset(&superblock, 0, sizeof(superblock));
+    superblock.superblock.n_inodeblocks = n_inodeblocks;
+    superblock.superblock.n_fatblocks = n_fatblocks;
+    superblock.superblock.fat_free_list = ndata > 0 ? 1 : 0;
+    if ((*below->write)(below, below_ino, 0, (block_t *) &superblock) < 0) {
+        return -1;
+    }
+    return 0;
+}
 
+/* Return all the entries of a file to the free list.
+ */
 static void fatdisk_free_file(struct fatdisk_snapshot *snapshot,
                               struct fatdisk_state *fs) {
-    /* Your code goes here:
-     */
+    fatentry_no e = snapshot->inode->head;
+    block_no i;
+
+    for (i = 0; i < snapshot->inode->nblocks && e != 0; i++) {
+        fatentry_no next = fs->fat[e];
+        fatdisk_mark_free(fs, e);
+        e = next;
+    }
+    fatdisk_cursor_reset(&fs->cursors[snapshot->inode_no]);
+
+    snapshot->inode->head = 0;
+    snapshot->inode->nblocks = 0;
+    if (fatdisk_put_inode(snapshot, fs) < 0) {
+        panic("fatdisk_free_file: inode block");
+    }
 }
 
 
 /* Write *block at the given block number 'offset'.
  */
 static int fatdisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block) {
-    /* Your code goes here:
+    struct fatdisk_state *fs = this_bs->state;
+    struct fatdisk_cursor *fc = &fs->cursors[ino];
+
+    struct fatdisk_snapshot snapshot;
+    if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+        return -1;
+    }
+    struct fatdisk_inode *inode = snapshot.inode;
+
+    /* Grow the file if necessary.  Blocks skipped over are zeroed.
      */
-    return 0;
+    if (offset >= inode->nblocks) {
+        fatentry_no tail = inode->nblocks == 0 ? 0 : fatdisk_lookup(fs, fc, inode, inode->nblocks - 1);
+        while (inode->nblocks <= offset) {
+            fatentry_no e = fatdisk_alloc_entry(fs, tail);
+            if (e == 0) {
+                fprintf(stderr, "!!FATDISK: disk full\n");
+                fatdisk_put_inode(&snapshot, fs);
+                return -1;
+            }
+            if (tail == 0) {
+                inode->head = e;
+                fatdisk_cursor_reset(fc);
+            }
+            else {
+                fatdisk_set_entry(fs, tail, e);
+            }
+            if (inode->nblocks < offset &&
+                    (*fs->below->write)(fs->below, fs->below_ino, fs->data_start + e - 1, &null_block) < 0) {
+                /* Give back the new entry, but keep the ones that were
+                 * zeroed already.
+                 */
+                if (tail == 0) {
+                    inode->head = 0;
+                }
+                else {
+                    fatdisk_set_entry(fs, tail, 0);
+                }
+                fatdisk_mark_free(fs, e);
+                fatdisk_put_inode(&snapshot, fs);
+                return -1;
+            }
+            tail = e;
+            inode->nblocks++;
+        }
+        if (fatdisk_put_inode(&snapshot, fs) < 0) {
+            return -1;
+        }
+    }
+
+    fatentry_no e = fatdisk_lookup(fs, fc, inode, offset);
+    return (*fs->below->write)(fs->below, fs->below_ino, fs->data_start + e - 1, block);
 }
 
 /* Read a block at the given block number 'offset' and return in *block.
  */
 static int fatdisk_read(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
-    /* Your code goes here:
-     */
-    return 0;
+    struct fatdisk_state *fs = this_bs->state;
+
+    struct fatdisk_snapshot snapshot;
+    if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+        return -1;
+    }
+    if (offset >= snapshot.inode->nblocks) {
+        fprintf(stderr, "!!FATDISK: offset too large %u %u\n", offset, snapshot.inode->nblocks);
+        return -1;
+    }
+
+    fatentry_no e = fatdisk_lookup(fs, &fs->cursors[ino], snapshot.inode, offset);
+    return (*fs->below->read)(fs->below, fs->below_ino, fs->data_start + e - 1, block);
 }
 
 static int fatdisk_getninodes(block_store_t *this_bs){
     struct fatdisk_state *fs = this_bs->state;
-    union fatdisk_block superblock;
-	if ((*fs->below->read)(fs->below, fs->below_ino, 0, (block_t *) &superblock) < 0) {
-        return -1;
-    }
-    return superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+    return fs->ninodes;
 }
 
 /* Get size.
@@ -120,7 +605,9 @@ static int fatdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no nb
     struct fatdisk_state *fs = this_bs->state;
 
     struct fatdisk_snapshot snapshot;
-    fatdisk_get_snapshot(&snapshot, fs, ino);
+    if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+        return -1;
+    }
     if (nblocks == snapshot.inode->nblocks) {
         return nblocks;
     }
@@ -129,17 +616,35 @@ static int fatdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no nb
         return -1;
     }
 
+    block_no oldsize = snapshot.inode->nblocks;
     fatdisk_free_file(&snapshot, fs);
-    return 0;
+    return oldsize;
 }
 
 static void fatdisk_release(block_store_t *this_bs){
-    free(this_bs->state);
+    struct fatdisk_state *fs = this_bs->state;
+    unsigned int i;
+
+    if (fatdisk_flush(fs) < 0) {
+        fprintf(stderr, "!!FATDISK: release: can't write back FAT\n");
+    }
+    for (i = 0; i < fs->ninodes; i++) {
+        free(fs->cursors[i].ckpt);
+    }
+    free(fs->cursors);
+    free(fs->runs);
+    free(fs->freemap);
+    free(fs->dirty);
+    free(fs->fat);
+    free(fs);
     free(this_bs);
 }
 
 static int fatdisk_sync(block_if bi, unsigned int ino){
     struct fatdisk_state *fs = bi->state;
+    if (fatdisk_flush(fs) < 0) {
+        return -1;
+    }
     return (*fs->below->sync)(fs->below, fs->below_ino);
 }
 
@@ -152,6 +657,58 @@ block_store_t *fatdisk_init(block_store_t *below, unsigned int below_ino){
     fs->below = below;
     fs->below_ino = below_ino;
 
+    /* Load the superblock and the FAT.
+     */
+    if ((*below->read)(below, below_ino, 0, &fs->superblock.datablock) < 0) {
+        free(fs);
+        return 0;
+    }
+    block_no n_inodeblocks = fs->superblock.superblock.n_inodeblocks;
+    block_no n_fatblocks = fs->superblock.superblock.n_fatblocks;
+    block_no nblocks = (*below->getsize)(below, below_ino);
+    if (n_inodeblocks == 0 || 1 + n_inodeblocks + n_fatblocks > nblocks) {
+        fprintf(stderr, "!!FATDISK: no FAT file system\n");
+        free(fs);
+        return 0;
+    }
+    fs->ninodes = n_inodeblocks * INODES_PER_BLOCK;
+    fs->data_start = 1 + n_inodeblocks + n_fatblocks;
+    fs->nentries = 1 + nblocks - fs->data_start;
+    if (fs->nentries > n_fatblocks * FAT_PER_BLOCK) {
+        fs->nentries = n_fatblocks * FAT_PER_BLOCK;
+    }
+    fs->fat = malloc(fs->nentries * sizeof(*fs->fat));
+    fs->dirty = calloc((n_fatblocks + 7) / 8, 1);
+    fs->cursors = calloc(fs->ninodes, sizeof(*fs->cursors));
+
+    union fatdisk_block fb;
+    block_no b;
+    for (b = 0; b < n_fatblocks; b++) {
+        if ((*below->read)(below, below_ino, 1 + n_inodeblocks + b, &fb.datablock) < 0) {
+            panic("fatdisk_init: can't read FAT");
+        }
+        unsigned int i;
+        for (i = 0; i < FAT_PER_BLOCK; i++) {
+            fatentry_no e = b * FAT_PER_BLOCK + i;
+            if (e < fs->nentries) {
+                fs->fat[e] = fb.fatblock.entries[i].next;
+            }
+        }
+    }
+
+    /* Mark the entries on the free list in the free bitmap.
+     */
+    fs->freemap = calloc((fs->nentries + 7) / 8, 1);
+    fatentry_no e = fs->superblock.superblock.fat_free_list;
+    while (e != 0) {
+        if (e >= fs->nentries || fatdisk_is_free(fs, e)) {
+            panic("fatdisk_init: bad free list");
+        }
+        fatdisk_mark_free(fs, e);
+        e = fs->fat[e];
+    }
+    fs->freelist_dirty = 0;
+
     /* Return a block interface to this block store.
      */
     block_store_t *this_bs = new_alloc(block_store_t);
@@ -166,4 +723,60 @@ block_store_t *fatdisk_init(block_store_t *below, unsigned int below_ino){
     return this_bs;
 }
 
+/* Print layout and allocation statistics.  An extent is a run of
+ * consecutive blocks of a file that are also physically consecutive.
+ */
+void fatdisk_dump_stats(block_store_t *this_bs){
+    struct fatdisk_state *fs = this_bs->state;
+    unsigned long nfiles = 0, nblocks = 0, nextents = 0, ncontig = 0;
+    union fatdisk_block ib;
+    block_no b;
+    unsigned int i;
+
+    for (b = 0; b < fs->superblock.superblock.n_inodeblocks; b++) {
+        if ((*fs->below->read)(fs->below, fs->below_ino, 1 + b, &ib.datablock) < 0) {
+            return;
+        }
+        for (i = 0; i < INODES_PER_BLOCK; i++) {
+            struct fatdisk_inode *inode = &ib.inodeblock.inodes[i];
+            fatentry_no e = inode->head, prev = 0;
+            unsigned long n = 0, ext = 0;
+
+            if (inode->nblocks == 0) {
+                continue;
+            }
+            for (; e != 0 && n < inode->nblocks; n++) {
+                if (n == 0 || e != prev + 1) {
+                    ext++;
+                }
+                prev = e;
+                e = fs->fat[e];
+            }
+            nfiles++;
+            nblocks += n;
+            nextents += ext;
+            if (ext == 1) {
+                ncontig++;
+            }
+        }
+    }
+
+    if (fs->runs_stale) {
+        fatdisk_build_runs(fs);
+    }
+    fatentry_no largest = 0;
+    for (i = 0; i < fs->nruns; i++) {
+        if (fs->runs[i].len > largest) {
+            largest = fs->runs[i].len;
+        }
+    }
+
+    printf("!$FAT: %lu files, %lu blocks, %lu extents (%lu files contiguous)\n",
+                nfiles, nblocks, nextents, ncontig);
+    printf("!$FAT: %u free entries in %u runs, largest run %u\n",
+                fs->nfree, fs->nruns, largest);
+    printf("!$FAT: allocations: %lu after tail, %lu from run index (%lu rebuilds)\n",
+                fs->nalloc_tail, fs->nalloc_run, fs->nrebuild);
+}
+
 #endif //HW_FS
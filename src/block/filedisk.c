@@ -10,6 +10,13 @@
  *		block_store_t *filedisk_init(block_t *blocks, block_no nblocks)
  *			Create a new block store, stored in the array of blocks
  *			pointed to by 'blocks', which has nblocks blocks in it.
+ *
+ *		block_store_t *filedisk_open(const char *file_name)
+ *			Open an existing file as a block store, without truncating
+ *			it.  The size of the block store is the size of the file.
+ *
+ *		block_store_t *filedisk_open_readonly(const char *file_name)
+ *			Same, but only for reading: writes and setsize fail.
  */
 
 #include <stdio.h>
@@ -22,6 +29,7 @@ struct filedisk_state {
 	FILE *fp;
 	block_no nblocks;		// desired #blocks
 	block_no current;		// current #blocks
+	int readonly;			// opened with filedisk_open_readonly()
 };
 
 static int filedisk_getninodes(block_if bi){
@@ -42,6 +50,10 @@ static int filedisk_getsize(block_store_t *this_bs, unsigned int ino){
 static int filedisk_setsize(block_store_t *this_bs, unsigned int ino, block_no nblocks){
 	struct filedisk_state *rs = this_bs->state;
 
+	if (rs->readonly) {
+		fprintf(stderr, "!!filedisk_setsize: read-only\n");
+		return -1;
+	}
 	int before = rs->nblocks;
 	rs->nblocks = nblocks;
 	return before;
@@ -83,6 +95,10 @@ static int filedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 		fprintf(stderr, "filedisk_write: bad offset\n");
 		return -1;
 	}
+	if (rs->readonly) {
+		fprintf(stderr, "!!filedisk_write: read-only\n");
+		return -1;
+	}
 	if (offset >= rs->current) {
 		rs->current = offset + 1;
 	}
@@ -92,6 +108,59 @@ static int filedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 	return 0;
 }
 
+static int filedisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct filedisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!filedisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset >= rs->nblocks || nblocks > rs->nblocks - offset) {
+		fprintf(stderr, "filedisk_readv: bad offset %u\n", offset);
+		return -1;
+	}
+
+	/* The part beyond the current end of the file reads as zeroes.
+	 */
+	block_no n = offset >= rs->current ? 0 : rs->current - offset;
+	if (n > nblocks) {
+		n = nblocks;
+	}
+	if (n > 0) {
+		fseek(rs->fp, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+		int r = fread(blocks, BLOCK_SIZE, n, rs->fp);
+		assert(r == (int) n);
+	}
+	memset(&blocks[n], 0, (nblocks - n) * BLOCK_SIZE);
+	return 0;
+}
+
+static int filedisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct filedisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!filedisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset >= rs->nblocks || nblocks > rs->nblocks - offset) {
+		fprintf(stderr, "filedisk_writev: bad offset\n");
+		return -1;
+	}
+	if (rs->readonly) {
+		fprintf(stderr, "!!filedisk_writev: read-only\n");
+		return -1;
+	}
+	if (offset + nblocks > rs->current) {
+		rs->current = offset + nblocks;
+	}
+	fseek(rs->fp, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+	int n = fwrite(blocks, BLOCK_SIZE, nblocks, rs->fp);
+	assert(n == (int) nblocks);
+	return 0;
+}
+
 static void filedisk_release(block_store_t *this_bs){
 	struct filedisk_state *rs = this_bs->state;
 
@@ -107,9 +176,28 @@ static int filedisk_sync(block_store_t *this_bs, unsigned int ino){
 	return 0;
 }
 
-block_store_t *filedisk_init(const char *file, block_no nblocks){
+static block_store_t *filedisk_setup(FILE *fp, block_no nblocks, block_no current){
 	struct filedisk_state *rs = new_alloc(struct filedisk_state);
 
+	rs->fp = fp;
+	rs->nblocks = nblocks;		// desired #blocks
+	rs->current = current;		// current #blocks
+
+	block_store_t *this_bs = new_alloc(block_store_t);
+	this_bs->state = rs;
+	this_bs->getninodes = filedisk_getninodes;
+	this_bs->getsize = filedisk_getsize;
+	this_bs->setsize = filedisk_setsize;
+	this_bs->read = filedisk_read;
+	this_bs->write = filedisk_write;
+	this_bs->release = filedisk_release;
+	this_bs->sync = filedisk_sync;
+	this_bs->readv = filedisk_readv;
+	this_bs->writev = filedisk_writev;
+	return this_bs;
+}
+
+block_store_t *filedisk_init(const char *file, block_no nblocks){
 	FILE *fp;
 
 	/* Create the file and make it the right size.
@@ -122,18 +210,31 @@ block_store_t *filedisk_init(const char *file, block_no nblocks){
 	fwrite("", 1, 1, fp);
 	fflush(fp);
 
-	rs->fp = fp;
-	rs->nblocks = nblocks;		// desired #blocks
-	rs->current = 0;			// current #blocks
+	return filedisk_setup(fp, nblocks, 0);
+}
 
-	block_store_t *this_bs = new_alloc(block_store_t);
-	this_bs->state = rs;
-	this_bs->getninodes = filedisk_getninodes;
-	this_bs->getsize = filedisk_getsize;
-	this_bs->setsize = filedisk_setsize;
-	this_bs->read = filedisk_read;
-	this_bs->write = filedisk_write;
-	this_bs->release = filedisk_release;
-	this_bs->sync = filedisk_sync;
+static block_store_t *filedisk_open_mode(const char *file, const char *mode){
+	FILE *fp;
+
+	if ((fp = fopen(file, mode)) == 0) {
+		perror(file);
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	block_no nblocks = ftell(fp) / BLOCK_SIZE;
+
+	return filedisk_setup(fp, nblocks, nblocks);
+}
+
+block_store_t *filedisk_open(const char *file){
+	return filedisk_open_mode(file, "r+");
+}
+
+block_store_t *filedisk_open_readonly(const char *file){
+	block_store_t *this_bs = filedisk_open_mode(file, "r");
+
+	if (this_bs != 0) {
+		((struct filedisk_state *) this_bs->state)->readonly = 1;
+	}
 	return this_bs;
 }
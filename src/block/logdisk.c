@@ -0,0 +1,706 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module writes all blocks to a log, so that the block
+ * store below only sees large sequential writes.  The interface is as
+ * follows:
+ *
+ *		int logdisk_create(block_if below, unsigned int below_ino,
+ *															block_no nblocks)
+ *			Initialize inode 'below_ino' of 'below' as an empty
+ *			log-structured block store of 'nblocks' blocks (all zero),
+ *			unless it already is one.  If nblocks is 0, it uses 80% of
+ *			the space in the log, which leaves room for the cleaner.
+ *
+ *		block_if logdisk_init(block_if below, unsigned int below_ino,
+ *										enum logdisk_policy policy)
+ *			Open the log-structured block store on inode 'below_ino' of
+ *			'below'.  It has a single inode.  'policy' selects the
+ *			segments that the cleaner cleans:
+ *				LOG_GREEDY: the segment with the fewest live blocks.
+ *				LOG_COST_BENEFIT: the segment with the highest
+ *					(1 - u) * age / (1 + u), where u is the fraction of
+ *					live blocks, so cold segments are cleaned before
+ *					they are almost empty and hot ones are left to empty
+ *					out on their own.
+ *
+ *		int logdisk_clean(block_if bi, unsigned int nsegments)
+ *			Clean up to 'nsegments' segments now, for example when the
+ *			block store is idle.  Returns the number cleaned.
+ *
+ *		void logdisk_dump_stats(block_if bi)
+ *			Print the write amplification, the fraction of the writes
+ *			below that were sequential, and what the cleaner did.
+ *
+ * Block 0 below is a superblock, followed by the checkpointed map from
+ * virtual blocks to the blocks below (0 for a block that was never
+ * written), and then the log, divided into segments of LOG_SEGMENT
+ * blocks.  The first block of a segment is its summary: its sequence
+ * number and which virtual block each of the others holds.
+ *
+ * Writes are appended to the current segment, which is kept in memory
+ * and written with a single writev when it is full.  On sync the new
+ * part is written.  The summary is written after the data it describes,
+ * so that a crash in between at worst loses the new part.  The map is
+ * in memory.  It is written as a checkpoint every LOG_CHECKPOINT
+ * segments, and when the cleaner has freed segments, which cannot be
+ * reused before the map that no longer points into them is on disk.  On
+ * open the map is read from the checkpoint and brought up to date from
+ * the summaries of the segments written since.
+ *
+ * When fewer than LOG_LOW_WATER segments are free, the cleaner picks
+ * segments according to the policy, and appends their live blocks to the
+ * log until LOG_HIGH_WATER segments are free.  A block is live if the map
+ * still points to it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define LOG_MAGIC		0x44110106
+#define LOG_SEGMENT		128			// blocks per segment, including summary
+#define LOG_CHECKPOINT	32			// segments between checkpoints
+#define LOG_LOW_WATER	4			// start cleaning below this many free segments
+#define LOG_HIGH_WATER	8			// ... and stop at this many
+
+#define LOG_DATA		(LOG_SEGMENT - 1)		// data blocks per segment
+#define MAP_PER_BLOCK	(BLOCK_SIZE / sizeof(uint32_t))
+
+struct logdisk_superblock {
+	uint32_t magic;
+	uint32_t segment;		// LOG_SEGMENT when created
+	uint32_t nblocks;		// #virtual blocks
+	uint32_t nmapblocks;	// #map blocks, following the superblock
+	uint32_t first;			// first block of the log
+	uint32_t nsegments;		// #segments in the log
+	uint32_t seq;			// the checkpoint includes segment seq ...
+	uint32_t count;			// ... up to this many of its blocks
+};
+
+struct logdisk_summary {
+	uint32_t magic;
+	uint32_t seq;			// sequence number of the segment
+	uint32_t count;			// #data blocks in the segment
+	uint32_t vblocks[LOG_DATA];		// virtual block held by each
+};
+
+union logdisk_block {
+	struct logdisk_superblock superblock;
+	struct logdisk_summary summary;
+	uint32_t map[MAP_PER_BLOCK];
+	block_t block;
+};
+
+enum logdisk_segstate { SEG_FREE, SEG_FULL, SEG_CURRENT, SEG_CLEANED };
+
+struct logdisk_state {
+	block_if below;			// block store below
+	unsigned int below_ino;	// inode below
+	struct logdisk_superblock sb;
+	enum logdisk_policy policy;
+
+	uint32_t *map;			// virtual block to block below, or 0
+	bool *map_dirty;		// map blocks changed since the last checkpoint
+
+	/* Per segment: state, #live blocks, and sequence number.
+	 */
+	enum logdisk_segstate *state;
+	uint32_t *live;
+	uint32_t *seqs;
+	unsigned int nfree;			// #segments in SEG_FREE
+	unsigned int ncleaned;		// #segments in SEG_CLEANED
+	uint32_t seq;				// last segment sequence number
+
+	/* The current segment: the summary and the data blocks.
+	 */
+	unsigned int cur;			// segment number
+	union logdisk_block *buf;	// LOG_SEGMENT blocks
+	unsigned int flushed;		// #data blocks written below
+	unsigned int since_checkpoint;	// #segments filled since the checkpoint
+	bool cleaning;				// the cleaner is running
+
+	/* Statistics.
+	 */
+	unsigned long nuser;			// blocks written above
+	unsigned long ncopied;			// live blocks copied by the cleaner
+	unsigned long nbelow;			// blocks written below
+	unsigned long nsequential;		// ... right after the previous block
+	unsigned long nwrites;			// write operations below
+	unsigned long nsegs_cleaned;	// segments cleaned
+	unsigned long ncheckpoints;		// checkpoints written
+	block_no next_write;			// block after the previous write below
+};
+
+#define SEG_START(ls, s)	((ls)->sb.first + (block_no) (s) * LOG_SEGMENT)
+
+static int logdisk_below_write(struct logdisk_state *ls, block_no offset, block_no n, block_t *blocks){
+	ls->nbelow += n;
+	ls->nwrites++;
+	ls->nsequential += n - 1;
+	if (offset == ls->next_write) {
+		ls->nsequential++;
+	}
+	ls->next_write = offset + n;
+	return block_store_writev(ls->below, ls->below_ino, offset, n, blocks);
+}
+
+/* Write the part of the current segment that is not yet below, and then
+ * the summary.
+ */
+static int logdisk_flush(struct logdisk_state *ls){
+	unsigned int count = ls->buf[0].summary.count;
+	block_no start = SEG_START(ls, ls->cur);
+
+	if (count == ls->flushed) {
+		return 0;
+	}
+
+	/* The data goes first, so that a crash in between never leaves a
+	 * summary that describes blocks that are not there.
+	 */
+	if (logdisk_below_write(ls, start + 1 + ls->flushed, count - ls->flushed,
+										&ls->buf[1 + ls->flushed].block) < 0 ||
+			logdisk_below_write(ls, start, 1, &ls->buf[0].block) < 0) {
+		return -1;
+	}
+	ls->flushed = count;
+	return 0;
+}
+
+/* Write the map and the superblock.  Cleaned segments can be reused
+ * after this.
+ */
+static int logdisk_checkpoint(struct logdisk_state *ls){
+	unsigned int b, s;
+
+	if (logdisk_flush(ls) < 0) {
+		return -1;
+	}
+	for (b = 0; b < ls->sb.nmapblocks; b++) {
+		if (!ls->map_dirty[b]) {
+			continue;
+		}
+		if (logdisk_below_write(ls, 1 + b, 1, (block_t *) &ls->map[b * MAP_PER_BLOCK]) < 0) {
+			fprintf(stderr, "!!logdisk_checkpoint: can't write map block %u\n", b);
+			return -1;
+		}
+		ls->map_dirty[b] = false;
+	}
+	ls->sb.seq = ls->seqs[ls->cur];
+	ls->sb.count = ls->buf[0].summary.count;
+
+	union logdisk_block blk;
+	memset(&blk, 0, sizeof(blk));
+	blk.superblock = ls->sb;
+	if ((*ls->below->sync)(ls->below, ls->below_ino) < 0 ||
+				logdisk_below_write(ls, 0, 1, &blk.block) < 0 ||
+				(*ls->below->sync)(ls->below, ls->below_ino) < 0) {
+		return -1;
+	}
+	for (s = 0; s < ls->sb.nsegments; s++) {
+		if (ls->state[s] == SEG_CLEANED) {
+			ls->state[s] = SEG_FREE;
+			ls->nfree++;
+		}
+	}
+	ls->ncleaned = 0;
+	ls->since_checkpoint = 0;
+	ls->ncheckpoints++;
+	return 0;
+}
+
+/* Start a new current segment, preferably the one after the current one
+ * in the log so the writes below stay sequential.
+ */
+static int logdisk_open_segment(struct logdisk_state *ls){
+	unsigned int i;
+
+	for (i = 1; i <= ls->sb.nsegments; i++) {
+		unsigned int s = (ls->cur + i) % ls->sb.nsegments;
+		if (ls->state[s] == SEG_FREE) {
+			ls->state[s] = SEG_CURRENT;
+			ls->nfree--;
+			ls->cur = s;
+			ls->seqs[s] = ++ls->seq;
+			ls->flushed = 0;
+			memset(&ls->buf[0], 0, BLOCK_SIZE);
+			ls->buf[0].summary.magic = LOG_MAGIC;
+			ls->buf[0].summary.seq = ls->seq;
+			return 0;
+		}
+	}
+	fprintf(stderr, "!!logdisk: log is full\n");
+	return -1;
+}
+
+/* The current segment is full.  Write it and start the next one.
+ */
+static int logdisk_next_segment(struct logdisk_state *ls){
+	if (logdisk_flush(ls) < 0) {
+		return -1;
+	}
+	ls->state[ls->cur] = SEG_FULL;
+	if (++ls->since_checkpoint >= LOG_CHECKPOINT || (ls->nfree == 0 && ls->ncleaned > 0)) {
+		if (logdisk_checkpoint(ls) < 0) {
+			return -1;
+		}
+	}
+	return logdisk_open_segment(ls);
+}
+
+static void logdisk_kill(struct logdisk_state *ls, block_no old){
+	if (old != 0) {
+		ls->live[(old - ls->sb.first) / LOG_SEGMENT]--;
+	}
+}
+
+/* Append virtual block v to the log.
+ */
+static int logdisk_append(struct logdisk_state *ls, block_no v, block_t *block){
+	if (ls->buf[0].summary.count == LOG_DATA && logdisk_next_segment(ls) < 0) {
+		return -1;
+	}
+	unsigned int i = ls->buf[0].summary.count++;
+	ls->buf[0].summary.vblocks[i] = v;
+	memcpy(&ls->buf[1 + i], block, BLOCK_SIZE);
+	logdisk_kill(ls, ls->map[v]);
+	ls->map[v] = SEG_START(ls, ls->cur) + 1 + i;
+	ls->map_dirty[v / MAP_PER_BLOCK] = true;
+	ls->live[ls->cur]++;
+	return 0;
+}
+
+static unsigned int logdisk_victim(struct logdisk_state *ls){
+	unsigned int s, best = ls->sb.nsegments;
+	double best_score = 0;
+
+	for (s = 0; s < ls->sb.nsegments; s++) {
+		if (ls->state[s] != SEG_FULL) {
+			continue;
+		}
+		double u = (double) ls->live[s] / LOG_DATA, score;
+		if (ls->policy == LOG_GREEDY) {
+			score = 1 - u;
+		}
+		else {
+			score = (1 - u) * (ls->seq - ls->seqs[s]) / (1 + u);
+		}
+		if (best == ls->sb.nsegments || score > best_score) {
+			best = s;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Clean one segment: append its live blocks to the log.
+ */
+static int logdisk_clean_one(struct logdisk_state *ls){
+	union logdisk_block *seg;
+	unsigned int s = logdisk_victim(ls), i;
+
+	if (s == ls->sb.nsegments || ls->live[s] == LOG_DATA) {
+		return 0;
+	}
+	block_no start = SEG_START(ls, s);
+	if (ls->live[s] > 0) {
+		seg = malloc(LOG_SEGMENT * BLOCK_SIZE);
+		if (block_store_readv(ls->below, ls->below_ino, start, LOG_SEGMENT, (block_t *) seg) < 0) {
+			free(seg);
+			return -1;
+		}
+		for (i = 0; i < seg[0].summary.count && ls->live[s] > 0; i++) {
+			block_no v = seg[0].summary.vblocks[i];
+			if (v < ls->sb.nblocks && ls->map[v] == start + 1 + i) {
+				if (logdisk_append(ls, v, &seg[1 + i].block) < 0) {
+					free(seg);
+					return -1;
+				}
+				ls->ncopied++;
+			}
+		}
+		free(seg);
+	}
+	ls->state[s] = SEG_CLEANED;
+	ls->ncleaned++;
+	ls->nsegs_cleaned++;
+	return 1;
+}
+
+int logdisk_clean(block_if bi, unsigned int nsegments){
+	struct logdisk_state *ls = bi->state;
+	unsigned int n;
+	int r = 0;
+
+	ls->cleaning = true;
+	for (n = 0; n < nsegments && (r = logdisk_clean_one(ls)) > 0; n++)
+		;
+	if (r >= 0 && ls->ncleaned > 0) {
+		r = logdisk_checkpoint(ls);
+	}
+	ls->cleaning = false;
+	return r < 0 ? -1 : (int) n;
+}
+
+static int logdisk_getninodes(block_if bi){
+	return 1;
+}
+
+static int logdisk_getsize(block_if bi, unsigned int ino){
+	struct logdisk_state *ls = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!logdisk_getsize: ino != 0 not supported\n");
+		return -1;
+	}
+	return ls->sb.nblocks;
+}
+
+static int logdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "!!logdisk_setsize: not supported\n");
+	return -1;
+}
+
+/* Return the current segment buffer that holds virtual block v, if any.
+ */
+static block_t *logdisk_buffered(struct logdisk_state *ls, block_no v){
+	block_no start = SEG_START(ls, ls->cur) + 1;
+
+	if (ls->map[v] >= start + ls->flushed && ls->map[v] < start + ls->buf[0].summary.count) {
+		return &ls->buf[1 + ls->map[v] - start].block;
+	}
+	return 0;
+}
+
+static int logdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct logdisk_state *ls = bi->state;
+	block_no i, n;
+	block_t *b;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!logdisk_read: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset + nblocks > ls->sb.nblocks || offset + nblocks < offset) {
+		fprintf(stderr, "!!logdisk_read: bad offset %u\n", offset);
+		return -1;
+	}
+
+	/* Read runs of blocks that are consecutive in the log at once.
+	 */
+	for (i = 0; i < nblocks; i += n) {
+		block_no p = ls->map[offset + i];
+		n = 1;
+		if (p == 0) {
+			memset(&blocks[i], 0, BLOCK_SIZE);
+		}
+		else if ((b = logdisk_buffered(ls, offset + i)) != 0) {
+			memcpy(&blocks[i], b, BLOCK_SIZE);
+		}
+		else {
+			while (i + n < nblocks && ls->map[offset + i + n] == p + n &&
+									logdisk_buffered(ls, offset + i + n) == 0) {
+				n++;
+			}
+			if (block_store_readv(ls->below, ls->below_ino, p, n, &blocks[i]) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int logdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	return logdisk_readv(bi, ino, offset, 1, block);
+}
+
+static int logdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct logdisk_state *ls = bi->state;
+	block_no i;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!logdisk_write: ino != 0 not supported\n");
+		return -1;
+	}
+	if (offset + nblocks > ls->sb.nblocks || offset + nblocks < offset) {
+		fprintf(stderr, "!!logdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+	for (i = 0; i < nblocks; i++) {
+		if (logdisk_append(ls, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+		ls->nuser++;
+	}
+
+	/* Clean if space is getting low.
+	 */
+	if (!ls->cleaning && ls->nfree < LOG_LOW_WATER) {
+		ls->cleaning = true;
+		while (ls->nfree + ls->ncleaned < LOG_HIGH_WATER) {
+			int r = logdisk_clean_one(ls);
+			if (r < 0) {
+				ls->cleaning = false;
+				return -1;
+			}
+			if (r == 0) {
+				break;
+			}
+		}
+		ls->cleaning = false;
+		if (ls->ncleaned > 0 && logdisk_checkpoint(ls) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int logdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	return logdisk_writev(bi, ino, offset, 1, block);
+}
+
+static int logdisk_sync(block_if bi, unsigned int ino){
+	struct logdisk_state *ls = bi->state;
+
+	if (logdisk_flush(ls) < 0) {
+		return -1;
+	}
+	return (*ls->below->sync)(ls->below, ls->below_ino);
+}
+
+static void logdisk_free_state(struct logdisk_state *ls){
+	free(ls->buf);
+	free(ls->seqs);
+	free(ls->live);
+	free(ls->state);
+	free(ls->map_dirty);
+	free(ls->map);
+	free(ls);
+}
+
+static void logdisk_release(block_if bi){
+	struct logdisk_state *ls = bi->state;
+
+	(void) logdisk_checkpoint(ls);
+	logdisk_free_state(ls);
+	free(bi);
+}
+
+void logdisk_dump_stats(block_if bi){
+	struct logdisk_state *ls = bi->state;
+
+	printf("!$LOG: %lu blocks written above, %lu copied by the cleaner, %lu written below\n",
+					ls->nuser, ls->ncopied, ls->nbelow);
+	printf("!$LOG: write amplification %.2f\n",
+					ls->nuser == 0 ? 0 : (double) ls->nbelow / ls->nuser);
+	printf("!$LOG: %lu writes below, %.1f%% of the blocks sequential\n", ls->nwrites,
+					ls->nbelow == 0 ? 0 : 100.0 * ls->nsequential / ls->nbelow);
+	printf("!$LOG: %s cleaner: %lu segments cleaned, %lu checkpoints, %u of %u segments free\n",
+					ls->policy == LOG_GREEDY ? "greedy" : "cost-benefit",
+					ls->nsegs_cleaned, ls->ncheckpoints, ls->nfree, ls->sb.nsegments);
+}
+
+int logdisk_create(block_if below, unsigned int below_ino, block_no nblocks){
+	union logdisk_block blk;
+
+	if (sizeof(blk) != BLOCK_SIZE) {
+		fprintf(stderr, "logdisk_create: block has wrong size\n");
+		return -1;
+	}
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	if (blk.superblock.magic == LOG_MAGIC) {
+		return 0;
+	}
+
+	int nbelow = (*below->getsize)(below, below_ino);
+	if (nbelow < 0) {
+		return -1;
+	}
+
+	/* Find the number of segments that fit along with the map.
+	 */
+	block_no nsegments = (nbelow - 1) / LOG_SEGMENT, nmapblocks = 0;
+	while (nsegments > 0) {
+		block_no n = nblocks != 0 ? nblocks : nsegments * LOG_DATA * 4 / 5;
+		nmapblocks = (n + MAP_PER_BLOCK - 1) / MAP_PER_BLOCK;
+		if (1 + nmapblocks + nsegments * LOG_SEGMENT <= (block_no) nbelow) {
+			nblocks = n;
+			break;
+		}
+		nsegments--;
+	}
+	if (nsegments < 2 * LOG_HIGH_WATER || nblocks > (nsegments - LOG_HIGH_WATER) * LOG_DATA) {
+		fprintf(stderr, "logdisk_create: too few blocks\n");
+		return -1;
+	}
+
+	/* No segment has a valid summary yet, and the map is all zeroes.
+	 */
+	block_no b;
+	memset(&blk, 0, sizeof(blk));
+	for (b = 0; b < nmapblocks; b++) {
+		if ((*below->write)(below, below_ino, 1 + b, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	for (b = 0; b < nsegments; b++) {
+		if ((*below->write)(below, below_ino, 1 + nmapblocks + b * LOG_SEGMENT, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	blk.superblock.magic = LOG_MAGIC;
+	blk.superblock.segment = LOG_SEGMENT;
+	blk.superblock.nblocks = nblocks;
+	blk.superblock.nmapblocks = nmapblocks;
+	blk.superblock.first = 1 + nmapblocks;
+	blk.superblock.nsegments = nsegments;
+	if ((*below->write)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	return (*below->sync)(below, below_ino);
+}
+
+/* Bring the map up to date with the segments written after the checkpoint,
+ * in the order they were written.
+ */
+static int logdisk_roll_forward(struct logdisk_state *ls, uint32_t *counts){
+	unsigned int s, i;
+
+	for (;;) {
+		unsigned int next = ls->sb.nsegments;
+		for (s = 0; s < ls->sb.nsegments; s++) {
+			if (counts[s] > 0 && ls->seqs[s] >= ls->sb.seq &&
+						(next == ls->sb.nsegments || ls->seqs[s] < ls->seqs[next])) {
+				next = s;
+			}
+		}
+		if (next == ls->sb.nsegments) {
+			return 0;
+		}
+
+		union logdisk_block blk;
+		if ((*ls->below->read)(ls->below, ls->below_ino, SEG_START(ls, next), &blk.block) < 0) {
+			return -1;
+		}
+		i = ls->seqs[next] == ls->sb.seq ? ls->sb.count : 0;
+		for (; i < blk.summary.count && i < LOG_DATA; i++) {
+			block_no v = blk.summary.vblocks[i];
+			if (v < ls->sb.nblocks) {
+				ls->map[v] = SEG_START(ls, next) + 1 + i;
+				ls->map_dirty[v / MAP_PER_BLOCK] = true;
+			}
+		}
+		counts[next] = 0;
+	}
+}
+
+block_if logdisk_init(block_if below, unsigned int below_ino, enum logdisk_policy policy){
+	union logdisk_block blk;
+	unsigned int s;
+	block_no b;
+
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return 0;
+	}
+	if (blk.superblock.magic != LOG_MAGIC || blk.superblock.segment != LOG_SEGMENT) {
+		fprintf(stderr, "!!logdisk_init: not a log-structured block store\n");
+		return 0;
+	}
+
+	struct logdisk_state *ls = new_alloc(struct logdisk_state);
+	ls->below = below;
+	ls->below_ino = below_ino;
+	ls->sb = blk.superblock;
+	ls->policy = policy;
+	ls->map = calloc(ls->sb.nmapblocks * MAP_PER_BLOCK, sizeof(*ls->map));
+	ls->map_dirty = calloc(ls->sb.nmapblocks, sizeof(*ls->map_dirty));
+	ls->state = calloc(ls->sb.nsegments, sizeof(*ls->state));
+	ls->live = calloc(ls->sb.nsegments, sizeof(*ls->live));
+	ls->seqs = calloc(ls->sb.nsegments, sizeof(*ls->seqs));
+	ls->buf = malloc(LOG_SEGMENT * BLOCK_SIZE);
+	ls->next_write = (block_no) -1;
+
+	/* Read the checkpoint and the segment summaries.
+	 */
+	for (b = 0; b < ls->sb.nmapblocks; b++) {
+		if ((*below->read)(below, below_ino, 1 + b, (block_t *) &ls->map[b * MAP_PER_BLOCK]) < 0) {
+			fprintf(stderr, "!!logdisk_init: can't read map block %u\n", b);
+			logdisk_free_state(ls);
+			return 0;
+		}
+	}
+	uint32_t *counts = calloc(ls->sb.nsegments, sizeof(*counts));
+	for (s = 0; s < ls->sb.nsegments; s++) {
+		if ((*below->read)(below, below_ino, SEG_START(ls, s), &blk.block) < 0) {
+			fprintf(stderr, "!!logdisk_init: can't read summary of segment %u\n", s);
+			free(counts);
+			logdisk_free_state(ls);
+			return 0;
+		}
+		if (blk.summary.magic == LOG_MAGIC) {
+			ls->seqs[s] = blk.summary.seq;
+			counts[s] = blk.summary.count;
+			if (blk.summary.seq > ls->seq) {
+				ls->seq = blk.summary.seq;
+			}
+		}
+	}
+	if (logdisk_roll_forward(ls, counts) < 0) {
+		fprintf(stderr, "!!logdisk_init: can't read the log\n");
+		free(counts);
+		logdisk_free_state(ls);
+		return 0;
+	}
+	free(counts);
+
+	/* Count the live blocks.  Segments without any are free.
+	 */
+	for (b = 0; b < ls->sb.nblocks; b++) {
+		if (ls->map[b] != 0) {
+			ls->live[(ls->map[b] - ls->sb.first) / LOG_SEGMENT]++;
+		}
+	}
+	for (s = 0; s < ls->sb.nsegments; s++) {
+		if (ls->live[s] == 0) {
+			ls->state[s] = SEG_FREE;
+			ls->nfree++;
+		}
+		else {
+			ls->state[s] = SEG_FULL;
+		}
+	}
+
+	/* Start a new segment after the newest one, and checkpoint so that
+	 * the summaries rolled forward are not needed again.
+	 */
+	for (s = 0; s < ls->sb.nsegments; s++) {
+		if (ls->seqs[s] == ls->seq) {
+			ls->cur = s;
+		}
+	}
+	if (logdisk_open_segment(ls) < 0 || logdisk_checkpoint(ls) < 0) {
+		logdisk_free_state(ls);
+		return 0;
+	}
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ls;
+	bi->getninodes = logdisk_getninodes;
+	bi->getsize = logdisk_getsize;
+	bi->setsize = logdisk_setsize;
+	bi->read = logdisk_read;
+	bi->write = logdisk_write;
+	bi->release = logdisk_release;
+	bi->sync = logdisk_sync;
+	bi->readv = logdisk_readv;
+	bi->writev = logdisk_writev;
+	return bi;
+}
@@ -0,0 +1,336 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Parity computations over blocks, shared by the RAID and erasure-coding
+ * block stores.
+ *
+ *		void parity_xor(block_t *dst, block_t **src, unsigned int nsrc)
+ *			Set dst to the XOR of src[0 .. nsrc - 1] in a single pass over
+ *			the blocks.  dst may be one of the sources.
+ *
+ *		const char *parity_kernel(void)
+ *			Returns the name of the kernel parity_xor() uses.
+ *
+ *		int parity_select(const char *name)
+ *			Use the named kernel ("word", "sse2" or "avx2").  Returns -1
+ *			if it is not available on this machine.
+ *
+ *		uint8_t gf256_mul(uint8_t a, uint8_t b)
+ *		uint8_t gf256_inv(uint8_t a)
+ *			Multiplication and inverse in GF(2^8) (polynomial 0x11d).
+ *
+ *		void gf256_madd(block_t *dst, block_t *src, uint8_t c)
+ *			dst ^= c * src, byte by byte in GF(2^8).
+ *
+ *		const char *gf256_kernel(void)
+ *		int gf256_select(const char *name)
+ *			Like parity_kernel() and parity_select(), for the kernel
+ *			gf256_madd() uses ("table", "ssse3" or "avx2").
+ *
+ * The "word" kernel works on 64-bit words and runs anywhere.  On x86-64,
+ * "sse2" (part of the base instruction set) works on 16-byte vectors,
+ * and "avx2" on 32-byte vectors if the processor and operating system
+ * support it.  For GF(2^8), the "table" kernel looks up each byte in a
+ * 64 KB multiplication table, and the "ssse3" and "avx2" kernels multiply
+ * 16 or 32 bytes at a time using two 16-entry tables (for the low and
+ * high nibble) and a byte shuffle.  The best kernel is selected on first
+ * use.  The kernels are written with GCC vector types and builtins rather
+ * than intrinsics, so they need no compiler headers or libgcc, and build
+ * inside EGOS as well.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <egos/block_store.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#define PARITY_X86
+#endif
+
+typedef uint64_t parity_word_t __attribute__((may_alias));
+
+/* Each kernel keeps four accumulators, and for every group of four words
+ * XORs in the corresponding words of all sources before storing them.
+ */
+#define PARITY_KERNEL(name, type, attr)									\
+attr static void name(block_t *dst, block_t **src, unsigned int nsrc){	\
+	type *d = (type *) dst;												\
+	const unsigned int n = BLOCK_SIZE / sizeof(type);					\
+	unsigned int i, k;													\
+																		\
+	for (i = 0; i < n; i += 4) {										\
+		type *s = (type *) src[0] + i;									\
+		type a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];				\
+		for (k = 1; k < nsrc; k++) {									\
+			s = (type *) src[k] + i;									\
+			a0 ^= s[0];													\
+			a1 ^= s[1];													\
+			a2 ^= s[2];													\
+			a3 ^= s[3];													\
+		}																\
+		d[i] = a0;														\
+		d[i + 1] = a1;													\
+		d[i + 2] = a2;													\
+		d[i + 3] = a3;													\
+	}																	\
+}
+
+PARITY_KERNEL(parity_xor_word, parity_word_t, )
+
+#ifdef PARITY_X86
+typedef uint64_t parity_v2_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint64_t parity_v4_t __attribute__((vector_size(32), aligned(1), may_alias));
+
+PARITY_KERNEL(parity_xor_sse2, parity_v2_t, )
+PARITY_KERNEL(parity_xor_avx2, parity_v4_t, __attribute__((target("avx2"))))
+
+static int parity_have_ssse3(void){
+	uint32_t a, b, c, d;
+
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+	return (c & (1 << 9)) != 0;
+}
+
+/* AVX2 needs support from both the processor and the operating system,
+ * which has to save the YMM registers on a context switch.
+ */
+static int parity_have_avx2(void){
+	uint32_t a, b, c, d;
+
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0), "c"(0));
+	if (a < 7) {
+		return 0;
+	}
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+	if (!(c & (1 << 27)) || !(c & (1 << 28))) {		// OSXSAVE, AVX
+		return 0;
+	}
+	__asm__ volatile ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	if ((a & 6) != 6) {								// XMM and YMM state
+		return 0;
+	}
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(7), "c"(0));
+	return (b & (1 << 5)) != 0;						// AVX2
+}
+#endif
+
+static struct parity_kernel {
+	const char *name;
+	void (*xor)(block_t *dst, block_t **src, unsigned int nsrc);
+} parity_kernels[] = {
+#ifdef PARITY_X86
+	{ "avx2", parity_xor_avx2 },
+	{ "sse2", parity_xor_sse2 },
+#endif
+	{ "word", parity_xor_word },
+};
+
+#define PARITY_NKERNELS		(sizeof(parity_kernels) / sizeof(parity_kernels[0]))
+
+static struct parity_kernel *parity_current;
+
+static int parity_available(struct parity_kernel *k){
+#ifdef PARITY_X86
+	if (k->xor == parity_xor_avx2) {
+		return parity_have_avx2();
+	}
+#endif
+	return 1;
+}
+
+static void parity_init(void){
+	unsigned int i;
+
+	for (i = 0; i < PARITY_NKERNELS; i++) {
+		if (parity_available(&parity_kernels[i])) {
+			parity_current = &parity_kernels[i];
+			return;
+		}
+	}
+}
+
+void parity_xor(block_t *dst, block_t **src, unsigned int nsrc){
+	if (nsrc == 0) {
+		memset(dst, 0, BLOCK_SIZE);
+		return;
+	}
+	if (parity_current == 0) {
+		parity_init();
+	}
+	(*parity_current->xor)(dst, src, nsrc);
+}
+
+const char *parity_kernel(void){
+	if (parity_current == 0) {
+		parity_init();
+	}
+	return parity_current->name;
+}
+
+int parity_select(const char *name){
+	unsigned int i;
+
+	for (i = 0; i < PARITY_NKERNELS; i++) {
+		if (strcmp(parity_kernels[i].name, name) == 0) {
+			if (!parity_available(&parity_kernels[i])) {
+				return -1;
+			}
+			parity_current = &parity_kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* GF(2^8) arithmetic.
+ */
+static uint8_t gf256_exp[510], gf256_log[256];
+static uint8_t gf256_table[256][256];		// gf256_table[c][x] = c * x
+static int gf256_initialized;
+
+static void gf256_init(void){
+	unsigned int i, x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gf256_exp[i] = gf256_exp[i + 255] = x;
+		gf256_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= 0x11d;
+		}
+	}
+	for (i = 0; i < 256 * 256; i++) {
+		unsigned int a = i / 256, b = i % 256;
+		gf256_table[a][b] = a == 0 || b == 0 ? 0 : gf256_exp[gf256_log[a] + gf256_log[b]];
+	}
+	gf256_initialized = 1;
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b){
+	if (!gf256_initialized) {
+		gf256_init();
+	}
+	return gf256_table[a][b];
+}
+
+uint8_t gf256_inv(uint8_t a){
+	if (!gf256_initialized) {
+		gf256_init();
+	}
+	return a == 0 ? 0 : gf256_exp[255 - gf256_log[a]];
+}
+
+static void gf256_madd_table(block_t *dst, block_t *src, uint8_t c){
+	uint8_t *row = gf256_table[c], *d = (uint8_t *) dst, *s = (uint8_t *) src;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE; i += 4) {
+		d[i] ^= row[s[i]];
+		d[i + 1] ^= row[s[i + 1]];
+		d[i + 2] ^= row[s[i + 2]];
+		d[i + 3] ^= row[s[i + 3]];
+	}
+}
+
+#ifdef PARITY_X86
+typedef char gf256_v16_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char gf256_v32_t __attribute__((vector_size(32), aligned(1), may_alias));
+
+/* Multiply by c one nibble at a time: c * x = c * lo(x) ^ c * (hi(x) << 4).
+ * The byte shuffle looks up 16 (or 32) nibbles in a 16-entry table at once.
+ */
+#define GF256_KERNEL(name, type, shuffle, attr)							\
+attr static void name(block_t *dst, block_t *src, uint8_t c){				\
+	type lo, hi, mask;													\
+	unsigned int i;														\
+																		\
+	for (i = 0; i < sizeof(type); i++) {								\
+		lo[i] = gf256_table[c][i % 16];									\
+		hi[i] = gf256_table[c][(i % 16) << 4];							\
+		mask[i] = 0x0f;													\
+	}																	\
+	type *d = (type *) dst, *s = (type *) src;							\
+	for (i = 0; i < BLOCK_SIZE / sizeof(type); i++) {					\
+		type x = s[i];													\
+		type l = x & mask;												\
+		type h = (type) ((uint64_t __attribute__((vector_size(sizeof(type))))) x >> 4) & mask;	\
+		d[i] ^= shuffle(lo, l) ^ shuffle(hi, h);						\
+	}																	\
+}
+
+GF256_KERNEL(gf256_madd_ssse3, gf256_v16_t, __builtin_ia32_pshufb128, __attribute__((target("ssse3"))))
+GF256_KERNEL(gf256_madd_avx2, gf256_v32_t, __builtin_ia32_pshufb256, __attribute__((target("avx2"))))
+#endif
+
+static struct gf256_kernel {
+	const char *name;
+	void (*madd)(block_t *dst, block_t *src, uint8_t c);
+	int (*available)(void);
+} gf256_kernels[] = {
+#ifdef PARITY_X86
+	{ "avx2", gf256_madd_avx2, parity_have_avx2 },
+	{ "ssse3", gf256_madd_ssse3, parity_have_ssse3 },
+#endif
+	{ "table", gf256_madd_table, 0 },
+};
+
+#define GF256_NKERNELS		(sizeof(gf256_kernels) / sizeof(gf256_kernels[0]))
+
+static struct gf256_kernel *gf256_current;
+
+static void gf256_choose(void){
+	unsigned int i;
+
+	if (!gf256_initialized) {
+		gf256_init();
+	}
+	for (i = 0; i < GF256_NKERNELS; i++) {
+		if (gf256_kernels[i].available == 0 || (*gf256_kernels[i].available)()) {
+			gf256_current = &gf256_kernels[i];
+			return;
+		}
+	}
+}
+
+void gf256_madd(block_t *dst, block_t *src, uint8_t c){
+	if (gf256_current == 0) {
+		gf256_choose();
+	}
+	if (c == 0) {
+		return;
+	}
+	if (c == 1) {
+		block_t *srcs[2] = { dst, src };
+		parity_xor(dst, srcs, 2);
+		return;
+	}
+	(*gf256_current->madd)(dst, src, c);
+}
+
+const char *gf256_kernel(void){
+	if (gf256_current == 0) {
+		gf256_choose();
+	}
+	return gf256_current->name;
+}
+
+int gf256_select(const char *name){
+	unsigned int i;
+
+	if (gf256_current == 0) {
+		gf256_choose();
+	}
+	for (i = 0; i < GF256_NKERNELS; i++) {
+		struct gf256_kernel *k = &gf256_kernels[i];
+		if (strcmp(k->name, name) == 0) {
+			if (k->available != 0 && !(*k->available)()) {
+				return -1;
+			}
+			gf256_current = k;
+			return 0;
+		}
+	}
+	return -1;
+}
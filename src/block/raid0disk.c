@@ -4,7 +4,20 @@
  *
  *		block_if raid0disk_init(block_if *below, unsigned int nbelow){
  *			'below' is an array of underlying block stores, all of which
- *			are assumed to be of the same size.
+ *			are assumed to be of the same size.  Blocks are striped over
+ *			the block stores one at a time.
+ *
+ *		block_if raid0disk_init_stripe(block_if *below, unsigned int nbelow,
+ *															block_no unit){
+ *			Like raid0disk_init(), but stripes in chunks of 'unit'
+ *			consecutive blocks: chunk c of the virtual disk is chunk
+ *			c / nbelow of block store c % nbelow.
+ *
+ * The readv and writev methods split a range of blocks into one
+ * contiguous range per block store below, and transfer the ranges using
+ * a block_store_pool.  In host programs this happens concurrently; inside
+ * EGOS there are no threads, so they are transferred one after the other
+ * (but still with a single readv or writev per block store).
  */
 
 #include <stdio.h>
@@ -15,8 +28,22 @@
 struct raid0disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
+	block_no unit;			// stripe unit in blocks
+	struct block_store_xfer *xfers;	// one per block store below
+	block_no *next;			// scatter/gather position in each xfer
+	struct block_store_pool *pool;	// one worker per block store below
 };
 
+/* Map a virtual block number to a block store and an offset on it.
+ */
+static unsigned int raid0disk_map(struct raid0disk_state *rds, block_no offset,
+													block_no *disk_off){
+	block_no chunk = offset / rds->unit;
+
+	*disk_off = (chunk / rds->nbelow) * rds->unit + offset % rds->unit;
+	return chunk % rds->nbelow;
+}
+
 static int raid0disk_getninodes(block_if bi){
 	return 1;
 }
@@ -27,18 +54,22 @@ static int raid0disk_getsize(block_if bi, unsigned int ino){
 		return -1;
 	}
 
+	/* Only the complete chunks of the smallest block store are usable.
+	 */
 	struct raid0disk_state *rds = bi->state;
-	int total = 0;
+	int min = -1;
 	unsigned int i;
 
 	for (i = 0; i < rds->nbelow; i++) {
-		int r = (*rds->below[0]->getsize)(rds->below[0], ino);
+		int r = (*rds->below[i]->getsize)(rds->below[i], ino);
 		if (r < 0) {
 			return r;
 		}
-		total += r;
+		if (min < 0 || r < min) {
+			min = r;
+		}
 	}
-	return total;
+	return rds->nbelow * (min / rds->unit * rds->unit);
 }
 
 static int raid0disk_setsize(block_if bi, unsigned int ino, block_no nblocks){
@@ -53,9 +84,9 @@ static int raid0disk_read(block_if bi, unsigned int ino, block_no offset, block_
 	}
 
 	struct raid0disk_state *rds = bi->state;
-	int i = offset % rds->nbelow;
-	offset /= rds->nbelow;
-	return (*rds->below[i]->read)(rds->below[i], ino, offset, block);
+	block_no disk_off;
+	unsigned int i = raid0disk_map(rds, offset, &disk_off);
+	return (*rds->below[i]->read)(rds->below[i], ino, disk_off, block);
 }
 
 static int raid0disk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
@@ -66,13 +97,97 @@ static int raid0disk_write(block_if bi, unsigned int ino, block_no offset, block
 		return -1;
 	}
 
-	int i = offset % rds->nbelow;
-	offset /= rds->nbelow;
-	return (*rds->below[i]->write)(rds->below[i], ino, offset, block);
+	block_no disk_off;
+	unsigned int i = raid0disk_map(rds, offset, &disk_off);
+	return (*rds->below[i]->write)(rds->below[i], ino, disk_off, block);
+}
+
+/* Split the range offset .. offset + nblocks - 1 into one contiguous range
+ * per block store below, and carve the bounce buffer 'buf' up among them.
+ * The intermediate chunks on each block store are complete, so only the
+ * first and last chunk on a block store can be partial.
+ */
+static void raid0disk_split(struct raid0disk_state *rds, unsigned int ino, int write,
+							block_no offset, block_no nblocks, block_t *buf){
+	unsigned int i;
+	block_no o, disk_off;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		rds->xfers[i].bs = rds->below[i];
+		rds->xfers[i].ino = ino;
+		rds->xfers[i].write = write;
+		rds->xfers[i].nblocks = 0;
+		rds->next[i] = 0;
+	}
+	for (o = offset; o < offset + nblocks; o++) {
+		struct block_store_xfer *x = &rds->xfers[raid0disk_map(rds, o, &disk_off)];
+		if (x->nblocks++ == 0) {
+			x->offset = disk_off;
+		}
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		rds->xfers[i].buf = buf;
+		buf += rds->xfers[i].nblocks;
+	}
+}
+
+static int raid0disk_readv(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct raid0disk_state *rds = bi->state;
+	block_no o, disk_off;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!raid0disk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	block_t *buf = malloc(nblocks * BLOCK_SIZE);
+	raid0disk_split(rds, ino, 0, offset, nblocks, buf);
+	int result = block_store_pool_run(rds->pool, rds->xfers, rds->nbelow);
+
+	/* Gather the blocks from the bounce buffers.
+	 */
+	if (result == 0) {
+		for (o = 0; o < nblocks; o++) {
+			unsigned int i = raid0disk_map(rds, offset + o, &disk_off);
+			memcpy(&blocks[o], &rds->xfers[i].buf[rds->next[i]++], BLOCK_SIZE);
+		}
+	}
+	free(buf);
+	return result;
+}
+
+static int raid0disk_writev(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct raid0disk_state *rds = bi->state;
+	block_no o, disk_off;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!raid0disk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	/* Scatter the blocks into the bounce buffers.
+	 */
+	block_t *buf = malloc(nblocks * BLOCK_SIZE);
+	raid0disk_split(rds, ino, 1, offset, nblocks, buf);
+	for (o = 0; o < nblocks; o++) {
+		unsigned int i = raid0disk_map(rds, offset + o, &disk_off);
+		memcpy(&rds->xfers[i].buf[rds->next[i]++], &blocks[o], BLOCK_SIZE);
+	}
+
+	int result = block_store_pool_run(rds->pool, rds->xfers, rds->nbelow);
+	free(buf);
+	return result;
 }
 
 static void raid0disk_release(block_if bi){
-	free(bi->state);
+	struct raid0disk_state *rds = bi->state;
+
+	block_store_pool_release(rds->pool);
+	free(rds->next);
+	free(rds->xfers);
+	free(rds);
 	free(bi);
 }
 
@@ -89,12 +204,21 @@ static int raid0disk_sync(block_if bi, unsigned int ino){
 	return 0;
 }
 
-block_if raid0disk_init(block_if *below, unsigned int nbelow){
+block_if raid0disk_init_stripe(block_if *below, unsigned int nbelow, block_no unit){
+	if (unit == 0) {
+		fprintf(stderr, "!!raid0disk_init_stripe: stripe unit must be positive\n");
+		return 0;
+	}
+
 	/* Create the block store state structure.
 	 */
 	struct raid0disk_state *rds = new_alloc(struct raid0disk_state);
 	rds->below = below;
 	rds->nbelow = nbelow;
+	rds->unit = unit;
+	rds->xfers = calloc(nbelow, sizeof(*rds->xfers));
+	rds->next = calloc(nbelow, sizeof(*rds->next));
+	rds->pool = block_store_pool_init(nbelow);
 
 	/* Return a block interface to this inode.
 	 */
@@ -107,5 +231,11 @@ block_if raid0disk_init(block_if *below, unsigned int nbelow){
 	bi->write = raid0disk_write;
 	bi->release = raid0disk_release;
 	bi->sync = raid0disk_sync;
+	bi->readv = raid0disk_readv;
+	bi->writev = raid0disk_writev;
 	return bi;
 }
+
+block_if raid0disk_init(block_if *below, unsigned int nbelow){
+	return raid0disk_init_stripe(below, nbelow, 1);
+}
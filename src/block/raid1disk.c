@@ -5,6 +5,50 @@
  *		block_if raid1disk_init(block_if *below, unsigned int nbelow){
  *			'below' is an array of underlying block stores, all of which
  *			are assumed to be of the same size.
+ *
+ *		int raid1disk_set_policy(block_if bi, enum raid1disk_policy policy)
+ *			Select which replica serves a read:
+ *				RAID1_PRIMARY: the first one that works
+ *				RAID1_ROUND_ROBIN: the replicas take turns (the default)
+ *				RAID1_FASTEST: the one with the lowest average read
+ *					latency so far
+ *				RAID1_NEAREST: the one whose last access was closest to
+ *					the requested block, to keep seeks short
+ *			If the selected replica fails, the others are tried.
+ *
+ *		void raid1disk_dump_stats(block_if bi)
+ *			Print the number of reads and the average read latency of
+ *			each replica.
+ *
+ *		int raid1disk_replace(block_if bi, unsigned int i, block_if replacement)
+ *			Replace replica i (below[i]) by 'replacement' and start
+ *			rebuilding it from the other replicas.
+ *
+ *		int raid1disk_reattach(block_if bi, unsigned int i)
+ *			Bring replica i back after a transient failure.  Only the
+ *			regions written while it was broken are resynchronized.
+ *
+ *		int raid1disk_rebuild_step(block_if bi)
+ *			Copy the next chunk to the replicas being rebuilt.  Returns
+ *			the number of regions still to be copied, or -1 if there is
+ *			no working replica to copy from.
+ *
+ *		void raid1disk_set_rebuild_rate(block_if bi, unsigned int blocks_per_sec)
+ *			Limit the rebuild rate (0 means unlimited).
+ *
+ * A multi-block read (readv) is divided into one contiguous range per
+ * working replica, and the ranges are read concurrently using a
+ * block_store_pool, so sequential read throughput scales with the number
+ * of replicas.  Writes go to all replicas.
+ *
+ * While a replica is broken, raid1disk keeps a bitmap of the regions of
+ * RAID1_REGION_SIZE blocks that were written, so that only those have to
+ * be copied when it comes back.  A replica that is being rebuilt receives
+ * all writes but serves no reads until it is up to date.  EGOS has no
+ * threads, so the rebuild runs in steps of one region: each foreground
+ * operation performs a step if the rebuild rate allows it, and an idle
+ * caller can drive the rebuild with raid1disk_rebuild_step().  The rate
+ * is enforced with a token bucket.
  */
 
 #include <stdio.h>
@@ -12,12 +56,61 @@
 #include <string.h>
 #include <egos/block_store.h>
 
+#define RAID1_REGION_SIZE		64		// blocks per dirty-region bit
+#define RAID1_DEFAULT_RATE		4096	// default rebuild rate in blocks/sec
+
+struct raid1disk_member_stats {
+	unsigned int nreads;		// #read operations
+	unsigned int nblocks;		// #blocks read
+	unsigned int nerrors;		// #failed reads
+	unsigned long usec;			// total read latency
+};
+
 struct raid1disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
 	char *broken;			// keeps track of which stores are broken
+
+	enum raid1disk_policy policy;
+	unsigned int next;			// next replica for round-robin
+	block_no *last;				// last block accessed per replica
+	struct raid1disk_member_stats *stats;
+
+	struct block_store_xfer *xfers;	// one per replica
+	struct block_store_pool *pool;	// one worker per replica
+
+	/* Rebuild state.
+	 */
+	char *rebuilding;			// replica is being brought up to date
+	unsigned char **dirty;		// per replica, regions it is missing
+	unsigned int nregions;		// #regions (0 until known)
+	unsigned int cursor;		// next region to look at
+	unsigned int ntodo;			// #regions to copy in this rebuild
+	unsigned int ndone;			// #regions copied in this rebuild
+	unsigned int rate;			// blocks/sec, 0 is unlimited
+	unsigned long tokens;		// token bucket, in blocks
+	unsigned long refill;		// last time the bucket was refilled
+	block_t *chunk;				// copy buffer of RAID1_REGION_SIZE blocks
 };
 
+static int raid1disk_poll(struct raid1disk_state *rds);
+
+/* A replica can serve reads if it is neither broken nor being rebuilt.
+ */
+static int raid1disk_readable(struct raid1disk_state *rds, unsigned int i){
+	return !rds->broken[i] && !rds->rebuilding[i];
+}
+
+/* Replica i failed.
+ */
+static void raid1disk_fail(struct raid1disk_state *rds, unsigned int i){
+	if (rds->rebuilding[i]) {
+		fprintf(stderr, "!!raid1disk: replica %u failed during rebuild\n", i);
+		rds->rebuilding[i] = 0;
+	}
+	rds->broken[i] = 1;
+}
+
 static int raid1disk_getninodes(block_if bi){
 	struct raid1disk_state *rds = bi->state;
 	unsigned int i;
@@ -28,7 +121,7 @@ static int raid1disk_getninodes(block_if bi){
 		if (!rds->broken[i]) {
 			int ninodes = (*rds->below[i]->getninodes)(rds->below[i]);
 			if (ninodes < 0) {
-				rds->broken[i] = 1;
+				raid1disk_fail(rds, i);
 			}
 			else {
 				return ninodes;
@@ -48,7 +141,7 @@ static int raid1disk_getsize(block_if bi, unsigned int ino){
 		if (!rds->broken[i]) {
 			int nblocks = (*rds->below[i]->getsize)(rds->below[i], ino);
 			if (nblocks < 0) {
-				rds->broken[i] = 1;
+				raid1disk_fail(rds, i);
 			}
 			else {
 				return nblocks;
@@ -69,7 +162,7 @@ static int raid1disk_setsize(block_if bi, unsigned int ino, block_no nblocks){
 	for (i = 0; i < rds->nbelow; i++) {
 		int r = (*rds->below[i]->setsize)(rds->below[i], ino, nblocks);
 		if (r < 0) {
-			rds->broken[i] = 1;
+			raid1disk_fail(rds, i);
 		}
 		else {
 			oldsize = r;
@@ -79,29 +172,237 @@ static int raid1disk_setsize(block_if bi, unsigned int ino, block_no nblocks){
 	return oldsize;
 }
 
+/* Pick a working replica to read 'offset' from according to the read
+ * policy.  Returns -1 if all replicas are broken.
+ */
+static int raid1disk_choose(struct raid1disk_state *rds, block_no offset){
+	int best = -1;
+	unsigned int i, k;
+
+	for (k = 0; k < rds->nbelow; k++) {
+		/* Start scanning at the round-robin position so ties rotate.
+		 */
+		i = rds->policy == RAID1_PRIMARY ? k : (rds->next + k) % rds->nbelow;
+		if (!raid1disk_readable(rds, i)) {
+			continue;
+		}
+		if (best < 0) {
+			best = i;
+			if (rds->policy == RAID1_PRIMARY || rds->policy == RAID1_ROUND_ROBIN) {
+				break;
+			}
+			continue;
+		}
+
+		if (rds->policy == RAID1_FASTEST) {
+			struct raid1disk_member_stats *s = &rds->stats[i], *b = &rds->stats[best];
+			if (s->nblocks > 0 && b->nblocks > 0 &&
+						s->usec / s->nblocks < b->usec / b->nblocks) {
+				best = i;
+			}
+		}
+		else {		/* RAID1_NEAREST */
+			block_no d = offset > rds->last[i] ? offset - rds->last[i] : rds->last[i] - offset;
+			block_no bd = offset > rds->last[best] ? offset - rds->last[best] : rds->last[best] - offset;
+			if (d < bd) {
+				best = i;
+			}
+		}
+	}
+	if (best >= 0) {
+		rds->next = (best + 1) % rds->nbelow;
+	}
+	return best;
+}
+
+/* Read a single block from replica i, keeping statistics.
+ */
+static int raid1disk_read_member(struct raid1disk_state *rds, unsigned int i,
+							unsigned int ino, block_no offset, block_t *block){
+	struct raid1disk_member_stats *s = &rds->stats[i];
+
+	unsigned long start = block_store_usec();
+	int r = (*rds->below[i]->read)(rds->below[i], ino, offset, block);
+	s->usec += block_store_usec() - start;
+	s->nreads++;
+	rds->last[i] = offset;
+	if (r < 0) {
+		s->nerrors++;
+	}
+	else {
+		s->nblocks++;
+	}
+	return r;
+}
+
 static int raid1disk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
 	struct raid1disk_state *rds = bi->state;
 	unsigned int i;
 
-	/* Simply try all of them.  If reading fails it is not necessary
-	 * to mark them as broken.
+	/* Try the replica selected by the policy first, then all the others.
+	 * If reading fails it is not necessary to mark them as broken.
 	 */
+	raid1disk_poll(rds);
+	int first = raid1disk_choose(rds, offset);
+	if (first < 0) {
+		return -1;
+	}
+	if (raid1disk_read_member(rds, first, ino, offset, block) >= 0) {
+		return 0;
+	}
 	for (i = 0; i < rds->nbelow; i++) {
-		if (rds->broken[i]) {
+		if (!raid1disk_readable(rds, i) || (int) i == first) {
 			continue;
 		}
-		if ((*rds->below[i]->read)(rds->below[i], ino, offset, block) >= 0) {
+		if (raid1disk_read_member(rds, i, ino, offset, block) >= 0) {
 			return 0;
 		}
 	}
 	return -1;
 }
 
+static int raid1disk_readv(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i, nworking = 0;
+	block_no o;
+
+	raid1disk_poll(rds);
+	for (i = 0; i < rds->nbelow; i++) {
+		rds->xfers[i].nblocks = 0;
+		if (raid1disk_readable(rds, i)) {
+			nworking++;
+		}
+	}
+	if (nworking == 0) {
+		return -1;
+	}
+	if (rds->policy == RAID1_PRIMARY) {
+		nworking = 1;
+	}
+
+	/* Divide the range into nworking pieces, and give each piece to the
+	 * replica chosen for its first block.
+	 */
+	block_no piece = (nblocks + nworking - 1) / nworking;
+	for (o = 0; o < nblocks; o += piece) {
+		int c = raid1disk_choose(rds, offset + o);
+		struct block_store_xfer *x = &rds->xfers[c];
+		if (x->nblocks > 0) {
+			/* The policy picked the same replica twice; use the next
+			 * free one instead.
+			 */
+			for (i = 0; i < rds->nbelow; i++) {
+				if (raid1disk_readable(rds, i) && rds->xfers[i].nblocks == 0) {
+					break;
+				}
+			}
+			if (i == rds->nbelow) {
+				break;
+			}
+			c = i;
+			x = &rds->xfers[c];
+		}
+		x->bs = rds->below[c];
+		x->ino = ino;
+		x->write = 0;
+		x->offset = offset + o;
+		x->nblocks = nblocks - o < piece ? nblocks - o : piece;
+		x->buf = &blocks[o];
+	}
+	if (o < nblocks) {
+		/* Could not place every piece; fall back to single blocks.
+		 */
+		for (o = 0; o < nblocks; o++) {
+			if (raid1disk_read(bi, ino, offset + o, &blocks[o]) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	unsigned long start = block_store_usec();
+	block_store_pool_run(rds->pool, rds->xfers, rds->nbelow);
+	unsigned long elapsed = block_store_usec() - start;
+
+	/* Account for each piece, and retry failed pieces block by block on
+	 * the other replicas.
+	 */
+	for (i = 0; i < rds->nbelow; i++) {
+		struct block_store_xfer *x = &rds->xfers[i];
+		if (x->nblocks == 0) {
+			continue;
+		}
+		struct raid1disk_member_stats *s = &rds->stats[i];
+		s->nreads++;
+		s->usec += elapsed;
+		rds->last[i] = x->offset + x->nblocks - 1;
+		if (x->result >= 0) {
+			s->nblocks += x->nblocks;
+			continue;
+		}
+		s->nerrors++;
+		for (o = 0; o < x->nblocks; o++) {
+			if (raid1disk_read(bi, ino, x->offset + o, &x->buf[o]) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Make sure the dirty-region bitmaps are allocated.  Returns -1 if the
+ * size of the replicas cannot be determined.
+ */
+static int raid1disk_regions(struct raid1disk_state *rds){
+	unsigned int i;
+
+	if (rds->nregions > 0) {
+		return 0;
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!rds->broken[i]) {
+			int size = (*rds->below[i]->getsize)(rds->below[i], 0);
+			if (size > 0) {
+				rds->nregions = (size + RAID1_REGION_SIZE - 1) / RAID1_REGION_SIZE;
+				break;
+			}
+		}
+	}
+	if (rds->nregions == 0) {
+		return -1;
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		rds->dirty[i] = calloc((rds->nregions + 7) / 8, 1);
+	}
+	return 0;
+}
+
+/* Remember that blocks offset .. offset + nblocks - 1 are missing on
+ * the broken replicas.
+ */
+static void raid1disk_mark_dirty(struct raid1disk_state *rds, block_no offset, block_no nblocks){
+	unsigned int i, r;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!rds->broken[i] || raid1disk_regions(rds) < 0) {
+			continue;
+		}
+		for (r = offset / RAID1_REGION_SIZE; r <= (offset + nblocks - 1) / RAID1_REGION_SIZE; r++) {
+			if (r < rds->nregions) {
+				rds->dirty[i][r / 8] |= 1 << (r % 8);
+			}
+		}
+	}
+}
+
 static int raid1disk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
 	struct raid1disk_state *rds = bi->state;
 	unsigned int i;
 	int result = -1;
 
+	raid1disk_poll(rds);
+
 	/* Try to write all of the underlying stores.
 	 */
 	for (i = 0; i < rds->nbelow; i++) {
@@ -109,18 +410,66 @@ static int raid1disk_write(block_if bi, unsigned int ino, block_no offset, block
 			continue;
 		}
 		if ((*rds->below[i]->write)(rds->below[i], ino, offset, block) < 0) {
-			rds->broken[i] = 1;
+			raid1disk_fail(rds, i);
 		}
 		else {
+			rds->last[i] = offset;
 			result = 0;
 		}
 	}
+	raid1disk_mark_dirty(rds, offset, 1);
+	return result;
+}
+
+static int raid1disk_writev(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i;
+	int result = -1;
+
+	raid1disk_poll(rds);
+
+	/* Write the range to all working replicas concurrently.
+	 */
+	for (i = 0; i < rds->nbelow; i++) {
+		struct block_store_xfer *x = &rds->xfers[i];
+		x->bs = rds->below[i];
+		x->ino = ino;
+		x->write = 1;
+		x->offset = offset;
+		x->nblocks = rds->broken[i] ? 0 : nblocks;
+		x->buf = blocks;
+	}
+	block_store_pool_run(rds->pool, rds->xfers, rds->nbelow);
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->xfers[i].nblocks == 0) {
+			continue;
+		}
+		if (rds->xfers[i].result < 0) {
+			raid1disk_fail(rds, i);
+		}
+		else {
+			rds->last[i] = offset + nblocks - 1;
+			result = 0;
+		}
+	}
+	raid1disk_mark_dirty(rds, offset, nblocks);
 	return result;
 }
 
 static void raid1disk_release(block_if bi){
 	struct raid1disk_state *rds = bi->state;
 
+	block_store_pool_release(rds->pool);
+	for (unsigned int i = 0; i < rds->nbelow; i++) {
+		free(rds->dirty[i]);
+	}
+	free(rds->dirty);
+	free(rds->rebuilding);
+	free(rds->chunk);
+	free(rds->xfers);
+	free(rds->stats);
+	free(rds->last);
 	free(rds->broken);
 	free(rds);
 	free(bi);
@@ -136,7 +485,7 @@ static int raid1disk_sync(block_if bi, unsigned int ino){
 			continue;
 		}
 		if ((*rds->below[i]->sync)(rds->below[i], ino) < 0) {
-			rds->broken[i] = 1;
+			raid1disk_fail(rds, i);
 		}
 		else {
 			result = 0;
@@ -145,6 +494,233 @@ static int raid1disk_sync(block_if bi, unsigned int ino){
 	return result;
 }
 
+int raid1disk_set_policy(block_if bi, enum raid1disk_policy policy){
+	struct raid1disk_state *rds = bi->state;
+
+	if (policy > RAID1_NEAREST) {
+		fprintf(stderr, "!!raid1disk_set_policy: unknown policy %d\n", policy);
+		return -1;
+	}
+	rds->policy = policy;
+	return 0;
+}
+
+void raid1disk_dump_stats(block_if bi){
+	struct raid1disk_state *rds = bi->state;
+	static const char *names[] = { "primary", "round-robin", "fastest", "nearest" };
+	unsigned int i;
+
+	printf("!$RAID1: policy %s\n", names[rds->policy]);
+	for (i = 0; i < rds->nbelow; i++) {
+		struct raid1disk_member_stats *s = &rds->stats[i];
+		printf("!$RAID1: replica %u%s: %u reads, %u blocks, %u errors, avg %lu us/read\n",
+				i, rds->broken[i] ? " (broken)" : rds->rebuilding[i] ? " (rebuilding)" : "",
+				s->nreads, s->nblocks,
+				s->nerrors, s->nreads == 0 ? 0 : s->usec / s->nreads);
+	}
+	if (rds->ntodo > 0) {
+		printf("!$RAID1: rebuild: %u of %u regions copied\n", rds->ndone, rds->ntodo);
+	}
+}
+
+/* Find the next region that some replica being rebuilt is missing,
+ * starting at the cursor.  Returns -1 if there is none.
+ */
+static int raid1disk_next_region(struct raid1disk_state *rds){
+	unsigned int k, i;
+
+	for (k = 0; k < rds->nregions; k++) {
+		unsigned int r = (rds->cursor + k) % rds->nregions;
+		for (i = 0; i < rds->nbelow; i++) {
+			if (rds->rebuilding[i] && (rds->dirty[i][r / 8] & (1 << (r % 8)))) {
+				rds->cursor = r;
+				return r;
+			}
+		}
+	}
+	return -1;
+}
+
+/* The rebuild is complete: the replicas being rebuilt are now readable.
+ */
+static void raid1disk_rebuild_done(struct raid1disk_state *rds){
+	unsigned int i;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->rebuilding[i]) {
+			printf("!$RAID1: replica %u rebuilt (%u regions)\n", i, rds->ndone);
+			rds->rebuilding[i] = 0;
+		}
+	}
+	rds->ntodo = rds->ndone = 0;
+}
+
+/* Copy one region from a readable replica to the replicas that are being
+ * rebuilt and are missing it.
+ */
+static int raid1disk_copy_region(struct raid1disk_state *rds, unsigned int r){
+	unsigned int i;
+	int size = -1;
+
+	block_no offset = r * RAID1_REGION_SIZE;
+	block_no nblocks = RAID1_REGION_SIZE;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (!raid1disk_readable(rds, i)) {
+			continue;
+		}
+		size = (*rds->below[i]->getsize)(rds->below[i], 0);
+		if (size < 0) {
+			continue;
+		}
+		if (offset + nblocks > (block_no) size) {
+			nblocks = size - offset;
+		}
+		if (block_store_readv(rds->below[i], 0, offset, nblocks, rds->chunk) >= 0) {
+			break;
+		}
+	}
+	if (i == rds->nbelow) {
+		fprintf(stderr, "!!raid1disk: no replica to rebuild from\n");
+		return -1;
+	}
+
+	for (i = 0; i < rds->nbelow; i++) {
+		unsigned char *map = rds->dirty[i];
+		if (!rds->rebuilding[i] || !(map[r / 8] & (1 << (r % 8)))) {
+			continue;
+		}
+		if (block_store_writev(rds->below[i], 0, offset, nblocks, rds->chunk) < 0) {
+			raid1disk_fail(rds, i);
+			continue;
+		}
+		map[r / 8] &= ~(1 << (r % 8));
+	}
+	rds->ndone++;
+
+	/* Report progress every 10%.
+	 */
+	if (rds->ndone < rds->ntodo &&
+			rds->ndone * 10 / rds->ntodo != (rds->ndone - 1) * 10 / rds->ntodo) {
+		printf("!$RAID1: rebuild: %u of %u regions copied\n", rds->ndone, rds->ntodo);
+	}
+	return 0;
+}
+
+/* Perform a rebuild step if there is a rebuild going on and the token
+ * bucket has enough tokens for a region.
+ */
+static int raid1disk_poll(struct raid1disk_state *rds){
+	unsigned int i;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->rebuilding[i]) {
+			break;
+		}
+	}
+	if (i == rds->nbelow) {
+		return 0;
+	}
+
+	if (rds->rate != 0) {
+		/* Refill the bucket, which holds at most two regions' worth.
+		 */
+		unsigned long now = block_store_usec();
+		unsigned long add = (now - rds->refill) * rds->rate / 1000000;
+		if (add > 0) {
+			rds->tokens += add;
+			rds->refill += add * 1000000 / rds->rate;
+		}
+		if (rds->tokens > 2 * RAID1_REGION_SIZE) {
+			rds->tokens = 2 * RAID1_REGION_SIZE;
+			rds->refill = now;
+		}
+		if (rds->tokens < RAID1_REGION_SIZE) {
+			return rds->ntodo - rds->ndone;
+		}
+		rds->tokens -= RAID1_REGION_SIZE;
+	}
+
+	int r = raid1disk_next_region(rds);
+	if (r < 0) {
+		raid1disk_rebuild_done(rds);
+		return 0;
+	}
+	if (raid1disk_copy_region(rds, r) < 0) {
+		return -1;
+	}
+	if (raid1disk_next_region(rds) < 0) {
+		raid1disk_rebuild_done(rds);
+		return 0;
+	}
+	return rds->ntodo - rds->ndone;
+}
+
+int raid1disk_rebuild_step(block_if bi){
+	return raid1disk_poll(bi->state);
+}
+
+void raid1disk_set_rebuild_rate(block_if bi, unsigned int blocks_per_sec){
+	struct raid1disk_state *rds = bi->state;
+
+	rds->rate = blocks_per_sec;
+}
+
+/* Start rebuilding replica i from the regions marked in its bitmap.
+ */
+static int raid1disk_start_rebuild(struct raid1disk_state *rds, unsigned int i){
+	unsigned int r;
+
+	if (raid1disk_regions(rds) < 0) {
+		fprintf(stderr, "!!raid1disk: cannot determine the size of the replicas\n");
+		return -1;
+	}
+	rds->broken[i] = 0;
+	rds->rebuilding[i] = 1;
+
+	/* Count the regions still to be copied to any replica.
+	 */
+	rds->ntodo = rds->ndone = 0;
+	rds->cursor = 0;
+	for (r = 0; r < rds->nregions; r++) {
+		for (i = 0; i < rds->nbelow; i++) {
+			if (rds->rebuilding[i] && (rds->dirty[i][r / 8] & (1 << (r % 8)))) {
+				rds->ntodo++;
+				break;
+			}
+		}
+	}
+	rds->tokens = 0;
+	rds->refill = block_store_usec();
+	return 0;
+}
+
+int raid1disk_replace(block_if bi, unsigned int i, block_if replacement){
+	struct raid1disk_state *rds = bi->state;
+
+	if (i >= rds->nbelow) {
+		fprintf(stderr, "!!raid1disk_replace: no replica %u\n", i);
+		return -1;
+	}
+	if (raid1disk_regions(rds) < 0) {
+		fprintf(stderr, "!!raid1disk_replace: cannot determine the size of the replicas\n");
+		return -1;
+	}
+	rds->below[i] = replacement;
+	memset(rds->dirty[i], 0xFF, (rds->nregions + 7) / 8);
+	return raid1disk_start_rebuild(rds, i);
+}
+
+int raid1disk_reattach(block_if bi, unsigned int i){
+	struct raid1disk_state *rds = bi->state;
+
+	if (i >= rds->nbelow || !rds->broken[i]) {
+		fprintf(stderr, "!!raid1disk_reattach: replica %u is not broken\n", i);
+		return -1;
+	}
+	return raid1disk_start_rebuild(rds, i);
+}
+
 block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	/* Create the block store state structure.
 	 */
@@ -152,6 +728,15 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	rds->below = below;
 	rds->nbelow = nbelow;
 	rds->broken = calloc(1, nbelow);
+	rds->policy = RAID1_ROUND_ROBIN;
+	rds->last = calloc(nbelow, sizeof(*rds->last));
+	rds->stats = calloc(nbelow, sizeof(*rds->stats));
+	rds->xfers = calloc(nbelow, sizeof(*rds->xfers));
+	rds->pool = block_store_pool_init(nbelow);
+	rds->rebuilding = calloc(1, nbelow);
+	rds->dirty = calloc(nbelow, sizeof(*rds->dirty));
+	rds->rate = RAID1_DEFAULT_RATE;
+	rds->chunk = malloc(RAID1_REGION_SIZE * BLOCK_SIZE);
 
 	/* Return a block interface to this inode.
 	 */
@@ -164,5 +749,7 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	bi->write = raid1disk_write;
 	bi->release = raid1disk_release;
 	bi->sync = raid1disk_sync;
+	bi->readv = raid1disk_readv;
+	bi->writev = raid1disk_writev;
 	return bi;
 }
@@ -5,19 +5,191 @@
  *		block_if raid4disk_init(block_if *below, unsigned int nbelow){
  *			'below' is an array of underlying block stores, all of which
  *			are assumed to be of the same size.
+ *
+ *		void raid4disk_dump_stats(block_if bi)
+ *			Print how many writes took each of the write paths below,
+ *			the number of degraded reads, and the parity cache hit rate.
+ *
+ * Block b of the virtual disk is stored as block b / (nbelow - 1) of
+ * data disk b % (nbelow - 1).  Disk nbelow - 1 holds the parity of each
+ * stripe of nbelow - 1 data blocks.  raid5disk uses the same code, with
+ * the parity rotating over the members instead (see raid4disk_pdisk()).
+ *
+ * There are three ways to write:
+ *
+ *		read-modify-write: a single block is written by reading the old data
+ *			and the old parity, and writing the new data and the parity
+ *			XOR-ed with both old and new data.
+ *
+ *		full stripe: a writev that covers a complete stripe computes the
+ *			parity from the new data alone, without reading anything.
+ *
+ *		reconstruct-write: if the data disk has failed, the parity is
+ *			computed from the new data and the other data blocks.
+ *
+ * The most recently used parity blocks are kept in a small cache, which
+ * saves reading the parity back when the same stripe is written again.
+ * A stripe is only cached once its parity is on disk; a failed write
+ * drops it from the cache.
+ *
+ * A member that returns an error is considered failed.  With one failed
+ * member, its blocks are reconstructed from the others (degraded mode).
+ * With two failed members, reads and writes fail.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
 #include <egos/block_store.h>
+#include "raid4disk.h"
+
+/* Return the disk that holds the parity of the given stripe.  With
+ * rotating parity the layout is left-symmetric: stripe s keeps its parity
+ * on member (nbelow - 1) - s % nbelow, and its data blocks on the members
+ * after it (modulo nbelow), so that consecutive blocks of the virtual disk
+ * go to consecutive members, even across stripes.
+ */
+static unsigned int raid4disk_pdisk(struct raid4disk_state *rds, block_no stripe){
+	if (rds->rotate) {
+		return rds->nbelow - 1 - stripe % rds->nbelow;
+	}
+	return rds->nbelow - 1;
+}
 
-// Disk nbelow-1 is used as the parity disk
-struct raid4disk_state {
-	block_if *below;		// block stores below
-	unsigned int nbelow;	// #block stores
-};
+/* Return the data disk that holds virtual block 'offset', and in *stripe
+ * the stripe (the block number on each member) it is in.
+ */
+static unsigned int raid4disk_map(struct raid4disk_state *rds, block_no offset, block_no *stripe){
+	*stripe = offset / rds->ndata;
+	if (rds->rotate) {
+		return (raid4disk_pdisk(rds, *stripe) + 1 + offset % rds->ndata) % rds->nbelow;
+	}
+	return offset % rds->ndata;
+}
+
+static int raid4disk_read_member(struct raid4disk_state *rds, unsigned int i,
+										block_no stripe, block_t *block){
+	if (rds->failed[i]) {
+		return -1;
+	}
+	if ((*rds->below[i]->read)(rds->below[i], 0, stripe, block) < 0) {
+		fprintf(stderr, "!!raid4disk: member %u failed\n", i);
+		rds->failed[i] = true;
+		return -1;
+	}
+	return 0;
+}
+
+static int raid4disk_write_member(struct raid4disk_state *rds, unsigned int i,
+										block_no stripe, block_t *block){
+	if (rds->failed[i]) {
+		return -1;
+	}
+	if ((*rds->below[i]->write)(rds->below[i], 0, stripe, block) < 0) {
+		fprintf(stderr, "!!raid4disk: member %u failed\n", i);
+		rds->failed[i] = true;
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned int raid4disk_nfailed(struct raid4disk_state *rds){
+	unsigned int i, n = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->failed[i]) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Look up the parity of a stripe in the cache.
+ */
+static struct raid4disk_pcache_entry *raid4disk_pcache_find(struct raid4disk_state *rds, block_no stripe){
+	unsigned int i;
+
+	for (i = 0; i < RAID4_PCACHE_SIZE; i++) {
+		struct raid4disk_pcache_entry *e = &rds->pcache[i];
+		if (e->valid && e->stripe == stripe) {
+			e->lru = ++rds->clock;
+			return e;
+		}
+	}
+	return 0;
+}
+
+/* Remember the parity of a stripe, replacing the least recently used entry.
+ */
+static void raid4disk_pcache_put(struct raid4disk_state *rds, block_no stripe, block_t *parity){
+	struct raid4disk_pcache_entry *e = raid4disk_pcache_find(rds, stripe);
+	unsigned int i;
+
+	if (e == 0) {
+		e = &rds->pcache[0];
+		for (i = 1; i < RAID4_PCACHE_SIZE; i++) {
+			struct raid4disk_pcache_entry *c = &rds->pcache[i];
+			if (!c->valid || (e->valid && c->lru < e->lru)) {
+				e = c;
+			}
+		}
+		e->valid = true;
+		e->stripe = stripe;
+		e->lru = ++rds->clock;
+	}
+	memcpy(&e->block, parity, BLOCK_SIZE);
+}
+
+/* Forget the parity of a stripe, after a write that may have left the
+ * parity on disk different from the cached one.
+ */
+static void raid4disk_pcache_drop(struct raid4disk_state *rds, block_no stripe){
+	struct raid4disk_pcache_entry *e = raid4disk_pcache_find(rds, stripe);
+
+	if (e != 0) {
+		e->valid = false;
+	}
+}
+
+/* Read the parity of a stripe, from the cache if possible.
+ */
+static int raid4disk_read_parity(struct raid4disk_state *rds, block_no stripe, block_t *parity){
+	struct raid4disk_pcache_entry *e = raid4disk_pcache_find(rds, stripe);
+
+	if (e != 0) {
+		rds->phits++;
+		memcpy(parity, &e->block, BLOCK_SIZE);
+		return 0;
+	}
+	rds->pmisses++;
+	if (raid4disk_read_member(rds, raid4disk_pdisk(rds, stripe), stripe, parity) < 0) {
+		return -1;
+	}
+	raid4disk_pcache_put(rds, stripe, parity);
+	return 0;
+}
+
+/* Compute the contents of member 'missing' in the given stripe by XOR-ing
+ * the blocks of all other members.
+ */
+static int raid4disk_reconstruct(struct raid4disk_state *rds, unsigned int missing,
+										block_no stripe, block_t *block){
+	unsigned int i, n = 0;
+
+	rds->ndegraded++;
+	for (i = 0; i < rds->nbelow; i++) {
+		if (i == missing) {
+			continue;
+		}
+		if (raid4disk_read_member(rds, i, stripe, &rds->tmp[i]) < 0) {
+			fprintf(stderr, "!!raid4disk: cannot reconstruct block %u of member %u\n", stripe, missing);
+			return -1;
+		}
+		rds->srcs[n++] = &rds->tmp[i];
+	}
+	parity_xor(block, rds->srcs, n);
+	return 0;
+}
 
 static int raid4disk_getninodes(block_if bi){
 	return 1;
@@ -28,47 +200,268 @@ static int raid4disk_getsize(block_if bi, unsigned int ino){
 		fprintf(stderr, "!!raid4disk_getsize: ino != 0 not supported\n");
 		return -1;
 	}
-    // Your code goes here
-    return -1;
+
+	/* Every member contributes as many stripes as the smallest one has
+	 * blocks.
+	 */
+	struct raid4disk_state *rds = bi->state;
+	int min = -1;
+	for (unsigned int i = 0; i < rds->nbelow; i++) {
+		if (rds->failed[i]) {
+			continue;
+		}
+		int r = (*rds->below[i]->getsize)(rds->below[i], 0);
+		if (r >= 0 && (min < 0 || r < min)) {
+			min = r;
+		}
+	}
+	return min < 0 ? -1 : min * (int) rds->ndata;
 }
 
 static int raid4disk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "!!raid4disk_setsize: not supported\n");
+	return -1;
+}
+
+static int raid4disk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
 	if (ino != 0) {
-		fprintf(stderr, "!!raid4disk_setsize: ino != 0 not supported\n");
+		fprintf(stderr, "!!raid4disk_read: ino != 0 not supported\n");
 		return -1;
 	}
 
 	struct raid4disk_state *rds = bi->state;
-    for (unsigned int i = 0; i < rds->nbelow; i++) {
-        (void) (*rds->below[i]->setsize)(rds->below[i], 0, nblocks);
-    }
-    return 0;
+	block_no stripe;
+	unsigned int d = raid4disk_map(rds, offset, &stripe);
+	if (raid4disk_read_member(rds, d, stripe, block) == 0) {
+		return 0;
+	}
+	return raid4disk_reconstruct(rds, d, stripe, block);
 }
 
-static int raid4disk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+static int raid4disk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct raid4disk_state *rds = bi->state;
+
 	if (ino != 0) {
-		fprintf(stderr, "!!raid4disk_read: ino != 0 not supported\n");
+		fprintf(stderr, "!!raid4disk_write: ino != 0 not supported\n");
+		return -1;
+	}
+
+	block_no stripe;
+	unsigned int d = raid4disk_map(rds, offset, &stripe);
+	unsigned int p = raid4disk_pdisk(rds, stripe);
+	block_t old, parity;
+
+	if (raid4disk_nfailed(rds) > 1) {
+		fprintf(stderr, "!!raid4disk_write: too many failed members\n");
+		return -1;
+	}
+
+	/* Without a parity disk there is no parity to maintain.
+	 */
+	if (rds->failed[p]) {
+		return raid4disk_write_member(rds, d, stripe, block);
+	}
+
+	/* Read-modify-write: parity ^= old data ^ new data.
+	 */
+	if (raid4disk_read_member(rds, d, stripe, &old) == 0) {
+		if (raid4disk_read_parity(rds, stripe, &parity) == 0) {
+			rds->nrmw++;
+			rds->srcs[0] = &parity;
+			rds->srcs[1] = &old;
+			rds->srcs[2] = block;
+			parity_xor(&parity, rds->srcs, 3);
+
+			/* If the data write fails the parity still covers the new
+			 * data, so it can be reconstructed.  The cache only keeps
+			 * the new parity if both writes went through.
+			 */
+			int rd = raid4disk_write_member(rds, d, stripe, block);
+			int rp = raid4disk_write_member(rds, p, stripe, &parity);
+			if (rd < 0 || rp < 0) {
+				raid4disk_pcache_drop(rds, stripe);
+				return rd < 0 && rp < 0 ? -1 : 0;
+			}
+			raid4disk_pcache_put(rds, stripe, &parity);
+			return 0;
+		}
+		if (rds->failed[p]) {
+			return raid4disk_write_member(rds, d, stripe, block);
+		}
 		return -1;
 	}
 
-    // Your code goes here
-    return 0;
+	/* The data disk has failed: reconstruct-write the parity from the
+	 * new data and the other data blocks.
+	 */
+	rds->nrecon++;
+	unsigned int n = 0;
+	rds->srcs[n++] = block;
+	for (unsigned int i = 0; i < rds->nbelow; i++) {
+		if (i == d || i == p) {
+			continue;
+		}
+		if (raid4disk_read_member(rds, i, stripe, &rds->tmp[i]) < 0) {
+			return -1;
+		}
+		rds->srcs[n++] = &rds->tmp[i];
+	}
+	parity_xor(&parity, rds->srcs, n);
+	if (raid4disk_write_member(rds, p, stripe, &parity) < 0) {
+		raid4disk_pcache_drop(rds, stripe);
+		return -1;
+	}
+	raid4disk_pcache_put(rds, stripe, &parity);
+	return 0;
 }
 
-static int raid4disk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+static int raid4disk_readv(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
 	struct raid4disk_state *rds = bi->state;
+	block_no o, stripe;
+	unsigned int i;
 
 	if (ino != 0) {
-		fprintf(stderr, "!!raid4disk_write: ino != 0 not supported\n");
+		fprintf(stderr, "!!raid4disk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	/* In degraded mode, read block by block.
+	 */
+	if (raid4disk_nfailed(rds) > 0 || nblocks < rds->ndata) {
+		for (o = 0; o < nblocks; o++) {
+			if (raid4disk_read(bi, ino, offset + o, &blocks[o]) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	/* Read a contiguous range from each data disk concurrently, then
+	 * gather the blocks.
+	 */
+	block_no first = offset / rds->ndata;
+	block_no last = (offset + nblocks - 1) / rds->ndata;
+	block_no nstripes = last - first + 1;
+	block_t *buf = malloc(nstripes * rds->nbelow * BLOCK_SIZE);
+	for (i = 0; i < rds->nbelow; i++) {
+		struct block_store_xfer *x = &rds->xfers[i];
+		x->bs = rds->below[i];
+		x->ino = 0;
+		x->write = 0;
+		x->offset = first;
+		x->nblocks = 0;
+		x->buf = &buf[i * nstripes];
+	}
+	for (o = 0; o < nblocks; o++) {
+		rds->xfers[raid4disk_map(rds, offset + o, &stripe)].nblocks = nstripes;
+	}
+	int result = block_store_pool_run(rds->pool, rds->xfers, rds->nbelow);
+	if (result == 0) {
+		for (o = 0; o < nblocks; o++) {
+			i = raid4disk_map(rds, offset + o, &stripe);
+			memcpy(&blocks[o], &rds->xfers[i].buf[stripe - first], BLOCK_SIZE);
+		}
+	}
+	else {
+		/* Mark the failed members and fall back to degraded reads.
+		 */
+		for (i = 0; i < rds->nbelow; i++) {
+			if (rds->xfers[i].nblocks > 0 && rds->xfers[i].result < 0) {
+				fprintf(stderr, "!!raid4disk: member %u failed\n", i);
+				rds->failed[i] = true;
+			}
+		}
+		result = 0;
+		for (o = 0; o < nblocks && result == 0; o++) {
+			result = raid4disk_read(bi, ino, offset + o, &blocks[o]);
+		}
+	}
+	free(buf);
+	return result;
+}
+
+static int raid4disk_writev(block_if bi, unsigned int ino, block_no offset,
+									block_no nblocks, block_t *blocks){
+	struct raid4disk_state *rds = bi->state;
+	block_no o = 0;
+	unsigned int i;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!raid4disk_writev: ino != 0 not supported\n");
 		return -1;
 	}
 
-    // Your code goes here
-    return -1;
+	block_t *stripe_buf = malloc(rds->nbelow * BLOCK_SIZE);
+	while (o < nblocks) {
+		block_no stripe;
+		raid4disk_map(rds, offset + o, &stripe);
+
+		/* Partial stripes go through the single-block path.
+		 */
+		if ((offset + o) % rds->ndata != 0 || nblocks - o < rds->ndata ||
+										raid4disk_nfailed(rds) > 0) {
+			if (raid4disk_write(bi, ino, offset + o, &blocks[o]) < 0) {
+				free(stripe_buf);
+				return -1;
+			}
+			o++;
+			continue;
+		}
+
+		/* Full stripe: lay out the data in stripe order and compute the
+		 * parity without reading anything.
+		 */
+		unsigned int p = raid4disk_pdisk(rds, stripe);
+		block_t *parity = &stripe_buf[p];
+		for (i = 0; i < rds->ndata; i++) {
+			block_no s;
+			unsigned int m = raid4disk_map(rds, offset + o + i, &s);
+			memcpy(&stripe_buf[m], &blocks[o + i], BLOCK_SIZE);
+			rds->srcs[i] = &blocks[o + i];
+		}
+		parity_xor(parity, rds->srcs, rds->ndata);
+		for (i = 0; i < rds->nbelow; i++) {
+			struct block_store_xfer *x = &rds->xfers[i];
+			x->bs = rds->below[i];
+			x->ino = 0;
+			x->write = 1;
+			x->offset = stripe;
+			x->nblocks = 1;
+			x->buf = &stripe_buf[i];
+		}
+		rds->nfull++;
+		if (block_store_pool_run(rds->pool, rds->xfers, rds->nbelow) == 0) {
+			raid4disk_pcache_put(rds, stripe, parity);
+		}
+		else {
+			raid4disk_pcache_drop(rds, stripe);
+			for (i = 0; i < rds->nbelow; i++) {
+				if (rds->xfers[i].result < 0) {
+					fprintf(stderr, "!!raid4disk: member %u failed\n", i);
+					rds->failed[i] = true;
+				}
+			}
+			if (raid4disk_nfailed(rds) > 1) {
+				free(stripe_buf);
+				return -1;
+			}
+		}
+		o += rds->ndata;
+	}
+	free(stripe_buf);
+	return 0;
 }
 
 static void raid4disk_release(block_if bi){
-	free(bi->state);
+	struct raid4disk_state *rds = bi->state;
+
+	block_store_pool_release(rds->pool);
+	free(rds->xfers);
+	free(rds->srcs);
+	free(rds->tmp);
+	free(rds->failed);
+	free(rds);
 	free(bi);
 }
 
@@ -77,6 +470,9 @@ static int raid4disk_sync(block_if bi, unsigned int ino){
 	 */
 	struct raid4disk_state *rds = bi->state;
 	for (unsigned int i = 0; i < rds->nbelow; i++) {
+		if (rds->failed[i]) {
+			continue;
+		}
 		if ((*rds->below[i]->sync)(rds->below[i], ino) < 0) {
 			fprintf(stderr, "!!raid4disk_sync: sync error for block store %d below\n", i);
 			return -1;
@@ -85,17 +481,34 @@ static int raid4disk_sync(block_if bi, unsigned int ino){
 	return 0;
 }
 
-block_if raid4disk_init(block_if *below, unsigned int nbelow){
-    if (nbelow <= 1) {
-		fprintf(stderr, "!!raid4disk_init: need at least 2 disks\n");
-        return NULL;
-    }
+void raid4disk_dump_stats(block_if bi){
+	struct raid4disk_state *rds = bi->state;
+	const char *name = rds->rotate ? "RAID5" : "RAID4";
+
+	printf("!$%s: writes: %u read-modify-write, %u full-stripe, %u reconstruct\n",
+				name, rds->nrmw, rds->nfull, rds->nrecon);
+	printf("!$%s: %u degraded reads, parity cache %u hits %u misses, %u failed members\n",
+				name, rds->ndegraded, rds->phits, rds->pmisses, raid4disk_nfailed(rds));
+}
+
+block_if raid4disk_new(block_if *below, unsigned int nbelow, bool rotate){
+	if (nbelow <= 1) {
+		fprintf(stderr, "!!%s_init: need at least 2 disks\n", rotate ? "raid5disk" : "raid4disk");
+		return NULL;
+	}
 
 	/* Create the block store state structure.
 	 */
 	struct raid4disk_state *rds = new_alloc(struct raid4disk_state);
 	rds->below = below;
 	rds->nbelow = nbelow;
+	rds->ndata = nbelow - 1;
+	rds->rotate = rotate;
+	rds->failed = calloc(nbelow, sizeof(*rds->failed));
+	rds->tmp = malloc(nbelow * BLOCK_SIZE);
+	rds->srcs = calloc(nbelow + 3, sizeof(*rds->srcs));
+	rds->xfers = calloc(nbelow, sizeof(*rds->xfers));
+	rds->pool = block_store_pool_init(nbelow);
 
 	/* Return a block interface to this inode.
 	 */
@@ -108,5 +521,11 @@ block_if raid4disk_init(block_if *below, unsigned int nbelow){
 	bi->write = raid4disk_write;
 	bi->release = raid4disk_release;
 	bi->sync = raid4disk_sync;
+	bi->readv = raid4disk_readv;
+	bi->writev = raid4disk_writev;
 	return bi;
 }
+
+block_if raid4disk_init(block_if *below, unsigned int nbelow){
+	return raid4disk_new(below, nbelow, false);
+}
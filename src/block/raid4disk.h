@@ -0,0 +1,53 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* The state of a parity RAID block store, shared by raid4disk.c, which
+ * implements it, and raid5disk.c, which only adds the rebuild path.  The
+ * two differ in where the parity of a stripe is kept (see
+ * raid4disk_pdisk()):
+ *
+ *		block_if raid4disk_new(block_if *below, unsigned int nbelow, bool rotate)
+ *			Like raid4disk_init(), but if 'rotate' is set the parity
+ *			rotates over the members as in RAID5.
+ */
+
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define RAID4_PCACHE_SIZE	32		// #cached parity blocks
+
+struct raid4disk_pcache_entry {
+	bool valid;
+	block_no stripe;
+	unsigned long lru;		// time of last use
+	block_t block;
+};
+
+struct raid4disk_state {
+	block_if *below;		// block stores below
+	unsigned int nbelow;	// #block stores
+	unsigned int ndata;		// #data disks (nbelow - 1)
+	bool rotate;			// rotating (RAID5) or fixed (RAID4) parity
+	bool *failed;			// members that returned an error
+
+	struct raid4disk_pcache_entry pcache[RAID4_PCACHE_SIZE];
+	unsigned long clock;	// for LRU replacement in the parity cache
+
+	block_t *tmp;			// one block per member
+	block_t **srcs;			// sources for parity_xor()
+
+	struct block_store_xfer *xfers;	// one per member
+	struct block_store_pool *pool;	// one worker per member
+
+	/* Statistics.
+	 */
+	unsigned int nrmw;			// read-modify-write writes
+	unsigned int nfull;			// full-stripe writes
+	unsigned int nrecon;		// reconstruct-writes
+	unsigned int ndegraded;		// reads of failed members
+	unsigned int phits, pmisses;	// parity cache
+};
+
+block_if raid4disk_new(block_if *below, unsigned int nbelow, bool rotate);
@@ -0,0 +1,104 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module implements RAID5.
+ *
+ *		block_if raid5disk_init(block_if *below, unsigned int nbelow){
+ *			'below' is an array of underlying block stores, all of which
+ *			are assumed to be of the same size.
+ *
+ *		void raid5disk_dump_stats(block_if bi)
+ *			Print how many writes took each of the write paths below,
+ *			the number of degraded reads, and the parity cache hit rate.
+ *
+ *		int raid5disk_rebuild(block_if bi, unsigned int i, block_if replacement)
+ *			Replace member i (below[i]) by 'replacement', and write on it
+ *			the contents of the old member, computed from the others.
+ *
+ * Like RAID4, but the parity rotates over the members so that no single
+ * member has to absorb the parity update of every write.  The layout is
+ * left-symmetric: stripe s (block s of each member) keeps its parity on
+ * member p = (nbelow - 1) - s % nbelow, and its data blocks on members
+ * p + 1, p + 2, ... (modulo nbelow).  Consecutive blocks of the virtual
+ * disk thus go to consecutive members, even across stripes.
+ *
+ * The rest (the write paths, the parity cache and degraded mode) is the
+ * code of raid4disk.c, which this module shares: see raid4disk.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <egos/block_store.h>
+#include "raid4disk.h"
+
+#define RAID5_REBUILD_BATCH		64		// stripes per rebuild step
+
+int raid5disk_rebuild(block_if bi, unsigned int i, block_if replacement){
+	struct raid4disk_state *rds = bi->state;
+	unsigned int j;
+	block_no s, n;
+
+	if (i >= rds->nbelow) {
+		fprintf(stderr, "!!raid5disk_rebuild: no member %u\n", i);
+		return -1;
+	}
+	for (j = 0; j < rds->nbelow; j++) {
+		if (j != i && rds->failed[j]) {
+			fprintf(stderr, "!!raid5disk_rebuild: member %u has failed too\n", j);
+			return -1;
+		}
+	}
+
+	/* Every block of the new member is the XOR of the corresponding
+	 * blocks of the others, whether it holds data or parity.
+	 */
+	int size = (*rds->below[(i + 1) % rds->nbelow]->getsize)(rds->below[(i + 1) % rds->nbelow], 0);
+	if (size < 0) {
+		return -1;
+	}
+	rds->below[i] = replacement;
+	rds->failed[i] = true;
+	block_t *acc = malloc(RAID5_REBUILD_BATCH * BLOCK_SIZE);
+	block_t *tmp = malloc(rds->nbelow * RAID5_REBUILD_BATCH * BLOCK_SIZE);
+	int result = 0;
+	for (s = 0; s < (block_no) size && result == 0; s += n) {
+		n = size - s < RAID5_REBUILD_BATCH ? size - s : RAID5_REBUILD_BATCH;
+		for (j = 0; j < rds->nbelow && result == 0; j++) {
+			if (j != i && block_store_readv(rds->below[j], 0, s, n, &tmp[j * RAID5_REBUILD_BATCH]) < 0) {
+				fprintf(stderr, "!!raid5disk_rebuild: member %u failed\n", j);
+				rds->failed[j] = true;
+				result = -1;
+			}
+		}
+		for (block_no k = 0; k < n && result == 0; k++) {
+			unsigned int nsrc = 0;
+			for (j = 0; j < rds->nbelow; j++) {
+				if (j != i) {
+					rds->srcs[nsrc++] = &tmp[j * RAID5_REBUILD_BATCH + k];
+				}
+			}
+			parity_xor(&acc[k], rds->srcs, nsrc);
+		}
+		if (result == 0 && block_store_writev(replacement, 0, s, n, acc) < 0) {
+			fprintf(stderr, "!!raid5disk_rebuild: cannot write the replacement\n");
+			result = -1;
+		}
+	}
+	free(acc);
+	free(tmp);
+	if (result == 0) {
+		rds->failed[i] = false;
+		printf("!$RAID5: member %u rebuilt (%d blocks)\n", i, size);
+	}
+	return result;
+}
+
+void raid5disk_dump_stats(block_if bi){
+	raid4disk_dump_stats(bi);
+}
+
+block_if raid5disk_init(block_if *below, unsigned int nbelow){
+	return raid4disk_new(below, nbelow, true);
+}
@@ -0,0 +1,298 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module forwards its method calls to an underlying
+ * block store, and when it sees an inode being read sequentially it reads
+ * ahead, so that the blocks are in the cache below by the time they are
+ * asked for:
+ *
+ *		block_if readaheaddisk_init(block_if below, block_no maxwindow)
+ *			'below' is the underlying block store, typically a file
+ *			system on top of a cache.  'maxwindow' is the largest number
+ *			of blocks to read ahead.  It should be at most a quarter of
+ *			the size of the cache, or blocks read ahead push each other
+ *			(and the file system metadata) out of the cache.
+ *
+ *		void readaheaddisk_dump_stats(block_if bi)
+ *			Print how many blocks were read ahead, and how many of
+ *			those were used (hits) or not (wasted).
+ *
+ * It keeps track of up to RA_NSTREAMS streams, one per inode, replacing
+ * the least recently used one.  A stream is the range of blocks read
+ * ahead for an inode, and the block expected to be read next.  When a
+ * read is for the expected block and reaches the blocks that were read
+ * ahead last (or the end of the stream), a window of blocks past the end
+ * of the stream is read with a single readv, and the window is doubled,
+ * up to maxwindow.  Reading ahead thus stays one step ahead of the reader
+ * without issuing a request on every read.  When a read is not
+ * for the expected block the stream is broken: the blocks that were read
+ * ahead and not used are counted as wasted, and if there were any the
+ * window is halved.  A readv from above counts as a read of each of its
+ * blocks in turn.
+ *
+ * Once the window of a stream has grown to maxwindow the inode is hinted
+ * below as streaming (see block_store.h), so that a cache can keep the
+ * scan from pushing everything else out, and when the stream is broken
+ * it is hinted as normal again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define RA_NSTREAMS		8
+#define RA_MINWINDOW	4
+
+struct readahead_stream {
+	unsigned int ino;
+	int valid;
+	block_no next;				// block expected to be read next
+	block_no start, end;		// blocks read ahead
+	block_no mark;				// first block of the last read ahead
+	block_no window;			// #blocks to read ahead
+	block_no streaming;			// #blocks hinted below as streaming, or 0
+	unsigned long last;			// time of last use, for replacement
+};
+
+struct readaheaddisk_state {
+	block_if below;				// block store below
+	block_no maxwindow;			// maximum window
+	block_t *buf;				// maxwindow blocks to read ahead into
+	unsigned long clock;		// counts reads
+	struct readahead_stream streams[RA_NSTREAMS];
+
+	/* Statistics.
+	 */
+	unsigned long nreads;			// #reads
+	unsigned long nprefetches;		// #readvs issued to read ahead
+	unsigned long nprefetched;		// #blocks read ahead
+	unsigned long nhits;			// #reads of blocks read ahead
+	unsigned long nwasted;			// #blocks read ahead but not used
+};
+
+/* Stop a stream, and count the blocks it read ahead that were not used.
+ */
+static void readahead_break(struct readaheaddisk_state *rs, struct readahead_stream *st){
+	block_no from = st->next > st->start ? st->next : st->start;
+
+	if (st->streaming != 0) {
+		(void) block_store_hint(rs->below, st->ino, 0, st->streaming, BLOCK_HINT_NORMAL);
+		st->streaming = 0;
+	}
+
+	if (st->end > from) {
+		rs->nwasted += st->end - from;
+		st->window /= 2;
+		if (st->window < RA_MINWINDOW) {
+			st->window = RA_MINWINDOW;
+		}
+	}
+	st->start = st->end = st->mark = 0;
+}
+
+static struct readahead_stream *readahead_stream(struct readaheaddisk_state *rs, unsigned int ino){
+	struct readahead_stream *st, *lru = &rs->streams[0];
+
+	for (st = rs->streams; st < &rs->streams[RA_NSTREAMS]; st++) {
+		if (st->valid && st->ino == ino) {
+			return st;
+		}
+		if (!st->valid || (lru->valid && st->last < lru->last)) {
+			lru = st;
+		}
+	}
+	if (lru->valid) {
+		readahead_break(rs, lru);
+	}
+	memset(lru, 0, sizeof(*lru));
+	lru->valid = 1;
+	lru->ino = ino;
+	lru->next = (block_no) -1;
+	lru->window = RA_MINWINDOW;
+	return lru;
+}
+
+/* Read ahead a window of blocks past offset, or past the blocks that were
+ * already read ahead.
+ */
+static void readahead_fill(struct readaheaddisk_state *rs, struct readahead_stream *st, block_no offset){
+	block_no from = st->end > offset + 1 ? st->end : offset + 1;
+	block_no to = from + st->window;
+	int size = (*rs->below->getsize)(rs->below, st->ino);
+
+	if (size >= 0 && to > (block_no) size) {
+		to = size;
+	}
+	if (from >= to) {
+		return;
+	}
+	if (block_store_readv(rs->below, st->ino, from, to - from, rs->buf) < 0) {
+		return;
+	}
+	if (st->end <= st->start) {
+		st->start = from;
+	}
+	st->mark = from;
+	st->end = to;
+	rs->nprefetches++;
+	rs->nprefetched += to - from;
+
+	if (st->window >= rs->maxwindow && st->streaming == 0) {
+		st->streaming = size >= 0 ? (block_no) size : to;
+		(void) block_store_hint(rs->below, st->ino, 0, st->streaming, BLOCK_HINT_STREAM);
+	}
+	st->window *= 2;
+	if (st->window > rs->maxwindow) {
+		st->window = rs->maxwindow;
+	}
+}
+
+static int readaheaddisk_getninodes(block_if bi){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return (*rs->below->getninodes)(rs->below);
+}
+
+static int readaheaddisk_getsize(block_if bi, unsigned int ino){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return (*rs->below->getsize)(rs->below, ino);
+}
+
+static int readaheaddisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	struct readaheaddisk_state *rs = bi->state;
+	struct readahead_stream *st;
+
+	for (st = rs->streams; st < &rs->streams[RA_NSTREAMS]; st++) {
+		if (st->valid && st->ino == ino) {
+			readahead_break(rs, st);
+			st->next = (block_no) -1;
+		}
+	}
+	return (*rs->below->setsize)(rs->below, ino, nblocks);
+}
+
+/* Update the stream after blocks offset .. offset + nblocks - 1 were read,
+ * and read ahead if they reach the blocks that were read ahead last.
+ */
+static void readahead_access(struct readaheaddisk_state *rs, struct readahead_stream *st,
+										block_no offset, block_no nblocks){
+	block_no last = offset + nblocks - 1, b;
+
+	if (offset == st->next) {
+		for (b = offset; b <= last; b++) {
+			if (b >= st->start && b < st->end) {
+				rs->nhits++;
+			}
+		}
+		if (last + 1 >= st->end || last >= st->mark) {
+			readahead_fill(rs, st, last);
+		}
+	}
+	else {
+		readahead_break(rs, st);
+	}
+	st->next = last + 1;
+}
+
+static int readaheaddisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct readaheaddisk_state *rs = bi->state;
+	struct readahead_stream *st = readahead_stream(rs, ino);
+
+	rs->nreads++;
+	st->last = ++rs->clock;
+	int r = (*rs->below->read)(rs->below, ino, offset, block);
+	if (r < 0) {
+		return r;
+	}
+	readahead_access(rs, st, offset, 1);
+	return r;
+}
+
+static int readaheaddisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct readaheaddisk_state *rs = bi->state;
+
+	if (nblocks == 0) {
+		return 0;
+	}
+	struct readahead_stream *st = readahead_stream(rs, ino);
+
+	rs->nreads += nblocks;
+	st->last = ++rs->clock;
+	int r = block_store_readv(rs->below, ino, offset, nblocks, blocks);
+	if (r < 0) {
+		return r;
+	}
+	readahead_access(rs, st, offset, nblocks);
+	return r;
+}
+
+static int readaheaddisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return (*rs->below->write)(rs->below, ino, offset, block);
+}
+
+static int readaheaddisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return block_store_writev(rs->below, ino, offset, nblocks, blocks);
+}
+
+static int readaheaddisk_hint(block_if bi, unsigned int ino, block_no offset, block_no nblocks, enum block_hint hint){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return block_store_hint(rs->below, ino, offset, nblocks, hint);
+}
+
+static int readaheaddisk_sync(block_if bi, unsigned int ino){
+	struct readaheaddisk_state *rs = bi->state;
+
+	return (*rs->below->sync)(rs->below, ino);
+}
+
+static void readaheaddisk_release(block_if bi){
+	struct readaheaddisk_state *rs = bi->state;
+
+	free(rs->buf);
+	free(rs);
+	free(bi);
+}
+
+void readaheaddisk_dump_stats(block_if bi){
+	struct readaheaddisk_state *rs = bi->state;
+
+	printf("!$READAHEAD: %lu reads, %lu read ahead in %lu requests\n",
+					rs->nreads, rs->nprefetched, rs->nprefetches);
+	printf("!$READAHEAD: %lu hits (%.1f%%), %lu wasted (%.1f%%)\n",
+					rs->nhits, rs->nprefetched == 0 ? 0 : 100.0 * rs->nhits / rs->nprefetched,
+					rs->nwasted, rs->nprefetched == 0 ? 0 : 100.0 * rs->nwasted / rs->nprefetched);
+}
+
+block_if readaheaddisk_init(block_if below, block_no maxwindow){
+	if (maxwindow < RA_MINWINDOW) {
+		maxwindow = RA_MINWINDOW;
+	}
+
+	struct readaheaddisk_state *rs = new_alloc(struct readaheaddisk_state);
+	rs->below = below;
+	rs->maxwindow = maxwindow;
+	rs->buf = malloc(maxwindow * BLOCK_SIZE);
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = rs;
+	bi->getninodes = readaheaddisk_getninodes;
+	bi->getsize = readaheaddisk_getsize;
+	bi->setsize = readaheaddisk_setsize;
+	bi->read = readaheaddisk_read;
+	bi->write = readaheaddisk_write;
+	bi->release = readaheaddisk_release;
+	bi->sync = readaheaddisk_sync;
+	bi->readv = readaheaddisk_readv;
+	bi->writev = readaheaddisk_writev;
+	bi->hint = readaheaddisk_hint;
+	return bi;
+}
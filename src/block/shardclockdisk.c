@@ -0,0 +1,453 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module is a write-back CLOCK cache like clockdisk, but
+ * it may be called by several threads at once.  The interface is as
+ * follows:
+ *
+ *		block_if shardclockdisk_init(block_if below,
+ *						block_t *blocks, block_no nblocks, unsigned int nshards)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory with 'nblocks' blocks for caching, which is
+ *			divided among 'nshards' shards.
+ *
+ *		void shardclockdisk_dump_stats(block_if bi)
+ *			Prints the cache statistics.
+ *
+ * A block is cached in the shard given by a hash of its inode and offset.
+ * Each shard has its own slots, clock hand and lock, so threads that use
+ * different shards do not wait for each other.  Read hits take no lock at
+ * all: each slot has a sequence number that is odd while the slot is being
+ * changed, and a reader copies the block and then checks that the
+ * sequence number did not change, or else retries with the shard locked.
+ * Calls to the block store below are made one at a time, under a separate
+ * lock, as block stores are not generally safe to call concurrently.
+ * Inside EGOS there are no threads and the locks are left out.
+ */
+
+#ifndef GRASS
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <egos/block_store.h>
+
+#define SLOT_EMPTY		((uint64_t) -1)		// tag of an empty slot
+
+enum shard_status { SHARD_OLD, SHARD_NEW };
+
+struct shard_slot {
+	uint64_t tag;			// inode << 32 | offset, or SLOT_EMPTY
+	unsigned int seq;		// odd while the slot is being changed
+	unsigned int status;	// SHARD_OLD or SHARD_NEW
+	unsigned int dirty;
+};
+
+/* A shard.  The padding keeps the locks and counters of different shards
+ * in different cache lines.
+ */
+struct shard {
+#ifndef GRASS
+	pthread_mutex_t lock;
+#endif
+	block_t *blocks;			// the shard's blocks
+	struct shard_slot *slots;
+	block_no nslots;
+	block_no clock_hand;
+
+	/* Statistics.  Read hits are counted without the lock.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+	char pad[64];
+};
+
+struct shardclockdisk_state {
+	block_if below;				// block store below
+	struct shard *shards;
+	unsigned int nshards;
+#ifndef GRASS
+	pthread_mutex_t below_lock;	// serializes calls below
+#endif
+};
+
+static void shard_lock(struct shard *sh){
+#ifndef GRASS
+	pthread_mutex_lock(&sh->lock);
+#endif
+}
+
+static void shard_unlock(struct shard *sh){
+#ifndef GRASS
+	pthread_mutex_unlock(&sh->lock);
+#endif
+}
+
+static void below_lock(struct shardclockdisk_state *ss){
+#ifndef GRASS
+	pthread_mutex_lock(&ss->below_lock);
+#endif
+}
+
+static void below_unlock(struct shardclockdisk_state *ss){
+#ifndef GRASS
+	pthread_mutex_unlock(&ss->below_lock);
+#endif
+}
+
+static uint64_t shard_tag(unsigned int ino, block_no offset){
+	return (uint64_t) ino << 32 | offset;
+}
+
+static struct shard *shard_of(struct shardclockdisk_state *ss, uint64_t tag){
+	uint64_t h = tag * 0x9E3779B97F4A7C15ull;
+
+	return &ss->shards[(h >> 32) % ss->nshards];
+}
+
+static int shard_below_read(struct shardclockdisk_state *ss, unsigned int ino, block_no offset, block_t *block){
+	below_lock(ss);
+	int r = (*ss->below->read)(ss->below, ino, offset, block);
+	below_unlock(ss);
+	return r;
+}
+
+static int shard_below_write(struct shardclockdisk_state *ss, unsigned int ino, block_no offset, block_t *block){
+	below_lock(ss);
+	int r = (*ss->below->write)(ss->below, ino, offset, block);
+	below_unlock(ss);
+	return r;
+}
+
+/* Start and finish changing a slot, with the shard locked.
+ */
+static void slot_begin(struct shard_slot *s){
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+}
+
+static void slot_end(struct shard_slot *s){
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy a block into and out of a slot.  Readers that take no lock may
+ * copy the slot while it is being changed, so the words are stored with
+ * release and loaded with acquire semantics: a reader that sees any of
+ * the new words also sees the odd sequence number that slot_begin()
+ * stored before them.  (On x86 these are ordinary moves.)
+ */
+static void slot_store(block_t *dst, block_t *src){
+	uint64_t *d = (uint64_t *) dst, *s = (uint64_t *) src;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+		__atomic_store_n(&d[i], s[i], __ATOMIC_RELEASE);
+	}
+}
+
+static void slot_load(block_t *dst, block_t *src){
+	uint64_t *d = (uint64_t *) dst, *s = (uint64_t *) src;
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+		d[i] = __atomic_load_n(&s[i], __ATOMIC_ACQUIRE);
+	}
+}
+
+/* Try to read a block from the cache without locking.  Returns 1 on a hit,
+ * and 0 if it is not cached or the slot changed while it was being read.
+ */
+static int shard_read_nolock(struct shard *sh, uint64_t tag, block_t *block){
+	block_no i;
+
+	for (i = 0; i < sh->nslots; i++) {
+		struct shard_slot *s = &sh->slots[i];
+		if (__atomic_load_n(&s->tag, __ATOMIC_RELAXED) != tag) {
+			continue;
+		}
+		unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || __atomic_load_n(&s->tag, __ATOMIC_RELAXED) != tag) {
+			return 0;
+		}
+		slot_load(block, &sh->blocks[i]);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) {
+			return 0;
+		}
+		__atomic_store_n(&s->status, SHARD_NEW, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sh->read_hit, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+/* Find a cached block, with the shard locked.  Returns the slot or
+ * sh->nslots.
+ */
+static block_no shard_find(struct shard *sh, uint64_t tag){
+	block_no i;
+
+	for (i = 0; i < sh->nslots; i++) {
+		if (sh->slots[i].tag == tag) {
+			break;
+		}
+	}
+	return i;
+}
+
+/* Put a block in the shard, with the shard locked, replacing a slot that
+ * has not been used since the clock hand last passed it.  A dirty block
+ * that is replaced is written back first.
+ */
+static int shard_insert(struct shardclockdisk_state *ss, struct shard *sh,
+								uint64_t tag, block_t *block, unsigned int dirty){
+	for (;;) {
+		block_no i = sh->clock_hand;
+		struct shard_slot *s = &sh->slots[i];
+		sh->clock_hand = (i + 1) % sh->nslots;
+
+		if (s->tag != SLOT_EMPTY && __atomic_load_n(&s->status, __ATOMIC_RELAXED) == SHARD_NEW) {
+			__atomic_store_n(&s->status, SHARD_OLD, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (s->tag != SLOT_EMPTY && s->dirty) {
+			if (shard_below_write(ss, s->tag >> 32, (block_no) s->tag, &sh->blocks[i]) < 0) {
+				return -1;
+			}
+			s->dirty = 0;
+		}
+
+		slot_begin(s);
+		__atomic_store_n(&s->tag, tag, __ATOMIC_RELAXED);
+		slot_store(&sh->blocks[i], block);
+		__atomic_store_n(&s->status, SHARD_NEW, __ATOMIC_RELAXED);
+		s->dirty = dirty;
+		slot_end(s);
+		return 0;
+	}
+}
+
+static int shardclockdisk_getninodes(block_if bi){
+	struct shardclockdisk_state *ss = bi->state;
+
+	below_lock(ss);
+	int r = (*ss->below->getninodes)(ss->below);
+	below_unlock(ss);
+	return r;
+}
+
+static int shardclockdisk_getsize(block_if bi, unsigned int ino){
+	struct shardclockdisk_state *ss = bi->state;
+
+	below_lock(ss);
+	int r = (*ss->below->getsize)(ss->below, ino);
+	below_unlock(ss);
+	return r;
+}
+
+static int shardclockdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	struct shardclockdisk_state *ss = bi->state;
+	unsigned int n;
+	block_no i;
+
+	// Drop the cached blocks that are about to be deleted
+	for (n = 0; n < ss->nshards; n++) {
+		struct shard *sh = &ss->shards[n];
+		shard_lock(sh);
+		for (i = 0; i < sh->nslots; i++) {
+			struct shard_slot *s = &sh->slots[i];
+			if (s->tag != SLOT_EMPTY && (s->tag >> 32) == ino && (block_no) s->tag >= nblocks) {
+				slot_begin(s);
+				__atomic_store_n(&s->tag, SLOT_EMPTY, __ATOMIC_RELAXED);
+				s->dirty = 0;
+				slot_end(s);
+			}
+		}
+		shard_unlock(sh);
+	}
+
+	below_lock(ss);
+	int r = (*ss->below->setsize)(ss->below, ino, nblocks);
+	below_unlock(ss);
+	return r;
+}
+
+static int shardclockdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct shardclockdisk_state *ss = bi->state;
+	uint64_t tag = shard_tag(ino, offset);
+	struct shard *sh = shard_of(ss, tag);
+
+	if (shard_read_nolock(sh, tag, block)) {
+		return 0;
+	}
+
+	shard_lock(sh);
+	block_no i = shard_find(sh, tag);
+	if (i < sh->nslots) {
+		// Cache hit, but the slot was being changed
+		memcpy(block, &sh->blocks[i], sizeof(block_t));
+		__atomic_store_n(&sh->slots[i].status, SHARD_NEW, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sh->read_hit, 1, __ATOMIC_RELAXED);
+		shard_unlock(sh);
+		return 0;
+	}
+
+	// Cache miss
+	sh->read_miss++;
+	int r = shard_below_read(ss, ino, offset, block);
+	if (r >= 0) {
+		(void) shard_insert(ss, sh, tag, block, 0);
+	}
+	shard_unlock(sh);
+	return r < 0 ? r : 0;
+}
+
+static int shardclockdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct shardclockdisk_state *ss = bi->state;
+	uint64_t tag = shard_tag(ino, offset);
+	struct shard *sh = shard_of(ss, tag);
+	int r = 0;
+
+	shard_lock(sh);
+	block_no i = shard_find(sh, tag);
+	if (i < sh->nslots) {
+		// Cache hit
+		struct shard_slot *s = &sh->slots[i];
+		slot_begin(s);
+		slot_store(&sh->blocks[i], block);
+		__atomic_store_n(&s->status, SHARD_NEW, __ATOMIC_RELAXED);
+		s->dirty = 1;
+		slot_end(s);
+		sh->write_hit++;
+	}
+	else {
+		// Cache miss
+		sh->write_miss++;
+		if (shard_insert(ss, sh, tag, block, 1) < 0) {
+			r = shard_below_write(ss, ino, offset, block);
+		}
+	}
+	shard_unlock(sh);
+	return r;
+}
+
+static int shardclockdisk_sync(block_if bi, unsigned int ino){
+	struct shardclockdisk_state *ss = bi->state;
+	int result = 0;
+	unsigned int n;
+	block_no i;
+
+	for (n = 0; n < ss->nshards; n++) {
+		struct shard *sh = &ss->shards[n];
+		shard_lock(sh);
+		for (i = 0; i < sh->nslots; i++) {
+			struct shard_slot *s = &sh->slots[i];
+			if (s->tag != SLOT_EMPTY && s->dirty &&
+						((s->tag >> 32) == ino || ino == (unsigned int) -1)) {
+				if (shard_below_write(ss, s->tag >> 32, (block_no) s->tag, &sh->blocks[i]) < 0) {
+					result = -1;
+					continue;
+				}
+				s->dirty = 0;
+			}
+		}
+		shard_unlock(sh);
+	}
+
+	below_lock(ss);
+	if ((*ss->below->sync)(ss->below, ino) < 0) {
+		result = -1;
+	}
+	below_unlock(ss);
+	return result;
+}
+
+static void shardclockdisk_release(block_if bi){
+	struct shardclockdisk_state *ss = bi->state;
+	unsigned int n;
+
+	for (n = 0; n < ss->nshards; n++) {
+		free(ss->shards[n].slots);
+#ifndef GRASS
+		pthread_mutex_destroy(&ss->shards[n].lock);
+#endif
+	}
+#ifndef GRASS
+	pthread_mutex_destroy(&ss->below_lock);
+#endif
+	free(ss->shards);
+	free(ss);
+	free(bi);
+}
+
+void shardclockdisk_dump_stats(block_if bi){
+	struct shardclockdisk_state *ss = bi->state;
+	unsigned int n, read_hit = 0, read_miss = 0, write_hit = 0, write_miss = 0;
+
+	for (n = 0; n < ss->nshards; n++) {
+		struct shard *sh = &ss->shards[n];
+		read_hit += __atomic_load_n(&sh->read_hit, __ATOMIC_RELAXED);
+		read_miss += sh->read_miss;
+		write_hit += sh->write_hit;
+		write_miss += sh->write_miss;
+	}
+	printf("!$CLOCK: #shards:       %u\n", ss->nshards);
+	printf("!$CLOCK: #read hits:    %u\n", read_hit);
+	printf("!$CLOCK: #read misses:  %u\n", read_miss);
+	printf("!$CLOCK: #write hits:   %u\n", write_hit);
+	printf("!$CLOCK: #write misses: %u\n", write_miss);
+}
+
+block_if shardclockdisk_init(block_if below, block_t *blocks, block_no nblocks, unsigned int nshards){
+	unsigned int n;
+	block_no i;
+
+	if (nshards == 0) {
+		nshards = 1;
+	}
+	if (nshards > nblocks) {
+		nshards = nblocks;
+	}
+	if (nshards == 0) {
+		fprintf(stderr, "!!shardclockdisk_init: no blocks\n");
+		return 0;
+	}
+
+	struct shardclockdisk_state *ss = new_alloc(struct shardclockdisk_state);
+	ss->below = below;
+	ss->nshards = nshards;
+	ss->shards = calloc(nshards, sizeof(*ss->shards));
+#ifndef GRASS
+	pthread_mutex_init(&ss->below_lock, 0);
+#endif
+
+	/* Divide the blocks among the shards.
+	 */
+	block_no first = 0;
+	for (n = 0; n < nshards; n++) {
+		struct shard *sh = &ss->shards[n];
+		sh->nslots = nblocks / nshards + (n < nblocks % nshards);
+		sh->blocks = &blocks[first];
+		sh->slots = calloc(sh->nslots, sizeof(*sh->slots));
+		for (i = 0; i < sh->nslots; i++) {
+			sh->slots[i].tag = SLOT_EMPTY;
+		}
+#ifndef GRASS
+		pthread_mutex_init(&sh->lock, 0);
+#endif
+		first += sh->nslots;
+	}
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ss;
+	bi->getninodes = shardclockdisk_getninodes;
+	bi->getsize = shardclockdisk_getsize;
+	bi->setsize = shardclockdisk_setsize;
+	bi->read = shardclockdisk_read;
+	bi->write = shardclockdisk_write;
+	bi->release = shardclockdisk_release;
+	bi->sync = shardclockdisk_sync;
+	return bi;
+}
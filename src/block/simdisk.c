@@ -0,0 +1,395 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module forwards its method calls to an underlying
+ * block store, and charges each read and write the time a real device
+ * would have taken, so that caches and request merging can be evaluated
+ * on top of a ramdisk or filedisk:
+ *
+ *		block_if simdisk_init(block_if below, enum simdisk_profile profile,
+ *										int sleep)
+ *			'below' is the underlying block store.  'profile' is SIM_HDD
+ *			or SIM_SSD.  If 'sleep' is set, each request is delayed
+ *			until the simulated device would have completed it.
+ *
+ *		unsigned long simdisk_time(block_if bi)
+ *			Returns the total simulated time in microseconds that
+ *			requests have spent in the device, including queueing.
+ *
+ *		void simdisk_dump_stats(block_if bi)
+ *			Print where the simulated time went.
+ *
+ * The disk model (SIM_HDD) keeps track of the track and the rotational
+ * position of the head.  A request first seeks to the track of its first
+ * block, which takes SIM_SEEK_MIN plus a part of SIM_SEEK_MAX that grows
+ * with the square root of the distance, then waits for the block to come
+ * around, and then transfers its blocks at one track per rotation.  A
+ * write for the block after the previous one costs only its transfer, as
+ * long as it arrives within SIM_OVERHEAD_HDD of the end of the previous
+ * request; later, the block has passed and the write waits for it to
+ * come around again.  Like real disks it has a track buffer: after a read
+ * the drive reads the rest of the track into the buffer, and later reads
+ * from that track are served from it at SIM_BUS_HDD per block.  A read
+ * that continues on the next track only pays for the transfer.
+ *
+ * The SSD model (SIM_SSD) has SIM_CHANNELS channels.  Block b is on
+ * channel b % SIM_CHANNELS, and each channel reads or programs one block
+ * at a time.  The blocks of a readv or writev on different channels are
+ * thus transferred in parallel.
+ *
+ * Simulated time runs along with real time, plus all the simulated time
+ * that requests did not actually wait for.  A request that arrives while
+ * the device (or, for SIM_SSD, the channel) is still busy with an earlier
+ * one is queued behind it, so concurrent callers see queueing delays.
+ * The position is taken to be the offset, so the model is meant for a
+ * below store with a single inode.  Inside EGOS the sleep is a busy wait.
+ */
+
+#ifndef GRASS
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define SIM_OVERHEAD_HDD	100			// controller overhead per request (usec)
+#define SIM_SEEK_MIN		800			// track-to-track seek (usec)
+#define SIM_SEEK_MAX		15000		// full-stroke seek (usec)
+#define SIM_ROTATION		8333		// one rotation at 7200 rpm (usec)
+#define SIM_TRACK			512			// blocks per track
+#define SIM_BUS_HDD			10			// transfer time from the track buffer per block (usec)
+
+#define SIM_OVERHEAD_SSD	20			// controller overhead per request (usec)
+#define SIM_CHANNELS		8
+#define SIM_READ			50			// page read latency (usec)
+#define SIM_PROGRAM			200			// page program latency (usec)
+#define SIM_BUS				8			// channel transfer time per block (usec)
+
+struct simdisk_state {
+	block_if below;				// block store below
+	enum simdisk_profile profile;
+	int sleep;					// delay requests until they complete
+	unsigned long start;		// real time at init
+	unsigned long skew;			// simulated time requests did not wait for
+	block_no ntracks;			// #tracks (SIM_HDD)
+	block_no head;				// block after the last one transferred (SIM_HDD)
+	block_no buffered;			// track in the track buffer + 1, or 0 (SIM_HDD)
+	unsigned long busy;			// device busy until (SIM_HDD)
+	unsigned long channels[SIM_CHANNELS];	// channel busy until (SIM_SSD)
+#ifndef GRASS
+	pthread_mutex_t lock;		// protects the model and the statistics
+#endif
+
+	/* Statistics.
+	 */
+	unsigned long nreads, nwrites;		// #requests
+	unsigned long nblocks;				// #blocks transferred
+	unsigned long nseeks;				// #requests that changed tracks
+	unsigned long nbuffered;			// #reads from the track buffer (SIM_HDD)
+	unsigned long total;				// time in the device, including queueing
+	unsigned long queued;				// time waiting for the device or a channel
+	unsigned long seek, rotation, transfer;		// time spent in each (SIM_HDD)
+};
+
+static unsigned long isqrt(unsigned long x){
+	unsigned long r = 0, bit = 1UL << 30;
+
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+/* Simulate a request for nblocks blocks starting at offset that arrives
+ * at simulated time 'now', and return when it completes.
+ */
+static unsigned long simdisk_hdd(struct simdisk_state *ss, unsigned long now,
+						block_no offset, block_no nblocks, int write){
+	unsigned long t = now > ss->busy ? now : ss->busy;
+	block_no track = offset / SIM_TRACK, cur = ss->head / SIM_TRACK;
+
+	ss->queued += t - now;
+
+	/* A write for the block under the head that arrives within
+	 * SIM_OVERHEAD_HDD of the end of the previous request continues it:
+	 * the drive overlaps the overhead with the previous transfer, so the
+	 * block has not passed yet and only the transfer is paid for.
+	 */
+	if (write && offset == ss->head && now <= ss->busy + SIM_OVERHEAD_HDD) {
+		unsigned long transfer = (unsigned long) nblocks * SIM_ROTATION / SIM_TRACK;
+		ss->transfer += transfer;
+		t += transfer;
+		ss->head = offset + nblocks;
+		ss->buffered = 0;
+		ss->busy = t;
+		return t;
+	}
+	t += SIM_OVERHEAD_HDD;
+
+	/* Reads are served from the track buffer as far as it goes.  Past it
+	 * the drive has kept reading, so a read that continues there only
+	 * pays for the transfer.
+	 */
+	if (!write && ss->buffered == track + 1) {
+		block_no n = SIM_TRACK - offset % SIM_TRACK;
+		if (n >= nblocks) {
+			ss->nbuffered++;
+			t += (unsigned long) nblocks * SIM_BUS_HDD;
+			ss->busy = t;
+			return t;
+		}
+		t += (unsigned long) n * SIM_BUS_HDD;
+		offset += n;
+		nblocks -= n;
+		track++;
+	}
+	if (!write && offset == ss->head) {
+		unsigned long transfer = (unsigned long) nblocks * SIM_ROTATION / SIM_TRACK;
+		ss->transfer += transfer;
+		t += transfer;
+	}
+	else {
+		if (track != cur) {
+			block_no dist = track > cur ? track - cur : cur - track;
+			unsigned long seek = SIM_SEEK_MIN +
+					(SIM_SEEK_MAX - SIM_SEEK_MIN) * isqrt(dist * 65536UL / ss->ntracks) / 256;
+			ss->seek += seek;
+			ss->nseeks++;
+			t += seek;
+		}
+
+		/* Wait for the first block to come under the head.
+		 */
+		unsigned long under = (t % SIM_ROTATION) * SIM_TRACK / SIM_ROTATION;
+		unsigned long wanted = offset % SIM_TRACK;
+		unsigned long wait = (wanted + SIM_TRACK - under) % SIM_TRACK * SIM_ROTATION / SIM_TRACK;
+		ss->rotation += wait;
+		t += wait;
+
+		unsigned long transfer = (unsigned long) nblocks * SIM_ROTATION / SIM_TRACK;
+		ss->transfer += transfer;
+		t += transfer;
+	}
+
+	/* After a read the drive reads the rest of the last track into the
+	 * track buffer.
+	 */
+	if (write) {
+		ss->head = offset + nblocks;
+		ss->buffered = 0;
+	}
+	else {
+		ss->buffered = (offset + nblocks - 1) / SIM_TRACK + 1;
+		ss->head = ss->buffered * SIM_TRACK;
+	}
+	ss->busy = t;
+	return t;
+}
+
+static unsigned long simdisk_ssd(struct simdisk_state *ss, unsigned long now,
+						block_no offset, block_no nblocks, int write){
+	unsigned long arrive = now + SIM_OVERHEAD_SSD, done = arrive;
+	block_no i;
+
+	for (i = 0; i < nblocks; i++) {
+		unsigned long *chan = &ss->channels[(offset + i) % SIM_CHANNELS];
+		unsigned long t = *chan > arrive ? *chan : arrive;
+
+		ss->queued += t - arrive;
+		*chan = t + (write ? SIM_PROGRAM : SIM_READ) + SIM_BUS;
+		if (*chan > done) {
+			done = *chan;
+		}
+	}
+	return done;
+}
+
+/* Charge a request, and sleep until it completes if so configured.
+ */
+static void simdisk_charge(struct simdisk_state *ss, block_no offset, block_no nblocks, int write){
+	unsigned long real, now, done, latency;
+
+#ifndef GRASS
+	pthread_mutex_lock(&ss->lock);
+#endif
+	real = block_store_usec() - ss->start;
+	now = real + ss->skew;
+	done = ss->profile == SIM_HDD ? simdisk_hdd(ss, now, offset, nblocks, write) :
+						simdisk_ssd(ss, now, offset, nblocks, write);
+	latency = done - now;
+	if (write) {
+		ss->nwrites++;
+	}
+	else {
+		ss->nreads++;
+	}
+	ss->nblocks += nblocks;
+	ss->total += latency;
+	if (!ss->sleep) {
+		ss->skew += latency;
+	}
+#ifndef GRASS
+	pthread_mutex_unlock(&ss->lock);
+#endif
+
+	if (ss->sleep) {
+		unsigned long target = ss->start + done, t;
+		while ((t = block_store_usec()) < target) {
+#ifdef GRASS
+			continue;
+#else
+			struct timespec ts;
+			ts.tv_sec = (target - t) / 1000000;
+			ts.tv_nsec = (target - t) % 1000000 * 1000;
+			nanosleep(&ts, 0);
+#endif
+		}
+	}
+}
+
+static int simdisk_getninodes(block_if bi){
+	struct simdisk_state *ss = bi->state;
+
+	return (*ss->below->getninodes)(ss->below);
+}
+
+static int simdisk_getsize(block_if bi, unsigned int ino){
+	struct simdisk_state *ss = bi->state;
+
+	return (*ss->below->getsize)(ss->below, ino);
+}
+
+static int simdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	struct simdisk_state *ss = bi->state;
+
+	return (*ss->below->setsize)(ss->below, ino, nblocks);
+}
+
+static int simdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct simdisk_state *ss = bi->state;
+
+	int r = (*ss->below->read)(ss->below, ino, offset, block);
+	if (r >= 0) {
+		simdisk_charge(ss, offset, 1, 0);
+	}
+	return r;
+}
+
+static int simdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct simdisk_state *ss = bi->state;
+
+	int r = (*ss->below->write)(ss->below, ino, offset, block);
+	if (r >= 0) {
+		simdisk_charge(ss, offset, 1, 1);
+	}
+	return r;
+}
+
+static int simdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct simdisk_state *ss = bi->state;
+
+	int r = block_store_readv(ss->below, ino, offset, nblocks, blocks);
+	if (r >= 0 && nblocks > 0) {
+		simdisk_charge(ss, offset, nblocks, 0);
+	}
+	return r;
+}
+
+static int simdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct simdisk_state *ss = bi->state;
+
+	int r = block_store_writev(ss->below, ino, offset, nblocks, blocks);
+	if (r >= 0 && nblocks > 0) {
+		simdisk_charge(ss, offset, nblocks, 1);
+	}
+	return r;
+}
+
+static int simdisk_sync(block_if bi, unsigned int ino){
+	struct simdisk_state *ss = bi->state;
+
+	return (*ss->below->sync)(ss->below, ino);
+}
+
+static void simdisk_release(block_if bi){
+	struct simdisk_state *ss = bi->state;
+
+#ifndef GRASS
+	pthread_mutex_destroy(&ss->lock);
+#endif
+	free(ss);
+	free(bi);
+}
+
+unsigned long simdisk_time(block_if bi){
+	struct simdisk_state *ss = bi->state;
+
+	return ss->total;
+}
+
+void simdisk_dump_stats(block_if bi){
+	struct simdisk_state *ss = bi->state;
+	unsigned long nreqs = ss->nreads + ss->nwrites;
+
+	printf("!$SIM: %s: %lu reads, %lu writes, %lu blocks\n",
+					ss->profile == SIM_HDD ? "hdd" : "ssd",
+					ss->nreads, ss->nwrites, ss->nblocks);
+	printf("!$SIM: simulated time %.3f s, %.1f us per request, %.1f us queued\n",
+					ss->total / 1e6, nreqs == 0 ? 0 : (double) ss->total / nreqs,
+					nreqs == 0 ? 0 : (double) ss->queued / nreqs);
+	if (ss->profile == SIM_HDD) {
+		printf("!$SIM: %lu seeks, %.3f s seeking, %.3f s rotating, %.3f s transferring\n",
+					ss->nseeks, ss->seek / 1e6, ss->rotation / 1e6, ss->transfer / 1e6);
+		printf("!$SIM: %lu reads from the track buffer\n", ss->nbuffered);
+	}
+}
+
+block_if simdisk_init(block_if below, enum simdisk_profile profile, int sleep){
+	int size;
+
+	if ((size = (*below->getsize)(below, 0)) < 0) {
+		fprintf(stderr, "!!simdisk_init: can't get the size below\n");
+		return 0;
+	}
+
+	struct simdisk_state *ss = new_alloc(struct simdisk_state);
+	ss->below = below;
+	ss->profile = profile;
+	ss->sleep = sleep;
+	ss->start = block_store_usec();
+	ss->ntracks = (size + SIM_TRACK - 1) / SIM_TRACK;
+	if (ss->ntracks == 0) {
+		ss->ntracks = 1;
+	}
+#ifndef GRASS
+	pthread_mutex_init(&ss->lock, 0);
+#endif
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ss;
+	bi->getninodes = simdisk_getninodes;
+	bi->getsize = simdisk_getsize;
+	bi->setsize = simdisk_setsize;
+	bi->read = simdisk_read;
+	bi->write = simdisk_write;
+	bi->release = simdisk_release;
+	bi->sync = simdisk_sync;
+	bi->readv = simdisk_readv;
+	bi->writev = simdisk_writev;
+	return bi;
+}
@@ -0,0 +1,663 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module keeps read-only point-in-time snapshots of a
+ * block store.  The interface is as follows:
+ *
+ *		int snapdisk_create(block_if below, unsigned int below_ino,
+ *															block_no nblocks)
+ *			Initialize inode 'below_ino' of 'below' as a snapshot block
+ *			store of 'nblocks' blocks without snapshots, unless it already
+ *			is one.  The rest of the space below holds the blocks that
+ *			snapshots keep.  If nblocks is 0, it uses half of the space.
+ *
+ *		block_if snapdisk_init(block_if below, unsigned int below_ino)
+ *			Open the snapshot block store on inode 'below_ino' of 'below'.
+ *			Inode 0 is the live volume.  Inodes 1 .. SNAP_MAX are the
+ *			snapshots, which can only be read.
+ *
+ *		int snapdisk_snapshot(block_if bi)
+ *			Take a snapshot of the live volume and return its inode
+ *			number, or -1 if all SNAP_MAX snapshots are in use.
+ *
+ *		int snapdisk_delete(block_if bi, unsigned int ino)
+ *			Delete the snapshot with inode 'ino' and free the blocks that
+ *			only it kept.
+ *
+ *		void snapdisk_dump_stats(block_if bi)
+ *			Print the snapshots, how many blocks each keeps, and how the
+ *			writes to the live volume were handled.
+ *
+ * The live volume is stored redirect-on-write.  Virtual block b starts
+ * out at "home" physical block b.  Each physical block has an entry in
+ * the owner table, saying whether it is free, holds a block of the live
+ * volume, or holds a block that a snapshot keeps, and which virtual
+ * block it holds.  A write to a live block that no snapshot shares is
+ * done in place.  Otherwise the new contents go to a free physical
+ * block, and the old physical block is given to the newest snapshot.
+ * So taking a snapshot costs nothing but a sync: it only records the
+ * snapshot in the superblock, after which all live blocks are shared
+ * with it.  Live blocks are found in an in-memory map, so reading the
+ * live volume takes no more I/O than the block store below.
+ *
+ * The blocks given to a snapshot form its block map: the blocks that
+ * were overwritten while it was the newest snapshot.  A snapshot sees
+ * virtual block b as the block that the oldest snapshot no older than
+ * itself keeps for b, or the live block if there is none.  The owner
+ * table is written on sync, and the block maps are computed from it
+ * when the block store is opened.  A crash while the table is written
+ * can leave a redirected block with two live copies, or with none; the
+ * newer copy or the old one is then taken as live.
+ *
+ * Block 0 below is the superblock, followed by the owner table and the
+ * physical blocks.
+ *
+ * The layers above a snapdisk normally use only inode 0.  To read a
+ * snapshot they are opened on its inode instead, which is what the block
+ * server does when it is run with -S -m snapshot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define SNAP_MAGIC		0x4411545A
+#define SNAP_MAX		15			// max #snapshots
+
+/* Owners in the owner table.  Snapshot slot s is owner SNAP_SLOT + s.
+ */
+#define SNAP_FREE		0
+#define SNAP_LIVE		1
+#define SNAP_SLOT		2
+
+struct snapdisk_superblock {
+	uint32_t magic;
+	uint32_t nblocks;		// #virtual blocks
+	uint32_t ntable;		// #owner table blocks, following the superblock
+	uint32_t seq;			// sequence number of the last snapshot taken
+	uint32_t slots[SNAP_MAX];	// sequence number of each snapshot, or 0
+};
+
+struct snapdisk_entry {
+	uint32_t vblock;		// virtual block held
+	uint32_t owner;			// SNAP_FREE, SNAP_LIVE, or SNAP_SLOT + slot
+	uint32_t seq;			// superblock seq when last written as live
+};
+
+#define ENTRIES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct snapdisk_entry))
+
+union snapdisk_block {
+	struct snapdisk_superblock superblock;
+	struct snapdisk_entry entries[ENTRIES_PER_BLOCK];
+	block_t block;
+};
+
+struct snapdisk_state {
+	block_if below;			// block store below
+	unsigned int below_ino;	// inode below
+	struct snapdisk_superblock sb;
+	block_no first;			// first physical block
+	block_no nphys;			// #physical blocks
+	block_no nfree;			// #free physical blocks
+	block_no rotor;			// where to look for a free block
+	uint32_t newest;		// sequence number of the newest snapshot, or 0
+
+	/* The owner table, indexed by physical block number - first.  The
+	 * table blocks that have to be written on sync are marked dirty.
+	 */
+	struct snapdisk_entry *table;
+	bool *table_dirty;
+
+	/* Where each live block is, and the blocks kept by snapshots for
+	 * each virtual block, as linked lists through next[].
+	 */
+	uint32_t *live;
+	uint32_t *kept;
+	uint32_t *next;
+
+	/* Statistics.
+	 */
+	unsigned int nlive_reads;		// blocks read from the live volume
+	unsigned int nsnap_reads;		// blocks read from snapshots
+	unsigned int ninplace;			// live writes done in place
+	unsigned int nredirect;			// live writes redirected
+	unsigned int nsnapshots;		// snapshots taken
+	unsigned int ndeleted;			// snapshots deleted
+};
+
+#define NONE		((uint32_t) -1)
+
+static void snapdisk_set_entry(struct snapdisk_state *ss, block_no i,
+							uint32_t vblock, uint32_t owner, uint32_t seq){
+	ss->table[i].vblock = vblock;
+	ss->table[i].owner = owner;
+	ss->table[i].seq = seq;
+	ss->table_dirty[i / ENTRIES_PER_BLOCK] = true;
+}
+
+static void snapdisk_newest(struct snapdisk_state *ss){
+	unsigned int s;
+
+	ss->newest = 0;
+	for (s = 0; s < SNAP_MAX; s++) {
+		if (ss->sb.slots[s] > ss->newest) {
+			ss->newest = ss->sb.slots[s];
+		}
+	}
+}
+
+/* Find the physical block (relative to first) that snapshot slot 'slot'
+ * sees for virtual block b.
+ */
+static block_no snapdisk_resolve(struct snapdisk_state *ss, unsigned int slot, block_no b){
+	uint32_t seq = ss->sb.slots[slot], best = 0, i, found = NONE;
+
+	for (i = ss->kept[b]; i != NONE; i = ss->next[i]) {
+		uint32_t s = ss->sb.slots[ss->table[i].owner - SNAP_SLOT];
+		if (s >= seq && (found == NONE || s < best)) {
+			best = s;
+			found = i;
+		}
+	}
+	return found == NONE ? ss->live[b] : found;
+}
+
+/* Find the physical block (relative to first) for virtual block b of
+ * inode ino, or return NONE if there is no such block.
+ */
+static block_no snapdisk_lookup(struct snapdisk_state *ss, unsigned int ino, block_no b){
+	if (b >= ss->sb.nblocks) {
+		return NONE;
+	}
+	if (ino == 0) {
+		return ss->live[b];
+	}
+	if (ino > SNAP_MAX || ss->sb.slots[ino - 1] == 0) {
+		return NONE;
+	}
+	return snapdisk_resolve(ss, ino - 1, b);
+}
+
+static block_no snapdisk_alloc(struct snapdisk_state *ss){
+	block_no i;
+
+	for (i = 0; i < ss->nphys; i++) {
+		block_no p = (ss->rotor + i) % ss->nphys;
+		if (ss->table[p].owner == SNAP_FREE) {
+			ss->rotor = (p + 1) % ss->nphys;
+			ss->nfree--;
+			return p;
+		}
+	}
+	return NONE;
+}
+
+static int snapdisk_getninodes(block_if bi){
+	return 1 + SNAP_MAX;
+}
+
+static int snapdisk_getsize(block_if bi, unsigned int ino){
+	struct snapdisk_state *ss = bi->state;
+
+	if (ino > SNAP_MAX || (ino > 0 && ss->sb.slots[ino - 1] == 0)) {
+		fprintf(stderr, "!!snapdisk_getsize: no inode %u\n", ino);
+		return -1;
+	}
+	return ss->sb.nblocks;
+}
+
+static int snapdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	fprintf(stderr, "!!snapdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int snapdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct snapdisk_state *ss = bi->state;
+	block_no p = snapdisk_lookup(ss, ino, offset);
+
+	if (p == NONE) {
+		fprintf(stderr, "!!snapdisk_read: bad inode %u or offset %u\n", ino, offset);
+		return -1;
+	}
+	if (ino == 0) {
+		ss->nlive_reads++;
+	}
+	else {
+		ss->nsnap_reads++;
+	}
+	return (*ss->below->read)(ss->below, ss->below_ino, ss->first + p, block);
+}
+
+/* Read runs of blocks that are consecutive below with a single readv.
+ */
+static int snapdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct snapdisk_state *ss = bi->state;
+	block_no i, n;
+
+	for (i = 0; i < nblocks; i += n) {
+		block_no p = snapdisk_lookup(ss, ino, offset + i);
+		if (p == NONE) {
+			fprintf(stderr, "!!snapdisk_readv: bad inode %u or offset %u\n", ino, offset + i);
+			return -1;
+		}
+		for (n = 1; i + n < nblocks && snapdisk_lookup(ss, ino, offset + i + n) == p + n; n++)
+			;
+		if (block_store_readv(ss->below, ss->below_ino, ss->first + p, n, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	if (ino == 0) {
+		ss->nlive_reads += nblocks;
+	}
+	else {
+		ss->nsnap_reads += nblocks;
+	}
+	return 0;
+}
+
+static int snapdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct snapdisk_state *ss = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!snapdisk_write: snapshot %u is read-only\n", ino);
+		return -1;
+	}
+	if (offset >= ss->sb.nblocks) {
+		fprintf(stderr, "!!snapdisk_write: bad offset %u\n", offset);
+		return -1;
+	}
+
+	/* If no snapshot shares the block, overwrite it.
+	 */
+	block_no old = ss->live[offset];
+	if (ss->newest == 0 || ss->table[old].seq >= ss->newest) {
+		ss->ninplace++;
+		return (*ss->below->write)(ss->below, ss->below_ino, ss->first + old, block);
+	}
+
+	/* Otherwise write it elsewhere and give the old block to the newest
+	 * snapshot.
+	 */
+	block_no p = snapdisk_alloc(ss);
+	if (p == NONE) {
+		fprintf(stderr, "!!snapdisk_write: out of space\n");
+		return -1;
+	}
+	if ((*ss->below->write)(ss->below, ss->below_ino, ss->first + p, block) < 0) {
+		ss->nfree++;
+		return -1;
+	}
+	unsigned int s;
+	for (s = 0; ss->sb.slots[s] != ss->newest; s++)
+		;
+	snapdisk_set_entry(ss, p, offset, SNAP_LIVE, ss->sb.seq);
+	snapdisk_set_entry(ss, old, offset, SNAP_SLOT + s, ss->table[old].seq);
+	ss->next[old] = ss->kept[offset];
+	ss->kept[offset] = old;
+	ss->live[offset] = p;
+	ss->nredirect++;
+	return 0;
+}
+
+static int snapdisk_write_super(struct snapdisk_state *ss){
+	union snapdisk_block blk;
+
+	memset(&blk, 0, sizeof(blk));
+	blk.superblock = ss->sb;
+	return (*ss->below->write)(ss->below, ss->below_ino, 0, &blk.block);
+}
+
+static int snapdisk_sync(block_if bi, unsigned int ino){
+	struct snapdisk_state *ss = bi->state;
+	block_no b;
+
+	for (b = 0; b < ss->sb.ntable; b++) {
+		if (!ss->table_dirty[b]) {
+			continue;
+		}
+		union snapdisk_block blk;
+		block_no n = ss->nphys - b * ENTRIES_PER_BLOCK;
+		if (n > ENTRIES_PER_BLOCK) {
+			n = ENTRIES_PER_BLOCK;
+		}
+		memset(&blk, 0, sizeof(blk));
+		memcpy(blk.entries, &ss->table[b * ENTRIES_PER_BLOCK], n * sizeof(struct snapdisk_entry));
+		if ((*ss->below->write)(ss->below, ss->below_ino, 1 + b, &blk.block) < 0) {
+			fprintf(stderr, "!!snapdisk_sync: can't write owner table block %u\n", b);
+			return -1;
+		}
+		ss->table_dirty[b] = false;
+	}
+	return (*ss->below->sync)(ss->below, ss->below_ino);
+}
+
+int snapdisk_snapshot(block_if bi){
+	struct snapdisk_state *ss = bi->state;
+	unsigned int s;
+
+	for (s = 0; s < SNAP_MAX; s++) {
+		if (ss->sb.slots[s] == 0) {
+			break;
+		}
+	}
+	if (s == SNAP_MAX) {
+		fprintf(stderr, "!!snapdisk_snapshot: too many snapshots\n");
+		return -1;
+	}
+
+	/* The owner table has to be on disk before the snapshot is, because
+	 * from now on the blocks it lists as live are not overwritten.
+	 */
+	if (snapdisk_sync(bi, 0) < 0) {
+		return -1;
+	}
+	ss->sb.slots[s] = ++ss->sb.seq;
+	if (snapdisk_write_super(ss) < 0 || (*ss->below->sync)(ss->below, ss->below_ino) < 0) {
+		ss->sb.slots[s] = 0;
+		return -1;
+	}
+	ss->newest = ss->sb.slots[s];
+	ss->nsnapshots++;
+	return 1 + s;
+}
+
+int snapdisk_delete(block_if bi, unsigned int ino){
+	struct snapdisk_state *ss = bi->state;
+	unsigned int s, prev = SNAP_MAX;
+	block_no b;
+
+	if (ino == 0 || ino > SNAP_MAX || ss->sb.slots[ino - 1] == 0) {
+		fprintf(stderr, "!!snapdisk_delete: no snapshot %u\n", ino);
+		return -1;
+	}
+	unsigned int slot = ino - 1;
+	uint32_t seq = ss->sb.slots[slot];
+
+	/* Write the owner table first, so that a crash while deleting can
+	 * only leave this snapshot half deleted, and not the live volume.
+	 */
+	if (snapdisk_sync(bi, 0) < 0) {
+		return -1;
+	}
+
+	/* The next older snapshot, if any, takes over the blocks it would see
+	 * through this one.  The others are freed.
+	 */
+	for (s = 0; s < SNAP_MAX; s++) {
+		if (ss->sb.slots[s] != 0 && ss->sb.slots[s] < seq &&
+					(prev == SNAP_MAX || ss->sb.slots[s] > ss->sb.slots[prev])) {
+			prev = s;
+		}
+	}
+	for (b = 0; b < ss->sb.nblocks; b++) {
+		uint32_t i, *pi, mine = NONE;
+		bool prev_has = false;
+
+		for (i = ss->kept[b]; i != NONE; i = ss->next[i]) {
+			if (ss->table[i].owner == SNAP_SLOT + slot) {
+				mine = i;
+			}
+			else if (prev != SNAP_MAX && ss->table[i].owner == SNAP_SLOT + prev) {
+				prev_has = true;
+			}
+		}
+		if (mine == NONE) {
+			continue;
+		}
+		if (prev != SNAP_MAX && !prev_has) {
+			snapdisk_set_entry(ss, mine, b, SNAP_SLOT + prev, ss->table[mine].seq);
+			continue;
+		}
+		for (pi = &ss->kept[b]; *pi != mine; pi = &ss->next[*pi])
+			;
+		*pi = ss->next[mine];
+		snapdisk_set_entry(ss, mine, 0, SNAP_FREE, 0);
+		ss->nfree++;
+	}
+
+	/* Remove it from the superblock only after the freed blocks are no
+	 * longer in the owner table, and before they can be reused.
+	 */
+	ss->sb.slots[slot] = 0;
+	snapdisk_newest(ss);
+	ss->ndeleted++;
+	if (snapdisk_sync(bi, 0) < 0 || snapdisk_write_super(ss) < 0) {
+		return -1;
+	}
+	return (*ss->below->sync)(ss->below, ss->below_ino);
+}
+
+static void snapdisk_free_state(struct snapdisk_state *ss){
+	free(ss->next);
+	free(ss->kept);
+	free(ss->live);
+	free(ss->table_dirty);
+	free(ss->table);
+	free(ss);
+}
+
+static void snapdisk_release(block_if bi){
+	(void) snapdisk_sync(bi, 0);
+	snapdisk_free_state(bi->state);
+	free(bi);
+}
+
+void snapdisk_dump_stats(block_if bi){
+	struct snapdisk_state *ss = bi->state;
+	unsigned int s, kept[SNAP_MAX];
+	block_no i;
+
+	memset(kept, 0, sizeof(kept));
+	for (i = 0; i < ss->nphys; i++) {
+		if (ss->table[i].owner >= SNAP_SLOT) {
+			kept[ss->table[i].owner - SNAP_SLOT]++;
+		}
+	}
+	printf("!$SNAP: %u blocks, %u of %u physical blocks free\n",
+					ss->sb.nblocks, ss->nfree, ss->nphys);
+	for (s = 0; s < SNAP_MAX; s++) {
+		if (ss->sb.slots[s] != 0) {
+			printf("!$SNAP: snapshot inode %u (#%u) keeps %u blocks\n",
+					1 + s, ss->sb.slots[s], kept[s]);
+		}
+	}
+	printf("!$SNAP: reads: %u live, %u snapshot\n", ss->nlive_reads, ss->nsnap_reads);
+	printf("!$SNAP: writes: %u in place, %u redirected\n", ss->ninplace, ss->nredirect);
+	printf("!$SNAP: %u snapshots taken, %u deleted\n", ss->nsnapshots, ss->ndeleted);
+}
+
+int snapdisk_create(block_if below, unsigned int below_ino, block_no nblocks){
+	union snapdisk_block blk;
+
+	if (sizeof(blk) != BLOCK_SIZE) {
+		fprintf(stderr, "snapdisk_create: block has wrong size\n");
+		return -1;
+	}
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	if (blk.superblock.magic == SNAP_MAGIC) {
+		return 0;
+	}
+
+	int nbelow = (*below->getsize)(below, below_ino);
+	if (nbelow < 0) {
+		return -1;
+	}
+	block_no ntable = 0, nphys = 0;
+	while (1 + ntable + nphys < (block_no) nbelow) {
+		nphys++;
+		ntable = (nphys + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+	}
+	if (1 + ntable + nphys > (block_no) nbelow) {
+		nphys--;
+	}
+	if (nblocks == 0) {
+		nblocks = nphys / 2;
+	}
+	if (nblocks == 0 || nblocks > nphys) {
+		fprintf(stderr, "snapdisk_create: too few blocks\n");
+		return -1;
+	}
+
+	/* Virtual block b is at physical block b, and the rest is free.
+	 */
+	block_no b, i;
+	for (b = 0; b < ntable; b++) {
+		memset(&blk, 0, sizeof(blk));
+		for (i = 0; i < ENTRIES_PER_BLOCK; i++) {
+			block_no p = b * ENTRIES_PER_BLOCK + i;
+			if (p < nblocks) {
+				blk.entries[i].vblock = p;
+				blk.entries[i].owner = SNAP_LIVE;
+			}
+		}
+		if ((*below->write)(below, below_ino, 1 + b, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	memset(&blk, 0, sizeof(blk));
+	blk.superblock.magic = SNAP_MAGIC;
+	blk.superblock.nblocks = nblocks;
+	blk.superblock.ntable = ntable;
+	if ((*below->write)(below, below_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	return (*below->sync)(below, below_ino);
+}
+
+block_if snapdisk_init(block_if below, unsigned int below_ino){
+	union snapdisk_block blk;
+	block_no b, i;
+	unsigned int s;
+
+	if ((*below->read)(below, below_ino, 0, &blk.block) < 0) {
+		return 0;
+	}
+	if (blk.superblock.magic != SNAP_MAGIC) {
+		fprintf(stderr, "!!snapdisk_init: not a snapshot block store\n");
+		return 0;
+	}
+	int nbelow = (*below->getsize)(below, below_ino);
+	if (nbelow < 0) {
+		return 0;
+	}
+
+	struct snapdisk_state *ss = new_alloc(struct snapdisk_state);
+	ss->below = below;
+	ss->below_ino = below_ino;
+	ss->sb = blk.superblock;
+	ss->first = 1 + ss->sb.ntable;
+	ss->nphys = nbelow - ss->first;
+	if (ss->nphys > ss->sb.ntable * ENTRIES_PER_BLOCK) {
+		ss->nphys = ss->sb.ntable * ENTRIES_PER_BLOCK;
+	}
+	snapdisk_newest(ss);
+	ss->table = calloc(ss->nphys, sizeof(*ss->table));
+	ss->table_dirty = calloc(ss->sb.ntable, sizeof(*ss->table_dirty));
+	ss->live = malloc(ss->sb.nblocks * sizeof(*ss->live));
+	ss->kept = malloc(ss->sb.nblocks * sizeof(*ss->kept));
+	ss->next = malloc(ss->nphys * sizeof(*ss->next));
+	memset(ss->live, 0xff, ss->sb.nblocks * sizeof(*ss->live));
+	memset(ss->kept, 0xff, ss->sb.nblocks * sizeof(*ss->kept));
+
+	/* Read the owner table and compute the live map and the block maps
+	 * of the snapshots from it.
+	 */
+	for (b = 0; b < ss->sb.ntable; b++) {
+		if ((*below->read)(below, below_ino, 1 + b, &blk.block) < 0) {
+			fprintf(stderr, "!!snapdisk_init: can't read owner table block %u\n", b);
+			snapdisk_free_state(ss);
+			return 0;
+		}
+		block_no n = ss->nphys - b * ENTRIES_PER_BLOCK;
+		memcpy(&ss->table[b * ENTRIES_PER_BLOCK], blk.entries,
+				(n < ENTRIES_PER_BLOCK ? n : ENTRIES_PER_BLOCK) * sizeof(struct snapdisk_entry));
+	}
+	for (i = 0; i < ss->nphys; i++) {
+		struct snapdisk_entry *e = &ss->table[i];
+		if (e->owner == SNAP_FREE) {
+			ss->nfree++;
+			continue;
+		}
+		if (e->vblock >= ss->sb.nblocks || e->owner >= SNAP_SLOT + SNAP_MAX ||
+				(e->owner >= SNAP_SLOT && ss->sb.slots[e->owner - SNAP_SLOT] == 0)) {
+			/* Left behind by a crash while deleting a snapshot.
+			 */
+			snapdisk_set_entry(ss, i, 0, SNAP_FREE, 0);
+			ss->nfree++;
+			continue;
+		}
+		if (e->owner == SNAP_LIVE) {
+			/* A crash while the owner table was written after a redirect
+			 * can leave both blocks live.  The one written later is, and
+			 * the other one goes to the newest snapshot, as on the write.
+			 */
+			uint32_t old = ss->live[e->vblock];
+			if (old != NONE && ss->table[old].seq > e->seq) {
+				old = i;
+			}
+			else {
+				ss->live[e->vblock] = i;
+			}
+			if (old != NONE && ss->newest == 0) {
+				snapdisk_set_entry(ss, old, 0, SNAP_FREE, 0);
+				ss->nfree++;
+			}
+			else if (old != NONE) {
+				for (s = 0; ss->sb.slots[s] != ss->newest; s++)
+					;
+				snapdisk_set_entry(ss, old, e->vblock, SNAP_SLOT + s, ss->table[old].seq);
+				ss->next[old] = ss->kept[e->vblock];
+				ss->kept[e->vblock] = old;
+			}
+		}
+		else {
+			ss->next[i] = ss->kept[e->vblock];
+			ss->kept[e->vblock] = i;
+		}
+	}
+	for (b = 0; b < ss->sb.nblocks; b++) {
+		if (ss->live[b] != NONE) {
+			continue;
+		}
+
+		/* Or neither: the old block was given to the newest snapshot
+		 * keeping b, but the new one is not in the table.  The old block
+		 * still holds b as of the last sync, so it is live again.
+		 */
+		uint32_t *pi, *newest = 0;
+		for (pi = &ss->kept[b]; *pi != NONE; pi = &ss->next[*pi]) {
+			if (newest == 0 || ss->sb.slots[ss->table[*pi].owner - SNAP_SLOT] >
+								ss->sb.slots[ss->table[*newest].owner - SNAP_SLOT]) {
+				newest = pi;
+			}
+		}
+		if (newest == 0) {
+			fprintf(stderr, "!!snapdisk_init: block %u is missing\n", b);
+			snapdisk_free_state(ss);
+			return 0;
+		}
+		i = *newest;
+		*newest = ss->next[i];
+		snapdisk_set_entry(ss, i, b, SNAP_LIVE, ss->table[i].seq);
+		ss->live[b] = i;
+	}
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ss;
+	bi->getninodes = snapdisk_getninodes;
+	bi->getsize = snapdisk_getsize;
+	bi->setsize = snapdisk_setsize;
+	bi->read = snapdisk_read;
+	bi->write = snapdisk_write;
+	bi->release = snapdisk_release;
+	bi->sync = snapdisk_sync;
+	bi->readv = snapdisk_readv;
+	return bi;
+}
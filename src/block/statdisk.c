@@ -10,6 +10,39 @@
  *
  *		block_store_t *statdisk_init(block_store_t *below){
  *			'below' is the underlying block store.
+ *
+ *		void statdisk_dump_stats(block_store_t *this_bs)
+ *			Print the statistics.
+ *
+ *		int statdisk_report(block_store_t *this_bs, char *buf, unsigned int size)
+ *			Write the statistics into buf in a machine-readable form,
+ *			one record per line.  Like snprintf, it returns the length
+ *			of the whole report even if it did not fit.
+ *
+ * For each type of operation it keeps the number of operations and
+ * blocks, and a histogram of their latencies: bucket i > 0 counts the
+ * operations that took from 2^i up to 2^(i+1) nanoseconds, and bucket 0
+ * those too short to measure, under STAT_RESOLUTION nanoseconds (or 2).
+ * Inside EGOS the clock only counts milliseconds, so most operations end
+ * up in bucket 0 there.  For each inode
+ * it counts the reads and writes, and how many of them started right
+ * after the previous one on that inode (sequential) or not (random).
+ * readv and writev count as a single read or write.  Finally it keeps
+ * track of the most frequently accessed blocks with the space-saving
+ * algorithm: STAT_NHOT counters each hold a block and a count, and a
+ * block without a counter takes over the one with the lowest count,
+ * incremented.  A block accessed more than 1/STAT_NHOT of the time is
+ * thus always among them, and its count is at most 'error' too high.
+ *
+ * The report has these records:
+ *
+ *		resolution <ns>
+ *		op <name> count <n> blocks <n> hist <bucket>:<n> ...
+ *		inode <ino> reads <n> writes <n> sequential <n> random <n>
+ *		hot <ino> <offset> count <n> error <n>
+ *
+ * with only the non-empty buckets, the inodes that were used, and the hot
+ * blocks in order of decreasing count.
  */
 
 #include <stdio.h>
@@ -17,15 +50,129 @@
 #include <string.h>
 #include <egos/block_store.h>
 
+#define STAT_NBUCKETS		40			// latency buckets (up to 2^40 ns)
+#ifdef GRASS
+#define STAT_RESOLUTION		1000000		// ns; sys_gettime() counts milliseconds
+#else
+#define STAT_RESOLUTION		1
+#endif
+#define STAT_NHOT			16			// #counters for hot blocks
+
+enum statdisk_op {
+	STAT_GETSIZE, STAT_SETSIZE, STAT_READ, STAT_WRITE, STAT_SYNC, STAT_READV, STAT_WRITEV,
+	STAT_NOPS
+};
+
+static const char *statdisk_names[STAT_NOPS] = {
+	"getsize", "setsize", "read", "write", "sync", "readv", "writev"
+};
+
+struct statdisk_opstat {
+	unsigned long count;					// #operations
+	unsigned long nblocks;					// #blocks read or written
+	unsigned long hist[STAT_NBUCKETS];		// latency histogram
+};
+
+struct statdisk_inode {
+	unsigned long nread, nwrite;			// #reads and #writes
+	unsigned long nsequential, nrandom;
+	block_no next;							// block after the previous access + 1, or 0
+};
+
+struct statdisk_hot {
+	unsigned int ino;
+	block_no offset;
+	unsigned long count, error;				// count == 0 if unused
+};
+
 struct statdisk_state {
 	block_store_t *below;	// block store below
-	unsigned int ngetsize;	// #getsize operations
-	unsigned int nsetsize;	// #setsize operations
-	unsigned int nread;		// #read operations
-	unsigned int nwrite;	// #write operations
-	unsigned int nsync;		// #sync operations
+	struct statdisk_opstat ops[STAT_NOPS];
+	struct statdisk_inode *inodes;			// per inode counters
+	unsigned int ninodes;					// size of inodes[]
+	struct statdisk_hot hot[STAT_NHOT];
 };
 
+/* Record an operation that started at 'start' (in nanoseconds).
+ */
+static void statdisk_op(struct statdisk_state *sds, enum statdisk_op op,
+							unsigned long start, block_no nblocks){
+	struct statdisk_opstat *os = &sds->ops[op];
+	unsigned long t = block_store_nsec() - start;
+	unsigned int b = 0;
+
+	if (t < STAT_RESOLUTION) {
+		t = 0;
+	}
+	while (t > 1 && b < STAT_NBUCKETS - 1) {
+		t >>= 1;
+		b++;
+	}
+	os->count++;
+	os->nblocks += nblocks;
+	os->hist[b]++;
+}
+
+static void statdisk_hot(struct statdisk_state *sds, unsigned int ino, block_no offset){
+	struct statdisk_hot *h, *min = &sds->hot[0];
+
+	for (h = sds->hot; h < &sds->hot[STAT_NHOT]; h++) {
+		if (h->count != 0 && h->ino == ino && h->offset == offset) {
+			h->count++;
+			return;
+		}
+		if (h->count < min->count) {
+			min = h;
+		}
+	}
+	min->ino = ino;
+	min->offset = offset;
+	min->error = min->count;
+	min->count++;
+}
+
+/* Account for a read or write of nblocks blocks at offset.  Only called
+ * for operations that succeeded, so ino is valid below.
+ */
+static void statdisk_access(struct statdisk_state *sds, unsigned int ino,
+							block_no offset, block_no nblocks, int write){
+	block_no i;
+
+	if (ino >= sds->ninodes) {
+		unsigned int n = sds->ninodes == 0 ? 16 : sds->ninodes;
+		while (n <= ino && n < (1U << 31)) {
+			n *= 2;
+		}
+		struct statdisk_inode *inodes = n <= ino ? 0 : realloc(sds->inodes, n * sizeof(*sds->inodes));
+		if (inodes == 0) {
+			fprintf(stderr, "!!statdisk_access: no room for inode %u\n", ino);
+			return;
+		}
+		sds->inodes = inodes;
+		memset(&sds->inodes[sds->ninodes], 0, (n - sds->ninodes) * sizeof(*sds->inodes));
+		sds->ninodes = n;
+	}
+
+	struct statdisk_inode *si = &sds->inodes[ino];
+	if (write) {
+		si->nwrite++;
+	}
+	else {
+		si->nread++;
+	}
+	if (si->next == offset + 1) {
+		si->nsequential++;
+	}
+	else {
+		si->nrandom++;
+	}
+	si->next = offset + nblocks + 1;
+
+	for (i = 0; i < nblocks; i++) {
+		statdisk_hot(sds, ino, offset + i);
+	}
+}
+
 static int statdisk_getninodes(block_store_t *this_bs){
 	struct statdisk_state *sds = this_bs->state;
 
@@ -34,61 +181,192 @@ static int statdisk_getninodes(block_store_t *this_bs){
 
 static int statdisk_getsize(block_store_t *this_bs, unsigned int ino){
 	struct statdisk_state *sds = this_bs->state;
+	unsigned long start = block_store_nsec();
 
-	sds->ngetsize++;
-	return (*sds->below->getsize)(sds->below, ino);
+	int r = (*sds->below->getsize)(sds->below, ino);
+	statdisk_op(sds, STAT_GETSIZE, start, 0);
+	return r;
 }
 
 static int statdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no nblocks){
 	struct statdisk_state *sds = this_bs->state;
+	unsigned long start = block_store_nsec();
 
-	sds->nsetsize++;
-	return (*sds->below->setsize)(sds->below, ino, nblocks);
+	int r = (*sds->below->setsize)(sds->below, ino, nblocks);
+	statdisk_op(sds, STAT_SETSIZE, start, 0);
+	return r;
 }
 
 static int statdisk_read(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
 	struct statdisk_state *sds = this_bs->state;
-	sds->nread++;
-	return (*sds->below->read)(sds->below, ino, offset, block);
+	unsigned long start = block_store_nsec();
+
+	int r = (*sds->below->read)(sds->below, ino, offset, block);
+	statdisk_op(sds, STAT_READ, start, 1);
+	if (r >= 0) {
+		statdisk_access(sds, ino, offset, 1, 0);
+	}
+	return r;
 }
 
 static int statdisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
 	struct statdisk_state *sds = this_bs->state;
-	sds->nwrite++;
-	return (*sds->below->write)(sds->below, ino, offset, block);
+	unsigned long start = block_store_nsec();
+
+	int r = (*sds->below->write)(sds->below, ino, offset, block);
+	statdisk_op(sds, STAT_WRITE, start, 1);
+	if (r >= 0) {
+		statdisk_access(sds, ino, offset, 1, 1);
+	}
+	return r;
+}
+
+static int statdisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset,
+							block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	unsigned long start = block_store_nsec();
+
+	int r = block_store_readv(sds->below, ino, offset, nblocks, blocks);
+	statdisk_op(sds, STAT_READV, start, nblocks);
+	if (r >= 0) {
+		statdisk_access(sds, ino, offset, nblocks, 0);
+	}
+	return r;
+}
+
+static int statdisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset,
+							block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	unsigned long start = block_store_nsec();
+
+	int r = block_store_writev(sds->below, ino, offset, nblocks, blocks);
+	statdisk_op(sds, STAT_WRITEV, start, nblocks);
+	if (r >= 0) {
+		statdisk_access(sds, ino, offset, nblocks, 1);
+	}
+	return r;
+}
+
+static int statdisk_hint(block_store_t *this_bs, unsigned int ino, block_no offset,
+							block_no nblocks, enum block_hint hint){
+	struct statdisk_state *sds = this_bs->state;
+
+	return block_store_hint(sds->below, ino, offset, nblocks, hint);
 }
 
 static void statdisk_release(block_store_t *this_bs){
-	free(this_bs->state);
+	struct statdisk_state *sds = this_bs->state;
+
+	free(sds->inodes);
+	free(sds);
 	free(this_bs);
 }
 
 static int statdisk_sync(block_store_t *this_bs, unsigned int ino){
 	struct statdisk_state *sds = this_bs->state;
-	sds->nsync++;
-	return (*sds->below->sync)(sds->below, ino);
+	unsigned long start = block_store_nsec();
+
+	int r = (*sds->below->sync)(sds->below, ino);
+	statdisk_op(sds, STAT_SYNC, start, 0);
+	return r;
+}
+
+static int statdisk_cmp_hot(const void *a, const void *b){
+	const struct statdisk_hot *x = a, *y = b;
+
+	return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/* Fill in the hot blocks in order of decreasing count, and return how
+ * many there are.
+ */
+static unsigned int statdisk_sorted_hot(struct statdisk_state *sds, struct statdisk_hot *hot){
+	unsigned int i, n = 0;
+
+	for (i = 0; i < STAT_NHOT; i++) {
+		if (sds->hot[i].count != 0) {
+			hot[n++] = sds->hot[i];
+		}
+	}
+	qsort(hot, n, sizeof(*hot), statdisk_cmp_hot);
+	return n;
 }
 
 void statdisk_dump_stats(block_store_t *this_bs){
 	struct statdisk_state *sds = this_bs->state;
+	struct statdisk_hot hot[STAT_NHOT];
+	unsigned long nsequential = 0, nrandom = 0;
+	unsigned int i, n;
+
+	printf("!$STAT: #getsize:  %lu\n", sds->ops[STAT_GETSIZE].count);
+	printf("!$STAT: #setsize:  %lu\n", sds->ops[STAT_SETSIZE].count);
+	printf("!$STAT: #read:     %lu\n", sds->ops[STAT_READ].count);
+	printf("!$STAT: #write:    %lu\n", sds->ops[STAT_WRITE].count);
+	printf("!$STAT: #sync:     %lu\n", sds->ops[STAT_SYNC].count);
+	printf("!$STAT: #readv:    %lu (%lu blocks)\n", sds->ops[STAT_READV].count,
+					sds->ops[STAT_READV].nblocks);
+	printf("!$STAT: #writev:   %lu (%lu blocks)\n", sds->ops[STAT_WRITEV].count,
+					sds->ops[STAT_WRITEV].nblocks);
+
+	for (i = 0; i < sds->ninodes; i++) {
+		nsequential += sds->inodes[i].nsequential;
+		nrandom += sds->inodes[i].nrandom;
+	}
+	printf("!$STAT: sequential: %lu, random: %lu\n", nsequential, nrandom);
+
+	n = statdisk_sorted_hot(sds, hot);
+	for (i = 0; i < n && i < 5; i++) {
+		printf("!$STAT: hot block %u:%u: %lu accesses\n", hot[i].ino, hot[i].offset, hot[i].count);
+	}
+}
+
+int statdisk_report(block_store_t *this_bs, char *buf, unsigned int size){
+	struct statdisk_state *sds = this_bs->state;
+	struct statdisk_hot hot[STAT_NHOT];
+	unsigned int i, b, n, len = 0;
+
+/* Append to buf, keeping track of the total length.
+ */
+#define REPORT(...)		(len += snprintf(buf + (len < size ? len : size), \
+							len < size ? size - len : 0, __VA_ARGS__))
 
-	printf("!$STAT: #getsize:  %u\n", sds->ngetsize);
-	printf("!$STAT: #setsize:  %u\n", sds->nsetsize);
-	printf("!$STAT: #read:     %u\n", sds->nread);
-	printf("!$STAT: #write:    %u\n", sds->nwrite);
-	printf("!$STAT: #sync:     %u\n", sds->nsync);
+	REPORT("resolution %u\n", STAT_RESOLUTION);
+	for (i = 0; i < STAT_NOPS; i++) {
+		struct statdisk_opstat *os = &sds->ops[i];
+		REPORT("op %s count %lu blocks %lu hist", statdisk_names[i], os->count, os->nblocks);
+		for (b = 0; b < STAT_NBUCKETS; b++) {
+			if (os->hist[b] != 0) {
+				REPORT(" %u:%lu", b, os->hist[b]);
+			}
+		}
+		REPORT("\n");
+	}
+	for (i = 0; i < sds->ninodes; i++) {
+		struct statdisk_inode *si = &sds->inodes[i];
+		if (si->nread != 0 || si->nwrite != 0) {
+			REPORT("inode %u reads %lu writes %lu sequential %lu random %lu\n",
+					i, si->nread, si->nwrite, si->nsequential, si->nrandom);
+		}
+	}
+	n = statdisk_sorted_hot(sds, hot);
+	for (i = 0; i < n; i++) {
+		REPORT("hot %u %u count %lu error %lu\n", hot[i].ino, hot[i].offset,
+					hot[i].count, hot[i].error);
+	}
+#undef REPORT
+	return len;
 }
 
 #ifdef CLOCKDISK_GRADING
-#define STATDISK_GETTER(stat) \
+#define STATDISK_GETTER(stat, op) \
 unsigned int statdisk_get##stat(block_store_t *this_bs) { \
-    return ((struct statdisk_state*)this_bs->state)->stat; \
+    return ((struct statdisk_state*)this_bs->state)->ops[op].count; \
 }
-STATDISK_GETTER(ngetsize)
-STATDISK_GETTER(nsetsize)
-STATDISK_GETTER(nread)
-STATDISK_GETTER(nwrite)
-STATDISK_GETTER(nsync)
+STATDISK_GETTER(ngetsize, STAT_GETSIZE)
+STATDISK_GETTER(nsetsize, STAT_SETSIZE)
+STATDISK_GETTER(nread, STAT_READ)
+STATDISK_GETTER(nwrite, STAT_WRITE)
+STATDISK_GETTER(nsync, STAT_SYNC)
 #undef STATDISK_GETTER
 #endif
 
@@ -111,5 +389,8 @@ block_store_t *statdisk_init(block_store_t *below){
 	this_bs->write = statdisk_write;
 	this_bs->release = statdisk_release;
 	this_bs->sync = statdisk_sync;
+	this_bs->readv = statdisk_readv;
+	this_bs->writev = statdisk_writev;
+	this_bs->hint = statdisk_hint;
 	return this_bs;
 }
@@ -0,0 +1,529 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module puts a small, fast block store in front of a
+ * large, slow one as a second-level cache.  The cache is kept on the fast
+ * store, along with its metadata, so it is still warm when the block
+ * store is opened again.  The interface is as follows:
+ *
+ *		int tierdisk_create(block_if fast, unsigned int fast_ino)
+ *			Initialize inode 'fast_ino' of 'fast' as an empty cache,
+ *			unless it already is one.
+ *
+ *		block_if tierdisk_init(block_if fast, unsigned int fast_ino,
+ *								block_if slow, enum tierdisk_mode mode)
+ *			Open the cache on inode 'fast_ino' of 'fast', in front of
+ *			all inodes of 'slow'.  With TIER_WRITE_THROUGH every write
+ *			goes to the slow store, and the fast store only holds
+ *			copies.  With TIER_WRITE_BACK writes to cached blocks only
+ *			go to the fast store, and are written to the slow store when
+ *			the block is evicted or on sync.
+ *
+ *		void tierdisk_dump_stats(block_if bi)
+ *			Print the hit rates and how many blocks were promoted,
+ *			evicted, and written back.
+ *
+ * Block 0 of the fast store is the superblock, followed by a table with
+ * an entry per cache slot, saying which block of the slow store it holds
+ * and whether it is dirty, and then the slots.  The cache is set
+ * associative with TIER_WAYS slots per set, replacing the least recently
+ * used slot of a set.  Only hot blocks are promoted into the cache: each
+ * set remembers the last TIER_WAYS blocks that missed, and a block is
+ * promoted when it misses TIER_PROMOTE times, so that a scan does not
+ * wipe out the cache.  Table entries are written as soon as they change,
+ * a slot is marked empty before it is reused, and marked dirty before a
+ * write overwrites its copy (in both modes), so the table is valid even
+ * if the block store is never closed.  With write-through the slot stays
+ * marked dirty until the next sync, so that further writes to it cost
+ * just the two copies and no table write; as the slow store already has
+ * the block, it is then marked clean without being written back.  The
+ * slow store should not be changed other than through the cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <egos/block_store.h>
+
+#define TIER_MAGIC		0x44117E12
+#define TIER_WAYS		8			// slots per set
+#define TIER_PROMOTE	2			// #misses before a block is promoted
+
+/* Flags in a table entry.
+ */
+#define TIER_VALID		0x1
+#define TIER_DIRTY		0x2
+
+struct tierdisk_superblock {
+	uint32_t magic;
+	uint32_t nslots;		// #slots, a multiple of TIER_WAYS
+	uint32_t ntable;		// #table blocks, following the superblock
+};
+
+struct tierdisk_entry {
+	uint32_t ino;			// block of the slow store held
+	uint32_t offset;
+	uint32_t flags;			// TIER_VALID, TIER_DIRTY
+};
+
+#define ENTRIES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct tierdisk_entry))
+
+union tierdisk_block {
+	struct tierdisk_superblock superblock;
+	struct tierdisk_entry entries[ENTRIES_PER_BLOCK];
+	block_t block;
+};
+
+/* A block of the slow store that recently missed.
+ */
+struct tierdisk_ghost {
+	uint32_t ino, offset;
+	unsigned int count;		// #misses, 0 if unused
+	unsigned long used;		// time of last miss
+};
+
+struct tierdisk_state {
+	block_if fast;			// fast store, holding the cache
+	unsigned int fast_ino;	// inode of the fast store
+	block_if slow;			// slow store
+	enum tierdisk_mode mode;
+	struct tierdisk_superblock sb;
+	block_no nsets;			// #sets
+
+	/* The table, with the blocks to be written marked dirty.
+	 */
+	union tierdisk_block *table;
+	bool *table_dirty;
+
+	unsigned long clock;	// counts operations
+	unsigned long *used;	// time of last use of each slot
+	bool *through;			// dirty slots whose block the slow store has too
+	struct tierdisk_ghost *ghosts;	// TIER_WAYS per set
+
+	/* Statistics.
+	 */
+	unsigned int nreads, read_hits;
+	unsigned int nwrites, write_hits;
+	unsigned int npromoted;			// blocks copied into the cache
+	unsigned int nevicted;			// blocks dropped from the cache
+	unsigned int nwriteback;		// dirty blocks written to the slow store
+};
+
+#define NONE		((block_no) -1)
+
+static struct tierdisk_entry *tier_entry(struct tierdisk_state *ts, block_no slot){
+	return &ts->table[slot / ENTRIES_PER_BLOCK].entries[slot % ENTRIES_PER_BLOCK];
+}
+
+static void tier_set_entry(struct tierdisk_state *ts, block_no slot,
+							uint32_t ino, uint32_t offset, uint32_t flags){
+	struct tierdisk_entry *e = tier_entry(ts, slot);
+
+	e->ino = ino;
+	e->offset = offset;
+	e->flags = flags;
+	ts->table_dirty[slot / ENTRIES_PER_BLOCK] = true;
+}
+
+/* Write the table blocks that changed.
+ */
+static int tier_write_table(struct tierdisk_state *ts){
+	block_no b;
+	int result = 0;
+
+	for (b = 0; b < ts->sb.ntable; b++) {
+		if (ts->table_dirty[b]) {
+			if ((*ts->fast->write)(ts->fast, ts->fast_ino, 1 + b, &ts->table[b].block) < 0) {
+				result = -1;
+				continue;
+			}
+			ts->table_dirty[b] = false;
+		}
+	}
+	return result;
+}
+
+static block_no tier_set(struct tierdisk_state *ts, unsigned int ino, block_no offset){
+	return (offset + ino * 2654435761u) % ts->nsets;
+}
+
+/* Return the slot that holds the given block, or NONE.
+ */
+static block_no tier_lookup(struct tierdisk_state *ts, unsigned int ino, block_no offset){
+	block_no first = tier_set(ts, ino, offset) * TIER_WAYS, slot;
+
+	for (slot = first; slot < first + TIER_WAYS; slot++) {
+		struct tierdisk_entry *e = tier_entry(ts, slot);
+		if ((e->flags & TIER_VALID) && e->ino == ino && e->offset == offset) {
+			return slot;
+		}
+	}
+	return NONE;
+}
+
+/* Count a miss on the given block, and return whether it is hot enough
+ * to be promoted.
+ */
+static bool tier_hot(struct tierdisk_state *ts, unsigned int ino, block_no offset){
+	struct tierdisk_ghost *g = &ts->ghosts[tier_set(ts, ino, offset) * TIER_WAYS];
+	struct tierdisk_ghost *lru = g;
+	unsigned int i;
+
+	for (i = 0; i < TIER_WAYS; i++) {
+		if (g[i].count != 0 && g[i].ino == ino && g[i].offset == offset) {
+			g[i].used = ts->clock;
+			if (++g[i].count < TIER_PROMOTE) {
+				return false;
+			}
+			g[i].count = 0;
+			return true;
+		}
+		if (g[i].count == 0 || (lru->count != 0 && g[i].used < lru->used)) {
+			lru = &g[i];
+		}
+	}
+	lru->ino = ino;
+	lru->offset = offset;
+	lru->count = 1;
+	lru->used = ts->clock;
+	return TIER_PROMOTE <= 1;
+}
+
+/* Write back a dirty slot to the slow store, unless it already has the
+ * block.  The table entry is updated but not written.
+ */
+static int tier_clean(struct tierdisk_state *ts, block_no slot){
+	struct tierdisk_entry *e = tier_entry(ts, slot);
+	block_t block;
+
+	if (!ts->through[slot]) {
+		if ((*ts->fast->read)(ts->fast, ts->fast_ino, ts->sb.ntable + 1 + slot, &block) < 0) {
+			return -1;
+		}
+		if ((*ts->slow->write)(ts->slow, e->ino, e->offset, &block) < 0) {
+			return -1;
+		}
+		ts->nwriteback++;
+	}
+	ts->through[slot] = false;
+	tier_set_entry(ts, slot, e->ino, e->offset, e->flags & ~TIER_DIRTY);
+	return 0;
+}
+
+/* Copy a block into the cache, replacing the least recently used slot in
+ * its set.  Returns the slot, or NONE if it could not be done.
+ */
+static block_no tier_promote(struct tierdisk_state *ts, unsigned int ino, block_no offset,
+										block_t *block, uint32_t flags){
+	block_no first = tier_set(ts, ino, offset) * TIER_WAYS, slot, victim = first;
+
+	for (slot = first; slot < first + TIER_WAYS; slot++) {
+		if (!(tier_entry(ts, slot)->flags & TIER_VALID)) {
+			victim = slot;
+			break;
+		}
+		if (ts->used[slot] < ts->used[victim]) {
+			victim = slot;
+		}
+	}
+
+	/* Empty the slot before it is overwritten.
+	 */
+	struct tierdisk_entry *e = tier_entry(ts, victim);
+	if (e->flags & TIER_VALID) {
+		if ((e->flags & TIER_DIRTY) && tier_clean(ts, victim) < 0) {
+			return NONE;
+		}
+		tier_set_entry(ts, victim, 0, 0, 0);
+		ts->nevicted++;
+		if (tier_write_table(ts) < 0) {
+			return NONE;
+		}
+	}
+
+	if ((*ts->fast->write)(ts->fast, ts->fast_ino, ts->sb.ntable + 1 + victim, block) < 0) {
+		return NONE;
+	}
+	tier_set_entry(ts, victim, ino, offset, TIER_VALID | flags);
+	ts->through[victim] = false;
+	if (tier_write_table(ts) < 0) {
+		return NONE;
+	}
+	ts->used[victim] = ts->clock;
+	ts->npromoted++;
+	return victim;
+}
+
+static int tierdisk_getninodes(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+
+	return (*ts->slow->getninodes)(ts->slow);
+}
+
+static int tierdisk_getsize(block_if bi, unsigned int ino){
+	struct tierdisk_state *ts = bi->state;
+
+	return (*ts->slow->getsize)(ts->slow, ino);
+}
+
+static int tierdisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	struct tierdisk_state *ts = bi->state;
+	block_no slot;
+
+	for (slot = 0; slot < ts->sb.nslots; slot++) {
+		struct tierdisk_entry *e = tier_entry(ts, slot);
+		if ((e->flags & TIER_VALID) && e->ino == ino && e->offset >= nblocks) {
+			tier_set_entry(ts, slot, 0, 0, 0);
+			ts->through[slot] = false;
+		}
+	}
+	if (tier_write_table(ts) < 0) {
+		return -1;
+	}
+	return (*ts->slow->setsize)(ts->slow, ino, nblocks);
+}
+
+static int tierdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct tierdisk_state *ts = bi->state;
+
+	ts->clock++;
+	ts->nreads++;
+	block_no slot = tier_lookup(ts, ino, offset);
+	if (slot != NONE) {
+		ts->read_hits++;
+		ts->used[slot] = ts->clock;
+		return (*ts->fast->read)(ts->fast, ts->fast_ino, ts->sb.ntable + 1 + slot, block);
+	}
+
+	int r = (*ts->slow->read)(ts->slow, ino, offset, block);
+	if (r >= 0 && tier_hot(ts, ino, offset)) {
+		(void) tier_promote(ts, ino, offset, block, 0);
+	}
+	return r;
+}
+
+static int tierdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct tierdisk_state *ts = bi->state;
+
+	ts->clock++;
+	ts->nwrites++;
+	block_no slot = tier_lookup(ts, ino, offset);
+	if (slot != NONE) {
+		ts->write_hits++;
+		ts->used[slot] = ts->clock;
+
+		/* The entry is marked dirty before the copy is overwritten, so
+		 * that after a crash in between the copy is still written back.
+		 * With write-through it stays dirty until the next sync.
+		 */
+		if (!(tier_entry(ts, slot)->flags & TIER_DIRTY)) {
+			tier_set_entry(ts, slot, ino, offset, TIER_VALID | TIER_DIRTY);
+			if (tier_write_table(ts) < 0) {
+				return -1;
+			}
+		}
+		if ((*ts->fast->write)(ts->fast, ts->fast_ino, ts->sb.ntable + 1 + slot, block) < 0) {
+			if (ts->mode == TIER_WRITE_BACK) {
+				return -1;
+			}
+
+			/* The old copy is the same as the slow store; drop it.
+			 */
+			tier_set_entry(ts, slot, 0, 0, 0);
+			ts->through[slot] = false;
+			ts->nevicted++;
+			if (tier_write_table(ts) < 0) {
+				return -1;
+			}
+			return (*ts->slow->write)(ts->slow, ino, offset, block);
+		}
+		if (ts->mode == TIER_WRITE_BACK) {
+			return 0;
+		}
+		if ((*ts->slow->write)(ts->slow, ino, offset, block) < 0) {
+			ts->through[slot] = false;
+			return -1;
+		}
+		ts->through[slot] = true;
+		return 0;
+	}
+
+	bool hot = tier_hot(ts, ino, offset);
+	if (ts->mode == TIER_WRITE_BACK && hot &&
+					tier_promote(ts, ino, offset, block, TIER_DIRTY) != NONE) {
+		return 0;
+	}
+	if ((*ts->slow->write)(ts->slow, ino, offset, block) < 0) {
+		return -1;
+	}
+	if (ts->mode == TIER_WRITE_THROUGH && hot) {
+		(void) tier_promote(ts, ino, offset, block, 0);
+	}
+	return 0;
+}
+
+static int tierdisk_sync(block_if bi, unsigned int ino){
+	struct tierdisk_state *ts = bi->state;
+	block_no slot;
+	int result = 0;
+
+	for (slot = 0; slot < ts->sb.nslots; slot++) {
+		struct tierdisk_entry *e = tier_entry(ts, slot);
+		if ((e->flags & TIER_DIRTY) && (e->ino == ino || ino == (unsigned int) -1)) {
+			if (tier_clean(ts, slot) < 0) {
+				result = -1;
+			}
+		}
+	}
+	if (tier_write_table(ts) < 0) {
+		result = -1;
+	}
+	if ((*ts->fast->sync)(ts->fast, ts->fast_ino) < 0) {
+		result = -1;
+	}
+	if ((*ts->slow->sync)(ts->slow, ino) < 0) {
+		result = -1;
+	}
+	return result;
+}
+
+static void tierdisk_release(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+	block_no slot;
+
+	for (slot = 0; slot < ts->sb.nslots; slot++) {
+		if (ts->through[slot]) {
+			(void) tier_clean(ts, slot);
+		}
+	}
+	(void) tier_write_table(ts);
+	free(ts->table);
+	free(ts->table_dirty);
+	free(ts->used);
+	free(ts->through);
+	free(ts->ghosts);
+	free(ts);
+	free(bi);
+}
+
+void tierdisk_dump_stats(block_if bi){
+	struct tierdisk_state *ts = bi->state;
+	block_no slot, nvalid = 0, ndirty = 0;
+
+	for (slot = 0; slot < ts->sb.nslots; slot++) {
+		struct tierdisk_entry *e = tier_entry(ts, slot);
+		nvalid += (e->flags & TIER_VALID) != 0;
+		ndirty += (e->flags & TIER_DIRTY) != 0;
+	}
+	printf("!$TIER: %s, %u slots, %u in use, %u dirty\n",
+					ts->mode == TIER_WRITE_BACK ? "write-back" : "write-through",
+					ts->sb.nslots, nvalid, ndirty);
+	printf("!$TIER: %u reads (%u hits), %u writes (%u hits)\n",
+					ts->nreads, ts->read_hits, ts->nwrites, ts->write_hits);
+	printf("!$TIER: %u promoted, %u evicted, %u written back\n",
+					ts->npromoted, ts->nevicted, ts->nwriteback);
+}
+
+int tierdisk_create(block_if fast, unsigned int fast_ino){
+	union tierdisk_block blk;
+
+	if (sizeof(blk) != BLOCK_SIZE) {
+		fprintf(stderr, "tierdisk_create: block has wrong size\n");
+		return -1;
+	}
+	if ((*fast->read)(fast, fast_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	if (blk.superblock.magic == TIER_MAGIC) {
+		return 0;
+	}
+
+	int nfast = (*fast->getsize)(fast, fast_ino);
+	if (nfast < 0) {
+		return -1;
+	}
+	block_no ntable = 0, nslots = 0;
+	while (1 + ntable + nslots < (block_no) nfast) {
+		nslots++;
+		ntable = (nslots + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+	}
+	if (1 + ntable + nslots > (block_no) nfast) {
+		nslots--;
+	}
+	nslots -= nslots % TIER_WAYS;
+	if (nslots == 0) {
+		fprintf(stderr, "tierdisk_create: too few blocks\n");
+		return -1;
+	}
+
+	/* All slots are empty.
+	 */
+	block_no b;
+	memset(&blk, 0, sizeof(blk));
+	for (b = 0; b < ntable; b++) {
+		if ((*fast->write)(fast, fast_ino, 1 + b, &blk.block) < 0) {
+			return -1;
+		}
+	}
+	blk.superblock.magic = TIER_MAGIC;
+	blk.superblock.nslots = nslots;
+	blk.superblock.ntable = ntable;
+	if ((*fast->write)(fast, fast_ino, 0, &blk.block) < 0) {
+		return -1;
+	}
+	return (*fast->sync)(fast, fast_ino);
+}
+
+block_if tierdisk_init(block_if fast, unsigned int fast_ino, block_if slow, enum tierdisk_mode mode){
+	union tierdisk_block blk;
+	block_no b;
+
+	if ((*fast->read)(fast, fast_ino, 0, &blk.block) < 0) {
+		return 0;
+	}
+	if (blk.superblock.magic != TIER_MAGIC) {
+		fprintf(stderr, "!!tierdisk_init: not a cache block store\n");
+		return 0;
+	}
+
+	struct tierdisk_state *ts = new_alloc(struct tierdisk_state);
+	ts->fast = fast;
+	ts->fast_ino = fast_ino;
+	ts->slow = slow;
+	ts->mode = mode;
+	ts->sb = blk.superblock;
+	ts->nsets = ts->sb.nslots / TIER_WAYS;
+	ts->table = malloc(ts->sb.ntable * sizeof(*ts->table));
+	ts->table_dirty = calloc(ts->sb.ntable, sizeof(*ts->table_dirty));
+	ts->used = calloc(ts->sb.nslots, sizeof(*ts->used));
+	ts->through = calloc(ts->sb.nslots, sizeof(*ts->through));
+	ts->ghosts = calloc(ts->sb.nslots, sizeof(*ts->ghosts));
+
+	for (b = 0; b < ts->sb.ntable; b++) {
+		if ((*fast->read)(fast, fast_ino, 1 + b, &ts->table[b].block) < 0) {
+			fprintf(stderr, "!!tierdisk_init: can't read table block %u\n", b);
+			free(ts->table);
+			free(ts->table_dirty);
+			free(ts->used);
+			free(ts->through);
+			free(ts->ghosts);
+			free(ts);
+			return 0;
+		}
+	}
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ts;
+	bi->getninodes = tierdisk_getninodes;
+	bi->getsize = tierdisk_getsize;
+	bi->setsize = tierdisk_setsize;
+	bi->read = tierdisk_read;
+	bi->write = tierdisk_write;
+	bi->release = tierdisk_release;
+	bi->sync = tierdisk_sync;
+	return bi;
+}
@@ -0,0 +1,313 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* This block store module forwards its method calls to an underlying
+ * block store, and records each of them in a trace file that can be
+ * replayed later (see src/apps/replay.c):
+ *
+ *		block_if tracedisk_init(block_if below, char *trace)
+ *			'below' is the underlying block store.  'trace' is the name
+ *			of the file to write the trace to.
+ *
+ *		struct tracedisk_reader *tracedisk_open(const char *trace)
+ *			Open a trace file for reading.
+ *
+ *		int tracedisk_next(struct tracedisk_reader *tr, struct tracedisk_op *op)
+ *			Read the next operation from the trace.  Returns 1 if there
+ *			is one, 0 at the end of the trace, and -1 if the trace is
+ *			corrupt.
+ *
+ *		void tracedisk_close(struct tracedisk_reader *tr)
+ *			Close the trace.
+ *
+ * A trace starts with a header with TRACE_MAGIC and the block size.  Each
+ * operation is then recorded as a byte with the operation type (and the
+ * top bit set if it failed), followed by the time since the previous
+ * operation started and the time it took in microseconds, and the inode,
+ * offset and number of blocks if the operation has them.  These numbers
+ * are encoded 7 bits per byte, low bits first, with the top bit set in
+ * all bytes but the last, so most operations take 6 to 10 bytes.  The
+ * operations are buffered in memory and written when the buffer is full
+ * and on sync.  The data is not recorded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <egos/block_store.h>
+
+#define TRACE_MAGIC			0x44117ACE
+#define TRACE_BUFSIZE		(64 * 1024)
+#define TRACE_MAXLONG		((8 * sizeof(unsigned long) + 6) / 7)	// max bytes per time
+#define TRACE_MAXINT		5		// max bytes per ino, offset or nblocks
+#define TRACE_MAXREC		(1 + 2 * TRACE_MAXLONG + 3 * TRACE_MAXINT)	// max size of one operation
+
+#define TRACE_FAILED		0x80
+
+struct tracedisk_header {
+	uint32_t magic;
+	uint32_t block_size;
+};
+
+struct tracedisk_state {
+	block_if below;				// block store below
+	FILE *fp;					// trace file
+	unsigned long last;			// start of the previous operation
+	unsigned int n;				// #bytes in buf
+	uint8_t buf[TRACE_BUFSIZE];
+};
+
+struct tracedisk_reader {
+	FILE *fp;
+	unsigned long time;			// start of the previous operation
+};
+
+static int tracedisk_flush(struct tracedisk_state *ts){
+	if (ts->n > 0 && fwrite(ts->buf, 1, ts->n, ts->fp) != ts->n) {
+		fprintf(stderr, "!!tracedisk: can't write trace\n");
+		ts->n = 0;
+		return -1;
+	}
+	ts->n = 0;
+	return 0;
+}
+
+static void tracedisk_put(struct tracedisk_state *ts, unsigned long x){
+	while (x >= 0x80) {
+		ts->buf[ts->n++] = (x & 0x7F) | 0x80;
+		x >>= 7;
+	}
+	ts->buf[ts->n++] = x;
+}
+
+/* Record an operation that started at 'start' and returned 'result'.
+ */
+static void tracedisk_record(struct tracedisk_state *ts, enum tracedisk_opcode op,
+				unsigned long start, int result, unsigned int ino,
+				block_no offset, block_no nblocks){
+	if (ts->n + TRACE_MAXREC > TRACE_BUFSIZE) {
+		(void) tracedisk_flush(ts);
+	}
+	/* Should the clock ever step back, record 0 rather than a time
+	 * that wrapped around.
+	 */
+	unsigned long now = block_store_usec();
+	ts->buf[ts->n++] = op | (result < 0 ? TRACE_FAILED : 0);
+	tracedisk_put(ts, start > ts->last ? start - ts->last : 0);
+	tracedisk_put(ts, now > start ? now - start : 0);
+	ts->last = start;
+	if (op != TRACE_GETNINODES) {
+		tracedisk_put(ts, ino);
+	}
+	if (op == TRACE_READ || op == TRACE_WRITE || op == TRACE_SETSIZE ||
+						op == TRACE_READV || op == TRACE_WRITEV) {
+		tracedisk_put(ts, offset);
+	}
+	if (op == TRACE_READV || op == TRACE_WRITEV) {
+		tracedisk_put(ts, nblocks);
+	}
+}
+
+static int tracedisk_getninodes(block_if bi){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->getninodes)(ts->below);
+	tracedisk_record(ts, TRACE_GETNINODES, start, r, 0, 0, 0);
+	return r;
+}
+
+static int tracedisk_getsize(block_if bi, unsigned int ino){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->getsize)(ts->below, ino);
+	tracedisk_record(ts, TRACE_GETSIZE, start, r, ino, 0, 0);
+	return r;
+}
+
+static int tracedisk_setsize(block_if bi, unsigned int ino, block_no nblocks){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->setsize)(ts->below, ino, nblocks);
+	tracedisk_record(ts, TRACE_SETSIZE, start, r, ino, nblocks, 0);
+	return r;
+}
+
+static int tracedisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->read)(ts->below, ino, offset, block);
+	tracedisk_record(ts, TRACE_READ, start, r, ino, offset, 1);
+	return r;
+}
+
+static int tracedisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->write)(ts->below, ino, offset, block);
+	tracedisk_record(ts, TRACE_WRITE, start, r, ino, offset, 1);
+	return r;
+}
+
+static int tracedisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = block_store_readv(ts->below, ino, offset, nblocks, blocks);
+	tracedisk_record(ts, TRACE_READV, start, r, ino, offset, nblocks);
+	return r;
+}
+
+static int tracedisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = block_store_writev(ts->below, ino, offset, nblocks, blocks);
+	tracedisk_record(ts, TRACE_WRITEV, start, r, ino, offset, nblocks);
+	return r;
+}
+
+static int tracedisk_sync(block_if bi, unsigned int ino){
+	struct tracedisk_state *ts = bi->state;
+	unsigned long start = block_store_usec();
+
+	int r = (*ts->below->sync)(ts->below, ino);
+	tracedisk_record(ts, TRACE_SYNC, start, r, ino, 0, 0);
+	if (tracedisk_flush(ts) < 0) {
+		return -1;
+	}
+	fflush(ts->fp);
+	return r;
+}
+
+static void tracedisk_release(block_if bi){
+	struct tracedisk_state *ts = bi->state;
+
+	(void) tracedisk_flush(ts);
+	fclose(ts->fp);
+	free(ts);
+	free(bi);
+}
+
+block_if tracedisk_init(block_if below, char *trace){
+	struct tracedisk_header hdr;
+	FILE *fp;
+
+	if ((fp = fopen(trace, "w")) == 0) {
+		fprintf(stderr, "!!tracedisk_init: can't create %s\n", trace);
+		return 0;
+	}
+	hdr.magic = TRACE_MAGIC;
+	hdr.block_size = BLOCK_SIZE;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		fprintf(stderr, "!!tracedisk_init: can't write %s\n", trace);
+		fclose(fp);
+		return 0;
+	}
+
+	struct tracedisk_state *ts = new_alloc(struct tracedisk_state);
+	ts->below = below;
+	ts->fp = fp;
+	ts->last = block_store_usec();
+
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ts;
+	bi->getninodes = tracedisk_getninodes;
+	bi->getsize = tracedisk_getsize;
+	bi->setsize = tracedisk_setsize;
+	bi->read = tracedisk_read;
+	bi->write = tracedisk_write;
+	bi->release = tracedisk_release;
+	bi->sync = tracedisk_sync;
+	bi->readv = tracedisk_readv;
+	bi->writev = tracedisk_writev;
+	return bi;
+}
+
+struct tracedisk_reader *tracedisk_open(const char *trace){
+	struct tracedisk_header hdr;
+	FILE *fp;
+
+	if ((fp = fopen(trace, "r")) == 0) {
+		fprintf(stderr, "!!tracedisk_open: can't open %s\n", trace);
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "!!tracedisk_open: %s is not a trace\n", trace);
+		fclose(fp);
+		return 0;
+	}
+	if (hdr.block_size != BLOCK_SIZE) {
+		fprintf(stderr, "!!tracedisk_open: %s has block size %u\n", trace, hdr.block_size);
+		fclose(fp);
+		return 0;
+	}
+	struct tracedisk_reader *tr = new_alloc(struct tracedisk_reader);
+	tr->fp = fp;
+	return tr;
+}
+
+static int tracedisk_get(struct tracedisk_reader *tr, unsigned long *x){
+	unsigned int shift;
+	int c;
+
+	*x = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = fgetc(tr->fp)) == EOF) {
+			return -1;
+		}
+		*x |= (unsigned long) (c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int tracedisk_next(struct tracedisk_reader *tr, struct tracedisk_op *op){
+	unsigned long dt, latency, ino = 0, offset = 0, nblocks = 0;
+	int c;
+
+	if ((c = fgetc(tr->fp)) == EOF) {
+		return 0;
+	}
+	op->op = c & ~TRACE_FAILED;
+	op->failed = (c & TRACE_FAILED) != 0;
+	if (op->op < TRACE_READ || op->op > TRACE_GETNINODES) {
+		return -1;
+	}
+	if (tracedisk_get(tr, &dt) < 0 || tracedisk_get(tr, &latency) < 0) {
+		return -1;
+	}
+	if (op->op != TRACE_GETNINODES && tracedisk_get(tr, &ino) < 0) {
+		return -1;
+	}
+	if ((op->op == TRACE_READ || op->op == TRACE_WRITE || op->op == TRACE_SETSIZE ||
+						op->op == TRACE_READV || op->op == TRACE_WRITEV) &&
+						tracedisk_get(tr, &offset) < 0) {
+		return -1;
+	}
+	nblocks = op->op == TRACE_READ || op->op == TRACE_WRITE ? 1 : 0;
+	if ((op->op == TRACE_READV || op->op == TRACE_WRITEV) && tracedisk_get(tr, &nblocks) < 0) {
+		return -1;
+	}
+	tr->time += dt;
+	op->time = tr->time;
+	op->latency = latency;
+	op->ino = ino;
+	op->offset = offset;
+	op->nblocks = nblocks;
+	return 1;
+}
+
+void tracedisk_close(struct tracedisk_reader *tr){
+	fclose(tr->fp);
+	free(tr);
+}
@@ -22,11 +22,26 @@
  *			Opens a virtual block store within inode below_ino of the block store below.
  *
  * The layout of the file system is described in the file "treedisk.h".
+ *
+ * Hints (see block_store.h) are kept per inode, and passed on below only
+ * when something changes, so a cache below can keep blocks in the right
+ * class without a hint on every access.  The superblock and the inode
+ * blocks are hinted as metadata once, as a single range.  When the class
+ * of an inode changes, all its data and indirect blocks are hinted with
+ * the new class, a run of consecutive blocks at a time, and blocks that
+ * it allocates later are hinted when they are allocated.  (Indirect
+ * blocks are not metadata by default, or those of a large file that was
+ * read once would hold on to the room the cache keeps for metadata.)
+ * Truncating an inode to 0 blocks, as is done when it is freed, hints its
+ * blocks as normal and makes it normal again.  Until then a metadata inode
+ * ignores other hints, such as the streaming hint readaheaddisk gives
+ * when it is read sequentially.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <egos/block_store.h>
 #include "treedisk.h"
@@ -47,11 +62,31 @@ struct treedisk_state {
 	block_store_t *below;			// block store below
 	unsigned int below_ino;			// inode number to use for the block store below
 	unsigned int ninodes;			// number of inodes in the treedisk
+	unsigned char *classes;			// enum block_hint per inode, or null
+	bool meta_hinted;				// superblock and inode blocks hinted
+};
+
+/* A run of consecutive blocks below to be hinted with the same class.
+ */
+struct treedisk_hint_run {
+	block_no start, nblocks;
+	enum block_hint class;
 };
 
 static unsigned int log_rpb;		// log2(REFS_PER_BLOCK)
 static block_t null_block;			// a block filled with null bytes
 
+/* Hint the block store below how block b is used.
+ */
+static void treedisk_hint_below(struct treedisk_state *ts, block_no b, block_no nblocks, enum block_hint hint){
+	(void) block_store_hint(ts->below, ts->below_ino, b, nblocks, hint);
+}
+
+static enum block_hint treedisk_class(struct treedisk_state *ts, unsigned int inode_no){
+	return ts->classes == 0 || inode_no >= ts->ninodes ? BLOCK_HINT_NORMAL :
+								(enum block_hint) ts->classes[inode_no];
+}
+
 static void panic(const char *s){
 	fprintf(stderr, "Panic: %s\n", s);
 	exit(1);
@@ -72,11 +107,17 @@ static block_no log_shift_r(block_no x, unsigned int nbits){
  */
 static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 								struct treedisk_state *ts, unsigned int inode_no){
-	/* Get the superblock.
+	/* Get the superblock.  The first time, hint it and the inode blocks
+	 * as metadata.
 	 */
 	if ((*ts->below->read)(ts->below, ts->below_ino, 0, (block_t *) &snapshot->superblock) < 0) {
 		return -1;
 	}
+	if (!ts->meta_hinted) {
+		treedisk_hint_below(ts, 0, 1 + snapshot->superblock.superblock.n_inodeblocks,
+								BLOCK_HINT_METADATA);
+		ts->meta_hinted = true;
+	}
 
 	/* Check the inode number.
 	 */
@@ -95,6 +136,61 @@ static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 	return 0;
 }
 
+/* Add block b to the run, hinting the run below if b does not extend it.
+ */
+static void treedisk_hint_add(struct treedisk_state *ts, struct treedisk_hint_run *run, block_no b){
+	if (run->nblocks > 0 && b == run->start + run->nblocks) {
+		run->nblocks++;
+		return;
+	}
+	if (run->nblocks > 0) {
+		treedisk_hint_below(ts, run->start, run->nblocks, run->class);
+	}
+	run->start = b;
+	run->nblocks = 1;
+}
+
+static int treedisk_hint_tree(struct treedisk_state *ts, struct treedisk_hint_run *run,
+								block_no b, unsigned int nlevels){
+	if (b == 0) {
+		return 0;
+	}
+	treedisk_hint_add(ts, run, b);
+	if (nlevels == 0) {
+		return 0;
+	}
+	union treedisk_block indirblock;
+	if ((*ts->below->read)(ts->below, ts->below_ino, b, (block_t *) &indirblock) < 0) {
+		return -1;
+	}
+	for (unsigned int i = 0; i < REFS_PER_BLOCK; i++) {
+		if (treedisk_hint_tree(ts, run, indirblock.indirblock.refs[i], nlevels - 1) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Hint all data and indirect blocks of the inode in the snapshot below.
+ */
+static int treedisk_hint_file(struct treedisk_state *ts, struct treedisk_snapshot *snapshot,
+								enum block_hint class){
+	struct treedisk_hint_run run = { 0, 0, class };
+	unsigned int nlevels = 0;
+
+	if (snapshot->inode->nblocks == 0) {
+		return 0;
+	}
+	while (log_shift_r(snapshot->inode->nblocks - 1, nlevels * log_rpb) != 0) {
+		nlevels++;
+	}
+	int r = treedisk_hint_tree(ts, &run, snapshot->inode->root, nlevels);
+	if (run.nblocks > 0) {
+		treedisk_hint_below(ts, run.start, run.nblocks, class);
+	}
+	return r;
+}
+
 /* Allocate a block from the free list.
  */
 static block_no treedisk_alloc_block(struct treedisk_state *ts, struct treedisk_snapshot *snapshot){
@@ -273,6 +369,14 @@ static int treedisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
 
 	struct treedisk_snapshot snapshot;
 	treedisk_get_snapshot(&snapshot, ts, ino);
+
+	/* The inode may be reused for a different kind of file, so forget
+	 * how it was hinted, and let its blocks go back to normal.
+	 */
+	if (nblocks == 0 && treedisk_class(ts, ino) != BLOCK_HINT_NORMAL) {
+		(void) treedisk_hint_file(ts, &snapshot, BLOCK_HINT_NORMAL);
+		ts->classes[ino] = BLOCK_HINT_NORMAL;
+	}
 	if (nblocks == snapshot.inode->nblocks) {
 		return nblocks;
 	}
@@ -356,6 +460,96 @@ static int treedisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
 	return 0;
 }
 
+/* Read blocks offset .. offset + nblocks - 1 into blocks[].  The block
+ * numbers below are looked up first, reading each indirect block only
+ * once, and then each run of consecutive blocks below is read with a
+ * single readv.
+ */
+static int treedisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset,
+								block_no nblocks, block_t *blocks){
+	struct treedisk_state *ts = this_bs->state;
+
+	if (nblocks == 0) {
+		return 0;
+	}
+
+	/* Get info from underlying file system.
+	 */
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
+		return -1;
+	}
+
+	/* See if the range is too big.
+	 */
+	if (offset >= snapshot.inode->nblocks || nblocks > snapshot.inode->nblocks - offset) {
+		fprintf(stderr, "!!TDERR: range too large %u %u %u\n", offset, nblocks, snapshot.inode->nblocks);
+		return -1;
+	}
+
+	/* Figure out how many levels there are in the tree.
+	 */
+	unsigned int nlevels = 0;
+	while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) != 0) {
+		nlevels++;
+	}
+
+	/* Map each block to the block below (0 for a hole).  leaf holds the
+	 * lowest level indirect block for the blocks leaf_no << log_rpb and on.
+	 */
+	block_no *map = malloc(nblocks * sizeof(block_no));
+	union treedisk_block leaf;
+	block_no leaf_no = (block_no) -1, i, j;
+	for (i = 0; i < nblocks; i++) {
+		block_no off = offset + i;
+		if (nlevels == 0) {
+			map[i] = snapshot.inode->root;
+			continue;
+		}
+		if (log_shift_r(off, log_rpb) != leaf_no) {
+			block_no b = snapshot.inode->root;
+			unsigned int level = nlevels;
+			while (b != 0 && level > 1) {
+				if ((*ts->below->read)(ts->below, ts->below_ino, b, (block_t *) &leaf) < 0) {
+					free(map);
+					return -1;
+				}
+				level--;
+				b = leaf.indirblock.refs[log_shift_r(off, level * log_rpb) % REFS_PER_BLOCK];
+			}
+			if (b == 0) {
+				memset(&leaf, 0, sizeof(leaf));
+			}
+			else {
+				if ((*ts->below->read)(ts->below, ts->below_ino, b, (block_t *) &leaf) < 0) {
+					free(map);
+					return -1;
+				}
+			}
+			leaf_no = log_shift_r(off, log_rpb);
+		}
+		map[i] = leaf.indirblock.refs[off % REFS_PER_BLOCK];
+	}
+
+	/* Read the runs.
+	 */
+	for (i = 0; i < nblocks; i = j) {
+		if (map[i] == 0) {
+			memset(&blocks[i], 0, BLOCK_SIZE);
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < nblocks && map[j] == map[j - 1] + 1; j++)
+			;
+		if (block_store_readv(ts->below, ts->below_ino, map[i], j - i, &blocks[i]) < 0) {
+			free(map);
+			return -1;
+		}
+	}
+	free(map);
+	return 0;
+}
+
 /* Write *block at the given block number 'offset'.
  */
 static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
@@ -411,6 +605,9 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 			tib.refs[0] = snapshot->inode->root;
 			snapshot->inode->root = indir;
 			dirty_inode = 1;
+			if (treedisk_class(ts, ino) != BLOCK_HINT_NORMAL) {
+				treedisk_hint_below(ts, indir, 1, treedisk_class(ts, ino));
+			}
 			if ((*ts->below->write)(ts->below, ts->below_ino, indir, (block_t *) &tib) < 0) {
 				panic("treedisk_write: indirect block");
 			}
@@ -440,6 +637,9 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 		struct treedisk_indirblock tib;
 		if ((b = *parent_no) == 0) {
 			b = *parent_no = treedisk_alloc_block(ts, snapshot);
+			if (treedisk_class(ts, ino) != BLOCK_HINT_NORMAL) {
+				treedisk_hint_below(ts, b, 1, treedisk_class(ts, ino));
+			}
 			if ((*ts->below->write)(ts->below, ts->below_ino, parent_off, parent_block) < 0) {
 				panic("treedisk_write: parent");
 			}
@@ -472,8 +672,46 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 	return 0;
 }
 
+/* Remember the hint for the inode, and if its class changes, hint its
+ * blocks below.  Hints are per inode, so the range is ignored.  A metadata
+ * inode keeps its class until it is truncated.
+ */
+static int treedisk_hint(block_store_t *this_bs, unsigned int ino, block_no offset,
+								block_no nblocks, enum block_hint hint){
+	struct treedisk_state *ts = this_bs->state;
+
+	if ((unsigned int) hint > BLOCK_HINT_STREAM) {
+		fprintf(stderr, "!!TDERR: bad hint %d\n", hint);
+		return -1;
+	}
+	struct treedisk_snapshot snapshot;
+	if (ts->classes == 0) {
+		if (treedisk_get_snapshot(&snapshot, ts, 0) < 0) {
+			return -1;
+		}
+		ts->ninodes = snapshot.superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+		ts->classes = calloc(ts->ninodes, 1);
+	}
+	if (ino >= ts->ninodes) {
+		fprintf(stderr, "!!TDERR: inode number too large %u\n", ino);
+		return -1;
+	}
+	if (hint == ts->classes[ino] ||
+			(hint != BLOCK_HINT_METADATA && ts->classes[ino] == BLOCK_HINT_METADATA)) {
+		return 0;
+	}
+	ts->classes[ino] = hint;
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
+		return -1;
+	}
+	return treedisk_hint_file(ts, &snapshot, hint);
+}
+
 static void treedisk_release(block_store_t *this_bs){
-	free(this_bs->state);
+	struct treedisk_state *ts = this_bs->state;
+
+	free(ts->classes);
+	free(ts);
 	free(this_bs);
 }
 
@@ -510,6 +748,8 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int below_ino){
 	this_bs->write = treedisk_write;
 	this_bs->release = treedisk_release;
 	this_bs->sync = treedisk_sync;
+	this_bs->readv = treedisk_readv;
+	this_bs->hint = treedisk_hint;
 	return this_bs;
 }
 
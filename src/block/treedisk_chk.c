@@ -6,6 +6,34 @@
 /* Author: Robbert van Renesse, August 2015
  *
  * Code to check the integrity of a treedisk file system.
+ *
+ * The checker streams over the underlying store rather than chasing
+ * pointers recursively.  It keeps two compact bitmaps (one bit per
+ * block): one for the blocks on the free list and one for blocks that
+ * are referenced by an inode.  The free list is scanned first.  The
+ * inode trees are then validated one level at a time: all the indirect
+ * blocks of a level are sorted by block number and read in ascending
+ * order, so the underlying store sees a sequential sweep per level
+ * instead of a random walk.  Each reference is checked against the two
+ * bitmaps as it is found.
+ *
+ *		int treedisk_check(block_if below)
+ *			Check the file system on inode 0 of 'below'.  Returns 1
+ *			if the file system is consistent and 0 if not.
+ *
+ *		int treedisk_check_parallel(block_if *below, unsigned int nthreads,
+ *										int verbose)
+ *			Same, but reads the indirect blocks of each level with a
+ *			block_store_pool of 'nthreads' workers, worker i reading
+ *			through below[i].  These must be separate handles on the same
+ *			store, such as files opened with filedisk_open_readonly(), as
+ *			they are used at the same time.  If 'verbose' is set, prints
+ *			how long the check took.
+ *
+ * Only the reads are done by the workers: a batch of runs of consecutive
+ * indirect blocks, one run per worker, is read at a time, and then the
+ * references in them are checked by the caller.  Inside EGOS the pool
+ * does the reads one after the other.
  */
 
 #include <stdio.h>
@@ -14,10 +42,37 @@
 #include <egos/block_store.h>
 #include "treedisk.h"
 
+#define CHK_BATCH		64		// max #indirect blocks read per worker per batch
+
 static unsigned int log_rpb;		// log2(REFS_PER_BLOCK)
 
-struct block_info {
-	enum { BI_UNKNOWN, BI_SUPER, BI_INODE, BI_INDIR, BI_DATA, BI_FREELIST, BI_FREE } status;
+/* An indirect block that still has to be scanned.
+ */
+struct chk_ref {
+	block_no node;				// block number of the indirect block
+	block_no nblocks;			// size of the file
+	block_no offset;			// first offset in the file covered by node
+	unsigned int nlevels;		// #levels of the tree rooted at node
+};
+
+/* A growable list of indirect blocks to scan.
+ */
+struct chk_list {
+	struct chk_ref *refs;
+	unsigned int n, max;
+};
+
+struct chk_state {
+	block_store_t **below;		// one handle per worker
+	unsigned int nworkers;
+	struct block_store_pool *pool;
+	struct block_store_xfer *xfers;			// one per worker
+	struct treedisk_indirblock *ibs;		// CHK_BATCH per worker
+	block_no fs_nblocks;		// size of the underlying store
+	unsigned char *freemap;		// blocks on the free list
+	unsigned char *usedmap;		// blocks referenced by an inode
+	unsigned long nread;		// #blocks read
+	int ok;						// cleared upon first error
 };
 
 /* Stupid ANSI C compiler leaves shifting by #bits in unsigned int or more
@@ -30,57 +85,158 @@ static block_no log_shift_r(block_no x, unsigned int nbits){
 	return x >> nbits;
 }
 
-static int check_inode(block_store_t *below, block_no nblocks, block_no node, unsigned int nlevels, block_no offset, block_no fs_nblocks, struct block_info *binfo){
-	/* Basic sanity checks.
-	 */
+static int bitmap_test(unsigned char *map, block_no b){
+	return (map[b / 8] >> (b % 8)) & 1;
+}
+
+/* Set bit b and return its old value.
+ */
+static int bitmap_test_and_set(unsigned char *map, block_no b){
+	unsigned char mask = 1 << (b % 8), old = map[b / 8];
+
+	map[b / 8] |= mask;
+	return (old & mask) != 0;
+}
+
+static void chk_error(struct chk_state *cs, const char *msg, block_no b){
+	if (cs->ok) {
+		fprintf(stderr, "!!TDCHK: %s (block %u)\n", msg, b);
+		cs->ok = 0;
+	}
+}
+
+static void chk_list_add(struct chk_list *cl, block_no node, block_no nblocks,
+							block_no offset, unsigned int nlevels){
+	if (cl->n == cl->max) {
+		cl->max = cl->max == 0 ? 64 : cl->max * 2;
+		cl->refs = realloc(cl->refs, cl->max * sizeof(*cl->refs));
+	}
+	struct chk_ref *cr = &cl->refs[cl->n++];
+	cr->node = node;
+	cr->nblocks = nblocks;
+	cr->offset = offset;
+	cr->nlevels = nlevels;
+}
+
+static int chk_ref_cmp(const void *a, const void *b){
+	const struct chk_ref *ra = a, *rb = b;
+
+	return ra->node < rb->node ? -1 : ra->node > rb->node;
+}
+
+/* Account for a reference to block 'node', which is the root of a tree
+ * of 'nlevels' levels.  Indirect blocks are queued on 'next' to be scanned
+ * in the next sweep.  Returns 0 on error.
+ */
+static int chk_mark(struct chk_state *cs, struct chk_list *next, block_no node,
+							block_no nblocks, block_no offset, unsigned int nlevels){
 	if (node == 0) {
 		return 1;
 	}
-	if (node >= fs_nblocks) {
-		fprintf(stderr, "!!TDERR: --> %u %u %u\n", node, fs_nblocks, offset);
-		fprintf(stderr, "!!TDCHK: block off the underlying file system\n");
+	if (node >= cs->fs_nblocks) {
+		chk_error(cs, "block off the underlying file system", node);
 		return 0;
 	}
-	if (binfo[node].status != BI_UNKNOWN) {
-		fprintf(stderr, "!!TDCHK: data block already used\n");
+	if (bitmap_test(cs->freemap, node)) {
+		chk_error(cs, "block both in use and on the free list", node);
 		return 0;
 	}
-
-	/* If it's a data block, mark that and return.
-	 */
-	if (nlevels == 0) {
-		binfo[node].status = BI_DATA;
-		return 1;
+	if (bitmap_test_and_set(cs->usedmap, node)) {
+		chk_error(cs, "data block already used", node);
+		return 0;
 	}
+	if (nlevels > 0) {
+		chk_list_add(next, node, nblocks, offset, nlevels);
+	}
+	return 1;
+}
 
-	/* Scan the tree below.  Start with getting the indirect block and
-	 * calculate the size of the tree below.
-	 */
-	binfo[node].status = BI_INDIR;
-	struct treedisk_indirblock ib;
-	(*below->read)(below, 0, node, (block_t *) &ib);
-	nlevels--;
-	block_no size = 1 << (nlevels * log_rpb);
+/* Scan the indirect blocks in cur[0..n), which must be sorted by block
+ * number, and add the indirect blocks they refer to to 'next'.
+ */
+static void chk_sweep(struct chk_state *cs, struct chk_ref *cur, unsigned int n,
+												struct chk_list *next){
+	unsigned int i, j, k, m, nx, nb;
 
-	/* Now scan through the block references.
-	 */
+	for (i = 0; i < n && cs->ok; i = j) {
+		/* Give each worker a run of consecutive indirect blocks.
+		 */
+		for (j = i, nx = 0, nb = 0; j < n && nx < cs->nworkers; j = k, nx++) {
+			for (k = j + 1; k < n && k - j < CHK_BATCH && cur[k].node == cur[k - 1].node + 1; k++)
+				;
+			struct block_store_xfer *x = &cs->xfers[nx];
+			x->bs = cs->below[nx];
+			x->ino = 0;
+			x->write = 0;
+			x->offset = cur[j].node;
+			x->nblocks = k - j;
+			x->buf = (block_t *) &cs->ibs[nb];
+			nb += k - j;
+		}
+		if (block_store_pool_run(cs->pool, cs->xfers, nx) < 0) {
+			chk_error(cs, "cannot read indirect block", cur[i].node);
+			return;
+		}
+		cs->nread += nb;
+
+		for (m = i; m < j; m++) {
+			struct chk_ref *cr = &cur[m];
+			unsigned int nlevels = cr->nlevels - 1;
+			block_no size = 1 << (nlevels * log_rpb);
+			block_no offset = cr->offset;
+
+			for (k = 0; k < REFS_PER_BLOCK && offset < cr->nblocks; k++) {
+				if (!chk_mark(cs, next, cs->ibs[m - i].refs[k], cr->nblocks, offset, nlevels)) {
+					break;
+				}
+				offset += size;
+			}
+		}
+	}
+}
+
+/* Walk the free list and mark its blocks in the free bitmap.
+ */
+static int chk_freelist(struct chk_state *cs, block_no fl, block_no n_inodeblocks){
+	struct treedisk_freelistblock tfb;
 	unsigned int i;
-	for (i = 0; i < REFS_PER_BLOCK; i++) {
-		if (!check_inode(below, nblocks, ib.refs[i], nlevels, offset, fs_nblocks, binfo)) {
+
+	while (fl != 0) {
+		if (fl >= cs->fs_nblocks) {
+			fprintf(stderr, "!!TDCHK: free list block number too large\n");
 			return 0;
 		}
-		offset += size;
-		if (offset >= nblocks) {
-			break;
+		if (fl <= n_inodeblocks || bitmap_test_and_set(cs->freemap, fl)) {
+			fprintf(stderr, "!!TDCHK: free list block already in use\n");
+			return 0;
 		}
-	}
 
+		/* Read the next block off the free list.
+		 */
+		(*cs->below[0]->read)(cs->below[0], 0, fl, (block_t *) &tfb);
+		cs->nread++;
+
+		for (i = 1; i < REFS_PER_BLOCK; i++) {
+			block_no b = tfb.refs[i];
+			if (b == 0 || b >= cs->fs_nblocks) {
+				continue;
+			}
+			if (b <= n_inodeblocks || bitmap_test_and_set(cs->freemap, b)) {
+				fprintf(stderr, "!!TDERR: --> %u %u\n", fl, b);
+				fprintf(stderr, "!!TDCHK: duplicate block in free list\n");
+				return 0;
+			}
+		}
+		fl = tfb.refs[0];
+	}
 	return 1;
 }
 
-int treedisk_check(block_store_t *below){
-	struct block_info *binfo = 0;
-	block_no fs_nblocks = (*below->getsize)(below, 0);
+int treedisk_check_parallel(block_store_t **below, unsigned int nthreads, int verbose){
+	block_no fs_nblocks = (*below[0]->getsize)(below[0], 0);
+	unsigned long start = block_store_usec();
+	struct chk_list cur, next;
+	struct chk_state cs;
 	block_no b;
 
 	if (fs_nblocks == 0) {
@@ -98,12 +254,13 @@ int treedisk_check(block_store_t *below){
 	/* Get the superblock.
 	 */
 	union treedisk_block superblock;
-	(*below->read)(below, 0, 0, (block_t *) &superblock);
+	(*below[0]->read)(below[0], 0, 0, (block_t *) &superblock);
+	block_no n_inodeblocks = superblock.superblock.n_inodeblocks;
 
 	/* Check the superblock.
 	 */
-	if (1 + superblock.superblock.n_inodeblocks > fs_nblocks) {
-		fprintf(stderr, "!!TDERR: %u %u\n", superblock.superblock.n_inodeblocks, fs_nblocks);
+	if (1 + n_inodeblocks > fs_nblocks) {
+		fprintf(stderr, "!!TDERR: %u %u\n", n_inodeblocks, fs_nblocks);
 		fprintf(stderr, "!!TDCHK: not enough room for inode blocks\n");
 		return 0;
 	}
@@ -112,22 +269,40 @@ int treedisk_check(block_store_t *below){
 		return 0;
 	}
 
-	/* Initialie the block info.
+	memset(&cs, 0, sizeof(cs));
+	cs.below = below;
+	cs.nworkers = nthreads;
+	cs.pool = block_store_pool_init(nthreads);
+	cs.xfers = calloc(nthreads, sizeof(*cs.xfers));
+	cs.ibs = malloc(nthreads * CHK_BATCH * sizeof(*cs.ibs));
+	cs.fs_nblocks = fs_nblocks;
+	cs.freemap = calloc((fs_nblocks + 7) / 8, 1);
+	cs.usedmap = calloc((fs_nblocks + 7) / 8, 1);
+	cs.nread = 1;
+	cs.ok = 1;
+	memset(&cur, 0, sizeof(cur));
+	memset(&next, 0, sizeof(next));
+
+	/* The superblock and the inode blocks are in use.
+	 */
+	for (b = 0; b <= n_inodeblocks; b++) {
+		bitmap_test_and_set(cs.usedmap, b);
+	}
+
+	/* Scan the free list, so that the tree scan can check against it.
 	 */
-	binfo = (struct block_info *) calloc(fs_nblocks, sizeof(*binfo));
-	binfo[0].status = BI_SUPER;
-	for (b = 1; b <= superblock.superblock.n_inodeblocks; b++) {
-		binfo[b].status = BI_INODE;
+	if (!chk_freelist(&cs, superblock.superblock.free_list, n_inodeblocks)) {
+		cs.ok = 0;
+		goto done;
 	}
 
-	/* Scan the inode blocks.
+	/* Scan the inode blocks, which are contiguous, and collect the roots.
 	 */
 	struct treedisk_inodeblock tib;
-	for (b = 1; b <= superblock.superblock.n_inodeblocks; b++) {
-		(*below->read)(below, 0, b, (block_t *) &tib);
+	for (b = 1; b <= n_inodeblocks && cs.ok; b++) {
+		(*below[0]->read)(below[0], 0, b, (block_t *) &tib);
+		cs.nread++;
 
-		/* Scan the inodes in the block.
-		 */
 		unsigned int i;
 		for (i = 0; i < INODES_PER_BLOCK; i++) {
 			struct treedisk_inode *ti = &tib.inodes[i];
@@ -136,63 +311,57 @@ int treedisk_check(block_store_t *below){
 				while (log_shift_r(ti->nblocks - 1, nlevels * log_rpb) != 0) {
 					nlevels++;
 				}
-				if (!check_inode(below, ti->nblocks, ti->root, nlevels, 0, fs_nblocks, binfo)) {
-					free(binfo);
-					return 0;
+				if (!chk_mark(&cs, &next, ti->root, ti->nblocks, 0, nlevels)) {
+					break;
 				}
 			}
 		}
 	}
-	
-	/* Scan the free list.
-	 */
-	block_no fl = superblock.superblock.free_list;
-	while (fl != 0) {
-		if (fl >= fs_nblocks) {
-			fprintf(stderr, "!!TDCHK: free list block number too large\n");
-			free(binfo);
-			return 0;
-		}
-		if (binfo[fl].status != BI_UNKNOWN) {
-			fprintf(stderr, "!!TDCHK: free list block already in use\n");
-			free(binfo);
-			return 0;
-		}
-		binfo[fl].status = BI_FREELIST;
-
-		/* Read the next block off the free list.
-		 */
-		struct treedisk_freelistblock tfb;
-		(*below->read)(below, 0, fl, (block_t *) &tfb);
 
-		unsigned int i;
-		for (i = 1; i < REFS_PER_BLOCK; i++) {
-			if (tfb.refs[i] != 0) {
-				if (tfb.refs[i] >= fs_nblocks) {
-					continue;
-				}
-				if (binfo[tfb.refs[i]].status != BI_UNKNOWN) {
-					fprintf(stderr, "!!TDERR: --> %u %u %d\n", fl, tfb.refs[i],
-										binfo[tfb.refs[i]].status);
-					fprintf(stderr, "!!TDCHK: duplicate block in free list\n");
-					free(binfo);
-					return 0;
-				}
-				binfo[tfb.refs[i]].status = BI_FREE;
-			}
-		}
-		fl = tfb.refs[0];
+	/* Sweep the trees one level at a time, in block order.
+	 */
+	while (cs.ok && next.n > 0) {
+		struct chk_list tmp = cur;
+		cur = next;
+		next = tmp;
+		next.n = 0;
+		qsort(cur.refs, cur.n, sizeof(*cur.refs), chk_ref_cmp);
+		chk_sweep(&cs, cur.refs, cur.n, &next);
+	}
+	if (!cs.ok) {
+		goto done;
 	}
 
 	/* Check the blocks.
 	 */
 	for (b = 0; b < fs_nblocks; b++) {
-		if (binfo[b].status == BI_UNKNOWN) {
+		if (!bitmap_test(cs.usedmap, b) && !bitmap_test(cs.freemap, b)) {
 			fprintf(stderr, "!!TDLEAK: unaccounted for block %u\n", b);
 			break;
 		}
 	}
 
-	free(binfo);
-	return 1;
+	if (verbose) {
+		unsigned long elapsed = block_store_usec() - start;
+		if (elapsed == 0) {
+			elapsed = 1;
+		}
+		printf("!$TDCHK: checked %u blocks (%lu read) in %lu ms: %lu blocks/s\n",
+					fs_nblocks, cs.nread, elapsed / 1000,
+					(unsigned long) ((double) fs_nblocks * 1000000 / elapsed));
+	}
+
+done:
+	block_store_pool_release(cs.pool);
+	free(cs.xfers);
+	free(cs.ibs);
+	free(cur.refs);
+	free(next.refs);
+	free(cs.freemap);
+	free(cs.usedmap);
+	return cs.ok;
+}
+
+int treedisk_check(block_store_t *below){
+	return treedisk_check_parallel(&below, 1, 0);
 }
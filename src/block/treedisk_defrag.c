@@ -0,0 +1,390 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* Code to defragment a treedisk file system.
+ *
+ *		int treedisk_defrag(block_if below, unsigned int below_ino)
+ *			Reorganize the treedisk file system stored in inode below_ino
+ *			of 'below'.  Returns the number of blocks moved, or -1 on error.
+ *
+ * Files that are grown by many interleaved appends end up with their
+ * blocks scattered over the disk.  The defragmenter computes a new layout
+ * in which the files are stored one after the other in inode order,
+ * directly behind the inode blocks.  Each file starts with its indirect
+ * blocks (breadth-first) followed by its data blocks in logical order,
+ * so that every file without holes becomes a single run of data blocks.
+ * The blocks are then moved by following the cycles of the permutation
+ * from old to new locations, which needs only two block buffers.
+ * References in indirect blocks and inodes are translated as the blocks
+ * are written.  Finally the free list is rebuilt from the (now contiguous)
+ * free space in such a way that treedisk allocates blocks in ascending
+ * order.
+ *
+ * The treedisk layer itself keeps no state between calls, so the file
+ * system may be defragmented underneath an open treedisk, provided nobody
+ * uses it in the meantime.  'below' is synced before and after, so that a
+ * write-back cache in 'below' holds no stale dirty blocks.  The operation
+ * is not crash-safe: a crash halfway leaves the file system corrupted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+#include "treedisk.h"
+
+/* Layout statistics for data blocks.
+ */
+struct defrag_stats {
+	unsigned int nextents;		// #runs of physically consecutive data blocks
+	unsigned long npairs;		// #pairs of logically consecutive data blocks
+	unsigned long nadjacent;	// #such pairs that are physically consecutive
+};
+
+struct defrag_state {
+	block_store_t *below;
+	unsigned int below_ino;
+	block_no fs_nblocks;
+	block_no *newloc;			// old location -> new location (0 if unused)
+	unsigned char *indirmap;	// indirect blocks (by old location)
+	unsigned char *movedmap;	// blocks whose contents have been moved
+	block_no next;				// next location to hand out
+	block_no *list, *next_list;	// per-level lists of block numbers
+	unsigned int list_max;
+	struct defrag_stats before, after;
+};
+
+static unsigned int log_rpb;		// log2(REFS_PER_BLOCK)
+
+/* Stupid ANSI C compiler leaves shifting by #bits in unsigned int or more
+ * undefined, but the result should clearly be 0...
+ */
+static block_no log_shift_r(block_no x, unsigned int nbits){
+	if (nbits >= sizeof(block_no) * 8) {
+		return 0;
+	}
+	return x >> nbits;
+}
+
+static int bitmap_test(unsigned char *map, block_no b){
+	return (map[b / 8] >> (b % 8)) & 1;
+}
+
+static void bitmap_set(unsigned char *map, block_no b){
+	map[b / 8] |= 1 << (b % 8);
+}
+
+/* Update layout statistics with the data block that follows 'prev' (0 if
+ * this is the first data block of the file).
+ */
+static void defrag_account(struct defrag_stats *ds, block_no prev, block_no b){
+	if (prev == 0) {
+		ds->nextents++;
+		return;
+	}
+	ds->npairs++;
+	if (b == prev + 1) {
+		ds->nadjacent++;
+	}
+	else {
+		ds->nextents++;
+	}
+}
+
+/* Assign a new location to block b.  Returns 0 if b was already assigned
+ * one, which means the file system is inconsistent.
+ */
+static int defrag_assign(struct defrag_state *ds, block_no b){
+	if (b >= ds->fs_nblocks || ds->newloc[b] != 0) {
+		fprintf(stderr, "!!DEFRAG: bad or shared block %u; run treedisk_check\n", b);
+		return 0;
+	}
+	ds->newloc[b] = ds->next++;
+	return 1;
+}
+
+/* Compute the new layout of the file with the given root and size.
+ */
+static int defrag_layout_file(struct defrag_state *ds, block_no root, block_no nblocks){
+	unsigned int nlevels = 0, n = 0, i, j;
+
+	if (root == 0) {
+		return 1;
+	}
+	while (log_shift_r(nblocks - 1, nlevels * log_rpb) != 0) {
+		nlevels++;
+	}
+
+	/* Go down the tree level by level, assigning locations to the indirect
+	 * blocks.  At the bottom the list holds the data blocks in logical order.
+	 */
+	ds->list[n++] = root;
+	for (; nlevels > 0; nlevels--) {
+		unsigned int next_n = 0;
+		for (i = 0; i < n; i++) {
+			struct treedisk_indirblock ib;
+
+			if (!defrag_assign(ds, ds->list[i])) {
+				return 0;
+			}
+			bitmap_set(ds->indirmap, ds->list[i]);
+			if ((*ds->below->read)(ds->below, ds->below_ino, ds->list[i], (block_t *) &ib) < 0) {
+				return 0;
+			}
+			for (j = 0; j < REFS_PER_BLOCK; j++) {
+				if (ib.refs[j] == 0) {
+					continue;
+				}
+				if (next_n == ds->list_max) {
+					fprintf(stderr, "!!DEFRAG: file larger than underlying store\n");
+					return 0;
+				}
+				ds->next_list[next_n++] = ib.refs[j];
+			}
+		}
+		block_no *tmp = ds->list;
+		ds->list = ds->next_list;
+		ds->next_list = tmp;
+		n = next_n;
+	}
+
+	/* Now the data blocks.
+	 */
+	for (i = 0; i < n; i++) {
+		if (!defrag_assign(ds, ds->list[i])) {
+			return 0;
+		}
+		defrag_account(&ds->before, i == 0 ? 0 : ds->list[i - 1], ds->list[i]);
+		defrag_account(&ds->after, i == 0 ? 0 : ds->newloc[ds->list[i - 1]],
+												ds->newloc[ds->list[i]]);
+	}
+	return 1;
+}
+
+/* Translate the references in an indirect block to their new locations.
+ */
+static void defrag_translate(struct defrag_state *ds, struct treedisk_indirblock *ib){
+	unsigned int i;
+
+	for (i = 0; i < REFS_PER_BLOCK; i++) {
+		if (ib->refs[i] != 0) {
+			ib->refs[i] = ds->newloc[ib->refs[i]];
+		}
+	}
+}
+
+/* Read the block at (old) location b, translating it if it is an
+ * indirect block.
+ */
+static int defrag_load(struct defrag_state *ds, block_no b, block_t *block){
+	if ((*ds->below->read)(ds->below, ds->below_ino, b, block) < 0) {
+		return 0;
+	}
+	if (bitmap_test(ds->indirmap, b)) {
+		defrag_translate(ds, (struct treedisk_indirblock *) block);
+	}
+	return 1;
+}
+
+/* Move the contents of the block at location 'start', and of all blocks
+ * in the way, to their new locations.  Returns the number of blocks moved,
+ * or -1 on error.
+ */
+static int defrag_move_chain(struct defrag_state *ds, block_no start){
+	union treedisk_block buf[2];
+	unsigned int cur_buf = 0;
+	block_no cur = start;
+	int nmoved = 0;
+
+	if (!defrag_load(ds, start, &buf[cur_buf].datablock)) {
+		return -1;
+	}
+	for (;;) {
+		block_no dst = ds->newloc[cur];
+		int more = dst != start && ds->newloc[dst] != 0 && !bitmap_test(ds->movedmap, dst);
+
+		/* If the destination holds a block that still has to be moved,
+		 * pick it up before overwriting it.
+		 */
+		if (more && !defrag_load(ds, dst, &buf[1 - cur_buf].datablock)) {
+			return -1;
+		}
+		if ((*ds->below->write)(ds->below, ds->below_ino, dst, &buf[cur_buf].datablock) < 0) {
+			return -1;
+		}
+		bitmap_set(ds->movedmap, cur);
+		if (dst != cur) {
+			nmoved++;
+		}
+		if (!more) {
+			return nmoved;
+		}
+		cur = dst;
+		cur_buf = 1 - cur_buf;
+	}
+}
+
+/* Rebuild the free list out of blocks first..fs_nblocks-1.  treedisk
+ * takes free blocks from the highest slot of the first free list block
+ * downwards, and then the free list block itself, so fill each free list
+ * block with references in descending order to have blocks allocated in
+ * ascending order.
+ */
+static block_no defrag_freelist(struct defrag_state *ds, block_no first){
+	struct treedisk_freelistblock fb;
+	block_no base, cnt, self;
+	unsigned int i;
+
+	for (base = first; base < ds->fs_nblocks; base += REFS_PER_BLOCK) {
+		cnt = ds->fs_nblocks - base;
+		if (cnt > REFS_PER_BLOCK) {
+			cnt = REFS_PER_BLOCK;
+		}
+		self = base + cnt - 1;
+
+		memset(&fb, 0, sizeof(fb));
+		for (i = 0; i < cnt - 1; i++) {
+			fb.refs[cnt - 1 - i] = base + i;
+		}
+
+		/* The next free list block is the last block of the next group.
+		 */
+		if (base + REFS_PER_BLOCK < ds->fs_nblocks) {
+			cnt = ds->fs_nblocks - (base + REFS_PER_BLOCK);
+			fb.refs[0] = base + REFS_PER_BLOCK + (cnt > REFS_PER_BLOCK ? REFS_PER_BLOCK : cnt) - 1;
+		}
+		if ((*ds->below->write)(ds->below, ds->below_ino, self, (block_t *) &fb) < 0) {
+			return (block_no) -1;
+		}
+	}
+	return first < ds->fs_nblocks ? first + (ds->fs_nblocks - first > REFS_PER_BLOCK ?
+						REFS_PER_BLOCK : ds->fs_nblocks - first) - 1 : 0;
+}
+
+static void defrag_print(const char *when, struct defrag_stats *ds){
+	unsigned int pct = ds->npairs == 0 ? 100 :
+				(unsigned int) (ds->nadjacent * 100 / ds->npairs);
+
+	printf("!$DEFRAG: %s: %u extents, %u%% of consecutive blocks contiguous\n",
+									when, ds->nextents, pct);
+}
+
+int treedisk_defrag(block_store_t *below, unsigned int below_ino){
+	struct defrag_state ds;
+	union treedisk_block superblock;
+	struct treedisk_inodeblock *inodeblocks = 0;
+	block_no b, n_inodeblocks;
+	int nmoved = -1, r;
+	unsigned int i;
+
+	/* Calculate log2(REFS_PER_BLOCK).
+	 */
+	log_rpb = 0;
+	do {
+		log_rpb++;
+	} while (((REFS_PER_BLOCK - 1) >> log_rpb) != 0);
+
+	/* Flush whatever is cached below before looking at the layout.
+	 */
+	if ((*below->sync)(below, below_ino) < 0) {
+		return -1;
+	}
+
+	memset(&ds, 0, sizeof(ds));
+	ds.below = below;
+	ds.below_ino = below_ino;
+	ds.fs_nblocks = (*below->getsize)(below, below_ino);
+	if ((*below->read)(below, below_ino, 0, (block_t *) &superblock) < 0) {
+		return -1;
+	}
+	n_inodeblocks = superblock.superblock.n_inodeblocks;
+	if (n_inodeblocks == 0 || 1 + n_inodeblocks > ds.fs_nblocks) {
+		fprintf(stderr, "!!DEFRAG: no treedisk file system\n");
+		return -1;
+	}
+
+	ds.newloc = calloc(ds.fs_nblocks, sizeof(block_no));
+	ds.indirmap = calloc((ds.fs_nblocks + 7) / 8, 1);
+	ds.movedmap = calloc((ds.fs_nblocks + 7) / 8, 1);
+	ds.list_max = ds.fs_nblocks;
+	ds.list = malloc(ds.list_max * sizeof(block_no));
+	ds.next_list = malloc(ds.list_max * sizeof(block_no));
+	inodeblocks = malloc(n_inodeblocks * sizeof(*inodeblocks));
+	ds.next = 1 + n_inodeblocks;
+
+	/* Compute the new layout, one file at a time.
+	 */
+	for (b = 0; b < n_inodeblocks; b++) {
+		if ((*below->read)(below, below_ino, 1 + b, (block_t *) &inodeblocks[b]) < 0) {
+			goto done;
+		}
+		for (i = 0; i < INODES_PER_BLOCK; i++) {
+			struct treedisk_inode *ti = &inodeblocks[b].inodes[i];
+			if (ti->nblocks != 0 && !defrag_layout_file(&ds, ti->root, ti->nblocks)) {
+				goto done;
+			}
+		}
+	}
+	defrag_print("before", &ds.before);
+
+	/* Move the blocks.  Blocks that stay in place may still have to be
+	 * rewritten to translate their references.
+	 */
+	nmoved = 0;
+	for (b = 1 + n_inodeblocks; b < ds.fs_nblocks; b++) {
+		if (ds.newloc[b] == 0 || bitmap_test(ds.movedmap, b)) {
+			continue;
+		}
+		if (ds.newloc[b] == b && !bitmap_test(ds.indirmap, b)) {
+			bitmap_set(ds.movedmap, b);
+			continue;
+		}
+		if ((r = defrag_move_chain(&ds, b)) < 0) {
+			fprintf(stderr, "!!DEFRAG: I/O error while moving blocks\n");
+			nmoved = -1;
+			goto done;
+		}
+		nmoved += r;
+	}
+
+	/* Update the inodes.
+	 */
+	for (b = 0; b < n_inodeblocks; b++) {
+		for (i = 0; i < INODES_PER_BLOCK; i++) {
+			struct treedisk_inode *ti = &inodeblocks[b].inodes[i];
+			if (ti->root != 0) {
+				ti->root = ds.newloc[ti->root];
+			}
+		}
+		if ((*below->write)(below, below_ino, 1 + b, (block_t *) &inodeblocks[b]) < 0) {
+			nmoved = -1;
+			goto done;
+		}
+	}
+
+	/* Rebuild the free list and the superblock.
+	 */
+	superblock.superblock.free_list = defrag_freelist(&ds, ds.next);
+	if (superblock.superblock.free_list == (block_no) -1 ||
+			(*below->write)(below, below_ino, 0, (block_t *) &superblock) < 0) {
+		nmoved = -1;
+		goto done;
+	}
+	if ((*below->sync)(below, below_ino) < 0) {
+		nmoved = -1;
+		goto done;
+	}
+	defrag_print("after", &ds.after);
+	printf("!$DEFRAG: moved %d of %u blocks in use\n", nmoved, ds.next - 1 - n_inodeblocks);
+
+done:
+	free(inodeblocks);
+	free(ds.list);
+	free(ds.next_list);
+	free(ds.movedmap);
+	free(ds.indirmap);
+	free(ds.newloc);
+	return nmoved;
+}
@@ -20,6 +20,13 @@
  *  We were unable to test the triple indirect pointers because our test suite
  *  does not allocate enough data blocks in RAM for the triple indirect pointers
  *  to be used.
+ *
+ *  To avoid re-reading metadata on every operation, the superblock is kept
+ *  in memory and inode blocks are cached as they are read.  In addition, the
+ *  indirect blocks on the path to the most recently accessed offset are
+ *  memoized for the UNIXDISK_NMEMO most recently used inodes (one slot per
+ *  level of indirection), so sequential access to a large file costs
+ *  roughly one read per data block.  All caches are write-through.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +39,21 @@
 #define EPB_2 (ENTRIES_PER_BLOCK * ENTRIES_PER_BLOCK)                     // Entries Per Block Squared
 #define EPB_3 (ENTRIES_PER_BLOCK * ENTRIES_PER_BLOCK * ENTRIES_PER_BLOCK) // Entries Per Block Cubed
 
+#define UNIXDISK_NMEMO 16 // number of inodes with memoized indirect blocks
+
+/* Memo slots, one per level of indirection.
+ */
+enum unixdisk_level
+{
+    L_SINGLE,  // single indirect block
+    L_DOUBLE1, // double indirect block
+    L_DOUBLE2, // block below the double indirect block
+    L_TRIPLE1, // triple indirect block
+    L_TRIPLE2, // block below the triple indirect block
+    L_TRIPLE3, // block below that
+    L_NLEVELS
+};
+
 /* Temporary information about the file system and a particular inode.
  * Convenient for all operations. See "unixdisk.h" for field details.
  */
@@ -44,25 +66,42 @@ struct unixdisk_snapshot
     struct unixdisk_inode *inode;
 };
 
+/* Memoized indirect blocks of an inode.
+ */
+struct unixdisk_memo
+{
+    unsigned int ino;   // inode number
+    int inuse;          // memo is assigned to ino
+    unsigned long lru;  // time of last use
+    struct
+    {
+        int valid;
+        block_no b;     // block number below
+        union unixdisk_block block;
+    } slots[L_NLEVELS];
+};
+
 struct unixdisk_state
 {
     block_store_t *below; // block store below
     unsigned int ninodes; // number of inodes
+    union unixdisk_block superblock;      // cached superblock
+    union unixdisk_block *inodeblocks;    // cached inode blocks
+    unsigned char *inode_valid;           // which inode blocks are cached
+    struct unixdisk_memo memos[UNIXDISK_NMEMO];
+    unsigned long clock;                  // for LRU replacement of memos
 };
 
 static block_t null_block; // a block filled with null bytes
 
 static int unixdisk_get_snapshot(struct unixdisk_snapshot *snapshot,
-                                 block_store_t *below, unsigned int inode_no)
+                                 struct unixdisk_state *fs, unsigned int inode_no)
 {
     snapshot->inode_no = inode_no;
 
     /* Get the super block
      */
-    if ((*below->read)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
-    {
-        return -1;
-    }
+    snapshot->superblock = fs->superblock;
 
     /* Check the inode number.
      */
@@ -75,15 +114,117 @@ static int unixdisk_get_snapshot(struct unixdisk_snapshot *snapshot,
     /* Find the inode.
     */
     snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
-    if ((*below->read)(below, 0, snapshot->inode_blockno, (block_t *)&snapshot->inodeblock) < 0)
+    unsigned int index = snapshot->inode_blockno - 1;
+    if (!fs->inode_valid[index])
     {
-        return -1;
+        if ((*fs->below->read)(fs->below, 0, snapshot->inode_blockno, (block_t *)&fs->inodeblocks[index]) < 0)
+        {
+            return -1;
+        }
+        fs->inode_valid[index] = 1;
     }
+    snapshot->inodeblock = fs->inodeblocks[index];
     snapshot->inode = &(snapshot->inodeblock.inodeblock.inodes[inode_no % INODES_PER_BLOCK]);
 
     return 0;
 }
 
+/* Write back the superblock in the snapshot.
+ */
+static int unixdisk_put_super(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot)
+{
+    fs->superblock = snapshot->superblock;
+    return (*fs->below->write)(fs->below, 0, 0, (block_t *)&snapshot->superblock);
+}
+
+/* Write back the inode block in the snapshot.
+ */
+static int unixdisk_put_inode(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot)
+{
+    fs->inodeblocks[snapshot->inode_blockno - 1] = snapshot->inodeblock;
+    fs->inode_valid[snapshot->inode_blockno - 1] = 1;
+    return (*fs->below->write)(fs->below, 0, snapshot->inode_blockno, (block_t *)&snapshot->inodeblock);
+}
+
+/* Find the memo of the given inode, or (if 'create') recycle the least
+ * recently used one.
+ */
+static struct unixdisk_memo *unixdisk_memo_find(struct unixdisk_state *fs, unsigned int ino, int create)
+{
+    struct unixdisk_memo *victim = &fs->memos[0];
+    unsigned int i;
+
+    for (i = 0; i < UNIXDISK_NMEMO; i++)
+    {
+        struct unixdisk_memo *m = &fs->memos[i];
+        if (m->inuse && m->ino == ino)
+        {
+            m->lru = ++fs->clock;
+            return m;
+        }
+        if (!m->inuse || (victim->inuse && m->lru < victim->lru))
+        {
+            victim = m;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    memset(victim->slots, 0, sizeof(victim->slots));
+    victim->ino = ino;
+    victim->inuse = 1;
+    victim->lru = ++fs->clock;
+    return victim;
+}
+
+/* Forget the memoized indirect blocks of an inode.
+ */
+static void unixdisk_memo_reset(struct unixdisk_state *fs, unsigned int ino)
+{
+    struct unixdisk_memo *m = unixdisk_memo_find(fs, ino, 0);
+    if (m != NULL)
+    {
+        m->inuse = 0;
+    }
+}
+
+/* Read indirect block b at the given level of the inode in the snapshot,
+ * using the memo if possible.
+ */
+static int unixdisk_indirect_read(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot,
+                                  enum unixdisk_level level, block_no b, union unixdisk_block *block)
+{
+    struct unixdisk_memo *m = unixdisk_memo_find(fs, snapshot->inode_no, 1);
+
+    if (!m->slots[level].valid || m->slots[level].b != b)
+    {
+        if ((*fs->below->read)(fs->below, 0, b, (block_t *)&m->slots[level].block) < 0)
+        {
+            m->slots[level].valid = 0;
+            return -1;
+        }
+        m->slots[level].valid = 1;
+        m->slots[level].b = b;
+    }
+    *block = m->slots[level].block;
+    return 0;
+}
+
+/* Write indirect block b at the given level of the inode in the snapshot,
+ * updating the memo.
+ */
+static int unixdisk_indirect_write(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot,
+                                   enum unixdisk_level level, block_no b, union unixdisk_block *block)
+{
+    struct unixdisk_memo *m = unixdisk_memo_find(fs, snapshot->inode_no, 1);
+
+    m->slots[level].valid = 1;
+    m->slots[level].b = b;
+    m->slots[level].block = *block;
+    return (*fs->below->write)(fs->below, 0, b, (block_t *)block);
+}
+
 /* Create a new UNIX file system on the block store below
  */
 int unixdisk_create(block_store_t *below, unsigned int below_ino, unsigned int ninodes)
@@ -189,7 +330,7 @@ int unixdisk_create(block_store_t *below, unsigned int below_ino, unsigned int n
  * Helper function for traversing UNIX table
  * Returns the absolute block number of the data to read (not data block number)
  */
-static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot *snapshot, unsigned int offset)
+static block_no unixdisk_traverse(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot, unsigned int offset)
 {
     /* Determine which pointer to look from */
     if (offset < 12)
@@ -206,7 +347,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
 
         datablock_no to_read = snapshot->inode->single_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_SINGLE, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -224,7 +365,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
 
         datablock_no to_read = snapshot->inode->double_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE1, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -232,7 +373,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
         first_index = (offset - 12 - ENTRIES_PER_BLOCK) / ENTRIES_PER_BLOCK;
         to_read = read_data.indirectblock.entries[first_index];
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE2, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -249,9 +390,9 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
         union unixdisk_block read_data;
         unsigned int first_index, second_index, third_index;
 
-        datablock_no to_read = snapshot->inode->double_indirect;
+        datablock_no to_read = snapshot->inode->triple_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE1, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -259,7 +400,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
         first_index = (offset - 12 - ENTRIES_PER_BLOCK - EPB_2) / EPB_2;
         to_read = read_data.indirectblock.entries[first_index];
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE2, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -267,7 +408,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
         second_index = (offset - 12 - ENTRIES_PER_BLOCK - EPB_2 - first_index * EPB_2) / ENTRIES_PER_BLOCK;
         to_read = read_data.indirectblock.entries[second_index];
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&read_data) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE3, to_read, &read_data) < 0)
         {
             return -1;
         }
@@ -285,7 +426,7 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
  * 
  * Returns (unsigned int)-1 on error
  */
-static datablock_no unixdisk_popfree(block_store_t *below, struct unixdisk_snapshot *snapshot)
+static datablock_no unixdisk_popfree(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot)
 {
     // Check if free list is empty
     if (snapshot->superblock.superblock.free_list == (unsigned int)-1)
@@ -300,7 +441,7 @@ static datablock_no unixdisk_popfree(block_store_t *below, struct unixdisk_snaps
 
     datablock_no next;
     union unixdisk_block free_head;
-    if ((below->read)(below, 0, free_list, (block_t *)&free_head) < 0)
+    if ((*fs->below->read)(fs->below, 0, free_list, (block_t *)&free_head) < 0)
     {
         return -1;
     }
@@ -320,7 +461,7 @@ static datablock_no unixdisk_popfree(block_store_t *below, struct unixdisk_snaps
     }
 
     // Write superblock back
-    if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+    if (unixdisk_put_super(fs, snapshot) < 0)
     {
         return -1;
     }
@@ -332,12 +473,12 @@ static datablock_no unixdisk_popfree(block_store_t *below, struct unixdisk_snaps
  * 
  * Returns -1 on error, 0 on success
  */
-static int unixdisk_pushfree(block_store_t *below, struct unixdisk_snapshot *snapshot, datablock_no block_no)
+static int unixdisk_pushfree(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot, datablock_no block_no)
 {
     unsigned int free_list = snapshot->superblock.superblock.free_list + 1 + snapshot->superblock.superblock.n_inodeblocks;
 
     union unixdisk_block free_head;
-    if ((below->read)(below, 0, free_list, (block_t *)&free_head) < 0)
+    if ((*fs->below->read)(fs->below, 0, free_list, (block_t *)&free_head) < 0)
     {
         return -1;
     }
@@ -347,12 +488,12 @@ static int unixdisk_pushfree(block_store_t *below, struct unixdisk_snapshot *sna
         // Head of free list has some free slots- stick the block_no in
         free_head.freeblock.entries[snapshot->superblock.superblock.free_offset++] = block_no;
         // Write head of freelist back
-        if ((*below->write)(below, 0, free_list, (block_t *)&free_head) < 0)
+        if ((*fs->below->write)(fs->below, 0, free_list, (block_t *)&free_head) < 0)
         {
             return -1;
         }
         // Write superblock back
-        if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+        if (unixdisk_put_super(fs, snapshot) < 0)
         {
             return -1;
         }
@@ -366,19 +507,19 @@ static int unixdisk_pushfree(block_store_t *below, struct unixdisk_snapshot *sna
         snapshot->superblock.superblock.free_list = block_no;
         snapshot->superblock.superblock.free_offset = 0;
         // Write head of freelist back
-        if ((*below->write)(below, 0, block_no + 1 + snapshot->superblock.superblock.n_inodeblocks, (block_t *)&free_head) < 0)
+        if ((*fs->below->write)(fs->below, 0, block_no + 1 + snapshot->superblock.superblock.n_inodeblocks, (block_t *)&free_head) < 0)
         {
             return -1;
         }
         // Write superblock back
-        if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+        if (unixdisk_put_super(fs, snapshot) < 0)
         {
             return -1;
         }
         return 0;
     }
 }
-static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapshot,
+static int unixdisk_alloc(struct unixdisk_state *fs, struct unixdisk_snapshot *snapshot,
                           unsigned int offset)
 {
     assert(offset >= snapshot->inode->nblocks);
@@ -389,7 +530,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
     // Allocate in Direct Blocks
     while (i < 12 && i <= offset)
     {
-        datablock_no next = unixdisk_popfree(below, snapshot);
+        datablock_no next = unixdisk_popfree(fs, snapshot);
         snapshot->inode->direct_blocks[i] = next;
         i++;
     }
@@ -400,23 +541,23 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12)
         {
-            snapshot->inode->single_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->single_indirect = unixdisk_popfree(fs, snapshot);
         }
         // Allocate in Single Indirect Block
         union unixdisk_block indirectblock;
         datablock_no to_read = snapshot->inode->single_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirectblock) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_SINGLE, to_read, &indirectblock) < 0)
         {
             return -1;
         }
         while (i < 12 + ENTRIES_PER_BLOCK && i <= offset)
         {
-            datablock_no next = unixdisk_popfree(below, snapshot);
+            datablock_no next = unixdisk_popfree(fs, snapshot);
             indirectblock.indirectblock.entries[i - 12] = next;
             i++;
         }
-        if ((below->write)(below, 0, to_read, (block_t *)&indirectblock) < 0)
+        if (unixdisk_indirect_write(fs, snapshot, L_SINGLE, to_read, &indirectblock) < 0)
         {
             return -1;
         }
@@ -427,13 +568,13 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK)
         {
-            snapshot->inode->double_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->double_indirect = unixdisk_popfree(fs, snapshot);
         }
         // Allocate in Double Indirect Block
         union unixdisk_block indirect1, indirect2;
         datablock_no to_read = snapshot->inode->double_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE1, to_read, &indirect1) < 0)
         {
             return -1;
         }
@@ -443,27 +584,27 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             // Check if we need to initialize indirect block
             if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + j * ENTRIES_PER_BLOCK)
             {
-                indirect1.indirectblock.entries[j] = unixdisk_popfree(below, snapshot);
+                indirect1.indirectblock.entries[j] = unixdisk_popfree(fs, snapshot);
             }
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-            if ((below->read)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE2, to_read, &indirect2) < 0)
             {
                 return -1;
             }
             while (i < 12 + ENTRIES_PER_BLOCK + (j + 1) * ENTRIES_PER_BLOCK && i <= offset)
             {
-                datablock_no next = unixdisk_popfree(below, snapshot);
+                datablock_no next = unixdisk_popfree(fs, snapshot);
                 indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK] = next;
                 i++;
             }
-            if ((below->write)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_write(fs, snapshot, L_DOUBLE2, to_read, &indirect2) < 0)
             {
                 return -1;
             }
             j++;
         }
-        if ((below->write)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_write(fs, snapshot, L_DOUBLE1, to_read, &indirect1) < 0)
         {
             return -1;
         }
@@ -474,13 +615,13 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2)
         {
-            snapshot->inode->triple_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->triple_indirect = unixdisk_popfree(fs, snapshot);
         }
         // Allocate in Triple Indirect Block
         union unixdisk_block indirect1, indirect2, indirect3;
-        datablock_no to_read = snapshot->inode->double_indirect;
+        datablock_no to_read = snapshot->inode->triple_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE1, to_read, &indirect1) < 0)
         {
             return -1;
         }
@@ -490,11 +631,11 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             // Check if we need to initialize indirect block
             if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2)
             {
-                indirect1.indirectblock.entries[j] = unixdisk_popfree(below, snapshot);
+                indirect1.indirectblock.entries[j] = unixdisk_popfree(fs, snapshot);
             }
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-            if ((below->read)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE2, to_read, &indirect2) < 0)
             {
                 return -1;
             }
@@ -504,40 +645,40 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
                 // Check if we need to initialize indirect block
                 if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + k * ENTRIES_PER_BLOCK)
                 {
-                    indirect2.indirectblock.entries[k] = unixdisk_popfree(below, snapshot);
+                    indirect2.indirectblock.entries[k] = unixdisk_popfree(fs, snapshot);
                 }
                 datablock_no to_read = indirect2.indirectblock.entries[k];
                 to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-                if ((below->read)(below, 0, to_read, (block_t *)&indirect3) < 0)
+                if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE3, to_read, &indirect3) < 0)
                 {
                     return -1;
                 }
                 while (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + (k + 1) * ENTRIES_PER_BLOCK && i <= offset)
                 {
-                    datablock_no next = unixdisk_popfree(below, snapshot);
+                    datablock_no next = unixdisk_popfree(fs, snapshot);
                     indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK] = next;
                     i++;
                 }
-                if ((below->write)(below, 0, to_read, (block_t *)&indirect3) < 0)
+                if (unixdisk_indirect_write(fs, snapshot, L_TRIPLE3, to_read, &indirect3) < 0)
                 {
                     return -1;
                 }
                 k++;
             }
-            if ((below->write)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_write(fs, snapshot, L_TRIPLE2, to_read, &indirect2) < 0)
             {
                 return -1;
             }
             j++;
         }
-        if ((below->write)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_write(fs, snapshot, L_TRIPLE1, to_read, &indirect1) < 0)
         {
             return -1;
         }
     }
     // Lastly Write the new inode
     snapshot->inode->nblocks = offset + 1;
-    if ((below->write)(below, 0, snapshot->inode_blockno, (block_t *)&snapshot->inodeblock) < 0)
+    if (unixdisk_put_inode(fs, snapshot) < 0)
     {
         return -1;
     }
@@ -545,7 +686,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
 }
 
 static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
-                               block_store_t *below)
+                               struct unixdisk_state *fs)
 {
     /* Your code goes here:
      */
@@ -560,7 +701,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
     while (i < 12 && i < snapshot->inode->nblocks)
     {
         // Free Direct Blocks
-        unixdisk_pushfree(below, snapshot, snapshot->inode->direct_blocks[i]);
+        unixdisk_pushfree(fs, snapshot, snapshot->inode->direct_blocks[i]);
         i++;
     }
     /* Free Single Indirect Blocks */
@@ -570,18 +711,18 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
         union unixdisk_block indirectblock;
         datablock_no to_read = snapshot->inode->single_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirectblock) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_SINGLE, to_read, &indirectblock) < 0)
         {
             return;
         }
         // Free Single Indirect Block Pointers
         while (i < 12 + ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
         {
-            unixdisk_pushfree(below, snapshot, indirectblock.indirectblock.entries[i - 12]);
+            unixdisk_pushfree(fs, snapshot, indirectblock.indirectblock.entries[i - 12]);
             i++;
         }
         // Free Single Indirect block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->single_indirect);
+        unixdisk_pushfree(fs, snapshot, snapshot->inode->single_indirect);
     }
     /* Free Double Indirect Blocks */
     if (i < EPB_2 + ENTRIES_PER_BLOCK + 12 && i < snapshot->inode->nblocks)
@@ -590,7 +731,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
         union unixdisk_block indirect1, indirect2;
         datablock_no to_read = snapshot->inode->double_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE1, to_read, &indirect1) < 0)
         {
             return;
         }
@@ -601,7 +742,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
             // Read Single Indirect Block
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-            if ((below->read)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_read(fs, snapshot, L_DOUBLE2, to_read, &indirect2) < 0)
             {
                 return;
             }
@@ -609,15 +750,15 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
             while (i < 12 + ENTRIES_PER_BLOCK + (j + 1) * ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
             {
                 // Free data blocks
-                unixdisk_pushfree(below, snapshot, indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK]);
+                unixdisk_pushfree(fs, snapshot, indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK]);
                 i++;
             }
             // Free Single Indirect Block
-            unixdisk_pushfree(below, snapshot, indirect1.indirectblock.entries[j]);
+            unixdisk_pushfree(fs, snapshot, indirect1.indirectblock.entries[j]);
             j++;
         }
         // Free Double Indirect Block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->double_indirect);
+        unixdisk_pushfree(fs, snapshot, snapshot->inode->double_indirect);
     }
     /* Free Third Indirect Blocks */
     if (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + EPB_3 && i < snapshot->inode->nblocks)
@@ -625,9 +766,9 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
         assert(i >= 12 + ENTRIES_PER_BLOCK + EPB_2);
         // Read Triple Indirect Block
         union unixdisk_block indirect1, indirect2, indirect3;
-        datablock_no to_read = snapshot->inode->double_indirect;
+        datablock_no to_read = snapshot->inode->triple_indirect;
         to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-        if ((below->read)(below, 0, to_read, (block_t *)&indirect1) < 0)
+        if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE1, to_read, &indirect1) < 0)
         {
             return;
         }
@@ -637,7 +778,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
             j = (i - 12 - ENTRIES_PER_BLOCK - EPB_2) / EPB_2;
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-            if ((below->read)(below, 0, to_read, (block_t *)&indirect2) < 0)
+            if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE2, to_read, &indirect2) < 0)
             {
                 return;
             }
@@ -647,7 +788,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
                 k = (i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2) / ENTRIES_PER_BLOCK;
                 datablock_no to_read = indirect2.indirectblock.entries[k];
                 to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
-                if ((below->read)(below, 0, to_read, (block_t *)&indirect3) < 0)
+                if (unixdisk_indirect_read(fs, snapshot, L_TRIPLE3, to_read, &indirect3) < 0)
                 {
                     return;
                 }
@@ -655,27 +796,28 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
                 while (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + (k + 1) * ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
                 {
                     // Free Data Block
-                    unixdisk_pushfree(below, snapshot, indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK]);
+                    unixdisk_pushfree(fs, snapshot, indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK]);
                     i++;
                 }
                 // Free Single Indirect Block
-                unixdisk_pushfree(below, snapshot, indirect2.indirectblock.entries[k]);
+                unixdisk_pushfree(fs, snapshot, indirect2.indirectblock.entries[k]);
                 k++;
             }
             // Free Double Indirect Block
-            unixdisk_pushfree(below, snapshot, indirect1.indirectblock.entries[j]);
+            unixdisk_pushfree(fs, snapshot, indirect1.indirectblock.entries[j]);
             j++;
         }
         // Free Triple Indirect Block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->triple_indirect);
+        unixdisk_pushfree(fs, snapshot, snapshot->inode->triple_indirect);
     }
 
     assert(i == snapshot->inode->nblocks);
 
     /* Done freeing all blocks, now need to update inode */
     /* Update Inode */
+    unixdisk_memo_reset(fs, snapshot->inode_no);
     snapshot->inode->nblocks = 0;
-    if ((*below->write)(below, 0, snapshot->inode_blockno, (block_t *)&snapshot->inodeblock) < 0)
+    if (unixdisk_put_inode(fs, snapshot) < 0)
     {
         return;
     }
@@ -692,7 +834,7 @@ static int unixdisk_write(block_store_t *this_bs, unsigned int ino, block_no off
     /* Get info from underlying file system.
 	 */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, ts->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
     {
         return -1;
     }
@@ -702,13 +844,13 @@ static int unixdisk_write(block_store_t *this_bs, unsigned int ino, block_no off
     {
 
         /* Offset big- need to allocate new blocks */
-        if (unixdisk_alloc(ts->below, &snapshot, offset) < 0)
+        if (unixdisk_alloc(ts, &snapshot, offset) < 0)
         {
             return -1;
         }
     }
     /* Traverse to the relevant datablock */
-    block_no to_write = unixdisk_traverse(ts->below, &snapshot, offset);
+    block_no to_write = unixdisk_traverse(ts, &snapshot, offset);
     if ((ts->below->write)(ts->below, 0, to_write, (block_t *)block) < 0)
     {
         return -1;
@@ -728,7 +870,7 @@ static int unixdisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
     /* Get info from underlying file system.
 	 */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, ts->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
     {
         return -1;
     }
@@ -741,7 +883,7 @@ static int unixdisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
     }
 
     /* Traverse Pointers */
-    block_no to_read = unixdisk_traverse(ts->below, &snapshot, offset);
+    block_no to_read = unixdisk_traverse(ts, &snapshot, offset);
     if ((ts->below->read)(ts->below, 0, to_read, (block_t *)block) < 0)
     {
         return -1;
@@ -752,11 +894,7 @@ static int unixdisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
 static int unixdisk_getninodes(block_store_t *this_bs)
 {
     struct unixdisk_state *fs = this_bs->state;
-    union unixdisk_block superblock;
-    if((*fs->below->read)(fs->below, 0, 0, (block_t*) &superblock) < 0) {
-        return -1;
-    }
-    return superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+    return fs->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
 }
 
 /* Get size.
@@ -768,7 +906,7 @@ static int unixdisk_getsize(block_store_t *this_bs, unsigned int ino)
     /* Get info from underlying file system.
      */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, fs->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, fs, ino) < 0)
     {
         return -1;
     }
@@ -783,7 +921,10 @@ static int unixdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
     struct unixdisk_state *fs = this_bs->state;
 
     struct unixdisk_snapshot snapshot;
-    unixdisk_get_snapshot(&snapshot, fs->below, ino);
+    if (unixdisk_get_snapshot(&snapshot, fs, ino) < 0)
+    {
+        return -1;
+    }
     if (nblocks == snapshot.inode->nblocks)
     {
         return nblocks;
@@ -794,13 +935,17 @@ static int unixdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
         return -1;
     }
 
-    unixdisk_free_file(&snapshot, fs->below);
+    unixdisk_free_file(&snapshot, fs);
     return 0;
 }
 
 static void unixdisk_release(block_store_t *this_bs)
 {
-    free(this_bs->state);
+    struct unixdisk_state *fs = this_bs->state;
+
+    free(fs->inodeblocks);
+    free(fs->inode_valid);
+    free(fs);
     free(this_bs);
 }
 
@@ -823,6 +968,18 @@ block_store_t *unixdisk_init(block_store_t *below, unsigned int below_ino)
     struct unixdisk_state *fs = new_alloc(struct unixdisk_state);
     fs->below = below;
 
+    /* Load the superblock and set up the inode block cache.
+     */
+    if ((*below->read)(below, 0, 0, (block_t *)&fs->superblock) < 0)
+    {
+        free(fs);
+        return NULL;
+    }
+    unsigned int n_inodeblocks = fs->superblock.superblock.n_inodeblocks;
+    fs->ninodes = n_inodeblocks * INODES_PER_BLOCK;
+    fs->inodeblocks = malloc(n_inodeblocks * sizeof(*fs->inodeblocks));
+    fs->inode_valid = calloc(n_inodeblocks, 1);
+
     /* Return a block interface to this inode.
      */
     block_store_t *this_bs = new_alloc(block_store_t);
@@ -222,9 +222,11 @@ void grass_main(void){
 	gpid_t disk_init(char *filename, unsigned int nblocks, bool sync);
 	ge.servers[GPID_DISK_PAGE] = disk_init("storage/page.dev", PG_DEV_BLOCKS, false);
 	ge.servers[GPID_DISK_FS] = disk_init("storage/fs.dev", 16 * 1024, false);
+	ge.servers[GPID_DISK_CACHE] = disk_init("storage/cache.dev", 1024, false);
 
 
-	// The -c argument to the block server determines which type of filesystem it uses
+	// The -c argument to the block server determines which type of filesystem it uses.
+	// Add "-T", "wb" or "-T", "wt" to use storage/cache.dev as a second-level cache.
 	char *blocksvr_args[] = {"-c", "tree"};
 
 	ge.servers[GPID_BLOCK] = spawn_user_proc(&ge, "bin/blocksvr.exe", 2, blocksvr_args);
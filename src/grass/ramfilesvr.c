@@ -385,6 +385,9 @@ static void ramfile_proc(void *arg){
 		case FILE_DELETE:
 			ramfile_do_delete(rs, req, src, uid);
 			break;
+		case FILE_HINT:
+			ramfile_respond(src, FILE_OK, 0, 0);		// all in memory anyway
+			break;
 		default:
 			printf("ram file server: bad request type: %u\n\r", req->type);
 			ramfile_respond(src, FILE_ERROR, 0, 0);
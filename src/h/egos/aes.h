@@ -0,0 +1,18 @@
+#ifndef _AES_H
+#define _AES_H
+
+#include <stdint.h>
+
+/* An expanded AES-128 key: the 11 round keys.
+ */
+struct aes128 {
+	uint8_t rk[11 * 16];
+};
+
+void aes128_init(struct aes128 *aes, const uint8_t key[16]);
+void aes128_encrypt(const struct aes128 *aes, const uint8_t in[16], uint8_t out[16]);
+void aes128_ctr(const struct aes128 *aes, const uint8_t iv[16], void *buf, unsigned int len);
+const char *aes128_kernel(void);
+int aes128_select(const char *name);
+
+#endif /* aes.h */
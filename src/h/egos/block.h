@@ -15,7 +15,11 @@ struct block_request {
         BLOCK_GETSIZE,
         BLOCK_SETSIZE,              // size is in field offset
         BLOCK_SYNC,
-		BLOCK_GETNINODES
+		BLOCK_GETNINODES,
+		BLOCK_DEFRAG,
+		BLOCK_SNAPSHOT,				// take (ino 0) or delete a snapshot
+		BLOCK_STATS,				// get the statdisk report
+		BLOCK_HINT					// enum block_hint is in field offset_nblock
     } type;                         // type of request
     unsigned int ino;               // inode number
     unsigned int offset_nblock;     // offset in blocks (not bytes)
@@ -27,6 +31,9 @@ struct block_reply {
     enum block_status { BLOCK_OK, BLOCK_ERROR } status;
     unsigned int size_nblock;       // size of device in case of GETSIZE request
 #define br_ninodes	size_nblock		// overloaded for getninodes
+#define br_nmoved	size_nblock		// overloaded for defrag
+#define br_snapshot	size_nblock		// overloaded for snapshot
+#define br_length	size_nblock		// overloaded for stats
 };
 
 bool block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr);
@@ -35,5 +42,10 @@ bool block_getsize(gpid_t svr, unsigned int ino, unsigned int *psize_nblock);
 bool block_setsize(gpid_t svr, unsigned int ino, unsigned int size_nblock);
 bool block_sync(gpid_t svr, unsigned int ino);
 bool block_getninodes(gpid_t svr, unsigned int *ninodes);
+bool block_defrag(gpid_t svr, unsigned int *nmoved);
+bool block_snapshot(gpid_t svr, unsigned int *snapshot);
+bool block_snapshot_delete(gpid_t svr, unsigned int snapshot);
+int block_stats(gpid_t svr, char *buf, unsigned int size);
+bool block_hint(gpid_t svr, unsigned int ino, unsigned int hint);
 
 #endif // _EGOS_BLOCK_H
@@ -44,6 +44,33 @@
  * All these return -1 upon error (typically after printing the
  * reason for the error).
  *
+ * In addition, a block store may provide the following two methods for
+ * transferring a range of consecutive blocks in one operation.  They are
+ * optional and may be null; use block_store_readv() and block_store_writev()
+ * to call them, which fall back to one read or write per block.
+ *
+ *      int readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
+ *          read blocks offset .. offset + nblocks - 1 into blocks[0 .. nblocks - 1]
+ *          returns 0
+ *
+ *      int writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
+ *          write blocks[0 .. nblocks - 1] to blocks offset .. offset + nblocks - 1
+ *          returns 0
+ *
+ * A block store may also take hints about how blocks are going to be used,
+ * so that a cache can keep apart blocks of different classes.  This method
+ * is optional as well; use block_store_hint() to call it, which does
+ * nothing if it is null.  Block stores that do not cache but sit above one
+ * pass hints on, translated to the inodes and offsets below if need be.
+ *
+ *      int hint(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, enum block_hint hint)
+ *          blocks offset .. offset + nblocks - 1 of the inode will be used
+ *          as 'hint' says: BLOCK_HINT_METADATA for small, hot blocks such
+ *          as inodes and directories, BLOCK_HINT_STREAM for blocks read or
+ *          written once, and BLOCK_HINT_NORMAL to undo an earlier hint.
+ *          nblocks (block_no) -1 means up to the end of the inode.
+ *          returns 0
+ *
  * A 'block_t' is a block of BLOCK_SIZE bytes.  A block store is an array
  * of blocks.  A 'block_no' holds the index of the block in the block store.
  *
@@ -60,6 +87,8 @@ typedef struct block {
 	char bytes[BLOCK_SIZE];
 } block_t;
 
+enum block_hint { BLOCK_HINT_NORMAL, BLOCK_HINT_METADATA, BLOCK_HINT_STREAM };
+
 typedef struct block_store {
 	void *state;
     int (*getninodes)(struct block_store *this_bs);
@@ -69,6 +98,9 @@ typedef struct block_store {
     int (*write)(struct block_store *this_bs, unsigned int ino, block_no offset, block_t *block);
     void (*release)(struct block_store *this_bs);
     int (*sync)(struct block_store *this_bs, unsigned int ino);
+    int (*readv)(struct block_store *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+    int (*writev)(struct block_store *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+    int (*hint)(struct block_store *this_bs, unsigned int ino, block_no offset, block_no nblocks, enum block_hint hint);
 } block_store_t;
 
 typedef block_store_t *block_if;			// block store interface
@@ -78,20 +110,38 @@ typedef block_store_t *block_if;			// block store interface
  * available block store types.
  */
 block_if checkdisk_init(block_if below, const char *descr);
+block_if cipherdisk_init(block_if below, unsigned int below_ino);
+block_if cipherdisk_init_passphrase(block_if below, unsigned int below_ino, const char *passphrase);
 block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks);
 block_if combinedisk_init(block_if *below, unsigned int nbelow);
+block_if compressdisk_init(block_if below, unsigned int below_ino);
 block_if debugdisk_init(block_if below, const char *descr);
+enum dedupdisk_hash { DEDUP_SHA256, DEDUP_FAST };
+block_if dedupdisk_init(block_if below, unsigned int below_ino, enum dedupdisk_hash hash, int verify);
+block_if ecdisk_init(block_if *below, unsigned int k, unsigned int m);
 block_if fatdisk_init(block_if below, unsigned int below_ino);
 block_if filedisk_init(const char *file_name, block_no nblocks);
+block_if filedisk_open(const char *file_name);
+block_if filedisk_open_readonly(const char *file_name);
+enum logdisk_policy { LOG_GREEDY, LOG_COST_BENEFIT };
+block_if logdisk_init(block_if below, unsigned int below_ino, enum logdisk_policy policy);
 block_if mapdisk_init(block_if below, unsigned int ino);
 block_if partdisk_init(block_if below, unsigned int ninodes, block_no partsizes[]);
 block_if protdisk_init(gpid_t below, unsigned int ino);
 block_if raid0disk_init(block_if *below, unsigned int nbelow);
+block_if raid0disk_init_stripe(block_if *below, unsigned int nbelow, block_no unit);
 block_if raid1disk_init(block_if *below, unsigned int nbelow);
 block_if raid4disk_init(block_if *below, unsigned int nbelow);
 block_if raid5disk_init(block_if *below, unsigned int nbelow);
 block_if ramdisk_init(block_t *blocks, block_no nblocks);
+block_if readaheaddisk_init(block_if below, block_no maxwindow);
+enum simdisk_profile { SIM_HDD, SIM_SSD };
+block_if shardclockdisk_init(block_if below, block_t *blocks, block_no nblocks, unsigned int nshards);
+block_if simdisk_init(block_if below, enum simdisk_profile profile, int sleep);
+block_if snapdisk_init(block_if below, unsigned int below_ino);
 block_if statdisk_init(block_if below);
+enum tierdisk_mode { TIER_WRITE_THROUGH, TIER_WRITE_BACK };
+block_if tierdisk_init(block_if fast, unsigned int fast_ino, block_if slow, enum tierdisk_mode mode);
 block_if tracedisk_init(block_if below, char *trace);
 block_if treedisk_init(block_if below, unsigned int below_ino);
 block_if unixdisk_init(block_if below, unsigned int below_ino);
@@ -99,14 +149,104 @@ block_if wtclockdisk_init(block_if below, block_t *blocks, block_no nblocks);
 
 /* Some useful functions on some block store types.
  */
+unsigned long block_store_usec(void);
+unsigned long block_store_nsec(void);
+int block_store_readv(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+int block_store_writev(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+int block_store_hint(block_if bs, unsigned int ino, block_no offset, block_no nblocks, enum block_hint hint);
+
+/* A transfer of a range of blocks to or from a block store.  A pool runs
+ * a batch of transfers to different block stores concurrently.
+ */
+struct block_store_xfer {
+	block_if bs;			// block store to transfer to or from
+	unsigned int ino;		// inode in bs
+	int write;				// write (1) or read (0)
+	block_no offset;		// first block
+	block_no nblocks;		// #blocks (transfers of 0 blocks are skipped)
+	block_t *buf;			// blocks to write or buffer to read into
+	int result;				// result of the readv or writev
+};
+struct block_store_pool;
+struct block_store_pool *block_store_pool_init(unsigned int nworkers);
+int block_store_pool_run(struct block_store_pool *pool, struct block_store_xfer *xfers, unsigned int nxfers);
+void block_store_pool_release(struct block_store_pool *pool);
+
+/* Operations in a trace recorded by tracedisk.  time is when the operation
+ * started, in microseconds since the start of the trace, and latency is
+ * how long it took.
+ */
+enum tracedisk_opcode {
+	TRACE_READ = 1, TRACE_WRITE, TRACE_READV, TRACE_WRITEV,
+	TRACE_GETSIZE, TRACE_SETSIZE, TRACE_SYNC, TRACE_GETNINODES
+};
+struct tracedisk_op {
+	enum tracedisk_opcode op;
+	int failed;				// the operation returned an error
+	unsigned int ino;
+	block_no offset;		// first block, or size for TRACE_SETSIZE
+	block_no nblocks;		// #blocks read or written
+	unsigned long time, latency;
+};
+struct tracedisk_reader;
+struct tracedisk_reader *tracedisk_open(const char *trace);
+int tracedisk_next(struct tracedisk_reader *tr, struct tracedisk_op *op);
+void tracedisk_close(struct tracedisk_reader *tr);
+
+void parity_xor(block_t *dst, block_t **src, unsigned int nsrc);
+const char *parity_kernel(void);
+int parity_select(const char *name);
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);
+void gf256_madd(block_t *dst, block_t *src, uint8_t c);
+const char *gf256_kernel(void);
+int gf256_select(const char *name);
+
 int treedisk_create(block_if below, unsigned int below_ino, unsigned int ninodes);
 int fatdisk_create(block_if below, unsigned int below_ino, unsigned int ninodes);
+int compressdisk_create(block_if below, unsigned int below_ino);
+int dedupdisk_create(block_if below, unsigned int below_ino, block_no nblocks);
+int logdisk_create(block_if below, unsigned int below_ino, block_no nblocks);
+int snapdisk_create(block_if below, unsigned int below_ino, block_no nblocks);
+int tierdisk_create(block_if fast, unsigned int fast_ino);
 int unixdisk_create(block_if below, unsigned int below_ino, unsigned int ninodes);
 
+enum raid1disk_policy {
+	RAID1_PRIMARY, RAID1_ROUND_ROBIN, RAID1_FASTEST, RAID1_NEAREST
+};
+void clockdisk_set_partition(block_if this_bs, block_no meta_min, block_no stream_max);
+int raid1disk_set_policy(block_if this_bs, enum raid1disk_policy policy);
+int raid1disk_replace(block_if this_bs, unsigned int i, block_if replacement);
+int raid1disk_reattach(block_if this_bs, unsigned int i);
+int raid1disk_rebuild_step(block_if this_bs);
+void raid1disk_set_rebuild_rate(block_if this_bs, unsigned int blocks_per_sec);
+int raid5disk_rebuild(block_if this_bs, unsigned int i, block_if replacement);
+int ecdisk_rebuild(block_if this_bs, unsigned int i, block_if replacement);
+int logdisk_clean(block_if this_bs, unsigned int nsegments);
+int snapdisk_snapshot(block_if this_bs);
+int snapdisk_delete(block_if this_bs, unsigned int ino);
+unsigned long simdisk_time(block_if this_bs);
+
 int treedisk_check(block_if below);
+int treedisk_check_parallel(block_if *below, unsigned int nthreads, int verbose);
+int treedisk_defrag(block_if below, unsigned int below_ino);
 void wtclockdisk_dump_stats(block_if this_bs);
 void clockdisk_dump_stats(block_if this_bs);
+void fatdisk_dump_stats(block_if this_bs);
+void compressdisk_dump_stats(block_if this_bs);
+void dedupdisk_dump_stats(block_if this_bs);
+void ecdisk_dump_stats(block_if this_bs);
+void logdisk_dump_stats(block_if this_bs);
+void raid1disk_dump_stats(block_if this_bs);
+void raid4disk_dump_stats(block_if this_bs);
+void raid5disk_dump_stats(block_if this_bs);
+void readaheaddisk_dump_stats(block_if this_bs);
+void shardclockdisk_dump_stats(block_if this_bs);
+void simdisk_dump_stats(block_if this_bs);
+void snapdisk_dump_stats(block_if this_bs);
 void statdisk_dump_stats(block_if this_bs);
+void tierdisk_dump_stats(block_if this_bs);
+int statdisk_report(block_if this_bs, char *buf, unsigned int size);
 
 #ifdef CLOCKDISK_GRADING
 #define STATDISK_GETTER(stat) \
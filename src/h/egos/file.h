@@ -49,6 +49,7 @@ struct file_request {
 		FILE_SETSIZE,				// size is in field offset
 		FILE_DELETE,
 		FILE_SYNC,
+		FILE_HINT,					// enum block_hint is in field offset
 
 		/* Special commands for tty server.
 		 */
@@ -81,5 +82,6 @@ bool file_setsize(gpid_t svr, unsigned int file_no, unsigned long size);
 bool file_delete(gpid_t svr, unsigned int file_no);
 bool file_set_flags(gpid_t svr, unsigned int file_no, unsigned long flags);
 bool file_sync(gpid_t svr, unsigned int file_no);
+bool file_hint(gpid_t svr, unsigned int file_no, unsigned int hint);
 
 #endif // _EGOS_FILE_H
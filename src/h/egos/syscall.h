@@ -69,6 +69,7 @@ enum grass_servers {
 	GPID_FILE_BLOCK,		// file server that uses the block server
 	GPID_BLOCK,				// block server
 	GPID_SYNC,				// sync server
+	GPID_DISK_CACHE,		// disk server for the second-level cache
 
 	GPID_NSERVERS			// #servers
 };
@@ -0,0 +1,484 @@
+/*
+ * (C) 2017, Cornell University
+ * All rights reserved.
+ */
+
+/* AES-128 block encryption and CTR mode.
+ *
+ *		void aes128_init(struct aes128 *aes, const uint8_t key[16])
+ *			Expand 'key' into the round keys.  This only has to be done
+ *			once per key.
+ *
+ *		void aes128_encrypt(const struct aes128 *aes, const uint8_t in[16],
+ *															uint8_t out[16])
+ *			Encrypt a single 16-byte block.
+ *
+ *		void aes128_ctr(const struct aes128 *aes, const uint8_t iv[16],
+ *												void *buf, unsigned int len)
+ *			Encrypt or decrypt 'len' bytes in CTR mode: XOR them with the
+ *			encryptions of iv, iv + 1, iv + 2, ..., where the counter is a
+ *			128-bit big-endian number.
+ *
+ *		const char *aes128_kernel(void)
+ *		int aes128_select(const char *name)
+ *			Like parity_kernel() and parity_select(), for the kernel
+ *			used by aes128_encrypt() and aes128_ctr() ("aesni" or
+ *			"portable").
+ *
+ * The "aesni" kernel uses the AES instructions of x86-64 processors, and
+ * works on eight counter blocks at a time so that their rounds overlap in
+ * the pipeline.  It is selected on first use if the processor has them.
+ *
+ * The "portable" kernel uses no lookup tables, whose memory access
+ * patterns depend on the key.  It works on four AES blocks (64 bytes) at
+ * a time.  For SubBytes the 64 bytes are transposed into eight 64-bit bit
+ * planes, so that bit i of plane b is bit b of byte i, and the S-box is
+ * computed on all of them at once: the inverse in GF(2^8) as x^254 using
+ * bitwise operations on the planes, followed by the affine transform.
+ * MixColumns works on one 32-bit column at a time.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <egos/aes.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#define AES_X86
+#endif
+
+/* GF(2^8) with the AES polynomial x^8 + x^4 + x^3 + x + 1, computed
+ * without tables or data-dependent branches.  These are only used to
+ * expand the key.
+ */
+static uint8_t aes_xtime(uint8_t x){
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static uint8_t aes_mul(uint8_t a, uint8_t b){
+	uint8_t r = 0;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		r ^= a & -(b & 1);
+		a = aes_xtime(a);
+		b >>= 1;
+	}
+	return r;
+}
+
+static uint8_t aes_affine(uint8_t x){
+	uint8_t r = x;
+	unsigned int i;
+
+	for (i = 1; i < 5; i++) {
+		r ^= (x << i) | (x >> (8 - i));
+	}
+	return r ^ 0x63;
+}
+
+static uint8_t aes_sbox(uint8_t x){
+	uint8_t r = 1;
+	unsigned int i;
+
+	for (i = 0; i < 254; i++) {			// x^254 = 1 / x, and 0 for 0
+		r = aes_mul(r, x);
+	}
+	return aes_affine(r);
+}
+
+void aes128_init(struct aes128 *aes, const uint8_t key[16]){
+	uint8_t *rk = aes->rk, rcon = 1;
+	unsigned int i, j;
+
+	memcpy(rk, key, 16);
+	for (i = 16; i < 176; i += 4) {
+		uint8_t t[4];
+		memcpy(t, &rk[i - 4], 4);
+		if (i % 16 == 0) {
+			uint8_t t0 = t[0];
+			t[0] = aes_sbox(t[1]) ^ rcon;
+			t[1] = aes_sbox(t[2]);
+			t[2] = aes_sbox(t[3]);
+			t[3] = aes_sbox(t0);
+			rcon = aes_xtime(rcon);
+		}
+		for (j = 0; j < 4; j++) {
+			rk[i + j] = rk[i + j - 16] ^ t[j];
+		}
+	}
+}
+
+/* Bitsliced S-box.  The polynomial product of two elements has 15 bit
+ * planes, which are reduced back to 8.
+ */
+static void aes_reduce(uint64_t *t, uint64_t *c){
+	int k;
+
+	for (k = 14; k >= 8; k--) {			// x^8 = x^4 + x^3 + x + 1
+		t[k - 4] ^= t[k];
+		t[k - 5] ^= t[k];
+		t[k - 7] ^= t[k];
+		t[k - 8] ^= t[k];
+	}
+	memcpy(c, t, 8 * sizeof(*c));
+}
+
+static void aes_slice_mul(uint64_t *c, const uint64_t *a, const uint64_t *b){
+	uint64_t t[15];
+	unsigned int i, j;
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 8; j++) {
+			t[i + j] ^= a[i] & b[j];
+		}
+	}
+	aes_reduce(t, c);
+}
+
+static void aes_slice_sqr(uint64_t *c, const uint64_t *a){
+	uint64_t t[15];
+	unsigned int i;
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < 8; i++) {
+		t[2 * i] = a[i];
+	}
+	aes_reduce(t, c);
+}
+
+static void aes_slice_sbox(uint64_t *x){
+	uint64_t x2[8], x3[8], x12[8], x15[8], t[8];
+	unsigned int i;
+
+	aes_slice_sqr(x2, x);
+	aes_slice_mul(x3, x2, x);
+	aes_slice_sqr(t, x3);
+	aes_slice_sqr(x12, t);
+	aes_slice_mul(x15, x12, x3);
+	aes_slice_sqr(t, x15);				// x^30
+	aes_slice_sqr(t, t);				// x^60
+	aes_slice_sqr(t, t);				// x^120
+	aes_slice_sqr(t, t);				// x^240
+	aes_slice_mul(t, t, x12);			// x^252
+	aes_slice_mul(t, t, x2);			// x^254
+
+	for (i = 0; i < 8; i++) {
+		x[i] = t[i] ^ t[(i + 4) % 8] ^ t[(i + 5) % 8] ^ t[(i + 6) % 8] ^ t[(i + 7) % 8] ^
+												-(uint64_t) ((0x63 >> i) & 1);
+	}
+}
+
+/* Transpose the 8 x 8 bit matrix in x, where byte r is row r and bit c
+ * is column c.
+ */
+static uint64_t aes_transpose(uint64_t x){
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x ^= t ^ (t << 28);
+	return x;
+}
+
+static void aes_subbytes(uint8_t *s){
+	uint64_t t[8], p[8];
+	unsigned int i, j;
+
+	for (j = 0; j < 8; j++) {
+		uint64_t x = 0;
+		for (i = 0; i < 8; i++) {
+			x |= (uint64_t) s[8 * j + i] << (8 * i);
+		}
+		t[j] = aes_transpose(x);
+	}
+	for (i = 0; i < 8; i++) {
+		p[i] = 0;
+		for (j = 0; j < 8; j++) {
+			p[i] |= ((t[j] >> (8 * i)) & 0xff) << (8 * j);
+		}
+	}
+	aes_slice_sbox(p);
+	for (j = 0; j < 8; j++) {
+		uint64_t x = 0;
+		for (i = 0; i < 8; i++) {
+			x |= ((p[i] >> (8 * j)) & 0xff) << (8 * i);
+		}
+		x = aes_transpose(x);
+		for (i = 0; i < 8; i++) {
+			s[8 * j + i] = x >> (8 * i);
+		}
+	}
+}
+
+/* Byte r of column c of an AES block is byte 4 * c + r.  ShiftRows
+ * rotates row r left by r columns.
+ */
+static void aes_shiftrows(uint8_t *s){
+	uint8_t t[16];
+	unsigned int r, c;
+
+	memcpy(t, s, 16);
+	for (c = 0; c < 4; c++) {
+		for (r = 1; r < 4; r++) {
+			s[4 * c + r] = t[4 * ((c + r) % 4) + r];
+		}
+	}
+}
+
+static uint32_t aes_rot(uint32_t w, unsigned int n){
+	return (w >> n) | (w << (32 - n));
+}
+
+/* Each output byte is 2 a[r] + 3 a[r + 1] + a[r + 2] + a[r + 3].  With
+ * the column in a 32-bit word with row r in byte r, rotating it right by
+ * 8 bits moves row r + 1 into byte r.
+ */
+static void aes_mixcolumns(uint8_t *s){
+	unsigned int c;
+
+	for (c = 0; c < 4; c++) {
+		uint8_t *col = &s[4 * c];
+		uint32_t w = col[0] | (col[1] << 8) | (col[2] << 16) | ((uint32_t) col[3] << 24);
+		uint32_t w1 = aes_rot(w, 8);
+		uint32_t x = w ^ w1;
+		x = ((x & 0x7f7f7f7f) << 1) ^ (((x >> 7) & 0x01010101) * 0x1b);
+		w = x ^ w1 ^ aes_rot(w, 16) ^ aes_rot(w, 24);
+		col[0] = w;
+		col[1] = w >> 8;
+		col[2] = w >> 16;
+		col[3] = w >> 24;
+	}
+}
+
+static void aes_addroundkey(uint8_t *s, const uint8_t *rk){
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		s[i] ^= rk[i];
+	}
+}
+
+/* Encrypt four blocks in place.
+ */
+static void aes_encrypt4(const struct aes128 *aes, uint8_t *s){
+	unsigned int r, b;
+
+	for (b = 0; b < 64; b += 16) {
+		aes_addroundkey(&s[b], &aes->rk[0]);
+	}
+	for (r = 1; r < 11; r++) {
+		aes_subbytes(s);
+		for (b = 0; b < 64; b += 16) {
+			aes_shiftrows(&s[b]);
+			if (r < 10) {
+				aes_mixcolumns(&s[b]);
+			}
+			aes_addroundkey(&s[b], &aes->rk[16 * r]);
+		}
+	}
+}
+
+static void aes_counter(uint8_t *block, uint64_t hi, uint64_t lo){
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		block[i] = hi >> (56 - 8 * i);
+		block[8 + i] = lo >> (56 - 8 * i);
+	}
+}
+
+/* XOR 'nblocks' 16-byte blocks of buf with the encrypted counter blocks
+ * starting at (*hi, *lo), and advance the counter.
+ */
+static void aes_ctr_portable(const struct aes128 *aes, uint64_t *hi, uint64_t *lo,
+										uint8_t *buf, unsigned int nblocks){
+	uint8_t ks[64];
+	unsigned int i, j, n;
+
+	while (nblocks > 0) {
+		n = nblocks < 4 ? nblocks : 4;
+		for (i = 0; i < n; i++) {
+			aes_counter(&ks[16 * i], *hi, *lo);
+			if (++*lo == 0) {
+				++*hi;
+			}
+		}
+		aes_encrypt4(aes, ks);
+		for (j = 0; j < 16 * n; j++) {
+			buf[j] ^= ks[j];
+		}
+		buf += 16 * n;
+		nblocks -= n;
+	}
+}
+
+static void aes_encrypt_portable(const struct aes128 *aes, const uint8_t *in, uint8_t *out){
+	uint8_t s[64];
+
+	memset(s, 0, sizeof(s));
+	memcpy(s, in, 16);
+	aes_encrypt4(aes, s);
+	memcpy(out, s, 16);
+}
+
+#ifdef AES_X86
+typedef long long aes_v2_t __attribute__((vector_size(16), aligned(1), may_alias));
+
+static int aes_have_aesni(void){
+	uint32_t a, b, c, d;
+
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+	return (c & (1 << 25)) != 0;
+}
+
+static aes_v2_t aes_ni_counter(uint64_t hi, uint64_t lo){
+	return (aes_v2_t) { (long long) __builtin_bswap64(hi), (long long) __builtin_bswap64(lo) };
+}
+
+__attribute__((target("aes")))
+static aes_v2_t aes_ni_encrypt(const aes_v2_t *rk, aes_v2_t x){
+	unsigned int r;
+
+	x ^= rk[0];
+	for (r = 1; r < 10; r++) {
+		x = __builtin_ia32_aesenc128(x, rk[r]);
+	}
+	return __builtin_ia32_aesenclast128(x, rk[10]);
+}
+
+#define AES_NI_ALL(f, k)												\
+	do {																\
+		x0 = f(x0, k); x1 = f(x1, k); x2 = f(x2, k); x3 = f(x3, k);		\
+		x4 = f(x4, k); x5 = f(x5, k); x6 = f(x6, k); x7 = f(x7, k);		\
+	} while (0)
+
+__attribute__((target("aes")))
+static void aes_ctr_aesni(const struct aes128 *aes, uint64_t *hi, uint64_t *lo,
+										uint8_t *buf, unsigned int nblocks){
+	aes_v2_t rk[11], *b = (aes_v2_t *) buf;
+	uint64_t h = *hi, l = *lo;
+	unsigned int i, r;
+
+	for (i = 0; i < 11; i++) {
+		rk[i] = *(aes_v2_t *) &aes->rk[16 * i];
+	}
+
+	/* Eight blocks at a time, unless the counter wraps around.
+	 */
+	for (; nblocks >= 8 && l <= UINT64_MAX - 8; nblocks -= 8, b += 8, l += 8) {
+		aes_v2_t x0 = aes_ni_counter(h, l) ^ rk[0], x1 = aes_ni_counter(h, l + 1) ^ rk[0];
+		aes_v2_t x2 = aes_ni_counter(h, l + 2) ^ rk[0], x3 = aes_ni_counter(h, l + 3) ^ rk[0];
+		aes_v2_t x4 = aes_ni_counter(h, l + 4) ^ rk[0], x5 = aes_ni_counter(h, l + 5) ^ rk[0];
+		aes_v2_t x6 = aes_ni_counter(h, l + 6) ^ rk[0], x7 = aes_ni_counter(h, l + 7) ^ rk[0];
+		for (r = 1; r < 10; r++) {
+			AES_NI_ALL(__builtin_ia32_aesenc128, rk[r]);
+		}
+		AES_NI_ALL(__builtin_ia32_aesenclast128, rk[10]);
+		b[0] ^= x0; b[1] ^= x1; b[2] ^= x2; b[3] ^= x3;
+		b[4] ^= x4; b[5] ^= x5; b[6] ^= x6; b[7] ^= x7;
+	}
+	for (; nblocks > 0; nblocks--, b++) {
+		*b ^= aes_ni_encrypt(rk, aes_ni_counter(h, l));
+		if (++l == 0) {
+			h++;
+		}
+	}
+	*hi = h;
+	*lo = l;
+}
+
+__attribute__((target("aes")))
+static void aes_encrypt_aesni(const struct aes128 *aes, const uint8_t *in, uint8_t *out){
+	*(aes_v2_t *) out = aes_ni_encrypt((const aes_v2_t *) aes->rk, *(aes_v2_t *) in);
+}
+#endif
+
+static struct aes_kernel {
+	const char *name;
+	void (*ctr)(const struct aes128 *aes, uint64_t *hi, uint64_t *lo,
+										uint8_t *buf, unsigned int nblocks);
+	void (*encrypt)(const struct aes128 *aes, const uint8_t *in, uint8_t *out);
+	int (*available)(void);
+} aes_kernels[] = {
+#ifdef AES_X86
+	{ "aesni", aes_ctr_aesni, aes_encrypt_aesni, aes_have_aesni },
+#endif
+	{ "portable", aes_ctr_portable, aes_encrypt_portable, 0 },
+};
+
+#define AES_NKERNELS		(sizeof(aes_kernels) / sizeof(aes_kernels[0]))
+
+static struct aes_kernel *aes_current;
+
+static void aes_choose(void){
+	unsigned int i;
+
+	for (i = 0; i < AES_NKERNELS; i++) {
+		if (aes_kernels[i].available == 0 || (*aes_kernels[i].available)()) {
+			aes_current = &aes_kernels[i];
+			return;
+		}
+	}
+}
+
+void aes128_encrypt(const struct aes128 *aes, const uint8_t in[16], uint8_t out[16]){
+	if (aes_current == 0) {
+		aes_choose();
+	}
+	(*aes_current->encrypt)(aes, in, out);
+}
+
+void aes128_ctr(const struct aes128 *aes, const uint8_t iv[16], void *buf, unsigned int len){
+	uint8_t *p = buf, tail[16];
+	uint64_t hi = 0, lo = 0;
+	unsigned int i;
+
+	if (aes_current == 0) {
+		aes_choose();
+	}
+	for (i = 0; i < 8; i++) {
+		hi = (hi << 8) | iv[i];
+		lo = (lo << 8) | iv[8 + i];
+	}
+	(*aes_current->ctr)(aes, &hi, &lo, p, len / 16);
+
+	/* A partial last block is XORed with part of the next key block.
+	 */
+	if (len % 16 != 0) {
+		p += len / 16 * 16;
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, p, len % 16);
+		(*aes_current->ctr)(aes, &hi, &lo, tail, 1);
+		memcpy(p, tail, len % 16);
+	}
+}
+
+const char *aes128_kernel(void){
+	if (aes_current == 0) {
+		aes_choose();
+	}
+	return aes_current->name;
+}
+
+int aes128_select(const char *name){
+	unsigned int i;
+
+	if (aes_current == 0) {
+		aes_choose();
+	}
+	for (i = 0; i < AES_NKERNELS; i++) {
+		struct aes_kernel *k = &aes_kernels[i];
+		if (strcmp(k->name, name) == 0) {
+			if (k->available != 0 && !(*k->available)()) {
+				return -1;
+			}
+			aes_current = k;
+			return 0;
+		}
+	}
+	return -1;
+}
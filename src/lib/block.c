@@ -142,3 +142,109 @@ bool block_getninodes(gpid_t svr, unsigned int *ninodes){
     *ninodes = reply.br_ninodes;
     return reply.status == BLOCK_OK;
 }
+
+bool block_defrag(gpid_t svr, unsigned int *nmoved){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_DEFRAG;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return false;
+    }
+    *nmoved = reply.br_nmoved;
+    return reply.status == BLOCK_OK;
+}
+
+bool block_snapshot(gpid_t svr, unsigned int *snapshot){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_SNAPSHOT;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return false;
+    }
+    *snapshot = reply.br_snapshot;
+    return reply.status == BLOCK_OK;
+}
+
+bool block_snapshot_delete(gpid_t svr, unsigned int snapshot){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_SNAPSHOT;
+    req.ino = snapshot;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return false;
+    }
+    return reply.status == BLOCK_OK;
+}
+
+/* Get the statistics report of the block server into buf, which is
+ * always null-terminated.  Returns the length of the whole report, which
+ * may be longer than what fit, or -1 on error.
+ */
+int block_stats(gpid_t svr, char *buf, unsigned int size){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_STATS;
+
+    /* Do the RPC.
+     */
+    struct block_reply *reply = (struct block_reply *) malloc(sizeof(*reply) + size);
+    int n = sys_rpc(svr, &req, sizeof(req), reply, sizeof(*reply) + size);
+    if (n < (int) sizeof(*reply) || reply->status != BLOCK_OK || size == 0) {
+        free(reply);
+        return -1;
+    }
+    n -= sizeof(*reply);
+    if (n >= (int) size) {
+        n = size - 1;
+    }
+    memcpy(buf, &reply[1], n);
+    buf[n] = 0;
+    n = reply->br_length;
+    free(reply);
+    return n;
+}
+
+/* Tell the block server how inode ino is going to be used.  hint is an
+ * enum block_hint (see <egos/block_store.h>).
+ */
+bool block_hint(gpid_t svr, unsigned int ino, unsigned int hint){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_HINT;
+    req.ino = ino;
+    req.offset_nblock = hint;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return false;
+    }
+    return reply.status == BLOCK_OK;
+}
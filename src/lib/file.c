@@ -217,3 +217,26 @@ bool file_set_flags(gpid_t svr, unsigned int file_no, unsigned long flags){
 	}
 	return reply.status == FILE_OK;
 }
+
+/* Tell the file server how the file is going to be used, so it can cache
+ * it accordingly.  hint is an enum block_hint (see <egos/block_store.h>).
+ * File servers that have nothing to do with hints simply accept them.
+ */
+bool file_hint(gpid_t svr, unsigned int file_no, unsigned int hint){
+	/* Prepare request.
+	 */
+	struct file_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = FILE_HINT;
+	req.file_no = file_no;
+	req.offset = hint;
+
+	/* Do the RPC.
+	 */
+	struct file_reply reply;
+	int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (result < (int) sizeof(reply)) {
+		return false;
+	}
+	return reply.status == FILE_OK;
+}
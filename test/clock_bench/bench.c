@@ -0,0 +1,192 @@
+/* Stress test and benchmark of shardclockdisk against clockdisk.
+ *
+ * 1 to 16 threads (doubling) each do a number of random single-block
+ * reads and writes on a cache over a ramdisk, and the total number of
+ * operations per second is reported.  clockdisk assumes a single caller,
+ * so it is called with a global lock held, as a server with several
+ * workers would have to.  shardclockdisk is called directly.
+ *
+ * Every block written is filled with copies of one 64-bit word holding
+ * the offset and a counter, and every block read is checked to hold the
+ * right offset and the same word throughout, to catch torn reads.  At the
+ * end the cache is synced and the ramdisk is checked the same way.  By
+ * default the range of blocks is four times the size of the cache, so
+ * that blocks are evicted and dirty blocks written back all the time.
+ *
+ * clockdisk prints its statistics every 20 operations.  Standard output
+ * is sent to /dev/null so that these do not bury the results, which go
+ * to the original standard output.
+ *
+ * Usage: bench [-n ops_per_thread] [-c cache_blocks] [-r range] [-s shards] [-w write_percent]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <egos/block_store.h>
+
+#define MAX_THREADS		16
+#define WORDS			(BLOCK_SIZE / sizeof(uint64_t))
+
+static unsigned int nops = 200000, ncache = 1024, range = 4096, nshards = 16, write_pct = 10;
+static FILE *report;				// the original standard output
+
+static block_if cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int locked;					// call the cache with cache_lock held
+static unsigned long nerrors;
+
+struct worker {
+	pthread_t tid;
+	unsigned int id;
+	uint64_t rng;
+};
+
+static uint64_t next_rand(uint64_t *x){
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static void fill(block_t *block, block_no offset, uint64_t version){
+	uint64_t *w = (uint64_t *) block, word = (uint64_t) offset << 32 | (uint32_t) version;
+	unsigned int i;
+
+	for (i = 0; i < WORDS; i++) {
+		w[i] = word;
+	}
+}
+
+/* A block must be all zeroes (never written) or all the same word with
+ * the right offset.
+ */
+static int check(block_t *block, block_no offset){
+	uint64_t *w = (uint64_t *) block;
+	unsigned int i;
+
+	if (w[0] != 0 && (w[0] >> 32) != offset) {
+		return -1;
+	}
+	for (i = 1; i < WORDS; i++) {
+		if (w[i] != w[0]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *worker_main(void *arg){
+	struct worker *wk = arg;
+	block_t block;
+	unsigned int i;
+
+	for (i = 0; i < nops; i++) {
+		uint64_t r = next_rand(&wk->rng);
+		block_no offset = (r >> 8) % range;
+		int write = (r & 0xFF) * 100 < write_pct * 256;
+
+		if (locked) {
+			pthread_mutex_lock(&cache_lock);
+		}
+		if (write) {
+			fill(&block, offset, (uint64_t) wk->id << 24 | i);
+			(*cache->write)(cache, 0, offset, &block);
+		}
+		else if ((*cache->read)(cache, 0, offset, &block) < 0 || check(&block, offset) < 0) {
+			__atomic_fetch_add(&nerrors, 1, __ATOMIC_RELAXED);
+		}
+		if (locked) {
+			pthread_mutex_unlock(&cache_lock);
+		}
+	}
+	return 0;
+}
+
+static void run(const char *name, unsigned int nthreads, int sharded){
+	struct worker workers[MAX_THREADS];
+	block_t *disk = calloc(range, BLOCK_SIZE), block;
+	block_if ram = ramdisk_init(disk, range);
+	unsigned int i;
+
+	cache = sharded ? shardclockdisk_init(ram, malloc(ncache * BLOCK_SIZE), ncache, nshards) :
+						clockdisk_init(ram, malloc(ncache * BLOCK_SIZE), ncache);
+	locked = !sharded;
+	nerrors = 0;
+
+	unsigned long start = block_store_usec();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].rng = 4411 + 7919 * i;
+		pthread_create(&workers[i].tid, 0, worker_main, &workers[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, 0);
+	}
+	unsigned long elapsed = block_store_usec() - start;
+
+	(*cache->sync)(cache, (unsigned int) -1);
+	for (i = 0; i < range; i++) {
+		(*ram->read)(ram, 0, i, &block);
+		if (check(&block, i) < 0) {
+			nerrors++;
+		}
+	}
+	fprintf(report, "%-6s %2u threads: %10.0f ops/s, %lu errors\n", name, nthreads,
+			elapsed == 0 ? 0 : (double) nops * nthreads * 1e6 / elapsed, nerrors);
+
+	(*cache->release)(cache);
+	(*ram->release)(ram);
+	free(disk);
+}
+
+int main(int argc, char **argv){
+	unsigned int n;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:c:r:s:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'c':
+			ncache = atoi(optarg);
+			break;
+		case 'r':
+			range = atoi(optarg);
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n ops_per_thread] [-c cache_blocks] [-r range] [-s shards] [-w write_percent]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (ncache == 0 || range == 0) {
+		fprintf(stderr, "bench: cache and range must not be empty\n");
+		return 1;
+	}
+
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	if (report == 0 || freopen("/dev/null", "w", stdout) == 0) {
+		perror("bench");
+		return 1;
+	}
+	setvbuf(report, 0, _IOLBF, 0);
+
+	fprintf(report, "%u ops per thread, %u%% writes, %u blocks in %u cache blocks, %u shards\n",
+			nops, write_pct, range, ncache, nshards);
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		run("clock", n, 0);
+		run("shard", n, 1);
+	}
+	return 0;
+}
@@ -0,0 +1,365 @@
+/* Checks that compressdisk returns the data written, also after it is
+ * closed and opened again and after a crash.  A number of rounds each
+ * apply random reads, writes, writes of zero blocks, readvs, writevs
+ * and syncs to compressdisk and to a model, and end in one of two ways:
+ *
+ *		reopen: the block store is released and opened again, after which
+ *			every block must read back as in the model.
+ *		crash: the block store below stops taking writes after a random
+ *			number of them, silently, as if the machine had crashed at that
+ *			point.  Writevs below are split into single blocks, so a crash
+ *			can tear them.  After opening again, every group of blocks must
+ *			read back as it was at the last completed sync or at some point
+ *			after it.
+ *
+ * Each block written holds its offset and a sequence number, so a block
+ * read back tells which write it came from.  The rest of the block is
+ * incompressible, text-like, or mostly zero, depending on the sequence
+ * number.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	1000	// blocks below
+#define GROUP		8		// COMPRESS_GROUP
+#define MAX_XFER	40
+#define NROUNDS		50
+
+/* A block store below that drops all writes after a number of them.
+ */
+struct crashing {
+	block_if below;
+	long budget;		// #writes until the crash, or -1
+};
+
+static int crashing_getsize(block_if bi, unsigned int ino){
+	struct crashing *c = bi->state;
+	return (*c->below->getsize)(c->below, ino);
+}
+
+static int crashing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	return (*c->below->read)(c->below, ino, offset, block);
+}
+
+static int crashing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	if (c->budget == 0) {
+		return 0;
+	}
+	if (c->budget > 0) {
+		c->budget--;
+	}
+	return (*c->below->write)(c->below, ino, offset, block);
+}
+
+static int crashing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if crashing_init(block_t *blocks, block_no nblocks, struct crashing *c){
+	block_if bi = new_alloc(block_store_t);
+	c->below = ramdisk_init(blocks, nblocks);
+	c->budget = -1;
+	bi->state = c;
+	bi->getsize = crashing_getsize;
+	bi->read = crashing_read;
+	bi->write = crashing_write;
+	bi->sync = crashing_sync;
+	return bi;
+}
+
+/* The writes since the last completed sync, in order.
+ */
+struct write {
+	block_no offset;
+	unsigned int seq;
+};
+
+static block_t disk[DISK_SIZE];
+static struct crashing crash;
+static block_if below, cz;
+static block_no size;
+static unsigned int *cur;		// sequence number of the last write of each block
+static unsigned int *synced;	// ... as of the last completed sync
+static unsigned int seq;		// sequence number of the last write
+static struct write *writes;
+static unsigned int nwrites, maxwrites;
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+static void fill(block_t *block, block_no offset, unsigned int s){
+	static const char *words[] = {
+		"int ", "return ", "struct ", "block_t ", "if (x) {\n", "\t}\n", "foo", "bar_baz ",
+	};
+	unsigned int *w = (unsigned int *) block, i, r = offset * 2654435761u ^ s * 40503u;
+	char *p = (char *) block;
+
+	memset(block, 0, sizeof(*block));
+	w[0] = offset;
+	w[1] = s;
+	switch (s % 4) {
+	case 0:
+		for (i = 2; i < BLOCK_SIZE / sizeof(*w); i++) {
+			r = r * 1103515245 + 12345;
+			w[i] = r ^ (r >> 16);
+		}
+		break;
+	case 1: case 2:
+		for (i = 2 * sizeof(*w); i < BLOCK_SIZE;) {
+			r = r * 1103515245 + 12345;
+			const char *q = words[(r >> 16) % 8];
+			for (; *q != 0 && i < BLOCK_SIZE; q++) {
+				p[i++] = *q;
+			}
+		}
+		break;
+	default:
+		w[2] = r;
+	}
+}
+
+/* Return the sequence number of the write that the block came from,
+ * which must have been a write to the given offset, or 0 if the block is
+ * zero.  Returns -1 if the block is corrupt.
+ */
+static int decode(block_t *block, block_no offset){
+	block_t expect;
+	unsigned int s = ((unsigned int *) block)[1];
+
+	if (s == 0) {
+		memset(&expect, 0, sizeof(expect));
+	}
+	else {
+		fill(&expect, offset, s);
+	}
+	return memcmp(block, &expect, sizeof(expect)) == 0 ? (int) s : -1;
+}
+
+/* What is read after the crash does not count: the block store goes on
+ * as if the writes below that were dropped had been done.
+ */
+static void check(block_t *block, block_no offset){
+	if (crash.budget == 0) {
+		return;
+	}
+	if (decode(block, offset) != (int) cur[offset]) {
+		fail("read returned the wrong data", offset);
+	}
+}
+
+static void written(block_no offset, unsigned int s){
+	if (nwrites == maxwrites) {
+		maxwrites = maxwrites == 0 ? 1024 : 2 * maxwrites;
+		writes = realloc(writes, maxwrites * sizeof(*writes));
+	}
+	writes[nwrites].offset = offset;
+	writes[nwrites].seq = s;
+	nwrites++;
+	cur[offset] = s;
+}
+
+static void sync_done(void){
+	memcpy(synced, cur, size * sizeof(*cur));
+	nwrites = 0;
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset, n, i;
+
+	if (rand() % 4 != 0) {
+		offset = rand() % (size / 8);
+	}
+	else {
+		offset = rand() % size;
+	}
+	n = 1 + rand() % MAX_XFER;
+	if (n > size - offset) {
+		n = size - offset;
+	}
+	switch (rand() % 20) {
+	case 0: case 1: case 2: case 3: case 4:
+		fill(&buf[0], offset, ++seq);
+		if ((*cz->write)(cz, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		written(offset, seq);
+		break;
+	case 5:
+		memset(&buf[0], 0, sizeof(buf[0]));
+		if ((*cz->write)(cz, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		written(offset, 0);
+		break;
+	case 6: case 7: case 8:
+		for (i = 0; i < n; i++) {
+			fill(&buf[i], offset + i, seq + 1 + i);
+		}
+		if (block_store_writev(cz, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			written(offset + i, ++seq);
+		}
+		break;
+	case 9: case 10: case 11: case 12: case 13:
+		if ((*cz->read)(cz, 0, offset, &buf[0]) < 0 && crash.budget != 0) {
+			fail("read failed", offset);
+		}
+		check(&buf[0], offset);
+		break;
+	case 14: case 15: case 16: case 17:
+		if (block_store_readv(cz, 0, offset, n, buf) < 0 && crash.budget != 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			check(&buf[i], offset + i);
+		}
+		break;
+	default:
+		if (rand() % 8 == 0) {
+			if ((*cz->sync)(cz, 0) < 0) {
+				fail("sync failed", 0);
+			}
+			if (crash.budget != 0) {
+				sync_done();
+			}
+		}
+	}
+}
+
+static void open_cz(void){
+	if ((cz = compressdisk_init(below, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	if ((*cz->getsize)(cz, 0) != (int) size) {
+		fail("wrong size", size);
+	}
+}
+
+static void check_all(void){
+	static block_t buf[MAX_XFER];
+	block_no b, i, n;
+
+	for (b = 0; b < size; b += n) {
+		n = size - b < MAX_XFER ? size - b : MAX_XFER;
+		if (block_store_readv(cz, 0, b, n, buf) < 0) {
+			fail("readv failed", b);
+		}
+		for (i = 0; i < n; i++) {
+			check(&buf[i], b + i);
+		}
+	}
+}
+
+static int group_equal(unsigned int *a, unsigned int *b, block_no group){
+	return memcmp(&a[group * GROUP], &b[group * GROUP], GROUP * sizeof(*a)) == 0;
+}
+
+/* After a crash every group holds what it held at the last sync, or what
+ * it held after one of the writes since.  That is what it holds from now
+ * on.
+ */
+static void check_recovered(void){
+	block_t block;
+	block_no b, g, ngroups = size / GROUP;
+	unsigned int k, *found = malloc(size * sizeof(*found));
+	char *ok = malloc(ngroups);
+
+	for (b = 0; b < size; b++) {
+		if ((*cz->read)(cz, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		int s = decode(&block, b);
+		if (s < 0) {
+			fail("block is corrupt", b);
+		}
+		found[b] = s;
+	}
+
+	/* Replay the writes since the last sync on top of what was synced.
+	 */
+	for (g = 0; g < ngroups; g++) {
+		ok[g] = group_equal(found, synced, g);
+	}
+	for (k = 0; k < nwrites; k++) {
+		g = writes[k].offset / GROUP;
+		synced[writes[k].offset] = writes[k].seq;
+		if (!ok[g]) {
+			ok[g] = group_equal(found, synced, g);
+		}
+	}
+	for (g = 0; g < ngroups; g++) {
+		if (!ok[g]) {
+			fail("group holds neither the synced data nor a later version", g * GROUP);
+		}
+	}
+	memcpy(cur, found, size * sizeof(*cur));
+	sync_done();
+	free(found);
+	free(ok);
+}
+
+int main(int argc, char **argv){
+	unsigned int round, k;
+
+	srand(4411);
+	below = crashing_init(disk, DISK_SIZE, &crash);
+	if (compressdisk_create(below, 0) < 0) {
+		fail("can't create", 0);
+	}
+	if ((cz = compressdisk_init(below, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	size = (*cz->getsize)(cz, 0);
+	if (size % GROUP != 0) {
+		fail("size is not a multiple of the group size", size);
+	}
+	cur = calloc(size, sizeof(*cur));
+	synced = calloc(size, sizeof(*synced));
+
+	for (round = 0; round < NROUNDS; round++) {
+		int crashing = rand() % 2;
+		snprintf(phase, sizeof(phase), "round %u (%s)", round, crashing ? "crash" : "reopen");
+		if (crashing) {
+			crash.budget = rand() % DISK_SIZE;
+		}
+		for (k = 0; k < 2000 && crash.budget != 0; k++) {
+			random_op();
+		}
+
+		/* Releasing after the crash writes nothing more.
+		 */
+		crash.budget = crashing ? 0 : -1;
+		(*cz->release)(cz);
+		crash.budget = -1;
+		open_cz();
+		if (crashing) {
+			check_recovered();
+		}
+		else {
+			check_all();
+			sync_done();
+		}
+	}
+	(*cz->release)(cz);
+	(*crash.below->release)(crash.below);
+	free(below);
+	free(cur);
+	free(synced);
+	free(writes);
+	printf("ok\n");
+	return 0;
+}
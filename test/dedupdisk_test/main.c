@@ -0,0 +1,323 @@
+/* Checks that dedupdisk returns the data written, also after it is
+ * closed and opened again and after a crash.  For both fingerprints, a
+ * number of rounds each apply random reads, writes and syncs to
+ * dedupdisk and to a model, and end in one of two ways:
+ *
+ *		reopen: the block store is released and opened again, after which
+ *			every block must read back as in the model.
+ *		crash: the block store below stops taking writes after a random
+ *			number of them, silently, as if the machine had crashed at that
+ *			point.  After opening again, every block must hold either what
+ *			it held at the last completed sync or something written to it
+ *			since.
+ *
+ * Many writes take their contents from a pool, so that blocks are shared
+ * and unshared all the time.  Some are zero, and the rest are unique.
+ * Syncs are rare enough that writes run out of free blocks and have to
+ * sync themselves.  Each block holds the number of its contents, so a
+ * block read back tells which write it came from.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	1000	// blocks below
+#define MAX_XFER	20
+#define NPOOL		200		// #contents in the pool
+#define NROUNDS		40
+
+/* A block store below that drops all writes after a number of them.
+ */
+struct crashing {
+	block_if below;
+	long budget;		// #writes until the crash, or -1
+};
+
+static int crashing_getsize(block_if bi, unsigned int ino){
+	struct crashing *c = bi->state;
+	return (*c->below->getsize)(c->below, ino);
+}
+
+static int crashing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	return (*c->below->read)(c->below, ino, offset, block);
+}
+
+static int crashing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	if (c->budget == 0) {
+		return 0;
+	}
+	if (c->budget > 0) {
+		c->budget--;
+	}
+	return (*c->below->write)(c->below, ino, offset, block);
+}
+
+static int crashing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if crashing_init(block_t *blocks, block_no nblocks, struct crashing *c){
+	block_if bi = new_alloc(block_store_t);
+	c->below = ramdisk_init(blocks, nblocks);
+	c->budget = -1;
+	bi->state = c;
+	bi->getsize = crashing_getsize;
+	bi->read = crashing_read;
+	bi->write = crashing_write;
+	bi->sync = crashing_sync;
+	return bi;
+}
+
+/* The writes since the last completed sync, in order.
+ */
+struct write {
+	block_no offset;
+	unsigned int value;
+};
+
+static block_t disk[DISK_SIZE];
+static struct crashing crash;
+static block_if below, dd;
+static enum dedupdisk_hash hash;
+static block_no size;
+static unsigned int *cur;		// contents of each block
+static unsigned int *synced;	// ... as of the last completed sync
+static unsigned int unique;		// last unique contents
+static struct write *writes;
+static unsigned int nwrites, maxwrites;
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+/* Contents 0 is a block of zeroes.
+ */
+static void fill(block_t *block, unsigned int value){
+	unsigned int *w = (unsigned int *) block, i;
+
+	if (value == 0) {
+		memset(block, 0, sizeof(*block));
+		return;
+	}
+	w[0] = value;
+	for (i = 1; i < BLOCK_SIZE / sizeof(*w); i++) {
+		w[i] = (value * 2654435761u) ^ (i * 40503u);
+	}
+}
+
+/* Return the contents of the block, or -1 if it is corrupt.
+ */
+static int decode(block_t *block){
+	block_t expect;
+	unsigned int value = ((unsigned int *) block)[0];
+
+	fill(&expect, value);
+	return memcmp(block, &expect, sizeof(expect)) == 0 ? (int) value : -1;
+}
+
+/* What is read after the crash does not count: the block store goes on
+ * as if the writes below that were dropped had been done.
+ */
+static void check(block_t *block, block_no offset){
+	if (crash.budget == 0) {
+		return;
+	}
+	if (decode(block) != (int) cur[offset]) {
+		fail("read returned the wrong data", offset);
+	}
+}
+
+static void written(block_no offset, unsigned int value){
+	if (nwrites == maxwrites) {
+		maxwrites = maxwrites == 0 ? 1024 : 2 * maxwrites;
+		writes = realloc(writes, maxwrites * sizeof(*writes));
+	}
+	writes[nwrites].offset = offset;
+	writes[nwrites].value = value;
+	nwrites++;
+	cur[offset] = value;
+}
+
+static void sync_done(void){
+	memcpy(synced, cur, size * sizeof(*cur));
+	nwrites = 0;
+}
+
+static unsigned int random_value(void){
+	switch (rand() % 10) {
+	case 0:
+		return 0;
+	case 1: case 2: case 3: case 4: case 5: case 6:
+		return ++unique;
+	default:
+		return 1 + rand() % NPOOL;
+	}
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset, n, i;
+
+	offset = rand() % size;
+	n = 1 + rand() % MAX_XFER;
+	if (n > size - offset) {
+		n = size - offset;
+	}
+	switch (rand() % 20) {
+	case 0: case 1: case 2: case 3: case 4: case 5: case 6:
+		for (i = 0; i < n; i++) {
+			unsigned int value = random_value();
+			fill(&buf[i], value);
+			if ((*dd->write)(dd, 0, offset + i, &buf[i]) < 0) {
+				fail("write failed", offset + i);
+			}
+			written(offset + i, value);
+		}
+		break;
+	case 7: case 8: case 9: case 10: case 11: case 12:
+		if ((*dd->read)(dd, 0, offset, &buf[0]) < 0 && crash.budget != 0) {
+			fail("read failed", offset);
+		}
+		check(&buf[0], offset);
+		break;
+	case 13: case 14: case 15: case 16: case 17:
+		if (block_store_readv(dd, 0, offset, n, buf) < 0 && crash.budget != 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			check(&buf[i], offset + i);
+		}
+		break;
+	default:
+		if (rand() % 80 == 0) {
+			if ((*dd->sync)(dd, 0) < 0) {
+				fail("sync failed", 0);
+			}
+			if (crash.budget != 0) {
+				sync_done();
+			}
+		}
+	}
+}
+
+static void open_dd(void){
+	if ((dd = dedupdisk_init(below, 0, hash, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	if ((*dd->getsize)(dd, 0) != (int) size) {
+		fail("wrong size", size);
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*dd->read)(dd, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		check(&block, b);
+	}
+}
+
+/* After a crash every block holds what it held at the last sync, or what
+ * one of the writes to it since wrote.  That is what it holds from now on.
+ */
+static void check_recovered(void){
+	block_t block;
+	block_no b;
+	unsigned int k;
+	char *ok = malloc(size);
+
+	for (b = 0; b < size; b++) {
+		if ((*dd->read)(dd, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		int value = decode(&block);
+		if (value < 0) {
+			fail("block is corrupt", b);
+		}
+		cur[b] = value;
+		ok[b] = cur[b] == synced[b];
+	}
+	for (k = 0; k < nwrites; k++) {
+		if (writes[k].value == cur[writes[k].offset]) {
+			ok[writes[k].offset] = 1;
+		}
+	}
+	for (b = 0; b < size; b++) {
+		if (!ok[b]) {
+			fail("block holds neither the synced nor a later write", b);
+		}
+	}
+	sync_done();
+	free(ok);
+}
+
+static void run(enum dedupdisk_hash h){
+	unsigned int round, k;
+
+	hash = h;
+	memset(disk, 0, sizeof(disk));
+	below = crashing_init(disk, DISK_SIZE, &crash);
+	if (dedupdisk_create(below, 0, 0) < 0) {
+		fail("can't create", 0);
+	}
+	if ((dd = dedupdisk_init(below, 0, hash, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	size = (*dd->getsize)(dd, 0);
+	cur = calloc(size, sizeof(*cur));
+	synced = calloc(size, sizeof(*synced));
+	nwrites = 0;
+
+	for (round = 0; round < NROUNDS; round++) {
+		int crashing = rand() % 2;
+		snprintf(phase, sizeof(phase), "%s, round %u (%s)",
+				hash == DEDUP_SHA256 ? "sha256" : "fast", round, crashing ? "crash" : "reopen");
+		if (crashing) {
+			crash.budget = rand() % DISK_SIZE;
+		}
+		for (k = 0; k < 2000 && crash.budget != 0; k++) {
+			random_op();
+		}
+
+		/* Releasing after the crash writes nothing more.
+		 */
+		crash.budget = crashing ? 0 : -1;
+		(*dd->release)(dd);
+		crash.budget = -1;
+		open_dd();
+		if (crashing) {
+			check_recovered();
+		}
+		else {
+			check_all();
+			sync_done();
+		}
+	}
+	(*dd->release)(dd);
+	(*crash.below->release)(crash.below);
+	free(below);
+	free(cur);
+	free(synced);
+}
+
+int main(int argc, char **argv){
+	srand(4411);
+	run(DEDUP_SHA256);
+	run(DEDUP_FAST);
+	free(writes);
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,190 @@
+/* Measures the encode and decode throughput of ecdisk over ramdisks, for
+ * each available GF(2^8) kernel and a few k+m configurations.
+ *
+ *		encode: full-stripe writevs, which compute m parity blocks per
+ *			stripe from k data blocks.
+ *		decode: readvs with m data members failed, so that every stripe
+ *			is reconstructed from the surviving members.
+ *
+ * Throughput is in GB/s of data written or read through ecdisk.  The
+ * data read back is checked against the data written.
+ *
+ * ecdisk reports each error of a failed member on standard error.
+ * Standard error is sent to /dev/null so that these do not bury the
+ * results; instead the number of errors is printed with them, and the
+ * bench's own errors go to the original standard error.
+ *
+ * Usage: bench [-s stripes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <egos/block_store.h>
+
+#define MAXDISKS	16
+
+static FILE *errors;				// the original standard error
+static unsigned long nfailures;		// #requests to failed members
+
+/* A block store that can be made to fail.
+ */
+struct failing {
+	block_if below;
+	int failed;
+};
+
+static int failing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	if (f->failed) {
+		nfailures++;
+		return -1;
+	}
+	return (*f->below->read)(f->below, ino, offset, block);
+}
+
+static int failing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	if (f->failed) {
+		nfailures++;
+		return -1;
+	}
+	return (*f->below->write)(f->below, ino, offset, block);
+}
+
+static int failing_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct failing *f = bi->state;
+	if (f->failed) {
+		nfailures++;
+		return -1;
+	}
+	return block_store_readv(f->below, ino, offset, nblocks, blocks);
+}
+
+static int failing_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct failing *f = bi->state;
+	if (f->failed) {
+		nfailures++;
+		return -1;
+	}
+	return block_store_writev(f->below, ino, offset, nblocks, blocks);
+}
+
+static int failing_getsize(block_if bi, unsigned int ino){
+	struct failing *f = bi->state;
+	return (*f->below->getsize)(f->below, ino);
+}
+
+static block_if failing_init(block_if below){
+	struct failing *f = new_alloc(struct failing);
+	f->below = below;
+	block_if bi = new_alloc(block_store_t);
+	bi->state = f;
+	bi->read = failing_read;
+	bi->write = failing_write;
+	bi->readv = failing_readv;
+	bi->writev = failing_writev;
+	bi->getsize = failing_getsize;
+	return bi;
+}
+
+static void run(unsigned int k, unsigned int m, unsigned int nstripes){
+	block_if members[MAXDISKS];
+	unsigned int i;
+
+	for (i = 0; i < k + m; i++) {
+		members[i] = failing_init(ramdisk_init(calloc(nstripes, BLOCK_SIZE), nstripes));
+	}
+	block_if ec = ecdisk_init(members, k, m);
+
+	unsigned int nblocks = nstripes * k;
+	block_t *data = malloc(nblocks * BLOCK_SIZE), *check = malloc(nblocks * BLOCK_SIZE);
+	for (i = 0; i < nblocks * BLOCK_SIZE / sizeof(int); i++) {
+		((int *) data)[i] = rand();
+	}
+
+	/* Touch all memory once before measuring.
+	 */
+	if (block_store_writev(ec, 0, 0, nblocks, data) < 0 ||
+			block_store_readv(ec, 0, 0, nblocks, check) < 0) {
+		fprintf(errors, "!!bench: warm-up failed\n");
+		exit(1);
+	}
+
+	unsigned long start = block_store_usec();
+	if (block_store_writev(ec, 0, 0, nblocks, data) < 0) {
+		fprintf(errors, "!!bench: writev failed\n");
+		exit(1);
+	}
+	unsigned long enc = block_store_usec() - start;
+
+	nfailures = 0;
+	for (i = 0; i < m; i++) {
+		((struct failing *) members[i]->state)->failed = 1;
+	}
+	start = block_store_usec();
+	if (block_store_readv(ec, 0, 0, nblocks, check) < 0) {
+		fprintf(errors, "!!bench: readv failed\n");
+		exit(1);
+	}
+	unsigned long dec = block_store_usec() - start;
+	if (memcmp(data, check, nblocks * BLOCK_SIZE) != 0) {
+		fprintf(errors, "!!bench: decoded data differs\n");
+		exit(1);
+	}
+
+	double bytes = (double) nblocks * BLOCK_SIZE;
+	printf("  %2u+%u  encode %6.2f GB/s  decode %6.2f GB/s  (%lu member errors)\n", k, m,
+			enc == 0 ? 0 : bytes / enc / 1e3, dec == 0 ? 0 : bytes / dec / 1e3, nfailures);
+
+	(*ec->release)(ec);
+	for (i = 0; i < k + m; i++) {
+		struct failing *f = members[i]->state;
+		(*f->below->release)(f->below);
+		free(f);
+		free(members[i]);
+	}
+	free(data);
+	free(check);
+}
+
+int main(int argc, char **argv){
+	static const char *kernels[] = { "table", "ssse3", "avx2" };
+	static const unsigned int configs[][2] = { { 4, 2 }, { 6, 3 }, { 8, 2 }, { 10, 4 } };
+	unsigned int nstripes = 4096, c, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			nstripes = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s stripes]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	errors = fdopen(dup(STDERR_FILENO), "w");
+	if (errors == 0 || freopen("/dev/null", "w", stderr) == 0) {
+		perror("bench");
+		return 1;
+	}
+	setvbuf(errors, 0, _IONBF, 0);
+
+	srand(4411);
+	printf("%u stripes, default kernel %s\n", nstripes, gf256_kernel());
+	for (c = 0; c < sizeof(kernels) / sizeof(kernels[0]); c++) {
+		if (gf256_select(kernels[c]) < 0) {
+			printf("%s: not available\n", kernels[c]);
+			continue;
+		}
+		printf("%s:\n", kernels[c]);
+		for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+			run(configs[i][0], configs[i][1], nstripes);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,285 @@
+/* Checks that ecdisk survives the failure of any m of its k + m members,
+ * and that its rebuild restores them exactly.  For a number of k+m
+ * configurations, and a few random choices of members to fail:
+ *
+ *		1. Random reads, writes, readvs and writevs (some covering whole
+ *		   stripes) are checked against a model, while m members fail one
+ *		   after the other, each in the middle of an operation.  All
+ *		   operations must succeed and return the model's data.
+ *		2. The failed members are rebuilt one at a time with
+ *		   ecdisk_rebuild, each while the others are still down.
+ *		3. Every member must then be identical to the corresponding
+ *		   member of a second ecdisk on which the model's data was
+ *		   written in one go, as the code is fully determined by the data.
+ *		4. m members other than the rebuilt ones fail (where there are
+ *		   enough), so that the data is decoded using the rebuilt ones,
+ *		   and everything is read back.  Then one more fails, after which
+ *		   a block on a failed data member cannot be read.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	70		// blocks per member, not a multiple of the batch sizes
+#define MAXDISKS	12
+#define MAX_XFER	40
+
+/* A block store that fails after a number of requests.
+ */
+struct failing {
+	block_if below;
+	long budget;		// #requests until it fails, or -1
+};
+
+static int failing_use(struct failing *f){
+	if (f->budget == 0) {
+		return -1;
+	}
+	if (f->budget > 0) {
+		f->budget--;
+	}
+	return 0;
+}
+
+static int failing_getsize(block_if bi, unsigned int ino){
+	struct failing *f = bi->state;
+	return (*f->below->getsize)(f->below, ino);
+}
+
+static int failing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	return failing_use(f) < 0 ? -1 : (*f->below->read)(f->below, ino, offset, block);
+}
+
+static int failing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	return failing_use(f) < 0 ? -1 : (*f->below->write)(f->below, ino, offset, block);
+}
+
+static int failing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if failing_init(block_t *blocks, struct failing *f){
+	block_if bi = new_alloc(block_store_t);
+	f->below = ramdisk_init(blocks, DISK_SIZE);
+	f->budget = -1;
+	bi->state = f;
+	bi->getsize = failing_getsize;
+	bi->read = failing_read;
+	bi->write = failing_write;
+	bi->sync = failing_sync;
+	return bi;
+}
+
+static block_t disks[MAXDISKS][DISK_SIZE];		// members
+static block_t spares[MAXDISKS][DISK_SIZE];		// replacements
+static block_t golden[MAXDISKS][DISK_SIZE];		// freshly encoded
+static struct failing fails[MAXDISKS], spare_fails[MAXDISKS];
+static struct failing *current[MAXDISKS];	// of the member in use
+static block_t model[MAXDISKS * DISK_SIZE];
+static block_no size;
+static block_if ec;
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset = rand() % size, n = 1 + rand() % MAX_XFER, i;
+
+	if (n > size - offset) {
+		n = size - offset;
+	}
+	switch (rand() % 4) {
+	case 0:
+		memset(&buf[0], rand(), BLOCK_SIZE);
+		buf[0].bytes[0] = offset;
+		if ((*ec->write)(ec, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		model[offset] = buf[0];
+		break;
+	case 1:
+		for (i = 0; i < n; i++) {
+			memset(&buf[i], rand(), BLOCK_SIZE);
+			buf[i].bytes[0] = offset + i;
+		}
+		if (block_store_writev(ec, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		memcpy(&model[offset], buf, n * BLOCK_SIZE);
+		break;
+	case 2:
+		if ((*ec->read)(ec, 0, offset, &buf[0]) < 0) {
+			fail("read failed", offset);
+		}
+		if (memcmp(&buf[0], &model[offset], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", offset);
+		}
+		break;
+	default:
+		if (block_store_readv(ec, 0, offset, n, buf) < 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			if (memcmp(&buf[i], &model[offset + i], BLOCK_SIZE) != 0) {
+				fail("readv returned the wrong data", offset + i);
+			}
+		}
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*ec->read)(ec, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		if (memcmp(&block, &model[b], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", b);
+		}
+	}
+}
+
+/* Choose m different members, none of which is in 'avoid'.
+ */
+static void choose(unsigned int n, unsigned int m, unsigned int *chosen, const char *avoid){
+	char taken[MAXDISKS];
+	unsigned int j, i;
+
+	memcpy(taken, avoid, sizeof(taken));
+	for (j = 0; j < m; j++) {
+		do {
+			i = rand() % n;
+		} while (taken[i]);
+		taken[i] = 1;
+		chosen[j] = i;
+	}
+}
+
+static void run(unsigned int k, unsigned int m){
+	block_if members[MAXDISKS], replacements[MAXDISKS], below[MAXDISKS], gbelow[MAXDISKS];
+	block_t *mem[MAXDISKS];
+	unsigned int n = k + m, i, j, failed[MAXDISKS], others[MAXDISKS + 1];
+	char avoid[MAXDISKS];
+
+	memset(disks, 0, sizeof(disks));
+	memset(spares, 0, sizeof(spares));
+	memset(golden, 0, sizeof(golden));
+	memset(model, 0, sizeof(model));
+	for (i = 0; i < n; i++) {
+		members[i] = failing_init(disks[i], &fails[i]);
+		replacements[i] = failing_init(spares[i], &spare_fails[i]);
+		below[i] = members[i];
+		mem[i] = disks[i];
+		current[i] = &fails[i];
+	}
+	ec = ecdisk_init(below, k, m);
+	size = (*ec->getsize)(ec, 0);
+	if (size != k * DISK_SIZE) {
+		fail("wrong size", size);
+	}
+
+	snprintf(phase, sizeof(phase), "%u+%u, failing", k, m);
+	memset(avoid, 0, sizeof(avoid));
+	choose(n, m, failed, avoid);
+	for (j = 0; j < m; j++) {
+		current[failed[j]]->budget = rand() % 20;
+		while (current[failed[j]]->budget != 0) {
+			random_op();
+		}
+		for (i = 0; i < 200; i++) {
+			random_op();
+		}
+	}
+	check_all();
+
+	snprintf(phase, sizeof(phase), "%u+%u, rebuilding", k, m);
+	for (j = 0; j < m; j++) {
+		i = failed[j];
+		if (ecdisk_rebuild(ec, i, replacements[i]) < 0) {
+			fail("rebuild failed", i);
+		}
+		mem[i] = spares[i];
+		current[i] = &spare_fails[i];
+		for (int r = 0; r < 50; r++) {
+			random_op();
+		}
+	}
+
+	snprintf(phase, sizeof(phase), "%u+%u, rebuilt", k, m);
+	for (i = 0; i < n; i++) {
+		gbelow[i] = ramdisk_init(golden[i], DISK_SIZE);
+	}
+	block_if gec = ecdisk_init(gbelow, k, m);
+	if (block_store_writev(gec, 0, 0, size, model) < 0) {
+		fail("writev of the second ecdisk failed", 0);
+	}
+	for (i = 0; i < n; i++) {
+		if (memcmp(mem[i], golden[i], DISK_SIZE * BLOCK_SIZE) != 0) {
+			fail("member differs from a fresh encoding", i);
+		}
+	}
+
+	/* Fail m other members, if possible none of the rebuilt ones, and
+	 * then a data member.
+	 */
+	memset(avoid, 0, sizeof(avoid));
+	if (m < n - m) {
+		for (j = 0; j < m; j++) {
+			avoid[failed[j]] = 1;
+		}
+	}
+	choose(n, m, others, avoid);
+	for (j = 0; j < m; j++) {
+		current[others[j]]->budget = 0;
+	}
+	snprintf(phase, sizeof(phase), "%u+%u, decoding with the rebuilt members", k, m);
+	check_all();
+	for (i = 0; i < k && current[i]->budget == 0; i++)
+		;
+	if (i < k) {
+		current[i]->budget = 0;
+		block_t block;
+		if ((*ec->read)(ec, 0, i, &block) == 0) {
+			fail("read with m + 1 failed members succeeded", i);
+		}
+	}
+
+	(*gec->release)(gec);
+	(*ec->release)(ec);
+	for (i = 0; i < n; i++) {
+		(*gbelow[i]->release)(gbelow[i]);
+		(*fails[i].below->release)(fails[i].below);
+		(*spare_fails[i].below->release)(spare_fails[i].below);
+		free(members[i]);
+		free(replacements[i]);
+	}
+}
+
+int main(int argc, char **argv){
+	static const unsigned int configs[][2] = {
+		{ 1, 1 }, { 2, 1 }, { 3, 2 }, { 4, 2 }, { 6, 3 }, { 5, 4 }, { 8, 4 }
+	};
+	unsigned int c, trial;
+
+	srand(4411);
+	for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		for (trial = 0; trial < 4; trial++) {
+			run(configs[c][0], configs[c][1]);
+		}
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,234 @@
+/* Checks fatdisk against a model of its files.
+ *
+ * A random mix of writes (including writes past the end of a file, which
+ * fill the gap with zero blocks), reads, getsizes and truncations to zero
+ * is applied to both fatdisk and an array that holds, for each block of
+ * each file, the write that produced it.  Every read must return the
+ * block of that write, and every getsize the size in the model.  Every
+ * so often the block store is released and opened again, which writes
+ * the FAT back and rebuilds the free list and the run index from it.
+ *
+ * Allocation is checked by filling the disk.  The first round finds how
+ * many blocks fit (all but the metadata), and some of the random writes
+ * run into a full disk.  Then all files are truncated and the disk is
+ * filled again by appending to all files in turn, file i taking i + 1
+ * blocks per turn, so that the tail allocations of the faster files eat
+ * into the free runs that the others start their extents in.  Exactly
+ * the same number of blocks must fit, and all files must read back
+ * correctly, so that no FAT entry was lost or handed out twice.  The
+ * same is checked once more with a single file, both before and after
+ * the block store is opened again.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	2048
+#define NINODES		16
+#define MAX_FILE	DISK_SIZE
+
+static block_t disk[DISK_SIZE];
+static block_if fat;
+
+static unsigned int *model[NINODES];	// write# of each block, 0 if zero
+static block_no size[NINODES];
+static block_no total;				// sum of the sizes
+static block_no capacity;			// #blocks that fit
+
+static void fail(const char *what, unsigned int ino, block_no offset){
+	fprintf(stderr, "!!ERROR: %s (inode %u, offset %u)\n", what, ino, offset);
+	exit(1);
+}
+
+static void fill(block_t *block, unsigned int ino, block_no offset, unsigned int gen){
+	if (gen == 0) {
+		memset(block, 0, sizeof(*block));
+		return;
+	}
+	memset(block, gen, sizeof(*block));
+	snprintf(block->bytes, BLOCK_SIZE, "%u:%u:%u", ino, offset, gen);
+}
+
+static void check_block(unsigned int ino, block_no offset){
+	block_t got, want;
+
+	if ((*fat->read)(fat, ino, offset, &got) < 0) {
+		fail("read failed", ino, offset);
+	}
+	fill(&want, ino, offset, model[ino][offset]);
+	if (memcmp(&got, &want, sizeof(got)) != 0) {
+		fail("read returned the wrong data", ino, offset);
+	}
+}
+
+static void check_file(unsigned int ino){
+	block_no offset;
+
+	if ((*fat->getsize)(fat, ino) != (int) size[ino]) {
+		fail("wrong size", ino, size[ino]);
+	}
+	for (offset = 0; offset < size[ino]; offset++) {
+		check_block(ino, offset);
+	}
+}
+
+/* Write a block at the given offset, growing the file in the model the
+ * same way.  If the disk fills up the file may have grown partly.
+ */
+static int write_block(unsigned int ino, block_no offset, unsigned int gen){
+	block_t block;
+
+	fill(&block, ino, offset, gen);
+	int r = (*fat->write)(fat, ino, offset, &block);
+	int n = (*fat->getsize)(fat, ino);
+	if (n < 0) {
+		fail("getsize failed", ino, offset);
+	}
+	if (r < 0 ? (block_no) n > offset : (block_no) n < offset + 1) {
+		fail("write left the wrong size", ino, offset);
+	}
+	for (; size[ino] < (block_no) n; size[ino]++, total++) {
+		model[ino][size[ino]] = 0;
+	}
+	if (r == 0) {
+		model[ino][offset] = gen;
+	}
+	return r;
+}
+
+static void truncate_file(unsigned int ino){
+	if ((*fat->setsize)(fat, ino, 0) < 0) {
+		fail("setsize failed", ino, 0);
+	}
+	total -= size[ino];
+	size[ino] = 0;
+}
+
+static void reopen(block_if ram){
+	if ((*fat->sync)(fat, -1) < 0) {
+		fail("sync failed", 0, 0);
+	}
+	(*fat->release)(fat);
+	if ((fat = fatdisk_init(ram, 0)) == 0) {
+		fail("can't open again", 0, 0);
+	}
+}
+
+/* Fill the disk with one file and return how many blocks fit.
+ */
+static block_no fill_disk(unsigned int ino, unsigned int gen){
+	block_no n;
+
+	for (n = 0; n < MAX_FILE; n++) {
+		if (write_block(ino, n, gen) < 0) {
+			break;
+		}
+	}
+	return n;
+}
+
+int main(int argc, char **argv){
+	unsigned int ino, gen = 0, i, full;
+
+	for (ino = 0; ino < NINODES; ino++) {
+		model[ino] = calloc(MAX_FILE, sizeof(*model[ino]));
+	}
+	block_if ram = ramdisk_init(disk, DISK_SIZE);
+	if (fatdisk_create(ram, 0, NINODES) < 0 || (fat = fatdisk_init(ram, 0)) == 0) {
+		fail("can't create", 0, 0);
+	}
+
+	/* An empty disk takes this many blocks.
+	 */
+	capacity = fill_disk(0, ++gen);
+	if (capacity < DISK_SIZE - DISK_SIZE / 64) {
+		fail("too few blocks fit", 0, capacity);
+	}
+	check_file(0);
+	truncate_file(0);
+
+	srand(4411);
+	for (i = 0; i < 100000; i++) {
+		ino = rand() % NINODES;
+		block_no offset;
+		switch (rand() % 10) {
+		case 0: case 1: case 2:
+			/* Overwrite, append, or leave a gap.  Near the end of the
+			 * disk some of these run out of space.
+			 */
+			if (size[ino] > 0 && rand() % 2 == 0) {
+				offset = rand() % size[ino];
+			}
+			else {
+				offset = size[ino] + rand() % 4;
+			}
+			if (write_block(ino, offset, ++gen) < 0 && total + offset + 1 - size[ino] <= capacity) {
+				fail("write failed with space left", ino, offset);
+			}
+			break;
+		case 3: case 4: case 5: case 6: case 7:
+			if (size[ino] > 0) {
+				check_block(ino, rand() % size[ino]);
+			}
+			break;
+		case 8:
+			if ((*fat->getsize)(fat, ino) != (int) size[ino]) {
+				fail("wrong size", ino, size[ino]);
+			}
+			break;
+		default:
+			/* Truncate more often when the disk is nearly full.
+			 */
+			if (rand() % 8 == 0 || total > capacity - capacity / 8) {
+				truncate_file(ino);
+			}
+		}
+		if (i % 10000 == 9999) {
+			reopen(ram);
+			for (ino = 0; ino < NINODES; ino++) {
+				check_file(ino);
+			}
+		}
+	}
+
+	/* After everything is freed the whole disk fits again, and not a
+	 * block more.
+	 */
+	for (ino = 0; ino < NINODES; ino++) {
+		truncate_file(ino);
+	}
+	reopen(ram);
+	for (full = 0; !full; ) {
+		for (ino = 0; ino < NINODES && !full; ino++) {
+			for (i = 0; i <= ino && !full; i++) {
+				full = write_block(ino, size[ino], ++gen) < 0;
+			}
+		}
+	}
+	if (total != capacity) {
+		fail("appends did not fill the disk", ino, total);
+	}
+	for (ino = 0; ino < NINODES; ino++) {
+		check_file(ino);
+		truncate_file(ino);
+	}
+	if (fill_disk(1, ++gen) != capacity) {
+		fail("free space was lost", 1, capacity);
+	}
+	check_file(1);
+	truncate_file(1);
+	reopen(ram);
+	if (fill_disk(1, ++gen) != capacity) {
+		fail("free space was lost after reopening", 1, capacity);
+	}
+	reopen(ram);
+	check_file(1);
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,291 @@
+/* Checks that logdisk returns the data written, also after it is closed
+ * and opened again and after a crash, while the cleaner is kept busy.
+ * For both cleaning policies, a number of rounds each apply random reads,
+ * writes (mostly to a hot tenth of the blocks), readvs, writevs, syncs
+ * and explicit cleans to logdisk and to a model, and end in one of two
+ * ways:
+ *
+ *		reopen: the block store is released and opened again, after which
+ *			every block must read back as in the model.
+ *		crash: the block store below stops taking writes after a random
+ *			number of them, silently, as if the machine had crashed at that
+ *			point.  Writevs below are split into single blocks, so a crash
+ *			can tear them.  After opening again, every block must hold
+ *			either what it held at the last completed sync or something
+ *			written to it since.
+ *
+ * Each block written holds its offset and a sequence number, so a block
+ * read back tells which write it came from.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	6000	// blocks below
+#define MAX_XFER	40
+#define NROUNDS		60
+
+/* A block store below that drops all writes after a number of them.
+ */
+struct crashing {
+	block_if below;
+	long budget;		// #writes until the crash, or -1
+};
+
+static int crashing_getsize(block_if bi, unsigned int ino){
+	struct crashing *c = bi->state;
+	return (*c->below->getsize)(c->below, ino);
+}
+
+static int crashing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	return (*c->below->read)(c->below, ino, offset, block);
+}
+
+static int crashing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	if (c->budget == 0) {
+		return 0;
+	}
+	if (c->budget > 0) {
+		c->budget--;
+	}
+	return (*c->below->write)(c->below, ino, offset, block);
+}
+
+static int crashing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if crashing_init(block_t *blocks, block_no nblocks, struct crashing *c){
+	block_if bi = new_alloc(block_store_t);
+	c->below = ramdisk_init(blocks, nblocks);
+	c->budget = -1;
+	bi->state = c;
+	bi->getsize = crashing_getsize;
+	bi->read = crashing_read;
+	bi->write = crashing_write;
+	bi->sync = crashing_sync;
+	return bi;
+}
+
+static block_t disk[DISK_SIZE];
+static struct crashing crash;
+static block_if below, log;
+static enum logdisk_policy policy;
+static block_no size;
+static unsigned int *cur;		// sequence number of the last write of each block
+static unsigned int *synced;	// ... as of the last completed sync
+static unsigned int seq;		// sequence number of the last write
+static unsigned int sync_seq;	// ... at the last completed sync
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+static void fill(block_t *block, block_no offset, unsigned int s){
+	unsigned int *w = (unsigned int *) block, i;
+
+	w[0] = offset;
+	w[1] = s;
+	for (i = 2; i < BLOCK_SIZE / sizeof(*w); i++) {
+		w[i] = (offset * 2654435761u) ^ (s * 40503u) ^ i;
+	}
+}
+
+/* Return the sequence number of the write that the block came from,
+ * which must have been a write to the given offset, or 0 if the block was
+ * never written.  Returns -1 if the block is corrupt.
+ */
+static int decode(block_t *block, block_no offset){
+	block_t expect;
+	unsigned int s = ((unsigned int *) block)[1];
+
+	if (s == 0) {
+		memset(&expect, 0, sizeof(expect));
+	}
+	else {
+		fill(&expect, offset, s);
+	}
+	return memcmp(block, &expect, sizeof(expect)) == 0 ? (int) s : -1;
+}
+
+static void check(block_t *block, block_no offset){
+	if (decode(block, offset) != (int) cur[offset]) {
+		fail("read returned the wrong data", offset);
+	}
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset, n, i;
+
+	if (rand() % 10 != 0) {
+		offset = rand() % (size / 10);
+	}
+	else {
+		offset = rand() % size;
+	}
+	n = 1 + rand() % MAX_XFER;
+	if (n > size - offset) {
+		n = size - offset;
+	}
+	switch (rand() % 20) {
+	case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+		fill(&buf[0], offset, ++seq);
+		if ((*log->write)(log, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		cur[offset] = seq;
+		break;
+	case 8: case 9:
+		for (i = 0; i < n; i++) {
+			fill(&buf[i], offset + i, seq + 1 + i);
+		}
+		if (block_store_writev(log, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			cur[offset + i] = ++seq;
+		}
+		break;
+	case 10: case 11: case 12: case 13: case 14: case 15:
+		if ((*log->read)(log, 0, offset, &buf[0]) < 0) {
+			fail("read failed", offset);
+		}
+		check(&buf[0], offset);
+		break;
+	case 16: case 17:
+		if (block_store_readv(log, 0, offset, n, buf) < 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			check(&buf[i], offset + i);
+		}
+		break;
+	case 18:
+		if (rand() % 8 == 0) {
+			if ((*log->sync)(log, 0) < 0) {
+				fail("sync failed", 0);
+			}
+			if (crash.budget != 0) {
+				memcpy(synced, cur, size * sizeof(*cur));
+				sync_seq = seq;
+			}
+		}
+		break;
+	default:
+		if (rand() % 50 == 0 && logdisk_clean(log, 1 + rand() % 3) < 0) {
+			fail("clean failed", 0);
+		}
+	}
+}
+
+static void open_log(void){
+	if ((log = logdisk_init(below, 0, policy)) == 0) {
+		fail("can't open", 0);
+	}
+	if ((*log->getsize)(log, 0) != (int) size) {
+		fail("wrong size", size);
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*log->read)(log, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		check(&block, b);
+	}
+}
+
+/* After a crash every block holds what it held at the last sync, or a
+ * later write to it.  That is what it holds from now on.
+ */
+static void check_recovered(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*log->read)(log, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		int s = decode(&block, b);
+		if (s < 0) {
+			fail("block is corrupt", b);
+		}
+		if ((unsigned int) s != synced[b] && ((unsigned int) s <= sync_seq || (unsigned int) s > cur[b])) {
+			fail("block holds neither the synced nor a later write", b);
+		}
+		cur[b] = synced[b] = s;
+	}
+	sync_seq = seq;
+}
+
+static void run(enum logdisk_policy p){
+	unsigned int round, k;
+
+	policy = p;
+	memset(disk, 0, sizeof(disk));
+	below = crashing_init(disk, DISK_SIZE, &crash);
+	if (logdisk_create(below, 0, 0) < 0) {
+		fail("can't create", 0);
+	}
+	if ((log = logdisk_init(below, 0, policy)) == 0) {
+		fail("can't open", 0);
+	}
+	size = (*log->getsize)(log, 0);
+	cur = calloc(size, sizeof(*cur));
+	synced = calloc(size, sizeof(*synced));
+	seq = sync_seq = 0;
+
+	for (round = 0; round < NROUNDS; round++) {
+		int crashing = rand() % 2;
+		snprintf(phase, sizeof(phase), "%s, round %u (%s)",
+				p == LOG_GREEDY ? "greedy" : "cost-benefit", round, crashing ? "crash" : "reopen");
+		if (crashing) {
+			crash.budget = rand() % (4 * DISK_SIZE);
+		}
+		for (k = 0; k < 5000 && crash.budget != 0; k++) {
+			random_op();
+		}
+
+		/* Releasing after the crash writes nothing more.
+		 */
+		crash.budget = crashing ? 0 : -1;
+		(*log->release)(log);
+		crash.budget = -1;
+		open_log();
+		if (crashing) {
+			check_recovered();
+		}
+		else {
+			check_all();
+			memcpy(synced, cur, size * sizeof(*cur));
+			sync_seq = seq;
+		}
+	}
+	(*log->release)(log);
+	(*crash.below->release)(crash.below);
+	free(below);
+	free(cur);
+	free(synced);
+}
+
+int main(int argc, char **argv){
+	srand(4411);
+	run(LOG_GREEDY);
+	run(LOG_COST_BENEFIT);
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,100 @@
+/* Measures parity_xor() throughput for each available kernel, XOR-ing
+ * 2 to 8 source blocks into a destination block.  Throughput counts the
+ * bytes read from the sources.  Each kernel is checked against a byte
+ * by byte XOR first.
+ *
+ * Usage: bench [-m megabytes per measurement]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <egos/block_store.h>
+
+#define NSETS		64		// distinct sets of blocks, to stay in cache
+#define MAXSRC		8
+
+static block_t blocks[NSETS][MAXSRC + 1];
+
+static int check(unsigned int nsrc){
+	block_t *src[MAXSRC], expect;
+	unsigned int i, k;
+
+	for (k = 0; k < nsrc; k++) {
+		src[k] = &blocks[0][k + 1];
+	}
+	memset(&expect, 0, BLOCK_SIZE);
+	for (k = 0; k < nsrc; k++) {
+		for (i = 0; i < BLOCK_SIZE; i++) {
+			expect.bytes[i] ^= src[k]->bytes[i];
+		}
+	}
+	parity_xor(&blocks[0][0], src, nsrc);
+	return memcmp(&expect, &blocks[0][0], BLOCK_SIZE) == 0;
+}
+
+int main(int argc, char **argv){
+	static const char *kernels[] = { "word", "sse2", "avx2" };
+	unsigned int mb = 256, i, k, n, c;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-m megabytes]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	srand(4411);
+	for (i = 0; i < NSETS; i++) {
+		for (k = 0; k <= MAXSRC; k++) {
+			for (n = 0; n < BLOCK_SIZE; n++) {
+				blocks[i][k].bytes[n] = rand();
+			}
+		}
+	}
+
+	printf("default kernel: %s\n", parity_kernel());
+	printf("kernel ");
+	for (n = 2; n <= MAXSRC; n++) {
+		printf("  %u src", n);
+	}
+	printf("   (GB/s)\n");
+
+	for (c = 0; c < sizeof(kernels) / sizeof(kernels[0]); c++) {
+		if (parity_select(kernels[c]) < 0) {
+			printf("%-6s not available\n", kernels[c]);
+			continue;
+		}
+		printf("%-6s", kernels[c]);
+		for (n = 2; n <= MAXSRC; n++) {
+			if (!check(n)) {
+				printf("\n!!bench: %s kernel gives wrong result for %u sources\n", kernels[c], n);
+				return 1;
+			}
+
+			/* Each call reads n blocks; repeat until 'mb' MB are read.
+			 */
+			unsigned long ncalls = (unsigned long) mb * 1024 * 1024 / (n * BLOCK_SIZE);
+			block_t *src[NSETS][MAXSRC];
+			for (i = 0; i < NSETS; i++) {
+				for (k = 0; k < n; k++) {
+					src[i][k] = &blocks[i][k + 1];
+				}
+			}
+			unsigned long start = block_store_usec();
+			for (unsigned long j = 0; j < ncalls; j++) {
+				parity_xor(&blocks[j % NSETS][0], src[j % NSETS], n);
+			}
+			unsigned long elapsed = block_store_usec() - start;
+			printf(" %7.2f", elapsed == 0 ? 0 : (double) ncalls * n * BLOCK_SIZE / elapsed / 1e3);
+		}
+		printf("\n");
+	}
+	return 0;
+}
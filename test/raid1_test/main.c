@@ -0,0 +1,264 @@
+/* Checks that raid1disk keeps serving the right data while replicas fail,
+ * and that resynchronizing and rebuilding them makes them identical to
+ * the data written.  For each read policy:
+ *
+ *		1. Random reads, writes, readvs and writevs are checked against
+ *		   a model.  Then replica 1 fails and is written around, so that
+ *		   raid1disk marks the regions it is missing.
+ *		2. Replica 1 comes back with raid1disk_reattach.  The rebuild is
+ *		   driven by raid1disk_rebuild_step alone, and must copy exactly
+ *		   the regions written while the replica was broken, after which
+ *		   it must hold the model's data.
+ *		3. Replica 2 is replaced by an empty one with raid1disk_replace.
+ *		   Now the rebuild is driven by the foreground operations, which
+ *		   go on being checked; as the new replica is empty, a read that
+ *		   it served before it is rebuilt would return zeroes.
+ *		4. Replicas 0 and 1 fail, so that everything is read from the
+ *		   rebuilt replica 2.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	1100	// not a multiple of the region size, nor of 8 regions
+#define NDISKS		3
+#define REGION_SIZE	64		// RAID1_REGION_SIZE
+#define MAX_XFER	100
+
+/* A block store that can be made to fail, and that counts the blocks
+ * written to it.
+ */
+struct failing {
+	block_if below;
+	int failed;
+	unsigned long nwritten;
+};
+
+static int failing_getsize(block_if bi, unsigned int ino){
+	struct failing *f = bi->state;
+	return (*f->below->getsize)(f->below, ino);
+}
+
+static int failing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	return f->failed ? -1 : (*f->below->read)(f->below, ino, offset, block);
+}
+
+static int failing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	if (f->failed) {
+		return -1;
+	}
+	f->nwritten++;
+	return (*f->below->write)(f->below, ino, offset, block);
+}
+
+static int failing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if failing_init(block_t *blocks, struct failing *f){
+	block_if bi = new_alloc(block_store_t);
+	memset(f, 0, sizeof(*f));
+	f->below = ramdisk_init(blocks, DISK_SIZE);
+	bi->state = f;
+	bi->getsize = failing_getsize;
+	bi->read = failing_read;
+	bi->write = failing_write;
+	bi->sync = failing_sync;
+	return bi;
+}
+
+static block_t disks[NDISKS + 1][DISK_SIZE];
+static struct failing fails[NDISKS + 1];
+static block_if members[NDISKS + 1];
+static block_t model[DISK_SIZE];
+static block_if raid;
+static const char *phase;
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+/* One random operation, checked against the model.  Returns the range
+ * written, if any.
+ */
+static void random_op(block_no *first, block_no *nwritten){
+	static block_t buf[MAX_XFER];
+	block_no offset = rand() % DISK_SIZE, n = 1 + rand() % MAX_XFER, i;
+
+	if (n > DISK_SIZE - offset) {
+		n = DISK_SIZE - offset;
+	}
+	*nwritten = 0;
+	switch (rand() % 4) {
+	case 0:
+		memset(&buf[0], rand(), BLOCK_SIZE);
+		if ((*raid->write)(raid, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		model[offset] = buf[0];
+		*first = offset;
+		*nwritten = 1;
+		break;
+	case 1:
+		for (i = 0; i < n; i++) {
+			memset(&buf[i], rand(), BLOCK_SIZE);
+		}
+		if (block_store_writev(raid, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		memcpy(&model[offset], buf, n * BLOCK_SIZE);
+		*first = offset;
+		*nwritten = n;
+		break;
+	case 2:
+		if ((*raid->read)(raid, 0, offset, &buf[0]) < 0) {
+			fail("read failed", offset);
+		}
+		if (memcmp(&buf[0], &model[offset], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", offset);
+		}
+		break;
+	default:
+		if (block_store_readv(raid, 0, offset, n, buf) < 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			if (memcmp(&buf[i], &model[offset + i], BLOCK_SIZE) != 0) {
+				fail("readv returned the wrong data", offset + i);
+			}
+		}
+	}
+}
+
+static void check_replica(unsigned int i){
+	block_no b;
+
+	for (b = 0; b < DISK_SIZE; b++) {
+		if (memcmp(&disks[i][b], &model[b], BLOCK_SIZE) != 0) {
+			fail("replica differs", b);
+		}
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < DISK_SIZE; b++) {
+		if ((*raid->read)(raid, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		if (memcmp(&block, &model[b], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", b);
+		}
+	}
+}
+
+static void run(enum raid1disk_policy policy){
+	block_if below[NDISKS];
+	block_no first, n, r, b;
+	unsigned int i, k;
+	int left;
+	char dirty[(DISK_SIZE + REGION_SIZE - 1) / REGION_SIZE];
+
+	memset(disks, 0, sizeof(disks));
+	memset(model, 0, sizeof(model));
+	for (i = 0; i <= NDISKS; i++) {
+		members[i] = failing_init(disks[i], &fails[i]);
+	}
+	for (i = 0; i < NDISKS; i++) {
+		below[i] = members[i];
+	}
+	raid = raid1disk_init(below, NDISKS);
+	raid1disk_set_policy(raid, policy);
+	raid1disk_set_rebuild_rate(raid, 0);
+
+	phase = "healthy";
+	for (k = 0; k < 2000; k++) {
+		random_op(&first, &n);
+	}
+	for (i = 0; i < NDISKS; i++) {
+		check_replica(i);
+	}
+
+	/* Replica 1 misses some writes.
+	 */
+	phase = "degraded";
+	fails[1].failed = 1;
+	memset(dirty, 0, sizeof(dirty));
+	for (k = 0; k < 20; k++) {
+		random_op(&first, &n);
+		for (b = first; b < first + n; b++) {
+			dirty[b / REGION_SIZE] = 1;
+		}
+	}
+
+	phase = "resync";
+	fails[1].failed = 0;
+	fails[1].nwritten = 0;
+	if (raid1disk_reattach(raid, 1) < 0) {
+		fail("reattach failed", 0);
+	}
+	while ((left = raid1disk_rebuild_step(raid)) != 0) {
+		if (left < 0) {
+			fail("rebuild step failed", 0);
+		}
+	}
+	n = 0;
+	for (r = 0; r < sizeof(dirty); r++) {
+		if (dirty[r]) {
+			n += r == sizeof(dirty) - 1 ? DISK_SIZE - r * REGION_SIZE : REGION_SIZE;
+		}
+	}
+	if (fails[1].nwritten != n) {
+		fprintf(stderr, "!!ERROR: resync wrote %lu blocks, not %u\n", fails[1].nwritten, n);
+		exit(1);
+	}
+	check_replica(1);
+
+	/* Replace replica 2 and rebuild it while the block store is in use.
+	 */
+	phase = "rebuild";
+	below[2] = members[NDISKS];
+	if (raid1disk_replace(raid, 2, members[NDISKS]) < 0) {
+		fail("replace failed", 0);
+	}
+	for (k = 0; k < 3000; k++) {
+		random_op(&first, &n);
+	}
+	if (raid1disk_rebuild_step(raid) != 0) {
+		fail("rebuild did not finish", 0);
+	}
+	check_replica(0);
+	check_replica(1);
+	check_replica(NDISKS);
+
+	phase = "rebuilt replica only";
+	fails[0].failed = fails[1].failed = 1;
+	check_all();
+
+	(*raid->release)(raid);
+	for (i = 0; i <= NDISKS; i++) {
+		(*fails[i].below->release)(fails[i].below);
+		free(members[i]);
+	}
+}
+
+int main(int argc, char **argv){
+	enum raid1disk_policy policy;
+
+	srand(4411);
+	for (policy = RAID1_PRIMARY; policy <= RAID1_NEAREST; policy++) {
+		run(policy);
+	}
+	printf("ok\n");
+	return 0;
+}
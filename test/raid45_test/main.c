@@ -0,0 +1,269 @@
+/* Checks raid4disk and raid5disk in normal and degraded mode, and the
+ * rebuild of raid5disk.  For RAID4 and RAID5 with 3 to 5 members, and
+ * each member in turn failing:
+ *
+ *		1. Random reads, writes, readvs and writevs (some of which cover
+ *		   full stripes) are checked against a model.  After every phase
+ *		   with all members working, the parity of every stripe is checked
+ *		   on the members themselves: the XOR of all members is zero.
+ *		2. The member fails in the middle of a random operation: it
+ *		   returns an error from its next request after a random number of
+ *		   them.  All operations must still succeed and return the model's
+ *		   data, using reconstruct-writes and degraded reads.
+ *		3. With RAID5, the member is rebuilt on an empty replacement, after
+ *		   which the parity is checked again.  Then the next member fails,
+ *		   so that its blocks have to be reconstructed using the rebuilt
+ *		   one, and everything is read back.
+ *		4. With two members failed, a block on a failed member can no
+ *		   longer be read, while the blocks before it must still be right.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	100		// blocks per member
+#define MAXDISKS	5
+#define MAX_XFER	(3 * MAXDISKS)
+
+/* A block store that fails after a number of requests.
+ */
+struct failing {
+	block_if below;
+	long budget;		// #requests until it fails, or -1
+};
+
+static int failing_use(struct failing *f){
+	if (f->budget == 0) {
+		return -1;
+	}
+	if (f->budget > 0) {
+		f->budget--;
+	}
+	return 0;
+}
+
+static int failing_getsize(block_if bi, unsigned int ino){
+	struct failing *f = bi->state;
+	return (*f->below->getsize)(f->below, ino);
+}
+
+static int failing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	return failing_use(f) < 0 ? -1 : (*f->below->read)(f->below, ino, offset, block);
+}
+
+static int failing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct failing *f = bi->state;
+	return failing_use(f) < 0 ? -1 : (*f->below->write)(f->below, ino, offset, block);
+}
+
+static int failing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if failing_init(block_t *blocks, struct failing *f){
+	block_if bi = new_alloc(block_store_t);
+	f->below = ramdisk_init(blocks, DISK_SIZE);
+	f->budget = -1;
+	bi->state = f;
+	bi->getsize = failing_getsize;
+	bi->read = failing_read;
+	bi->write = failing_write;
+	bi->sync = failing_sync;
+	return bi;
+}
+
+static block_t disks[MAXDISKS + 1][DISK_SIZE];
+static struct failing fails[MAXDISKS + 1];
+static block_if members[MAXDISKS + 1];
+static block_t model[MAXDISKS * DISK_SIZE];
+static block_no size;
+static block_if raid;
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset = rand() % size, n = 1 + rand() % MAX_XFER, i;
+
+	if (n > size - offset) {
+		n = size - offset;
+	}
+	switch (rand() % 4) {
+	case 0:
+		memset(&buf[0], rand(), BLOCK_SIZE);
+		buf[0].bytes[0] = offset;
+		if ((*raid->write)(raid, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		model[offset] = buf[0];
+		break;
+	case 1:
+		for (i = 0; i < n; i++) {
+			memset(&buf[i], rand(), BLOCK_SIZE);
+			buf[i].bytes[0] = offset + i;
+		}
+		if (block_store_writev(raid, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		memcpy(&model[offset], buf, n * BLOCK_SIZE);
+		break;
+	case 2:
+		if ((*raid->read)(raid, 0, offset, &buf[0]) < 0) {
+			fail("read failed", offset);
+		}
+		if (memcmp(&buf[0], &model[offset], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", offset);
+		}
+		break;
+	default:
+		if (block_store_readv(raid, 0, offset, n, buf) < 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			if (memcmp(&buf[i], &model[offset + i], BLOCK_SIZE) != 0) {
+				fail("readv returned the wrong data", offset + i);
+			}
+		}
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*raid->read)(raid, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		if (memcmp(&block, &model[b], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", b);
+		}
+	}
+}
+
+/* Check that the XOR of block s of all members is zero.
+ */
+static void check_parity(block_t **mem, unsigned int ndisks){
+	block_no s;
+	unsigned int i, j;
+
+	for (s = 0; s < DISK_SIZE; s++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			char x = 0;
+			for (i = 0; i < ndisks; i++) {
+				x ^= mem[i][s].bytes[j];
+			}
+			if (x != 0) {
+				fail("parity is wrong", s);
+			}
+		}
+	}
+}
+
+static void run(int rotate, unsigned int ndisks, unsigned int victim){
+	block_if below[MAXDISKS];
+	block_t *mem[MAXDISKS];
+	unsigned int i, k;
+
+	snprintf(phase, sizeof(phase), "RAID%d, %u members, member %u fails",
+							rotate ? 5 : 4, ndisks, victim);
+	memset(disks, 0, sizeof(disks));
+	memset(model, 0, sizeof(model));
+	for (i = 0; i <= ndisks; i++) {
+		members[i] = failing_init(disks[i], &fails[i]);
+	}
+	for (i = 0; i < ndisks; i++) {
+		below[i] = members[i];
+		mem[i] = disks[i];
+	}
+	raid = rotate ? raid5disk_init(below, ndisks) : raid4disk_init(below, ndisks);
+	size = (*raid->getsize)(raid, 0);
+	if (size != (ndisks - 1) * DISK_SIZE) {
+		fail("wrong size", size);
+	}
+
+	for (k = 0; k < 1000; k++) {
+		random_op();
+	}
+	check_parity(mem, ndisks);
+
+	fails[victim].budget = rand() % 20;
+	for (k = 0; k < 1000; k++) {
+		random_op();
+	}
+	if (fails[victim].budget != 0) {
+		fail("member did not fail", victim);
+	}
+	check_all();
+
+	if (rotate) {
+		mem[victim] = disks[ndisks];
+		if (raid5disk_rebuild(raid, victim, members[ndisks]) < 0) {
+			fail("rebuild failed", victim);
+		}
+		check_parity(mem, ndisks);
+		for (k = 0; k < 300; k++) {
+			random_op();
+		}
+		check_parity(mem, ndisks);
+		fails[(victim + 1) % ndisks].budget = 0;
+		check_all();
+		for (k = 0; k < 300; k++) {
+			random_op();
+		}
+		check_all();
+		fails[(victim + 2) % ndisks].budget = 0;
+	}
+	else {
+		fails[(victim + 1) % ndisks].budget = 0;
+	}
+
+	/* Now two members have failed.  The blocks on the working members
+	 * can still be read, up to the first block on a failed member.
+	 */
+	block_t block;
+	block_no b;
+	for (b = 0; b < size; b++) {
+		if ((*raid->read)(raid, 0, b, &block) < 0) {
+			break;
+		}
+		if (memcmp(&block, &model[b], BLOCK_SIZE) != 0) {
+			fail("read returned the wrong data", b);
+		}
+	}
+	if (b == size) {
+		fail("all reads succeeded with two failed members", 0);
+	}
+
+	(*raid->release)(raid);
+	for (i = 0; i <= ndisks; i++) {
+		(*fails[i].below->release)(fails[i].below);
+		free(members[i]);
+	}
+}
+
+int main(int argc, char **argv){
+	unsigned int ndisks, victim;
+	int rotate;
+
+	srand(4411);
+	for (rotate = 0; rotate <= 1; rotate++) {
+		for (ndisks = 3; ndisks <= MAXDISKS; ndisks++) {
+			for (victim = 0; victim < ndisks; victim++) {
+				run(rotate, ndisks, victim);
+			}
+		}
+	}
+	printf("ok\n");
+	return 0;
+}
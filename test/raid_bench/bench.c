@@ -0,0 +1,137 @@
+/* Compares raid4disk and raid5disk under a random-write trace.
+ *
+ * Each member disk is a ramdisk that counts the operations it serves.
+ * Assuming every operation takes the same service time on a member and
+ * the members work in parallel, the array can sustain at most
+ *
+ *		#writes / (service time * operations on the busiest member)
+ *
+ * writes per second.  With RAID4 the busiest member is the parity disk,
+ * which is involved in every write; RAID5 spreads the parity over all
+ * members.
+ *
+ * Usage: bench [-n nwrites] [-s service_usec] [-w maxdisks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	4096		// blocks per member
+
+struct counter {
+	block_if below;
+	unsigned int nops;
+};
+
+static int counter_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct counter *c = bi->state;
+	c->nops++;
+	return (*c->below->read)(c->below, ino, offset, block);
+}
+
+static int counter_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct counter *c = bi->state;
+	c->nops++;
+	return (*c->below->write)(c->below, ino, offset, block);
+}
+
+static int counter_getsize(block_if bi, unsigned int ino){
+	struct counter *c = bi->state;
+	return (*c->below->getsize)(c->below, ino);
+}
+
+static int counter_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if counter_init(block_if below){
+	struct counter *c = new_alloc(struct counter);
+	c->below = below;
+	block_if bi = new_alloc(block_store_t);
+	bi->state = c;
+	bi->read = counter_read;
+	bi->write = counter_write;
+	bi->getsize = counter_getsize;
+	bi->sync = counter_sync;
+	return bi;
+}
+
+static void run(const char *name, block_if (*init)(block_if *, unsigned int),
+				unsigned int ndisks, unsigned int nwrites, unsigned int svc){
+	block_if members[16];
+	block_t block;
+	unsigned int i;
+
+	for (i = 0; i < ndisks; i++) {
+		members[i] = counter_init(ramdisk_init(calloc(DISK_SIZE, BLOCK_SIZE), DISK_SIZE));
+	}
+	block_if raid = (*init)(members, ndisks);
+	int size = (*raid->getsize)(raid, 0);
+
+	srand(4411);
+	unsigned long start = block_store_usec();
+	for (i = 0; i < nwrites; i++) {
+		memset(&block, i, BLOCK_SIZE);
+		if ((*raid->write)(raid, 0, rand() % size, &block) < 0) {
+			fprintf(stderr, "!!bench: write failed\n");
+			exit(1);
+		}
+	}
+	unsigned long elapsed = block_store_usec() - start;
+
+	unsigned int max = 0, total = 0;
+	for (i = 0; i < ndisks; i++) {
+		struct counter *c = members[i]->state;
+		total += c->nops;
+		if (c->nops > max) {
+			max = c->nops;
+		}
+	}
+	printf("%s %u disks: %u ops, busiest member %u ops (%.0f%%), %.0f writes/s modeled, %.0f writes/s in memory\n",
+			name, ndisks, total, max, 100.0 * max / total,
+			(double) nwrites * 1e6 / ((double) max * svc),
+			elapsed == 0 ? 0 : (double) nwrites * 1e6 / elapsed);
+
+	(*raid->release)(raid);
+	for (i = 0; i < ndisks; i++) {
+		struct counter *c = members[i]->state;
+		(*c->below->release)(c->below);
+		free(c);
+		free(members[i]);
+	}
+}
+
+int main(int argc, char **argv){
+	unsigned int nwrites = 100000, svc = 100, maxdisks = 8;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			nwrites = atoi(optarg);
+			break;
+		case 's':
+			svc = atoi(optarg);
+			break;
+		case 'w':
+			maxdisks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n nwrites] [-s service_usec] [-w maxdisks]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (maxdisks > 16) {
+		maxdisks = 16;
+	}
+
+	printf("%u random single-block writes, %u us per member operation\n", nwrites, svc);
+	for (unsigned int n = 3; n <= maxdisks; n++) {
+		run("raid4", raid4disk_init, n, nwrites, svc);
+		run("raid5", raid5disk_init, n, nwrites, svc);
+	}
+	return 0;
+}
@@ -0,0 +1,416 @@
+/* Checks that snapdisk returns the data written to the live volume, and
+ * that every snapshot keeps returning the live volume as it was when the
+ * snapshot was taken, also after the block store is closed and opened
+ * again and after a crash.  A number of rounds each apply random reads,
+ * writes (mostly to a hot quarter of the blocks), readvs, writevs and
+ * syncs to the live volume, reads and readvs of the snapshots, and now
+ * and then take or delete a snapshot.  Each round ends in one of two
+ * ways:
+ *
+ *		reopen: the block store is released and opened again, after which
+ *			the live volume and all snapshots must read back as in the
+ *			model.
+ *		crash: the block store below stops taking writes after a random
+ *			number of them, silently, as if the machine had crashed at that
+ *			point.  After opening again, every live block must hold either
+ *			what it held at the last completed sync or something written to
+ *			it since, and the snapshots must be unchanged.  A snapshot that
+ *			was being taken or deleted at the time of the crash may or may
+ *			not be there; if it is being taken and is there, it must be
+ *			complete.
+ *
+ * Each block written holds its offset and a sequence number, so a block
+ * read back tells which write it came from.
+ *
+ * Prints "!!ERROR: ..." and exits with status 1 at the first difference,
+ * and "ok" otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+#define DISK_SIZE	2000	// blocks below
+#define MAX_XFER	40
+#define MAX_SNAPS	3		// snapshots kept at a time
+#define NROUNDS		300
+#define NINODES		16		// live volume and snapshots
+
+/* A block store below that drops all writes after a number of them.
+ */
+struct crashing {
+	block_if below;
+	long budget;		// #writes until the crash, or -1
+};
+
+static int crashing_getsize(block_if bi, unsigned int ino){
+	struct crashing *c = bi->state;
+	return (*c->below->getsize)(c->below, ino);
+}
+
+static int crashing_read(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	return (*c->below->read)(c->below, ino, offset, block);
+}
+
+static int crashing_write(block_if bi, unsigned int ino, block_no offset, block_t *block){
+	struct crashing *c = bi->state;
+	if (c->budget == 0) {
+		return 0;
+	}
+	if (c->budget > 0) {
+		c->budget--;
+	}
+	return (*c->below->write)(c->below, ino, offset, block);
+}
+
+static int crashing_sync(block_if bi, unsigned int ino){
+	return 0;
+}
+
+static block_if crashing_init(block_t *blocks, block_no nblocks, struct crashing *c){
+	block_if bi = new_alloc(block_store_t);
+	c->below = ramdisk_init(blocks, nblocks);
+	c->budget = -1;
+	bi->state = c;
+	bi->getsize = crashing_getsize;
+	bi->read = crashing_read;
+	bi->write = crashing_write;
+	bi->sync = crashing_sync;
+	return bi;
+}
+
+static block_t disk[DISK_SIZE];
+static struct crashing crash;
+static block_if below, snap;
+static block_no size;
+static unsigned int *cur;		// sequence number of the last write of each block
+static unsigned int *synced;	// ... as of the last completed sync
+static unsigned int seq;		// sequence number of the last write
+static unsigned int sync_seq;	// ... at the last completed sync
+static unsigned int nsnaps;		// #snapshots in the model
+
+/* The sequence numbers that each snapshot holds, or null.  A snapshot
+ * that was being taken or deleted when the block store crashed is kept
+ * in 'pending' until it is known whether it is there.
+ */
+static unsigned int *snaps[NINODES];
+static unsigned int pending;
+static unsigned int *pending_seqs;
+static char phase[64];
+
+static void fail(const char *what, block_no offset){
+	fprintf(stderr, "!!ERROR: %s: %s (offset %u)\n", phase, what, offset);
+	exit(1);
+}
+
+static void fill(block_t *block, block_no offset, unsigned int s){
+	unsigned int *w = (unsigned int *) block, i;
+
+	w[0] = offset;
+	w[1] = s;
+	for (i = 2; i < BLOCK_SIZE / sizeof(*w); i++) {
+		w[i] = (offset * 2654435761u) ^ (s * 40503u) ^ i;
+	}
+}
+
+/* Return the sequence number of the write that the block came from,
+ * which must have been a write to the given offset, or 0 if the block was
+ * never written.  Returns -1 if the block is corrupt.
+ */
+static int decode(block_t *block, block_no offset){
+	block_t expect;
+	unsigned int s = ((unsigned int *) block)[1];
+
+	if (s == 0) {
+		memset(&expect, 0, sizeof(expect));
+	}
+	else {
+		fill(&expect, offset, s);
+	}
+	return memcmp(block, &expect, sizeof(expect)) == 0 ? (int) s : -1;
+}
+
+static void check(unsigned int ino, block_t *block, block_no offset){
+	unsigned int *seqs = ino == 0 ? cur : snaps[ino];
+
+	if (decode(block, offset) != (int) seqs[offset]) {
+		fail(ino == 0 ? "read returned the wrong data" :
+						"snapshot read returned the wrong data", offset);
+	}
+}
+
+static void sync_done(void){
+	if (crash.budget != 0) {
+		memcpy(synced, cur, size * sizeof(*cur));
+		sync_seq = seq;
+	}
+}
+
+/* Return a random snapshot inode in the model, or 0 if there are none.
+ */
+static unsigned int random_snap(void){
+	unsigned int ino, k = rand() % NINODES;
+
+	for (ino = 1; ino < NINODES; ino++) {
+		if (snaps[(ino + k) % (NINODES - 1) + 1] != 0) {
+			return (ino + k) % (NINODES - 1) + 1;
+		}
+	}
+	return 0;
+}
+
+static void take_snapshot(void){
+	long before = crash.budget;
+	int ino = snapdisk_snapshot(snap);
+
+	if (ino < 1 || ino >= NINODES || snaps[ino] != 0) {
+		fail("snapshot returned a bad inode", ino);
+	}
+	unsigned int *seqs = malloc(size * sizeof(*seqs));
+	memcpy(seqs, cur, size * sizeof(*cur));
+	if (before != 0 && crash.budget == 0) {
+		pending = ino;
+		pending_seqs = seqs;
+	}
+	else {
+		snaps[ino] = seqs;
+		nsnaps++;
+	}
+	sync_done();
+}
+
+static void delete_snapshot(unsigned int ino){
+	long before = crash.budget;
+
+	if (snapdisk_delete(snap, ino) < 0) {
+		fail("delete failed", ino);
+	}
+	if (before != 0 && crash.budget == 0) {
+		pending = ino;
+		pending_seqs = 0;
+	}
+	free(snaps[ino]);
+	snaps[ino] = 0;
+	nsnaps--;
+	sync_done();
+}
+
+static void random_op(void){
+	static block_t buf[MAX_XFER];
+	block_no offset, n, i;
+	unsigned int ino;
+
+	/* Writes stay in the hot quarter, so that the snapshots never keep
+	 * more blocks than there is room for.
+	 */
+	int op = rand() % 20;
+	block_no range = op <= 6 || rand() % 10 != 0 ? size / 4 : size;
+	offset = rand() % range;
+	n = 1 + rand() % MAX_XFER;
+	if (n > range - offset) {
+		n = range - offset;
+	}
+	switch (op) {
+	case 0: case 1: case 2: case 3: case 4: case 5:
+		fill(&buf[0], offset, ++seq);
+		if ((*snap->write)(snap, 0, offset, &buf[0]) < 0) {
+			fail("write failed", offset);
+		}
+		cur[offset] = seq;
+		break;
+	case 6:
+		for (i = 0; i < n; i++) {
+			fill(&buf[i], offset + i, seq + 1 + i);
+		}
+		if (block_store_writev(snap, 0, offset, n, buf) < 0) {
+			fail("writev failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			cur[offset + i] = ++seq;
+		}
+		break;
+	case 7: case 8: case 9: case 10:
+		if ((*snap->read)(snap, 0, offset, &buf[0]) < 0) {
+			fail("read failed", offset);
+		}
+		check(0, &buf[0], offset);
+		break;
+	case 11: case 12:
+		if (block_store_readv(snap, 0, offset, n, buf) < 0) {
+			fail("readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			check(0, &buf[i], offset + i);
+		}
+		break;
+	case 13: case 14:
+		if ((ino = random_snap()) == 0) {
+			break;
+		}
+		if ((*snap->read)(snap, ino, offset, &buf[0]) < 0) {
+			fail("snapshot read failed", offset);
+		}
+		check(ino, &buf[0], offset);
+		break;
+	case 15: case 16:
+		if ((ino = random_snap()) == 0) {
+			break;
+		}
+		if (block_store_readv(snap, ino, offset, n, buf) < 0) {
+			fail("snapshot readv failed", offset);
+		}
+		for (i = 0; i < n; i++) {
+			check(ino, &buf[i], offset + i);
+		}
+		break;
+	case 17:
+		if (rand() % 2 == 0) {
+			if ((*snap->sync)(snap, 0) < 0) {
+				fail("sync failed", 0);
+			}
+			sync_done();
+		}
+		break;
+	case 18:
+		if (rand() % 20 == 0) {
+			if (nsnaps == MAX_SNAPS) {
+				delete_snapshot(random_snap());
+			}
+			if (crash.budget != 0) {
+				take_snapshot();
+			}
+		}
+		break;
+	default:
+		if (rand() % 60 == 0 && (ino = random_snap()) != 0) {
+			delete_snapshot(ino);
+		}
+	}
+}
+
+static void open_snap(void){
+	if ((snap = snapdisk_init(below, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	if ((*snap->getsize)(snap, 0) != (int) size) {
+		fail("wrong size", size);
+	}
+}
+
+static void check_all(void){
+	block_t block;
+	block_no b;
+	unsigned int ino;
+
+	for (ino = 0; ino < NINODES; ino++) {
+		if (ino > 0 && snaps[ino] == 0) {
+			continue;
+		}
+		if ((*snap->getsize)(snap, ino) != (int) size) {
+			fail("snapshot is gone", ino);
+		}
+		for (b = 0; b < size; b++) {
+			if ((*snap->read)(snap, ino, b, &block) < 0) {
+				fail("read failed", b);
+			}
+			check(ino, &block, b);
+		}
+	}
+}
+
+/* After a crash every live block holds what it held at the last sync, or
+ * a later write to it.  That is what it holds from now on.  A snapshot
+ * that was being deleted is deleted again if it is still there.
+ */
+static void check_recovered(void){
+	block_t block;
+	block_no b;
+
+	for (b = 0; b < size; b++) {
+		if ((*snap->read)(snap, 0, b, &block) < 0) {
+			fail("read failed", b);
+		}
+		int s = decode(&block, b);
+		if (s < 0) {
+			fail("block is corrupt", b);
+		}
+		if ((unsigned int) s != synced[b] && ((unsigned int) s <= sync_seq || (unsigned int) s > cur[b])) {
+			fail("block holds neither the synced nor a later write", b);
+		}
+		cur[b] = synced[b] = s;
+	}
+	sync_seq = seq;
+
+	if (pending != 0) {
+		if (pending_seqs != 0) {
+			if ((*snap->getsize)(snap, pending) == (int) size) {
+				snaps[pending] = pending_seqs;
+				nsnaps++;
+			}
+			else {
+				free(pending_seqs);
+			}
+		}
+		else if ((*snap->getsize)(snap, pending) == (int) size &&
+						snapdisk_delete(snap, pending) < 0) {
+			fail("delete failed", pending);
+		}
+		pending = 0;
+		pending_seqs = 0;
+	}
+	check_all();
+}
+
+int main(int argc, char **argv){
+	unsigned int round, k, ino;
+
+	srand(4411);
+	below = crashing_init(disk, DISK_SIZE, &crash);
+	if (snapdisk_create(below, 0, 0) < 0) {
+		fail("can't create", 0);
+	}
+	if ((snap = snapdisk_init(below, 0)) == 0) {
+		fail("can't open", 0);
+	}
+	size = (*snap->getsize)(snap, 0);
+	cur = calloc(size, sizeof(*cur));
+	synced = calloc(size, sizeof(*synced));
+
+	for (round = 0; round < NROUNDS; round++) {
+		int crashing = rand() % 2;
+		snprintf(phase, sizeof(phase), "round %u (%s)", round, crashing ? "crash" : "reopen");
+		if (crashing) {
+			crash.budget = rand() % DISK_SIZE;
+		}
+		for (k = 0; k < 3000 && crash.budget != 0; k++) {
+			random_op();
+		}
+
+		/* Releasing after the crash writes nothing more.
+		 */
+		crash.budget = crashing ? 0 : -1;
+		(*snap->release)(snap);
+		crash.budget = -1;
+		open_snap();
+		if (crashing) {
+			check_recovered();
+		}
+		else {
+			check_all();
+			memcpy(synced, cur, size * sizeof(*cur));
+			sync_seq = seq;
+		}
+	}
+	(*snap->release)(snap);
+	(*crash.below->release)(crash.below);
+	free(below);
+	free(cur);
+	free(synced);
+	for (ino = 1; ino < NINODES; ino++) {
+		free(snaps[ino]);
+	}
+	printf("ok\n");
+	return 0;
+}